@@ -5,6 +5,9 @@
 #include <DueFlashStorage.h>
 #include "tracker.h"
 #include "storage.h"
+#include "transport.h"
+#include "scheduler.h"
+#include "atcmd.h"
 #include "secrets.h"
 
 #ifdef DEBUG
@@ -32,21 +35,55 @@ unsigned long engineRunningTime = 0;
 unsigned long engineStartTime;
 TinyGPS gps;
 DueFlashStorage dueFlashStorage;
-#if 0
+#if 1
 FlashServerDataStore serverDataStore(dueFlashStorage, 1024, 64*1024);
 #else
 RAMServerDataStore serverDataStore(2048);
 #endif
+#if TRANSPORT_HTTP_ENABLED
+ProtocolTransport<HttpProtocol> httpTransport;
+#endif
+#if TRANSPORT_TCP_ENABLED
+ProtocolTransport<TcpProtocol> tcpTransport;
+#endif
+#if TRANSPORT_UDP_ENABLED
+ProtocolTransport<UdpProtocol> udpTransport;
+#endif
+#if TRANSPORT_MQTT_ENABLED
+ProtocolTransport<MqttProtocol> mqttTransport;
+#endif
+/**
+ * The server transports compiled in, see settings.server_send_flags
+ */
+ServerTransport* serverTransports[] = {
+#if TRANSPORT_HTTP_ENABLED
+    &httpTransport,
+#endif
+#if TRANSPORT_TCP_ENABLED
+    &tcpTransport,
+#endif
+#if TRANSPORT_UDP_ENABLED
+    &udpTransport,
+#endif
+#if TRANSPORT_MQTT_ENABLED
+    &mqttTransport,
+#endif
+};
 unsigned long gsmFailedToUpdateTime = 0;
 SETTINGS_T config;
 GPSDATA_T lastGoodGPSData;
-GPSDATA_T lastReportedGPSData;
 GPSDATA_T gpsData;
-char serverMsg[DATA_LIMIT];
+unsigned long gpsFixTime = 0; // millis() when gpsData was last assigned
 unsigned long lastServerUpdateTime;
 unsigned long serverUpdatePeriod;
+MOTION_STATE_T motionState = MOTION_MOVING; // see motion.ino
+GPSDATA_T motionRest;           // best fix of where we stopped
+bool motionParkPending = false; // parked but not yet reported where
+GSMSTATUS_T gsmNetworkStatus = NOT_READY;
+unsigned storedMessagesDelivered = 0;
 char modem_command[256];  // Modem AT command buffer
 char modem_data[PACKET_SIZE]; // Modem TCP data buffer
+size_t modem_data_len = 0;      // Bytes waiting to be sent in modem_data[]
 char modem_reply[1024];    //data received from modem
 /**
  * Controls the logging of commands/replies from the modem
@@ -58,6 +95,29 @@ bool modemLogging = false;
 #define debug_port SerialUSB
 #define gsm_port Serial2
 
+/**
+ * serverUpdateCheck() task states
+ */
+#define SERVER_STATE_DRAINING 1
+/**
+ * The scheduled tasks which loop() runs. The first BACKGROUND_TASK_COUNT
+ * tasks never use the modem, so they are also run whilst we wait for it.
+ */
+TASK_T tasks[] = {
+    TASK("led", ledTask, 0, 1),
+    TASK("ignition", ignitionCheck, 50, 1),
+    TASK("gps", gpsCheck, 0, 5),
+    TASK("modem", modemCheck, 0, 1),
+    TASK("network", networkCheck, SECS(5), 5),
+    TASK("smsrx", smsRequestCheck, MINS(5), 5), // Signalled by +CMTI
+    TASK("server", serverUpdateCheck, ONE_SEC, 5),
+    TASK("mqtt", mqttCheck, SECS(MQTT_KEEPALIVE / 4), 5), // Signalled by +QIRDI
+    TASK("smstx", smsNotificationCheck, SECS(60), 5),
+    TASK("system", systemCheck, ONE_SEC, 5),
+    TASK("report", reportCheck, MINS(10), 5)
+};
+#define BACKGROUND_TASK_COUNT 3
+
 /**
  * Safe string copy to copy a string with limited length and guaranteed
  * '\0' termination
@@ -80,10 +140,7 @@ void strncopy(
 void sendBootMessage() {
     if (strlen(config.sms_send_number) != 0) {
         char timeStr[22];
-        if (!gsmGetTime(timeStr, DIM(timeStr), SECS(5))) {
-            debug_println(F("sendBootMessage(): Could not read modem time"));
-            strncopy(timeStr, BAD_TIME, DIM(timeStr));
-        }
+        clockFormatTime(timeStr, DIM(timeStr), clockNow());
         char imeiStr[IMEI_LEN+1];
         if (!gsmGetIMEI(imeiStr, DIM(imeiStr), SECS(5))) {
             debug_println(F("sendBootMessage(): Could not read modem IMEI"));
@@ -107,9 +164,7 @@ void sendGSMRestartMessage(
 ) {
     if (strlen(config.sms_send_number) != 0) {
         char timeStr[22];
-        if (!gsmGetTime(timeStr, DIM(timeStr), SECS(5))) {
-            strncopy(timeStr, BAD_TIME, DIM(timeStr));
-        }
+        clockFormatTime(timeStr, DIM(timeStr), clockNow());
         char imeiStr[IMEI_LEN+1];
         if (!gsmGetIMEI(imeiStr, DIM(imeiStr), SECS(5))) {
             strncopy(imeiStr, BAD_IMEI, DIM(imeiStr));
@@ -131,6 +186,8 @@ void powerUpGSMModem() {
         // Yikes! What else can we do?
         reboot();
     } else {
+        // Drop anything we had queued for the old modem session
+        atReset();
         // Sync the command stream to the modem
         gsmSyncComms(SECS(5));
         // Setup the modem
@@ -140,8 +197,7 @@ void powerUpGSMModem() {
             debug_println(F("powerUpGSMModem() did not get a gsm connection"));
         } else {
             // Wait up to 60s for time sync
-            char timeStr[22];
-            if (!gsmGetTime(timeStr, DIM(timeStr), SECS(60))) {
+            if (!gsmSyncClock(SECS(60))) {
                 debug_println(F("powerUpGSMModem() did not get time sync"));
             }
         }
@@ -166,20 +222,24 @@ void setup() {
     //GPS setup 
     gps_setup();
     gps_on_off();
+    lastGoodGPSData.fixAge = TinyGPS::GPS_INVALID_AGE;
+    gpsData.fixAge = TinyGPS::GPS_INVALID_AGE;
+    gpsRxStart();
+    //setup ignition detection
+    pinMode(PIN_S_DETECT, INPUT);
     //GSM setup
     gsmSetupPIO();
+    gsmRegisterURCs();
     // turn on GSM
     powerUpGSMModem();
     // Initialise server data flash storage
     serverDataStore.init();
-    //setup ignition detection
-    pinMode(PIN_S_DETECT, INPUT);
     lastServerUpdateTime = millis();
     serverUpdatePeriod = config.fast_server_interval;
-    lastGoodGPSData.fixAge = TinyGPS::GPS_INVALID_AGE;
-    gpsData.fixAge = TinyGPS::GPS_INVALID_AGE;
-    lastReportedGPSData.fixAge = TinyGPS::GPS_INVALID_AGE;
     sendBootMessage();
+    schedulerInit(tasks, DIM(tasks));
+    // Pick up any SMS messages which arrived whilst we were not running
+    schedulerSignal(schedulerFindTask(tasks, DIM(tasks), "smsrx"));
     debug_println(F("setup(): System initialisation complete"));
 }
 
@@ -202,7 +262,15 @@ unsigned long timeDiff(unsigned long end_time, unsigned long start_time) {
     return end_time + (ULONG_MAX - start_time) + 1;
 }
 
-void ignitionCheck() {
+void ledTask(
+    TASK_T* pTask
+) {
+    status_led();
+}
+
+void ignitionCheck(
+    TASK_T* pTask
+) {
     ignState = (digitalRead(PIN_S_DETECT) == 0);
     if (ignState) {
         // Insert here only code that should be processed when Ignition is ON
@@ -211,6 +279,7 @@ void ignitionCheck() {
             // engine started, so record time started
             engineStartTime = millis();
             engineRunning = true;
+            motionWake();
         } else {
             // Update engine running time
             engineRunningTime = timeDiff(millis(), engineStartTime);
@@ -224,112 +293,139 @@ void ignitionCheck() {
     }
 }
 
-void gpsCheck() {
-    if (!readGPSData(&gpsData, 2000)) {
-        debug_println(F("Failed to read GPS data"));
-    } else {
+void gpsCheck(
+    TASK_T* pTask
+) {
+    gpsRxService();
+    if (readGPSData(&gpsData, pTask)) {
+        gpsFixTime = millis();
+        clockSetFromGPS(gpsData.date, gpsData.time);
         lastGoodGPSData = gpsData;
-        if (lastReportedGPSData.fixAge != TinyGPS::GPS_INVALID_AGE) {
-            // Inspect distance travelled
-            float distance = gps.distance_between(
-                gpsData.lat, gpsData.lon,
-                lastReportedGPSData.lat, lastReportedGPSData.lon);
-            // If we have travelled more then 100m use the fast update period
-            if (distance > 100) {
-                if (serverUpdatePeriod != config.fast_server_interval) {
-                    debug_println(F("Switching to use fast update period"));
-                    serverUpdatePeriod = config.fast_server_interval;
-                }
-            } else {
-                if (serverUpdatePeriod != config.slow_server_interval) {
-                    debug_println(F("Switching to use slow update period"));
-                    serverUpdatePeriod = config.slow_server_interval;
-                }
-            }
-        }
+        motionUpdate(&gpsData);
+        captureFix(&gpsData);
     }
 }
 
 /**
- * Sends one or more server data blocks to the server
- * @param pServerData points ot the first data block
- * @param count number of data blocks to send
+ * Starts reading the records of a batch from the first
+ * @param pBatch the batch
  */
-bool sendDataToServer(
-    SERVER_DATA_T* pServerData,
-    size_t count
+void serverBatchRewind(
+    SERVER_BATCH_T* pBatch
 ) {
-    bool allSentOK = true;
-    const char* pMessages[10];
-    while (count) {
-        // Generate as many messages as will fit into serverMsg[]
-        // or pMessages[]
-        char* pMsgPos = serverMsg;
-        size_t msgIdx = 0;
-        while (count && (msgIdx < DIM(pMessages))) {
-            size_t lenLeft = sizeof(serverMsg)-(pMsgPos-serverMsg);
-            if (!formServerUpdateMessage(pServerData, pMsgPos, lenLeft)) {
-                // Run out of buffer space, so send what we have so far
-                break;
-            } else {
-                // Save message to message list
-                pMessages[msgIdx++] = pMsgPos;
-                pMsgPos += strlen(pMsgPos) + 1;
-                ++pServerData;
-                count -= 1;
-            }
-        }
-        if (msgIdx == 0) {
-            // We had server data to send but failed to construct any
-            // message data. There must be something wrong with the server
-            // data set, so skip to the next one
-            ++pServerData;
-            count -= 1;
-            allSentOK = false;
-        } else {
-            // Send as many messages as we generated
-            if (!gsmSendServerMessages(pMessages, msgIdx)) {
-                allSentOK = false;
-            }
+    pBatch->readCount = 0;
+    pBatch->cursor = pBatch->start;
+}
+
+/**
+ * Reads the next record of a batch
+ * @param pBatch the batch
+ * @param pServerData where to write the record
+ * @return true if pServerData assigned ok, false if there are no more
+ *         records
+ */
+bool serverBatchRead(
+    SERVER_BATCH_T* pBatch,
+    SERVER_DATA_T* pServerData
+) {
+    if (pBatch->readCount >= pBatch->count) {
+        return false;
+    }
+    if (pBatch->pServerData != NULL) {
+        *pServerData = pBatch->pServerData[pBatch->readCount];
+    } else if (!serverDataStore.readCursor(&pBatch->cursor, pServerData)) {
+        return false;
+    }
+    pBatch->readCount += 1;
+    return true;
+}
+
+/**
+ * Gets the configured server transport
+ * @return the transport, the first one compiled in if the configured one
+ *         is not
+ */
+ServerTransport* serverTransport() {
+    unsigned id = (config.server_send_flags >> SERVER_SEND_TRANSPORT_POS)
+                  & SERVER_SEND_TRANSPORT_MASK;
+    for (size_t i = 0; i < DIM(serverTransports); i++) {
+        if (serverTransports[i]->getId() == id) {
+            return serverTransports[i];
         }
     }
-    return allSentOK;
+    return serverTransports[0];
+}
+
+/**
+ * Gets the most records we send the server in one batch
+ * @return the max records for the configured transport
+ */
+size_t serverBatchMaxRecords() {
+    return serverTransport()->getMaxRecords();
+}
+
+/**
+ * Sends a batch of server data records to the server
+ * @param pBatch the records to send
+ * @return true if the server acknowledged the batch, false if not
+ */
+bool sendDataToServer(
+    SERVER_BATCH_T* pBatch
+) {
+    return serverTransport()->send(pBatch);
 }
 
+/**
+ * Sends a batch of the oldest server data we stored, reading the records
+ * straight from the store as they are sent
+ * @param pSent assigned a cursor just after the last record in the batch
+ * @return true if the server acknowledged the batch, false if not
+ */
+bool sendStoredDataBatch(
+    STORE_CURSOR_T* pSent
+) {
+    SERVER_BATCH_T batch;
+    memset(&batch, 0, sizeof(batch));
+    serverDataStore.startCursor(&batch.start);
+    batch.count = MIN(serverDataStore.getStoredServerDataCount(),
+                      serverBatchMaxRecords());
+    bool sentOK = sendDataToServer(&batch);
+    *pSent = batch.cursor;
+    return sentOK;
+}
 
+/**
+ * Sends the next batch of old GPS data we stored whilst there was no GSM
+ * connection, and forgets the records the server acknowledged
+ * @param networkStatus the current network status
+ * @return the network status after sending the batch
+ */
 GSMSTATUS_T sendStoredMessagesToServer(
     GSMSTATUS_T networkStatus
 ) {
-    unsigned storedMessagesDelivered = 0;
-    SERVER_DATA_T serverData[10];
-    unsigned long timeNow = millis();
-    // Spend up to 2 mins sending any old GPS data we stored whilst
-    // there was no GSM connection
-    size_t count = 0;
-    while ((networkStatus == CONNECTED) &&
-            serverDataStore.readOldestServerDataBlock(
-                serverData, DIM(serverData), &count) &&
-            (timeDiff(millis(), timeNow) < 120*ONE_SEC)) {
-        if (sendDataToServer(serverData, count)) {
-            if (serverDataStore.forgetOldestServerData(count)) {
+    STORE_CURSOR_T sent;
+    if ((networkStatus == CONNECTED) &&
+            (serverDataStore.getStoredServerDataCount() > 0)) {
+        if (sendStoredDataBatch(&sent)) {
+            if (serverDataStore.commitCursor(&sent)) {
                 storedMessagesDelivered += 1;
             }
         }
         networkStatus = gsmGetNetworkStatus();
     }
-    if (storedMessagesDelivered > 0) {
-        debug_print(F("Sent "));
-        debug_print(storedMessagesDelivered);
-        debug_println(F(" stored messages to server"));
-    }
     return networkStatus;
 }
 
 bool updateServerWithCurrentData(
-    SERVER_DATA_T* pServerData
+    SERVER_DATA_T* pServerData,
+    size_t count
 ) {
     bool serverUpdatedStatus = false;
-    if (!sendDataToServer(pServerData, 1)) {
+    SERVER_BATCH_T batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.pServerData = pServerData;
+    batch.count = count;
+    if (!sendDataToServer(&batch)) {
         debug_println(F("Failed to send server update message"));
         unsigned long timeNow = millis();
         if (gsmFailedToUpdateTime == 0) {
@@ -346,67 +442,104 @@ bool updateServerWithCurrentData(
     return serverUpdatedStatus;
 }
 
-void serverUpdateCheck() {
-    GSMSTATUS_T networkStatus = gsmGetNetworkStatus();
-    // If we have network connection and have stored messages then send
-    // them (or at least some of them) now
-    if ((networkStatus == CONNECTED) &&
-        (serverDataStore.getStoredServerDataCount() > 0)) {
-        networkStatus = sendStoredMessagesToServer(networkStatus);
-    }
-    // Is it time to update the server with current data?
+/**
+ * Sends the current data to the server if an update is due
+ */
+void serverCurrentDataCheck() {
+    GSMSTATUS_T networkStatus = gsmNetworkStatus;
+    // Is it time to update the server with current data? Once parked and
+    // we have reported where, only heartbeats are due.
+    bool heartbeat = (motionState == MOTION_PARKED) && !motionParkPending;
+    unsigned long updatePeriod = heartbeat
+        ? MINS((unsigned long)config.heartbeat_interval)
+        : SECS(serverUpdatePeriod);
     unsigned long timeNow = millis();
     unsigned long timeSinceLastServerUpdate =
         timeDiff(timeNow, lastServerUpdateTime);
-    if (timeSinceLastServerUpdate < SECS(serverUpdatePeriod)) {
+    POLICY_TRIGGER_T trigger =
+        policyCheck(timeSinceLastServerUpdate, updatePeriod);
+    if (!motionParkPending && (trigger == POLICY_TRIGGER_NONE)) {
         // No, not time to update server
         debug_print(F("Seconds to next server update = "));
-        debug_print((SECS(serverUpdatePeriod) - timeSinceLastServerUpdate)/ONE_SEC);
+        debug_print((updatePeriod - timeSinceLastServerUpdate)/ONE_SEC);
         debug_print(F(", Network Status = "));
         debug_println(gsmGetNetworkStatusString(networkStatus));
+    } else if (heartbeat) {
+        debug_println(F("It is time to send a heartbeat"));
+        motionSendHeartbeat();
+        lastServerUpdateTime = timeNow;
     } else {
         // Yes, we are due a server update
-        debug_println(F("It is time to update server"));
-        bool shouldReportData = true;
+        debug_print(F("It is time to update server, trigger = "));
+        debug_println(policyTriggerName(trigger));
         if (lastGoodGPSData.fixAge == TinyGPS::GPS_INVALID_AGE) {
             debug_println(F("But dont have current GPS data"));
-            shouldReportData = false;
-        } else if (memcmp(&lastReportedGPSData,
-                          &lastGoodGPSData, sizeof(GPSDATA_T)) == 0) {
-            debug_println(F("But GPS data has not changed since last update"));
-            shouldReportData = false;
-        }
-        if (shouldReportData) {
+        } else {
             SERVER_DATA_T serverData;
-            serverData.gpsData = lastGoodGPSData;
+            serverData.gpsData =
+                motionParkPending ? motionRest : lastGoodGPSData;
             serverData.ignState = ignState;
             serverData.engineRuntime = engineRunningTime;
-            bool serverUpdatedOK = false;
-            if (networkStatus == CONNECTED) {
-                serverUpdatedOK = updateServerWithCurrentData(&serverData);
-            }
-            if (serverUpdatedOK) {
-                debug_println(F("Server updated OK"));
-            } else {
-                debug_println(F("Server update failed so storing to flash"));
-                if (serverDataStore.writeServerData(&serverData)) {
-                    serverUpdatedOK = true;
-                } else {
-                    debug_println(F("Store to flash failed"));
-                }
+            serverData.captureTime = clockNow();
+            policySampled(&serverData.gpsData, trigger);
+            // Only the points needed to redraw the track get reported, but
+            // where we parked always is. Whilst capturing the gps task has
+            // already added the track since the last update.
+            if (motionParkPending || (config.capture_interval == 0)) {
+                captureSample(&serverData, motionParkPending);
             }
-            if (serverUpdatedOK) {
+            if (captureFlush(networkStatus)) {
                 // Note we record the data as reported even if we only stored it
                 // to flash, it will eventually get reported and this assignment
                 // prevents us repeatedly writing to the flash (or server)
-                lastReportedGPSData = lastGoodGPSData;
+                motionParkPending = false;
                 lastServerUpdateTime = timeNow;
             }
         }
     }
 }
 
-void smsNotificationCheck() {
+/**
+ * Server update task. When we have a network connection and stored messages
+ * we send them one block per step, interleaved with sending the current data
+ * whenever a server update falls due.
+ */
+void serverUpdateCheck(
+    TASK_T* pTask
+) {
+    switch (pTask->state) {
+    case TASK_STATE_IDLE:
+        // If we have network connection and have stored messages then start
+        // sending them
+        if ((gsmNetworkStatus == CONNECTED) &&
+            (serverDataStore.getStoredServerDataCount() > 0)) {
+            storedMessagesDelivered = 0;
+            pTask->state = SERVER_STATE_DRAINING;
+        }
+        break;
+    case SERVER_STATE_DRAINING:
+        gsmNetworkStatus = sendStoredMessagesToServer(gsmNetworkStatus);
+        if ((gsmNetworkStatus != CONNECTED) ||
+            (serverDataStore.getStoredServerDataCount() == 0)) {
+            if (storedMessagesDelivered > 0) {
+                debug_print(F("Sent "));
+                debug_print(storedMessagesDelivered);
+                debug_println(F(" stored messages to server"));
+            }
+            pTask->state = TASK_STATE_IDLE;
+        }
+        break;
+    }
+    serverCurrentDataCheck();
+}
+
+void smsNotificationCheck(
+    TASK_T* pTask
+) {
+    if ((strlen(config.sms_send_number) == 0) ||
+        (config.sms_send_interval == 0)) {
+        return;
+    }
     unsigned long timeNow = millis();
     if (timeDiff(timeNow, lastSMSSendTime)
         > (60*1000) * config.sms_send_interval) {
@@ -424,22 +557,26 @@ void smsNotificationCheck() {
     }
 }
 
-void loop() {
-    GSMSTATUS_T networkStatus = gsmGetNetworkStatus();
-    status_led();
-    // Ignition status update
-    ignitionCheck();
-    // Process any SMS configuration requests
-    smsRequestCheck();
-    // Collect GPS data
-    gpsCheck();
-    // Server update
-    serverUpdateCheck();
-    // SMS notification update
-    if ((strlen(config.sms_send_number) != 0) &&
-        (config.sms_send_interval != 0)) {
-        smsNotificationCheck();
+/**
+ * Keeps gsmNetworkStatus and the device clock up to date
+ */
+void networkCheck(
+    TASK_T* pTask
+) {
+    // gsmNetworkStatus is updated when the modem replies
+    gsmRequestNetworkStatus();
+    // Fall back to network time if we have not had GPS time for a while
+    if ((gsmNetworkStatus == CONNECTED) && clockNetworkSyncDue()) {
+        gsmSyncClock(SECS(5));
     }
+}
+
+/**
+ * Handles config saves, gsm restarts and reboots
+ */
+void systemCheck(
+    TASK_T* pTask
+) {
     // Auto reboot check
     if (config.reboot_interval != 0) {
         if (millis() > (1000*60*config.reboot_interval)) {
@@ -456,7 +593,7 @@ void loop() {
         gsmPowerOff();
         powerUpGSMModem();
         gsmRestart = false;
-        sendGSMRestartMessage(networkStatus);
+        sendGSMRestartMessage(gsmNetworkStatus);
     }
     if (powerReboot) {
         debug_println(F("Rebooting"));
@@ -464,3 +601,34 @@ void loop() {
         reboot();
     }
 }
+
+/**
+ * Periodically reports the task statistics
+ */
+void reportCheck(
+    TASK_T* pTask
+) {
+    schedulerReport(tasks, DIM(tasks));
+    gpsReport();
+    gsmReport();
+    trackReport();
+    motionReport();
+    policyReport();
+    captureReport();
+    mqttReport();
+    for (size_t i = 0; i < DIM(serverTransports); i++) {
+        serverTransports[i]->report();
+    }
+    serverDataStore.report();
+}
+
+/**
+ * Runs the background tasks whilst we wait for the modem
+ */
+void modemWaitIdle() {
+    schedulerRun(tasks, BACKGROUND_TASK_COUNT);
+}
+
+void loop() {
+    schedulerRun(tasks, DIM(tasks));
+}
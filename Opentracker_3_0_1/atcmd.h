@@ -0,0 +1,71 @@
+/**
+ * Results passed to AT command completion callbacks
+ */
+#define AT_RESULT_OK      0   //!< Modem gave a successful final result
+#define AT_RESULT_ERROR   1   //!< Modem gave an error final result
+#define AT_RESULT_TIMEOUT 2   //!< No final result within the timeout
+/**
+ * Number of commands which can be waiting for the modem
+ */
+#define AT_QUEUE_LEN 4
+/**
+ * Maximum number of URC handlers which can be registered
+ */
+#define AT_URC_HANDLER_MAX 8
+/**
+ * Size of the buffer holding the line currently being received
+ */
+#define AT_LINE_LEN 256
+/**
+ * ms a partly received line, arriving whilst no command is active, is given
+ * to finish before it is dropped and the next command is sent
+ */
+#define AT_RESYNC_TIME 100
+/**
+ * How a received line is classified by the result code table
+ */
+#define AT_LINE_INTERMEDIATE 0  //!< Part of the reply, not a result code
+#define AT_LINE_OK           1  //!< "OK", final if the command allows it
+#define AT_LINE_DONE         2  //!< Successful final result
+#define AT_LINE_ERROR        3  //!< Error final result
+#define AT_LINE_PROMPT       4  //!< "> " prompt for command data
+#define AT_LINE_DATA         5  //!< Header for raw data, see AT_RESULT_CODE_T
+/**
+ * Definition of a result code table entry. Codes ending in ':' match any
+ * line starting with the code, all others must match the whole line. For
+ * AT_LINE_DATA lines the number after the last ',' is the number of raw
+ * data bytes which follow the line e.g. "+QIRD: 1.2.3.4:80,TCP,5".
+ */
+typedef struct AT_RESULT_CODE_S {
+    const char* pCode;              //!< The result code text
+    unsigned kind;                  //!< One of the AT_LINE_xxx values
+} AT_RESULT_CODE_T;
+/**
+ * Definition of a queued AT command. The command is sent once all commands
+ * queued before it have completed.
+ */
+typedef struct AT_CMD_S {
+    unsigned long id;               //!< Identifies the command, 0 if free
+    char command[256];              //!< The command, without the '\r'
+    bool allowOK;                   //!< true if "OK" ends the reply
+    unsigned long timeout;          //!< ms to wait for the final result
+    const uint8_t* pPayload;        //!< Data sent at the "> " prompt or NULL
+    size_t payloadLen;              //!< Number of bytes in pPayload
+    //! Called with each intermediate reply line instead of adding it to
+    //! modem_reply[], so replies of any length can be handled. Returns the
+    //! number of lines which follow that are payload (e.g. SMS text) and are
+    //! passed straight back to it, unclassified. May be NULL.
+    unsigned (*lineFn)(const char* pLine);
+    //! Called with the command id and AT_RESULT_xxx value when the command
+    //! completes, modem_reply[] holds the reply. May be NULL.
+    void (*doneFn)(unsigned long id, unsigned result);
+} AT_CMD_T;
+/**
+ * Definition of a handler for unsolicited result codes. Any received line
+ * which starts with pPrefix is passed to urcFn rather than being treated as
+ * part of a command reply.
+ */
+typedef struct AT_URC_HANDLER_S {
+    const char* pPrefix;            //!< URC line start e.g. "+CMTI:"
+    void (*urcFn)(const char* pLine); //!< Handles the URC line
+} AT_URC_HANDLER_T;
@@ -0,0 +1,394 @@
+/**
+ * Event driven AT command engine. Commands are queued and sent to the modem
+ * one at a time by atService(), which also reads the modem UART a line at a
+ * time. Lines which start with a registered URC prefix are passed to the
+ * URC handler, whatever else is going on. All other lines received whilst a
+ * command is outstanding are classified once, against the atResultCodes[]
+ * table, and intermediate lines are added to modem_reply[] (or passed to the
+ * command's line callback) until the final result arrives, at which point
+ * the command's completion callback is called.
+ */
+
+/**
+ * The result codes which end (or otherwise affect) a command reply
+ */
+const AT_RESULT_CODE_T atResultCodes[] = {
+    { "OK", AT_LINE_OK },
+    { "ERROR", AT_LINE_ERROR },
+    { "+CME ERROR:", AT_LINE_ERROR },
+    { "+CMS ERROR:", AT_LINE_ERROR },
+    { "> ", AT_LINE_PROMPT },
+    { "SEND OK", AT_LINE_DONE },
+    { "SEND FAIL", AT_LINE_ERROR },
+    { "CONNECT OK", AT_LINE_DONE },
+    { "ALREADY CONNECT", AT_LINE_DONE },
+    { "CONNECT FAIL", AT_LINE_ERROR },
+    { "CLOSE OK", AT_LINE_DONE },
+    { "DEACT OK", AT_LINE_DONE },
+    { "BUSY", AT_LINE_ERROR },
+    { "NO ANSWER", AT_LINE_ERROR },
+    { "NO CARRIER", AT_LINE_ERROR },
+    { "NO DIALTONE", AT_LINE_ERROR },
+    { "+QIRD:", AT_LINE_DATA }
+};
+
+AT_CMD_T atQueue[AT_QUEUE_LEN];
+size_t atQueueHead = 0;             // index of the oldest queued command
+size_t atQueueCount = 0;            // number of queued commands
+unsigned long atNextId = 1;         // id given to the next queued command
+bool atActive = false;              // true if the oldest command was sent
+unsigned long atSendTime = 0;       // millis() when it was sent
+unsigned long atDoneId = 0;         // id of the last completed command
+unsigned atDoneResult = AT_RESULT_OK; // AT_RESULT_xxx for atDoneId
+char atLine[AT_LINE_LEN];           // the line being received
+size_t atLineLen = 0;
+size_t atLineStart = 0;             // where the line starts in modem_reply
+size_t atReplyLen = 0;              // number of chars in modem_reply
+size_t atRawCount = 0;              // raw data bytes still to be received
+unsigned atPayloadLines = 0;        // payload lines claimed by the lineFn
+unsigned long atReceiveTime = 0;    // millis() when the last char arrived
+AT_URC_HANDLER_T atUrcHandlers[AT_URC_HANDLER_MAX];
+size_t atUrcHandlerCount = 0;
+unsigned long atUrcCount = 0;       // number of URCs dispatched
+unsigned long atTimeoutCount = 0;   // number of commands which timed out
+
+/**
+ * Registers a handler for an unsolicited result code
+ * @param pPrefix the start of the URC line e.g. "+CMTI:"
+ * @param urcFn the handler, called with the whole URC line. Handlers may
+ *        queue commands but must not wait for them.
+ * @return true if registered, false if there are too many handlers
+ */
+bool atRegisterURC(
+    const char* pPrefix,
+    void (*urcFn)(const char* pLine)
+) {
+    if (atUrcHandlerCount >= DIM(atUrcHandlers)) {
+        debug_println(F("atRegisterURC: too many URC handlers"));
+        return false;
+    }
+    atUrcHandlers[atUrcHandlerCount].pPrefix = pPrefix;
+    atUrcHandlers[atUrcHandlerCount].urcFn = urcFn;
+    atUrcHandlerCount += 1;
+    return true;
+}
+
+/**
+ * Discards all queued commands, e.g. when the modem has been restarted.
+ * Completion callbacks are called with AT_RESULT_TIMEOUT.
+ */
+void atReset() {
+    while (atQueueCount > 0) {
+        at_complete(AT_RESULT_TIMEOUT);
+    }
+    atLineLen = 0;
+    atRawCount = 0;
+}
+
+/**
+ * Queues a command for the modem
+ * @param pCommand the command to send (no trailing '\r' required)
+ * @param allowOK when true, a modem response of "OK" ends the reply. Some
+ *        commands send "OK" and then more data, so for these pass false.
+ * @param timeout ms to wait for the final result once the command is sent
+ * @param pPayload data to send when the modem gives the "> " prompt, or
+ *        NULL. This must stay valid until the command completes.
+ * @param payloadLen the number of bytes in pPayload
+ * @param lineFn called with each intermediate reply line, or NULL to have
+ *        them added to modem_reply[]. Returns the number of following lines
+ *        which are payload and are passed to it without being classified.
+ * @param doneFn called when the command completes, or NULL
+ * @return the id of the queued command, or 0 if the queue is full
+ */
+unsigned long atQueueCommand(
+    const char* pCommand,
+    bool allowOK,
+    unsigned long timeout,
+    const void* pPayload,
+    size_t payloadLen,
+    unsigned (*lineFn)(const char* pLine),
+    void (*doneFn)(unsigned long id, unsigned result)
+) {
+    if (atQueueCount >= DIM(atQueue)) {
+        return 0;
+    }
+    AT_CMD_T* pCmd = &atQueue[(atQueueHead + atQueueCount) % DIM(atQueue)];
+    pCmd->id = atNextId++;
+    strncopy(pCmd->command, pCommand, DIM(pCmd->command));
+    pCmd->allowOK = allowOK;
+    pCmd->timeout = timeout;
+    pCmd->pPayload = (const uint8_t*)pPayload;
+    pCmd->payloadLen = payloadLen;
+    pCmd->lineFn = lineFn;
+    pCmd->doneFn = doneFn;
+    atQueueCount += 1;
+    return pCmd->id;
+}
+
+/**
+ * Sends a command to the modem and waits for it to complete. The background
+ * tasks keep running whilst we wait.
+ * @param pCommand the command to send (no trailing '\r' required)
+ * @param allowOK when true, a modem response of "OK" ends the reply
+ * @param timeout ms to wait for the final result once the command is sent
+ * @param pPayload data to send at the "> " prompt, or NULL
+ * @param payloadLen the number of bytes in pPayload
+ * @param lineFn called with each intermediate reply line, or NULL to have
+ *        them added to modem_reply[]
+ * @return one of the AT_RESULT_xxx values. The reply is in modem_reply[]
+ */
+unsigned atSendCommand(
+    const char* pCommand,
+    bool allowOK,
+    unsigned long timeout,
+    const void* pPayload,
+    size_t payloadLen,
+    unsigned (*lineFn)(const char* pLine)
+) {
+    unsigned long id;
+    while ((id = atQueueCommand(pCommand, allowOK, timeout,
+                                pPayload, payloadLen, lineFn, NULL)) == 0) {
+        atService();
+        modemWaitIdle();
+    }
+    while (atDoneId != id) {
+        atService();
+        if (atDoneId != id) {
+            modemWaitIdle();
+        }
+    }
+    return atDoneResult;
+}
+
+/**
+ * Checks whether a command is still queued or running
+ * @param id the command id from atQueueCommand()
+ * @return true if the command has not yet completed
+ */
+bool atIsPending(
+    unsigned long id
+) {
+    for (size_t idx = 0; idx < atQueueCount; ++idx) {
+        if (atQueue[(atQueueHead + idx) % DIM(atQueue)].id == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Completes the oldest queued command
+ * @param result the AT_RESULT_xxx value
+ */
+void at_complete(
+    unsigned result
+) {
+    AT_CMD_T* pCmd = &atQueue[atQueueHead];
+    void (*doneFn)(unsigned long id, unsigned result) = pCmd->doneFn;
+    unsigned long id = pCmd->id;
+    pCmd->id = 0;
+    atQueueHead = (atQueueHead + 1) % DIM(atQueue);
+    atQueueCount -= 1;
+    atActive = false;
+    atPayloadLines = 0;
+    atDoneId = id;
+    atDoneResult = result;
+    if (result == AT_RESULT_TIMEOUT) {
+        atTimeoutCount += 1;
+        debug_println(F("Warning: timed out waiting for modem reply"));
+    }
+    if (doneFn != NULL) {
+        doneFn(id, result);
+    }
+}
+
+/**
+ * Classifies a received line against the result code table
+ * @param pLine the line, including any line terminator
+ * @return one of the AT_LINE_xxx values
+ */
+unsigned at_classify_line(
+    const char* pLine
+) {
+    for (size_t idx = 0; idx < DIM(atResultCodes); ++idx) {
+        const char* pCode = atResultCodes[idx].pCode;
+        if (pCode[0] != pLine[0]) {
+            continue;
+        }
+        size_t len = strlen(pCode);
+        if ((strncmp(pLine, pCode, len) == 0) &&
+            ((pCode[len - 1] == ':') || (pLine[len] == '\r') ||
+             (pLine[len] == '\n') || (pLine[len] == '\0'))) {
+            return atResultCodes[idx].kind;
+        }
+    }
+    return AT_LINE_INTERMEDIATE;
+}
+
+/**
+ * Handles a complete line (or prompt) received from the modem
+ */
+void at_process_line() {
+    atLine[atLineLen] = '\0';
+    if (atActive && (atPayloadLines > 0)) {
+        // Payload claimed by the line callback, which could look like a URC
+        // or a result code, so don't match it against either
+        atPayloadLines -= 1;
+        atReplyLen = atLineStart;
+        modem_reply[atReplyLen] = '\0';
+        atPayloadLines += atQueue[atQueueHead].lineFn(atLine);
+        return;
+    }
+    for (size_t idx = 0; idx < atUrcHandlerCount; ++idx) {
+        const char* pPrefix = atUrcHandlers[idx].pPrefix;
+        if ((pPrefix[0] == atLine[0]) &&
+            (strncmp(atLine, pPrefix, strlen(pPrefix)) == 0)) {
+            // Not part of any command reply
+            if (atActive) {
+                atReplyLen = atLineStart;
+                modem_reply[atReplyLen] = '\0';
+            }
+            atUrcCount += 1;
+            atUrcHandlers[idx].urcFn(atLine);
+            return;
+        }
+    }
+    if (!atActive) {
+        if (modemLogging && (atLineLen > 2)) {
+            debug_print(F("atService: discarded: "));
+            debug_println(atLine);
+        }
+        return;
+    }
+    AT_CMD_T* pCmd = &atQueue[atQueueHead];
+    switch (at_classify_line(atLine)) {
+    case AT_LINE_OK:
+        if (pCmd->allowOK) {
+            at_complete(AT_RESULT_OK);
+        }
+        break;
+    case AT_LINE_DONE:
+        at_complete(AT_RESULT_OK);
+        break;
+    case AT_LINE_ERROR:
+        at_complete(AT_RESULT_ERROR);
+        break;
+    case AT_LINE_PROMPT:
+        if (pCmd->pPayload == NULL) {
+            at_complete(AT_RESULT_OK);
+        } else {
+            // Modem wants the command data. Drop the prompt from the reply
+            // as it is no longer the final result.
+            gsm_port.write(pCmd->pPayload, pCmd->payloadLen);
+            pCmd->pPayload = NULL;
+            atReplyLen = atLineStart;
+            modem_reply[atReplyLen] = '\0';
+        }
+        break;
+    case AT_LINE_DATA: {
+        // The data bytes which follow are not lines, so don't classify them
+        const char* pCount = strrchr(atLine, ',');
+        if (pCount != NULL) {
+            atRawCount = atoi(pCount + 1);
+        }
+        break;
+    }
+    default:
+        if (pCmd->lineFn != NULL) {
+            atReplyLen = atLineStart;
+            modem_reply[atReplyLen] = '\0';
+            atPayloadLines = pCmd->lineFn(atLine);
+        }
+        break;
+    }
+}
+
+/**
+ * Reads the modem UART until there is no more data or a command completes
+ */
+void at_receive() {
+    unsigned long doneId = atDoneId;
+    if (gsm_port.available()) {
+        // Everything waiting is read in one go, so it all arrived by now
+        atReceiveTime = millis();
+    }
+    while (gsm_port.available() && (atDoneId == doneId)) {
+        char inChar = gsm_port.read();
+        if (atRawCount > 0) {
+            // Raw data following an AT_LINE_DATA line
+            atRawCount -= 1;
+            if (atActive && (atReplyLen < sizeof(modem_reply) - 1)) {
+                modem_reply[atReplyLen++] = inChar;
+                modem_reply[atReplyLen] = '\0';
+            }
+            continue;
+        }
+        if (atActive) {
+            if (atLineLen == 0) {
+                atLineStart = atReplyLen;
+            }
+            if (atReplyLen < sizeof(modem_reply) - 1) {
+                modem_reply[atReplyLen++] = inChar;
+                modem_reply[atReplyLen] = '\0';
+            }
+        }
+        if (atLineLen < sizeof(atLine) - 1) {
+            atLine[atLineLen++] = inChar;
+        }
+        if ((inChar == '\n') ||
+            ((atLineLen == 2) && (atLine[0] == '>') && (atLine[1] == ' '))) {
+            at_process_line();
+            atLineLen = 0;
+        }
+    }
+}
+
+/**
+ * Runs the AT command engine: sends the next queued command when the modem
+ * is free, handles received data and times out commands. Completes at most
+ * one command per call.
+ */
+void atService() {
+    if (!atActive && (atQueueCount > 0)) {
+        // Anything received since the last command completed (e.g. an "OK"
+        // after its final result) is not part of the next reply. URCs are
+        // still handled, other lines are dropped, and a partly received
+        // line is given AT_RESYNC_TIME to finish before it is dropped too.
+        at_receive();
+        if (((atLineLen > 0) || (atRawCount > 0)) &&
+            (timeDiff(millis(), atReceiveTime) < AT_RESYNC_TIME)) {
+            return;
+        }
+        atLineLen = 0;
+        atRawCount = 0;
+        AT_CMD_T* pCmd = &atQueue[atQueueHead];
+        if (modemLogging) {
+            debug_print(F("atService: "));
+            debug_println(pCmd->command);
+        }
+        modem_reply[0] = '\0';
+        atReplyLen = 0;
+        atLineStart = 0;
+        atPayloadLines = 0;
+        atActive = true;
+        atSendTime = millis();
+        gsm_port.print(pCmd->command);
+        gsm_port.print("\r");
+    }
+    unsigned long doneId = atDoneId;
+    at_receive();
+    if (atActive && (atDoneId == doneId) &&
+        (timeDiff(millis(), atSendTime) >= atQueue[atQueueHead].timeout)) {
+        at_complete(AT_RESULT_TIMEOUT);
+    }
+}
+
+/**
+ * Scheduled task step which keeps the AT command engine running
+ * @param pTask the task
+ */
+void modemCheck(
+    TASK_T* /* pTask */
+) {
+    atService();
+}
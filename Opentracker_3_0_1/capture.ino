@@ -0,0 +1,186 @@
+/**
+ * Fix capture buffer. Whilst we are not parked a fix is captured every
+ * config.capture_interval secs, passed through the track simplifier and the
+ * points it keeps are held in RAM. Each server update then sends everything
+ * captured since the last one, so we get a high resolution track for the
+ * same number of connections. If the server cannot be reached the records
+ * spill to serverDataStore.
+ *
+ * The buffer is always emptied whole so it is a plain array rather than a
+ * ring. Only the server task spills to the store, fixes captured by the gps
+ * task whilst a send is in progress are appended after the records being
+ * sent.
+ */
+
+SERVER_DATA_T captureBuffer[CAPTURE_BUFFER_SIZE];
+size_t captureCount = 0;           // records in captureBuffer[]
+unsigned long captureTime = 0;     // millis() of the last capture
+bool captureStarted = false;       // true once a fix has been captured
+/**
+ * Statistics
+ */
+size_t capturePeak = 0;                 // most records held since the report
+unsigned long captureSpillCount = 0;    // records spilled to the store
+unsigned long captureOverrunCount = 0;  // fixes not captured, buffer full
+
+/**
+ * Checks if the capture buffer has room for what one more sample may add
+ * @return true if there is room
+ */
+bool captureHasRoom() {
+    return captureCount + TRACK_MAX_EMIT <= CAPTURE_BUFFER_SIZE;
+}
+
+/**
+ * Checks if the capture buffer needs emptying
+ * @return true if the next sample may not fit
+ */
+bool captureIsFull() {
+    return !captureHasRoom();
+}
+
+/**
+ * Captures a new GPS fix if one is due
+ * @param pFix the new fix
+ */
+void captureFix(
+    const GPSDATA_T* pFix
+) {
+    if ((config.capture_interval == 0) || (motionState == MOTION_PARKED)) {
+        return;
+    }
+    unsigned long timeNow = millis();
+    if (captureStarted && (timeDiff(timeNow, captureTime) <
+                           SECS((unsigned long)config.capture_interval))) {
+        return;
+    }
+    captureTime = timeNow;
+    captureStarted = true;
+    if (!captureHasRoom()) {
+        // The server task has not emptied it yet
+        captureOverrunCount += 1;
+        return;
+    }
+    SERVER_DATA_T serverData;
+    serverData.gpsData = *pFix;
+    serverData.ignState = ignState;
+    serverData.engineRuntime = engineRunningTime;
+    serverData.captureTime = clockNow();
+    captureCount += trackAddPoint(&serverData, &captureBuffer[captureCount]);
+    capturePeak = MAX(capturePeak, captureCount);
+}
+
+/**
+ * Writes captured records to the store
+ * @param first index of the first record to write
+ * @param end index after the last record to write
+ * @return true if all the records were stored
+ */
+bool captureSpill(
+    size_t first,
+    size_t end
+) {
+    bool storedOK = true;
+    for (size_t i = first; i < end; i++) {
+        if (serverDataStore.writeServerData(&captureBuffer[i])) {
+            captureSpillCount += 1;
+        } else {
+            storedOK = false;
+        }
+    }
+    return storedOK;
+}
+
+/**
+ * Removes the first records from the capture buffer
+ * @param count the number of records to remove
+ */
+void captureRemove(
+    size_t count
+) {
+    memmove(&captureBuffer[0], &captureBuffer[count],
+            (captureCount - count) * sizeof(captureBuffer[0]));
+    captureCount -= count;
+}
+
+/**
+ * Adds a sample taken by the server task to the capture buffer, making
+ * room first if need be
+ * @param pServerData the sample
+ * @param endSegment true if the sample must be reported, see
+ *        trackEndSegment()
+ */
+void captureSample(
+    SERVER_DATA_T* pServerData,
+    bool endSegment
+) {
+    if (!captureHasRoom()) {
+        captureStore();
+    }
+    SERVER_DATA_T* pEmit = &captureBuffer[captureCount];
+    captureCount += endSegment ? trackEndSegment(pServerData, pEmit)
+                               : trackAddPoint(pServerData, pEmit);
+    capturePeak = MAX(capturePeak, captureCount);
+}
+
+/**
+ * Sends the captured records to the server, as many batches as it takes,
+ * and spills any the server did not get to the store
+ * @param networkStatus the current network status
+ * @return true if all the records were sent or stored
+ */
+bool captureFlush(
+    GSMSTATUS_T networkStatus
+) {
+    // Records captured whilst we send are left for next time
+    size_t count = captureCount;
+    size_t sent = 0;
+    if (networkStatus == CONNECTED) {
+        while (sent < count) {
+            size_t batchCount = MIN(count - sent, serverBatchMaxRecords());
+            if (!updateServerWithCurrentData(&captureBuffer[sent],
+                                             batchCount)) {
+                break;
+            }
+            sent += batchCount;
+        }
+    }
+    bool flushedOK = true;
+    if (sent < count) {
+        debug_println(F("Server update failed so storing to flash"));
+        flushedOK = captureSpill(sent, count);
+        if (!flushedOK) {
+            debug_println(F("Store to flash failed"));
+        }
+    } else if (count > 0) {
+        debug_println(F("Server updated OK"));
+    }
+    captureRemove(count);
+    return flushedOK;
+}
+
+/**
+ * Stores the captured records so they are not lost, e.g. before a reboot
+ */
+void captureStore() {
+    size_t count = captureCount;
+    captureSpill(0, count);
+    captureRemove(count);
+}
+
+/**
+ * Reports how full the capture buffer has been
+ */
+void captureReport() {
+    debug_print(F("captureReport: records="));
+    debug_print(captureCount);
+    debug_print(F("/"));
+    debug_print(CAPTURE_BUFFER_SIZE);
+    debug_print(F(" peak="));
+    debug_print(capturePeak);
+    debug_print(F(" spilled="));
+    debug_print(captureSpillCount);
+    debug_print(F(" overruns="));
+    debug_println(captureOverrunCount);
+    capturePeak = captureCount;
+}
@@ -0,0 +1,185 @@
+/**
+ * Device clock. We keep UTC time as a count of seconds since
+ * 2000/01/01 00:00:00 along with the millis() value when it was set, so
+ * reading the time is pure CPU work. The clock is disciplined from each GPS
+ * fix and, when we have no recent GPS time, from the network time.
+ */
+
+/**
+ * Where the clock was last set from
+ */
+#define CLOCK_SOURCE_NONE    0
+#define CLOCK_SOURCE_NETWORK 1
+#define CLOCK_SOURCE_GPS     2
+/**
+ * How often we re-sync from the network if GPS time is not available
+ */
+#define CLOCK_NETWORK_SYNC_INTERVAL MINS(60)
+
+unsigned long clockTime = CLOCK_INVALID_TIME; // secs since 2000 when set
+unsigned long clockSetTime = 0;     // millis() when clockTime was set
+unsigned clockSource = CLOCK_SOURCE_NONE;
+int clockTimeZone = 0;              // Network time zone in 1/4 hours
+
+/**
+ * Converts a date and time to seconds since 2000/01/01 00:00:00
+ * @param year the year 2000..2099 (or 0..99)
+ * @param month the month 1..12
+ * @param day the day of the month 1..31
+ * @param hour the hour 0..23
+ * @param mi the minute 0..59
+ * @param sec the second 0..59
+ * @return seconds since 2000/01/01 00:00:00
+ */
+unsigned long clockMakeTime(
+    unsigned year,
+    unsigned month,
+    unsigned day,
+    unsigned hour,
+    unsigned mi,
+    unsigned sec
+) {
+    static const unsigned short DAYS_BEFORE_MONTH[] = {
+        0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+    };
+    year %= 100;
+    unsigned long days = 365UL * year + (year + 3) / 4 +
+                         DAYS_BEFORE_MONTH[(month - 1) % 12] + day - 1;
+    if ((month > 2) && ((year % 4) == 0)) {
+        days += 1;
+    }
+    return ((days * 24 + hour) * 60 + mi) * 60 + sec;
+}
+
+/**
+ * Converts seconds since 2000/01/01 00:00:00 to a date and time
+ * @param t seconds since 2000/01/01 00:00:00
+ * @param pYear assigned the year 0..99
+ * @param pMonth assigned the month 1..12
+ * @param pDay assigned the day of the month 1..31
+ * @param pHour assigned the hour 0..23
+ * @param pMin assigned the minute 0..59
+ * @param pSec assigned the second 0..59
+ */
+void clockBreakTime(
+    unsigned long t,
+    unsigned* pYear,
+    unsigned* pMonth,
+    unsigned* pDay,
+    unsigned* pHour,
+    unsigned* pMin,
+    unsigned* pSec
+) {
+    static const unsigned char DAYS_IN_MONTH[] = {
+        31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+    };
+    *pSec = t % 60;
+    t /= 60;
+    *pMin = t % 60;
+    t /= 60;
+    *pHour = t % 24;
+    unsigned long days = t / 24;
+    // 1461 days in each 4 year cycle, starting with a leap year
+    unsigned year = 4 * (days / 1461);
+    days %= 1461;
+    if (days >= 366) {
+        days -= 366;
+        year += 1 + days / 365;
+        days %= 365;
+    }
+    unsigned month = 0;
+    while (true) {
+        unsigned monthDays = DAYS_IN_MONTH[month];
+        if ((month == 1) && ((year % 4) == 0)) {
+            monthDays += 1;
+        }
+        if (days < monthDays) {
+            break;
+        }
+        days -= monthDays;
+        month += 1;
+    }
+    *pYear = year;
+    *pMonth = month + 1;
+    *pDay = days + 1;
+}
+
+/**
+ * Sets the device clock
+ * @param t the current UTC time in seconds since 2000/01/01 00:00:00
+ * @param source one of the CLOCK_SOURCE_xxx values
+ */
+void clockSet(
+    unsigned long t,
+    unsigned source
+) {
+    clockTime = t;
+    clockSetTime = millis();
+    clockSource = source;
+}
+
+/**
+ * Gets the current time from the device clock
+ * @return seconds since 2000/01/01 00:00:00 UTC or CLOCK_INVALID_TIME if
+ *         the clock has not been set
+ */
+unsigned long clockNow() {
+    if (clockTime == CLOCK_INVALID_TIME) {
+        return CLOCK_INVALID_TIME;
+    }
+    return clockTime + timeDiff(millis(), clockSetTime) / ONE_SEC;
+}
+
+/**
+ * Disciplines the clock from a GPS fix
+ * @param date the GPS date as ddmmyy
+ * @param time the GPS time as hhmmsscc
+ */
+void clockSetFromGPS(
+    unsigned long date,
+    unsigned long time
+) {
+    if ((date != TinyGPS::GPS_INVALID_DATE) &&
+        (time != TinyGPS::GPS_INVALID_TIME)) {
+        clockSet(clockMakeTime(date % 100, (date / 100) % 100, date / 10000,
+                               time / 1000000, (time / 10000) % 100,
+                               (time / 100) % 100),
+                 CLOCK_SOURCE_GPS);
+    }
+}
+
+/**
+ * Checks whether the clock should be re-synced from the network i.e. we
+ * have not had GPS (or network) time recently
+ * @return true if a network time sync is due
+ */
+bool clockNetworkSyncDue() {
+    return (clockTime == CLOCK_INVALID_TIME) ||
+           (timeDiff(millis(), clockSetTime) > CLOCK_NETWORK_SYNC_INTERVAL);
+}
+
+/**
+ * Forms the time string we send to the server and in SMS messages
+ * e.g. "15/08/09,15:01:49+01"
+ * @param pStr points to where to write the string
+ * @param strSize the storage size for pStr
+ * @param t the time to show (secs since 2000) or CLOCK_INVALID_TIME
+ * @return pStr
+ */
+char* clockFormatTime(
+    char* pStr,
+    size_t strSize,
+    unsigned long t
+) {
+    if (t == CLOCK_INVALID_TIME) {
+        strncopy(pStr, BAD_TIME, strSize);
+    } else {
+        unsigned year, month, day, hour, mi, sec;
+        clockBreakTime(t, &year, &month, &day, &hour, &mi, &sec);
+        snprintf(pStr, strSize, "%02u/%02u/%02u,%02u:%02u:%02u%c%02u",
+            year, month, day, hour, mi, sec,
+            clockTimeZone < 0 ? '-' : '+',
+            (clockTimeZone < 0 ? -clockTimeZone : clockTimeZone) / 4);
+    }
+    return pStr;
+}
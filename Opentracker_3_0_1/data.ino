@@ -1,3 +1,17 @@
+/**
+ * Battery level in mV, sampled once for each batch by dataSampleBattery()
+ * so a batch comes out the same each time it is formed
+ */
+unsigned long dataBatteryLevel = 0;
+
+/**
+ * Samples the battery level sent with the records of a batch
+ */
+void dataSampleBattery() {
+    dataBatteryLevel = analogRead(AIN_S_INLEVEL)
+        * (242.0f / 22.0f * ANALOG_VREF / 1024.0f * 1000.0f);
+}
+
 /**
  * Form server update message
  * @param pServer points to data set to send to the server
@@ -13,10 +27,9 @@ bool formServerUpdateMessage(
     bool rStat = true;
     char* pos = pMsg;
     char timeStr[22];
+    char valueStr[14];
 
-    if (!gsmGetTime(timeStr, DIM(timeStr), SECS(5))) {
-        strncopy(timeStr, BAD_TIME, DIM(timeStr));
-    }
+    clockFormatTime(timeStr, DIM(timeStr), pServerData->captureTime);
     pos = calc_snprintf_return_pointer(
         pos, msgSize - (pos-pMsg),
         snprintf(pos, msgSize - (pos-pMsg),
@@ -49,8 +62,9 @@ bool formServerUpdateMessage(
             pos = calc_snprintf_return_pointer(
                 pos, msgSize - (pos-pMsg),
                 snprintf(pos, msgSize - (pos-pMsg),
-                         "%s%1.6f", pos == dataStart ? "" : ",",
-                         pServerData->gpsData.lat)
+                         "%s%s", pos == dataStart ? "" : ",",
+                         gps_form_fixed_str(valueStr, DIM(valueStr),
+                             pServerData->gpsData.lat, GPS_LATLON_DIGITS, 6))
             );
         }
         if ((config.server_send_flags >> SERVER_SEND_LONGITUDE_POS)
@@ -58,8 +72,9 @@ bool formServerUpdateMessage(
             pos = calc_snprintf_return_pointer(
                 pos, msgSize - (pos-pMsg),
                 snprintf(pos, msgSize - (pos-pMsg),
-                         "%s%1.6f", pos == dataStart ? "" : ",",
-                         pServerData->gpsData.lon)
+                         "%s%s", pos == dataStart ? "" : ",",
+                         gps_form_fixed_str(valueStr, DIM(valueStr),
+                             pServerData->gpsData.lon, GPS_LATLON_DIGITS, 6))
             );
         }
         if ((config.server_send_flags >> SERVER_SEND_SPEED_POS)
@@ -67,8 +82,9 @@ bool formServerUpdateMessage(
             pos = calc_snprintf_return_pointer(
                 pos, msgSize - (pos-pMsg),
                 snprintf(pos, msgSize - (pos-pMsg),
-                         "%s%1.6f", pos == dataStart ? "" : ",",
-                         pServerData->gpsData.speed)
+                         "%s%s", pos == dataStart ? "" : ",",
+                         gps_form_fixed_str(valueStr, DIM(valueStr),
+                             gps_cms_to_kmph100(pServerData->gpsData.speed), GPS_CENTI_DIGITS, 2))
             );
         }
         if ((config.server_send_flags >> SERVER_SEND_ALTITUDE_POS)
@@ -76,8 +92,9 @@ bool formServerUpdateMessage(
             pos = calc_snprintf_return_pointer(
                 pos, msgSize - (pos-pMsg),
                 snprintf(pos, msgSize - (pos-pMsg),
-                         "%s%1.6f", pos == dataStart ? "" : ",",
-                         pServerData->gpsData.alt)
+                         "%s%s", pos == dataStart ? "" : ",",
+                         gps_form_fixed_str(valueStr, DIM(valueStr),
+                             pServerData->gpsData.alt, GPS_CENTI_DIGITS, 2))
             );
         }
         if ((config.server_send_flags >> SERVER_SEND_HEADING_POS)
@@ -85,8 +102,9 @@ bool formServerUpdateMessage(
             pos = calc_snprintf_return_pointer(
                 pos, msgSize - (pos-pMsg),
                 snprintf(pos, msgSize - (pos-pMsg),
-                         "%s%1.6f", pos == dataStart ? "" : ",",
-                         pServerData->gpsData.course)
+                         "%s%s", pos == dataStart ? "" : ",",
+                         gps_form_fixed_str(valueStr, DIM(valueStr),
+                             pServerData->gpsData.course, GPS_CENTI_DIGITS, 2))
             );
         }
         if ((config.server_send_flags >> SERVER_SEND_HDOP_POS)
@@ -116,9 +134,7 @@ bool formServerUpdateMessage(
     if ((config.server_send_flags >> SERVER_SEND_BATT_POS)
                                    & SERVER_SEND_BATT_MASK) {
         // append battery level to data packet
-        float sensorValue = analogRead(AIN_S_INLEVEL);
-        float outputValue = sensorValue
-            * (242.0f / 22.0f * ANALOG_VREF / 1024.0f);
+        float outputValue = dataBatteryLevel / 1000.0f;
         pos = calc_snprintf_return_pointer(
             pos, msgSize - (pos-pMsg),
             snprintf(pos, msgSize - (pos-pMsg),
@@ -150,3 +166,232 @@ bool formServerUpdateMessage(
     }
     return rStat;
 }
+
+/**
+ * Appends an unsigned varint to a binary server batch
+ * @param pPos where to write the value, NULL if the batch is already full
+ * @param pEnd the end of the batch storage
+ * @param value the value to write
+ * @return the position after the value or NULL if it did not fit
+ */
+uint8_t* data_put_varint(
+    uint8_t* pPos,
+    const uint8_t* pEnd,
+    unsigned long value
+) {
+    while (pPos != NULL) {
+        if (pPos >= pEnd) {
+            pPos = NULL;
+        } else if (value < 0x80) {
+            *pPos++ = value;
+            break;
+        } else {
+            *pPos++ = (value & 0x7F) | 0x80;
+            value >>= 7;
+        }
+    }
+    return pPos;
+}
+
+/**
+ * Appends a value to a binary server batch as a zig-zag coded delta from the
+ * previous value
+ * @param pPos where to write the value, NULL if the batch is already full
+ * @param pEnd the end of the batch storage
+ * @param value the value to write
+ * @param pPrev points to the previous value, updated to value
+ * @return the position after the value or NULL if it did not fit
+ */
+uint8_t* data_put_delta(
+    uint8_t* pPos,
+    const uint8_t* pEnd,
+    long value,
+    long* pPrev
+) {
+    long delta = value - *pPrev;
+    *pPrev = value;
+    return data_put_varint(pPos, pEnd,
+        ((unsigned long)delta << 1) ^ (unsigned long)(delta >> 31));
+}
+
+/**
+ * Reads an unsigned varint written by data_put_varint()
+ * @param pPos where to read the value, NULL if a previous read failed
+ * @param pEnd the end of the data
+ * @param pValue assigned the value
+ * @return the position after the value or NULL if the data ended first
+ */
+const uint8_t* data_get_varint(
+    const uint8_t* pPos,
+    const uint8_t* pEnd,
+    unsigned long* pValue
+) {
+    unsigned long value = 0;
+    for (unsigned shift = 0; pPos != NULL; shift += 7) {
+        if ((pPos >= pEnd) || (shift > 28)) {
+            pPos = NULL;
+        } else {
+            value |= (unsigned long)(*pPos & 0x7F) << shift;
+            if ((*pPos++ & 0x80) == 0) {
+                break;
+            }
+        }
+    }
+    *pValue = value;
+    return pPos;
+}
+
+/**
+ * Reads a value written by data_put_delta()
+ * @param pPos where to read the value, NULL if a previous read failed
+ * @param pEnd the end of the data
+ * @param pValue points to the previous value, updated to the value read
+ * @return the position after the value or NULL if the data ended first
+ */
+const uint8_t* data_get_delta(
+    const uint8_t* pPos,
+    const uint8_t* pEnd,
+    long* pValue
+) {
+    unsigned long zigzag = 0;
+    pPos = data_get_varint(pPos, pEnd, &zigzag);
+    if (pPos != NULL) {
+        *pValue += (long)(zigzag >> 1) ^ -(long)(zigzag & 1);
+    }
+    return pPos;
+}
+
+/**
+ * Appends a length prefixed string to a binary server batch
+ * @param pPos where to write the string, NULL if the batch is already full
+ * @param pEnd the end of the batch storage
+ * @param pStr the string to write
+ * @return the position after the string or NULL if it did not fit
+ */
+uint8_t* data_put_string(
+    uint8_t* pPos,
+    const uint8_t* pEnd,
+    const char* pStr
+) {
+    size_t len = strlen(pStr);
+    pPos = data_put_varint(pPos, pEnd, len);
+    if ((pPos != NULL) && (pPos + len <= pEnd)) {
+        memcpy(pPos, pStr, len);
+        pPos += len;
+    } else {
+        pPos = NULL;
+    }
+    return pPos;
+}
+
+/**
+ * Appends one server data record to a binary server batch
+ * @param pPos where to write the record
+ * @param pEnd the end of the batch storage
+ * @param pServerData the server data to write
+ * @param fieldMask the server_send_flags data field bits to send
+ * @param pPrev the previous record's values, SERVER_SEND_FIELD_COUNT field
+ *        values followed by the captureTime
+ * @return the position after the record or NULL if it did not fit
+ */
+uint8_t* data_put_server_record(
+    uint8_t* pPos,
+    const uint8_t* pEnd,
+    const SERVER_DATA_T* pServerData,
+    unsigned long fieldMask,
+    long* pPrev
+) {
+    const GPSDATA_T* pGPS = &pServerData->gpsData;
+    bool gpsValid = (pGPS->fixAge != TinyGPS::GPS_INVALID_AGE);
+    long values[SERVER_SEND_FIELD_COUNT];
+    values[SERVER_SEND_GPSDATE_POS] = clockMakeTime(
+        pGPS->date % 100, (pGPS->date / 100) % 100, pGPS->date / 10000,
+        0, 0, 0) / (24UL * 60 * 60);
+    values[SERVER_SEND_GPSTIME_POS] = (pGPS->time / 1000000) * 360000 +
+        ((pGPS->time / 10000) % 100) * 6000 + (pGPS->time % 10000);
+    values[SERVER_SEND_LATITUDE_POS] = pGPS->lat;
+    values[SERVER_SEND_LONGITUDE_POS] = pGPS->lon;
+    values[SERVER_SEND_SPEED_POS] = pGPS->speed;
+    values[SERVER_SEND_ALTITUDE_POS] = pGPS->alt;
+    values[SERVER_SEND_HEADING_POS] = pGPS->course;
+    values[SERVER_SEND_HDOP_POS] = pGPS->hdop;
+    values[SERVER_SEND_NSAT_POS] = pGPS->nsats;
+    values[SERVER_SEND_BATT_POS] = dataBatteryLevel;
+    values[SERVER_SEND_IGN_POS] = 0; // sent in the record flags
+    values[SERVER_SEND_RUNTIME_POS] = pServerData->engineRuntime;
+    pPos = data_put_varint(pPos, pEnd,
+        (gpsValid ? SERVER_RECORD_GPS_VALID : 0) |
+        (pServerData->ignState ? SERVER_RECORD_IGN_ON : 0));
+    pPos = data_put_delta(pPos, pEnd, pServerData->captureTime,
+                          &pPrev[SERVER_SEND_FIELD_COUNT]);
+    for (unsigned field = 0; field < SERVER_SEND_FIELD_COUNT; ++field) {
+        if (((fieldMask >> field) & 1) && (field != SERVER_SEND_IGN_POS) &&
+            (gpsValid || (field >= SERVER_SEND_BATT_POS))) {
+            pPos = data_put_delta(pPos, pEnd, values[field], &pPrev[field]);
+        }
+    }
+    return pPos;
+}
+
+/**
+ * Writes a binary format server batch (see SERVER_BINARY_VERSION) a record
+ * at a time, so the batch is never held in RAM. The records are read
+ * twice, first to find the payload length for the batch header.
+ * @param pBatch the records to write
+ * @param sequence the datagram sequence number, 0 for a batch without one
+ * @param writeFn writes the next bytes of the batch
+ * @return true if written OK, false if writeFn failed
+ */
+bool formServerBinaryBatch(
+    SERVER_BATCH_T* pBatch,
+    unsigned sequence,
+    bool (*writeFn)(const uint8_t* pData, size_t len)
+) {
+    // The header then the sequence, imei, key, field mask and count varints
+    uint8_t header[SERVER_BINARY_HEADER_LEN + 3 + 1 + IMEI_LEN +
+                   1 + MAX_SERVER_KEY_LEN + 5 + 1];
+    uint8_t record[SERVER_BINARY_MAX_RECORD_LEN];
+    const uint8_t* pHeaderEnd = header + sizeof(header);
+    const uint8_t* pRecordEnd = record + sizeof(record);
+    unsigned long fieldMask = config.server_send_flags &
+                              SERVER_SEND_FIELDS_MASK;
+    long prev[SERVER_SEND_FIELD_COUNT + 1] = { 0 };
+    SERVER_DATA_T serverData;
+    size_t count = 0;
+    size_t payloadLen = 0;
+    dataSampleBattery();
+    serverBatchRewind(pBatch);
+    while ((count < SERVER_BINARY_MAX_RECORDS) &&
+           serverBatchRead(pBatch, &serverData)) {
+        payloadLen += data_put_server_record(record, pRecordEnd,
+            &serverData, fieldMask, prev) - record;
+        count += 1;
+    }
+    uint8_t* pos = header + SERVER_BINARY_HEADER_LEN;
+    if (sequence != 0) {
+        pos = data_put_varint(pos, pHeaderEnd, sequence);
+    }
+    pos = data_put_string(pos, pHeaderEnd, config.imei);
+    pos = data_put_string(pos, pHeaderEnd, config.key);
+    pos = data_put_varint(pos, pHeaderEnd, fieldMask);
+    pos = data_put_varint(pos, pHeaderEnd, count);
+    payloadLen += pos - header - SERVER_BINARY_HEADER_LEN;
+    if (payloadLen > 0xFFFF) {
+        debug_println(F("formServerBinaryBatch() batch too long"));
+        return false;
+    }
+    header[0] = SERVER_BINARY_MAGIC1;
+    header[1] = SERVER_BINARY_MAGIC2;
+    header[2] = (sequence != 0) ? SERVER_BINARY_VERSION_SEQ
+                                : SERVER_BINARY_VERSION;
+    header[3] = payloadLen & 0xFF;
+    header[4] = payloadLen >> 8;
+    bool rStat = writeFn(header, pos - header);
+    memset(prev, 0, sizeof(prev));
+    serverBatchRewind(pBatch);
+    while (rStat && (count-- > 0) && serverBatchRead(pBatch, &serverData)) {
+        rStat = writeFn(record, data_put_server_record(record, pRecordEnd,
+            &serverData, fieldMask, prev) - record);
+    }
+    return rStat;
+}
@@ -15,47 +15,153 @@ void gps_on_off() {
 }
 
 /**
- * Collect current gps position data
+ * GPS receive ring buffer. Serial1 (USART0) received data is written into
+ * this by the PDC (DMA) rather than by the Serial1 interrupt handler, so no
+ * received data is lost whilst we are busy elsewhere.
+ */
+uint8_t gpsRxBuffer[GPS_RX_BUFFER_SIZE];
+/**
+ * Index into gpsRxBuffer[] of the next byte to decode
+ */
+size_t gpsRxTail = 0;
+/**
+ * Number of times the PDC filled the ring buffer before we consumed it
+ */
+unsigned long gpsRxOverruns = 0;
+/**
+ * millis() and TinyGPS statistics values at the last gpsReport()
+ */
+unsigned long gpsLastReportTime = 0;
+unsigned long gpsLastReportChars = 0;
+
+/**
+ * Starts the PDC receiving GPS data into gpsRxBuffer[]. Call after
+ * gps_port.begin().
+ */
+void gpsRxStart() {
+    const size_t half = GPS_RX_BUFFER_SIZE / 2;
+    // Stop the Serial1 interrupt handler taking the received data
+    USART0->US_IDR = US_IDR_RXRDY;
+    USART0->US_PTCR = US_PTCR_RXTDIS;
+    USART0->US_RPR = (uint32_t)(uintptr_t)gpsRxBuffer;
+    USART0->US_RCR = half;
+    USART0->US_RNPR = (uint32_t)(uintptr_t)(gpsRxBuffer + half);
+    USART0->US_RNCR = half;
+    gpsRxTail = 0;
+    USART0->US_PTCR = US_PTCR_RXTEN;
+}
+
+/**
+ * Gets the index into gpsRxBuffer[] where the PDC will write the next byte
+ * @return the PDC write index
+ */
+size_t gpsRxHead() {
+    return ((uint8_t*)(uintptr_t)USART0->US_RPR - gpsRxBuffer) % GPS_RX_BUFFER_SIZE;
+}
+
+/**
+ * Keeps the PDC supplied with buffer space. Once the PDC has moved on to
+ * the next half of the ring buffer we hand the half it filled back to it,
+ * as soon as we have decoded everything in that half.
+ */
+void gpsRxService() {
+    const size_t half = GPS_RX_BUFFER_SIZE / 2;
+    if (USART0->US_RNCR == 0) {
+        if (USART0->US_RCR == 0) {
+            // Both halves filled before we consumed them, so the PDC has
+            // stopped and received data has been lost
+            debug_println(F("gpsRxService: GPS receive overrun"));
+            gpsRxOverruns += 1;
+            gpsRxStart();
+        } else {
+            size_t filledHalf = (gpsRxHead() < half) ? half : 0;
+            if ((gpsRxTail < filledHalf) || (gpsRxTail >= filledHalf + half)) {
+                USART0->US_RNPR = (uint32_t)(uintptr_t)(gpsRxBuffer + filledHalf);
+                USART0->US_RNCR = half;
+            }
+        }
+    }
+}
+
+/**
+ * Reads the next received GPS byte from the ring buffer
+ * @return the next byte or -1 if there is no received data waiting
+ */
+int gpsRxRead() {
+    if (gpsRxTail == gpsRxHead()) {
+        return -1;
+    }
+    int c = gpsRxBuffer[gpsRxTail];
+    gpsRxTail = (gpsRxTail + 1) % GPS_RX_BUFFER_SIZE;
+    return c;
+}
+
+/**
+ * Decodes received gps data into current gps position data. We only decode
+ * GPS data which has already been received, so this never waits for the GPS
+ * receiver. pGPSData is left holding the latest fix decoded.
  * @param pGPSData points to the record to receive the GPS data
- * @param timeout how long to wait in ms to receive current data
+ * @param pTask the task reading the GPS data, we stop decoding once its step
+ *        deadline has passed
+ * @return true if pGPSData was assigned a new current fix
  */
 bool readGPSData(
     GPSDATA_T* pGPSData,
-    unsigned long timeout
+    TASK_T* pTask
 ) {
     bool rStat = false;
-    unsigned long tStart = millis();
-    // Clear out any buffered received GPS data
-    while (gps_port.available() && timeDiff(millis(), tStart) < timeout) {
-        (void) gps_port.read();
-    }
-    while ((rStat == false) && timeDiff(millis(), tStart) < timeout) {
-        if (gps_port.available()) {
-            // As new GPS data arrives, feed it to the gps object until it tells
-            // us it has received a new gps data sentence
-            int c = gps_port.read();
-            if (gps.encode(c)) {
-                gps.f_get_position(
-                    &pGPSData->lat, &pGPSData->lon, &pGPSData->fixAge);
-                if ((pGPSData->fixAge != TinyGPS::GPS_INVALID_AGE) &&
-                    (pGPSData->fixAge < 1000)) {
-                    // We have a fix which is < 1s old so consider it
-                    // as current
-                    pGPSData->alt = gps.f_altitude();
-                    pGPSData->course = gps.f_course();
-                    pGPSData->speed = gps.f_speed_kmph();
-                    pGPSData->hdop = gps.hdop();
-                    pGPSData->nsats = gps.satellites();
-                    gps.get_datetime(&pGPSData->date, &pGPSData->time);
+    int c;
+    while (taskHasTime(pTask) && ((c = gpsRxRead()) >= 0)) {
+        // Feed the GPS data to the gps object until it tells us it has
+        // received a new gps data sentence
+        if (gps.encode(c)) {
+            GPSDATA_T fix;
+            gps.get_position(&fix.lat, &fix.lon, &fix.fixAge);
+            if ((fix.fixAge != TinyGPS::GPS_INVALID_AGE) &&
+                (fix.fixAge < 1000)) {
+                // We have a fix which is < 1s old so consider it
+                // as current. TinyGPS gives lat/lon in 1e-6 degrees.
+                fix.lat *= 10;
+                fix.lon *= 10;
+                fix.alt = gps.altitude();
+                fix.course = gps.course();
+                fix.speed = gps_knots100_to_cms(gps.speed());
+                fix.hdop = gps.hdop();
+                fix.nsats = gps.satellites();
+                gps.get_datetime(&fix.date, &fix.time);
+                *pGPSData = fix;
+                if (!rStat) {
                     blink_got_gps();
-                    rStat = true;
                 }
+                rStat = true;
             }
         }
     }
     return rStat;
 }
 
+/**
+ * Reports the GPS decode statistics to the debug port
+ */
+void gpsReport() {
+    unsigned long chars;
+    unsigned short goodSentences;
+    unsigned short failedChecksums;
+    gps.stats(&chars, &goodSentences, &failedChecksums);
+    unsigned long timeNow = millis();
+    unsigned long period = timeDiff(timeNow, gpsLastReportTime);
+    debug_print(F("gpsReport: bytes/s="));
+    debug_print(period ? ((chars - gpsLastReportChars) * 1000) / period : 0);
+    debug_print(F(" sentences="));
+    debug_print(goodSentences);
+    debug_print(F(" failedChecksums="));
+    debug_print(failedChecksums);
+    debug_print(F(" overruns="));
+    debug_println(gpsRxOverruns);
+    gpsLastReportTime = timeNow;
+    gpsLastReportChars = chars;
+}
+
 char* calc_snprintf_return_pointer(
     char* pStr,
     size_t strSize,
@@ -72,16 +178,181 @@ char* calc_snprintf_return_pointer(
     }
 }
 
+/**
+ * Converts a TinyGPS speed value to cm/s
+ * @param knots100 the speed in 100ths of a knot
+ * @return the speed in cm/s (1 knot = 51.4444 cm/s)
+ */
+unsigned long gps_knots100_to_cms(
+    unsigned long knots100
+) {
+    if (knots100 == TinyGPS::GPS_INVALID_SPEED) {
+        return TinyGPS::GPS_INVALID_SPEED;
+    }
+    return (knots100 * 5144UL + 5000UL) / 10000UL;
+}
+
+/**
+ * Converts a speed in cm/s to 100ths of a km/h
+ * @param cms the speed in cm/s
+ * @return the speed in 100ths of a km/h (1 cm/s = 0.036 km/h)
+ */
+unsigned long gps_cms_to_kmph100(
+    unsigned long cms
+) {
+    if (cms == TinyGPS::GPS_INVALID_SPEED) {
+        return TinyGPS::GPS_INVALID_SPEED;
+    }
+    return (cms * 36UL + 5UL) / 10UL;
+}
+
+/**
+ * Forms the decimal string for a fixed point value, without going anywhere
+ * near floating point
+ * @param pStr points to where to write the string
+ * @param strSize the storage size for pStr
+ * @param value the fixed point value
+ * @param valueDigits number of decimal places held in value e.g. 7 if value
+ *        is in 1e-7 units
+ * @param showDigits number of decimal places to show (<= valueDigits). The
+ *        value is rounded to this many places.
+ * @return pStr
+ */
+char* gps_form_fixed_str(
+    char* pStr,
+    size_t strSize,
+    long value,
+    unsigned valueDigits,
+    unsigned showDigits
+) {
+    static const unsigned long POW10[] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000
+    };
+    unsigned long magnitude = (value < 0) ? -(unsigned long)value : value;
+    unsigned long dropScale = POW10[valueDigits - showDigits];
+    magnitude = (magnitude + dropScale/2) / dropScale;
+    const char* pSign = ((value < 0) && (magnitude != 0)) ? "-" : "";
+    if (showDigits == 0) {
+        snprintf(pStr, strSize, "%s%lu", pSign, magnitude);
+    } else {
+        unsigned long unit = POW10[showDigits];
+        snprintf(pStr, strSize, "%s%lu.%0*lu", pSign,
+            magnitude / unit, (int)showDigits, magnitude % unit);
+    }
+    return pStr;
+}
+
+/**
+ * Cosine of 0..90 degrees in 1/32768ths, used to scale longitude
+ * differences when working out distances
+ */
+const unsigned short GPS_COS_TABLE[91] = {
+    32768, 32763, 32748, 32723, 32688, 32643, 32588, 32524, 32449, 32365,
+    32270, 32166, 32052, 31928, 31795, 31651, 31499, 31336, 31164, 30983,
+    30792, 30592, 30382, 30163, 29935, 29698, 29452, 29197, 28932, 28660,
+    28378, 28088, 27789, 27482, 27166, 26842, 26510, 26170, 25822, 25466,
+    25102, 24730, 24351, 23965, 23571, 23170, 22763, 22348, 21926, 21498,
+    21063, 20622, 20174, 19720, 19261, 18795, 18324, 17847, 17364, 16877,
+    16384, 15886, 15384, 14876, 14365, 13848, 13328, 12803, 12275, 11743,
+    11207, 10668, 10126, 9580, 9032, 8481, 7927, 7371, 6813, 6252,
+    5690, 5126, 4560, 3993, 3425, 2856, 2286, 1715, 1144, 572,
+    0
+};
+
+/**
+ * Integer square root
+ * @param value the value to find the square root of
+ * @return the largest integer whose square is <= value
+ */
+uint32_t gps_isqrt(
+    uint64_t value
+) {
+    uint64_t root = 0;
+    uint64_t bit = (uint64_t)1 << 62;
+    while (bit > value) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (value >= root + bit) {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)root;
+}
+
+/**
+ * Calculates how far east and north one position is from another using an
+ * equirectangular approximation, which is plenty accurate over the
+ * distances we compare
+ * @param lat1 latitude of the first position in 1e-7 degrees
+ * @param lon1 longitude of the first position in 1e-7 degrees
+ * @param lat2 latitude of the second position in 1e-7 degrees
+ * @param lon2 longitude of the second position in 1e-7 degrees
+ * @param pDx assigned the distance east in 1/10ths of a meter
+ * @param pDy assigned the distance north in 1/10ths of a meter
+ */
+void gps_offset_between(
+    long lat1,
+    long lon1,
+    long lat2,
+    long lon2,
+    int64_t* pDx,
+    int64_t* pDy
+) {
+    // 1e-7 degree = 11.1195mm along a great circle
+    int64_t dLat = (int64_t)lat2 - lat1;
+    int64_t dLon = (int64_t)lon2 - lon1;
+    if (dLon > 1800000000LL) {
+        dLon -= 3600000000LL;
+    } else if (dLon < -1800000000LL) {
+        dLon += 3600000000LL;
+    }
+    long midLat = (long)(((int64_t)lat1 + lat2) / 2);
+    unsigned cosIdx = (unsigned)
+        ((((midLat < 0) ? -midLat : midLat) + 5000000L) / 10000000L);
+    *pDy = dLat * 111195 / 1000000LL;
+    *pDx = dLon * 111195 / 1000000LL * GPS_COS_TABLE[MIN(cosIdx, 90u)] / 32768;
+}
+
+/**
+ * Calculates the distance between two positions, see gps_offset_between()
+ * @param lat1 latitude of the first position in 1e-7 degrees
+ * @param lon1 longitude of the first position in 1e-7 degrees
+ * @param lat2 latitude of the second position in 1e-7 degrees
+ * @param lon2 longitude of the second position in 1e-7 degrees
+ * @return the distance between the positions in meters
+ */
+unsigned long gps_distance_between(
+    long lat1,
+    long lon1,
+    long lat2,
+    long lon2
+) {
+    int64_t dx;
+    int64_t dy;
+    gps_offset_between(lat1, lon1, lat2, lon2, &dx, &dy);
+    return (gps_isqrt((uint64_t)(dx * dx + dy * dy)) + 5) / 10;
+}
+
 char* gps_form_map_location_url(
     char* pURL,
     size_t urlSize,
     GPSDATA_T* pGPSData
 ) {
+    char latStr[14];
+    char lonStr[14];
     return calc_snprintf_return_pointer(
         pURL, urlSize,
         snprintf(pURL, urlSize,
-            "comgooglemaps://?center=%.6f,%.6f&zoom=18",
-            pGPSData->lat, pGPSData->lon)
+            "comgooglemaps://?center=%s,%s&zoom=18",
+            gps_form_fixed_str(latStr, DIM(latStr), pGPSData->lat,
+                               GPS_LATLON_DIGITS, 6),
+            gps_form_fixed_str(lonStr, DIM(lonStr), pGPSData->lon,
+                               GPS_LATLON_DIGITS, 6))
             );
 }
 
@@ -90,11 +361,16 @@ char* gps_form_web_location_url(
     size_t urlSize,
     GPSDATA_T* pGPSData
 ) {
+    char latStr[14];
+    char lonStr[14];
     return calc_snprintf_return_pointer(
         pURL, urlSize,
         snprintf(pURL, urlSize,
-            "https://www.google.com/maps/%%40%.6f%%2C%.6f%%2C18z",
-            pGPSData->lat, pGPSData->lon)
+            "https://www.google.com/maps/%%40%s%%2C%s%%2C18z",
+            gps_form_fixed_str(latStr, DIM(latStr), pGPSData->lat,
+                               GPS_LATLON_DIGITS, 6),
+            gps_form_fixed_str(lonStr, DIM(lonStr), pGPSData->lon,
+                               GPS_LATLON_DIGITS, 6))
             );
 }
 
@@ -103,11 +379,16 @@ char* gps_form_val_location_str(
     size_t strSize,
     GPSDATA_T* pGPSData
 ) {
+    char latStr[14];
+    char lonStr[14];
     return calc_snprintf_return_pointer(
         pStr, strSize,
         snprintf(pStr, strSize,
-            "lat=%.6f, lon=%.6f",
-            pGPSData->lat, pGPSData->lon)
+            "lat=%s, lon=%s",
+            gps_form_fixed_str(latStr, DIM(latStr), pGPSData->lat,
+                               GPS_LATLON_DIGITS, 6),
+            gps_form_fixed_str(lonStr, DIM(lonStr), pGPSData->lon,
+                               GPS_LATLON_DIGITS, 6))
             );
 }
 
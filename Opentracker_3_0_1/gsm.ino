@@ -1,3 +1,27 @@
+/**
+ * Session manager state. We keep the PDP context and the socket to the
+ * server open between server updates and only set them up again when the
+ * modem tells us they have been closed, a send fails or the transport
+ * wants a different socket.
+ */
+bool gsmSessionOpen = false;            // true if the socket is connected
+const char* gsmSessionType = NULL;      // "TCP" or "UDP" of the open socket
+const char* gsmSessionPort = NULL;      // server port of the open socket
+unsigned long gsmSessionReuseCount = 0; // sends made over an open socket
+unsigned long gsmSessionSetupCount = 0; // sockets opened OK
+unsigned long gsmSessionFailCount = 0;  // socket opens which failed
+unsigned long gsmSessionCloseCount = 0; // sockets closed by the network
+unsigned long gsmSessionSetupTotalTime = 0; // ms spent opening sockets
+unsigned long gsmSessionSetupMaxTime = 0;   // worst case socket open ms
+unsigned long gsmNetworkStatusId = 0; // id of the AT+QNSTATUS request
+size_t gsmTcpUnacked = 0;               // bytes in flight, see TCP_SEND_WINDOW
+unsigned long gsmTcpAckChecks = 0;      // AT+QISACK checks made
+unsigned long gsmTcpWindowWaits = 0;    // backoffs whilst the window was full
+unsigned long gsmDataBytesSent = 0;     // bytes the modem accepted to send
+unsigned gsmUdpSequence = 0;            // sequence of the last datagram batch
+unsigned long gsmUdpRetransmits = 0;    // datagrams resent for want of an ack
+unsigned long gsmUdpStaleAcks = 0;      // acks for earlier datagrams
+
 /**
  * Sets the IO pins (directions) for the modem
  */
@@ -88,8 +112,62 @@ bool gsmSendModemCommand(
     const char* pCommand
 ) {
     snprintf(modem_command, sizeof(modem_command), pCommand);
-    gsmWriteCommand();
-    return gsmWaitForReply(true);
+    return gsmSendCommand(true);
+}
+
+/**
+ * Sends modem_command[] to the modem and waits for the modem to respond.
+ * The ASCIZ string in modem_command does not need the '\r' as the last
+ * character.
+ * @param allowOK when true, indicates that a modem response of "OK" is enough
+ *        to indicate the end of the modem response. Some commands send an
+ *        "OK" response and then send some data, so for these you dont want
+ *        to pass this is as true.
+ * @return true if the modem response arrived within the timeout period. The
+ *         response is held in modem_reply[]
+ */
+bool gsmSendCommand(
+    bool allowOK
+) {
+    unsigned result = atSendCommand(modem_command, allowOK,
+        SECS(GSM_MODEM_COMMAND_TIMEOUT), NULL, 0, NULL);
+    show_modem_reply();
+    return (result != AT_RESULT_TIMEOUT);
+}
+
+/**
+ * Sends modem_command[] to the modem and waits for the final result,
+ * passing each intermediate reply line to lineFn as it arrives rather than
+ * collecting the reply in modem_reply[] e.g. for AT+CMGL
+ * @param lineFn called with each intermediate reply line, returns the number
+ *        of following lines which are payload for it
+ * @return one of the AT_RESULT_xxx values
+ */
+unsigned gsmSendCommandLines(
+    unsigned (*lineFn)(const char* pLine)
+) {
+    unsigned result = atSendCommand(modem_command, true,
+        SECS(GSM_MODEM_COMMAND_TIMEOUT), NULL, 0, lineFn);
+    show_modem_reply();
+    return result;
+}
+
+/**
+ * Sends modem_command[] to the modem, sends data when the modem gives the
+ * "> " prompt and waits for the final result e.g. for AT+QISEND
+ * @param pData the data to send
+ * @param len the number of bytes to send
+ * @return one of the AT_RESULT_xxx values. The response is held in
+ *         modem_reply[]
+ */
+unsigned gsmSendCommandData(
+    const void* pData,
+    size_t len
+) {
+    unsigned result = atSendCommand(modem_command, true,
+        SECS(GSM_MODEM_COMMAND_TIMEOUT), pData, len, NULL);
+    show_modem_reply();
+    return result;
 }
 
 /**
@@ -118,8 +196,41 @@ bool gsmSyncComms(
  * @returns one of the GSMSTATUS_E values
  */
 GSMSTATUS_T gsmGetNetworkStatus() {
-    GSMSTATUS_T status = NOT_READY;
     gsmSendModemCommand("AT+QNSTATUS");
+    return gsm_parse_network_status();
+}
+
+/**
+ * Asks the modem for its network status without waiting for the reply.
+ * gsmNetworkStatus is updated when the reply arrives.
+ */
+void gsmRequestNetworkStatus() {
+    if (!atIsPending(gsmNetworkStatusId)) {
+        gsmNetworkStatusId = atQueueCommand("AT+QNSTATUS", true,
+            SECS(GSM_MODEM_COMMAND_TIMEOUT), NULL, 0, NULL,
+            gsm_network_status_done);
+    }
+}
+
+/**
+ * Completion callback for gsmRequestNetworkStatus()
+ * @param id the command id
+ * @param result the AT_RESULT_xxx value
+ */
+void gsm_network_status_done(
+    unsigned long id,
+    unsigned result
+) {
+    gsmNetworkStatus = (result == AT_RESULT_OK) ?
+                       gsm_parse_network_status() : NOT_READY;
+}
+
+/**
+ * Extracts the network status from an AT+QNSTATUS reply in modem_reply[]
+ * @returns one of the GSMSTATUS_E values
+ */
+GSMSTATUS_T gsm_parse_network_status() {
+    GSMSTATUS_T status = NOT_READY;
     char *pos = strstr(modem_reply, "+QNSTATUS:");
     if (pos != NULL) {
         pos += 10;
@@ -154,24 +265,6 @@ const char* gsmGetNetworkStatusString(
     return status;
 }
 
-/**
- * Writes modem_command[] to the modem UART. The ASCIZ string in modem_command
- * does not need the '\r' as the last character.
- */
-void gsmWriteCommand() {
-    // Empty out any residual received data
-    while (gsm_port.available()) {
-        (void)gsm_port.read();
-    }
-    modem_reply[0] = '\0';
-    if (modemLogging) {
-        debug_print(F("gsmWriteCommand: "));
-        debug_println(modem_command);
-    }
-    gsm_port.print(modem_command);
-    gsm_port.print("\r");
-}
-
 /**
  * Unlocks the modem by setting any configured modem PIN
  * @return true if the pin is not required or is set OK
@@ -190,10 +283,9 @@ bool gsmSetPin() {
             if (strlen(config.sim_pin) == 4) {
                 debug_println(
                     F("gsm_set_pin: PIN supplied, sending to modem."));
-                gsm_port.print("AT+CPIN=");
-                gsm_port.print(config.sim_pin);
-                gsm_port.print("\r");
-                gsmWaitForReply(true);
+                snprintf(modem_command, sizeof(modem_command),
+                    "AT+CPIN=%s", config.sim_pin);
+                gsmSendCommand(true);
                 tmp = strstr(modem_reply, "OK");
                 if (tmp != NULL) {
                     debug_println(F("gsm_set_pin: PIN is accepted"));
@@ -214,23 +306,20 @@ bool gsmSetPin() {
 }
 
 /**
- * Reads a time string from the modem
- * @param pStr points to where to write the string
- * @param strSize the storage size for pStr
+ * Sets the device clock from the modem's network time
+ * @param timeout how long to keep trying to read a valid time
  * @return true if we read a valid time, false if not
  * 
- * gsmWriteCommand(): AT+QLTS
+ * gsmSendModemCommand(): AT+QLTS
  * Modem Reply: 'AT+QLTS\r\r\n+QLTS: "15/08/09,15:01:49+04,1"\r\n\r\nOK\r\n'
+ * The time is UTC and the time zone is in 1/4 hours.
  */
-bool gsmGetTime(
-    char* pStr,
-    size_t strSize,
+bool gsmSyncClock(
     unsigned timeout
 ) {
     bool validTime = false;
     unsigned long tStart = millis();
     while (!validTime && (timeDiff(millis(), tStart) < timeout)) {
-        *pStr = '\0';
         gsmSendModemCommand("AT+QLTS");
         char *tStart = strstr(modem_reply, "+QLTS: \"");
         if (tStart != NULL) {
@@ -239,10 +328,13 @@ bool gsmGetTime(
             if (sscanf(tStart+8, "%u/%u/%u,%u:%u:%u%c%c%c",
                        &year, &month, &day, &hour, &mi, &sec,
                        &tz1, &tz2, &tz3) == 9) {
-                unsigned tz = (10*(tz2-'0') + (tz3-'0'))/4;
-                snprintf(pStr, strSize, "%02u/%02u/%02u,%02u:%02u:%02u%c%02u",
-                    year, month, day, hour, mi, sec, tz1, tz
-                );
+                int tz = 10*(tz2-'0') + (tz3-'0');
+                clockTimeZone = (tz1 == '-') ? -tz : tz;
+                if ((clockSource != CLOCK_SOURCE_GPS) ||
+                    clockNetworkSyncDue()) {
+                    clockSet(clockMakeTime(year, month, day, hour, mi, sec),
+                             CLOCK_SOURCE_NETWORK);
+                }
                 validTime = true;
             }
         }
@@ -339,8 +431,7 @@ bool gsmSetAPN() {
     snprintf(modem_command, sizeof(modem_command),
         "AT+QIREGAPP=\"%s\",\"%s\",\"%s\"", config.apn, config.user,
         config.pwd);
-    gsmWriteCommand();
-    rStat = rStat && gsmWaitForReply(true);
+    rStat = rStat && gsmSendCommand(true);
     rStat = rStat && gsmSendModemCommand("AT+QIDNSCFG=\"8.8.8.8\"");
     rStat = rStat && gsmSendModemCommand("AT+QIDNSIP=1");
     return rStat;
@@ -366,12 +457,18 @@ bool gsmConfigure() {
         debug_print(F("gsmConfigure: read IMEI: "));
         debug_println(config.imei);
     }
+    // Any TCP session did not survive the modem (re)start
+    gsmSessionOpen = false;
     //disable echo for TCP data
     rStat = rStat && gsmSendModemCommand("AT+QISDE=0");
+    // Only allow a single TCP session
+    rStat = rStat && gsmSendModemCommand("AT+QIMUX=0");
     //set receiving TCP data by command
     rStat = rStat && gsmSendModemCommand("AT+QINDI=1");
     //set SMS as text format
     rStat = rStat && gsmSendModemCommand("AT+CMGF=1");
+    // Indicate new SMS messages with +CMTI: <mem>,<index>
+    rStat = rStat && gsmSendModemCommand("AT+CNMI=2,1,0,0,0");
     // Request network time sync
     rStat = rStat && gsmSendModemCommand("AT+QNITZ=1");
     // Request local time saved to RTC time
@@ -415,9 +512,12 @@ bool gsmDisconnect(
     bool rStat = true;
     //disconnect GSM 
     snprintf(modem_command, sizeof(modem_command), "AT+QIDEACT");
-    gsmWriteCommand();
-    if (waitForReply) {
-        gsmWaitForReply(false);
+    gsmSessionOpen = false;
+    if (!waitForReply) {
+        atQueueCommand(modem_command, false,
+            SECS(GSM_MODEM_COMMAND_TIMEOUT), NULL, 0, NULL, NULL);
+    } else {
+        gsmSendCommand(false);
         //check if result contains DEACT OK
         char *tmp = strstr(modem_reply, "DEACT OK");
         if (tmp == NULL) {
@@ -429,10 +529,15 @@ bool gsmDisconnect(
 }
 
 /**
- * Connects the modem to a TCP host
+ * Connects the modem to the server
+ * @param pType the socket type, "TCP" or "UDP"
+ * @param pPort the server port
  * @return true if connected OK, false if not
  */
-bool gsmConnect() {
+bool gsmConnect(
+    const char* pType,
+    const char* pPort
+) {
     bool rStat = false;
     //try to connect multiple times
     for (int i = 0; i < CONNECT_RETRY; i++) {
@@ -441,10 +546,12 @@ bool gsmConnect() {
         //open socket connection to remote host
         //opening connection
         snprintf(modem_command, sizeof(modem_command),
-            "AT+QIOPEN=\"%s\",\"%s\",\"%s\"", PROTO, HOSTNAME, HTTP_PORT);
-        gsmWriteCommand();
-        gsmWaitForReply(false);
+            "AT+QIOPEN=\"%s\",\"%s\",\"%s\"", pType, HOSTNAME, pPort);
+        gsmSendCommand(false);
         char *tmp = strstr(modem_reply, "CONNECT OK");
+        if (tmp == NULL) {
+            tmp = strstr(modem_reply, "ALREADY CONNECT");
+        }
         if (tmp != NULL) {
             debug_print(F("Connected to remote server: "));
             debug_println(HOSTNAME);
@@ -458,189 +565,445 @@ bool gsmConnect() {
     return rStat;
 }
 
-void gsm_send_tcp_data() {
-    if (modemLogging) {
-        debug_print(F("gsm_send_tcp_data: "));
-        debug_println(modem_data);
-    }
-    gsm_port.print(modem_data);
-}
-
-int gsm_validate_tcp() {
-    char *str;
-    int nonacked = 0;
-    int ret = 0;
-    char *tmp;
-    char *tmpval;
-
-    //todo check in the loop if everything delivered
-    for (int k = 0; k < 10; k++) {
-        gsmSendModemCommand("AT+QISACK");
-        //todo check if everything is delivered
-        tmp = strstr(modem_reply, "+QISACK: ");
-        tmp += strlen("+QISACK: ");
-        tmpval = strtok(tmp, "\r");
-        //checking how many bytes NON-acked
-        str = strtok_r(tmpval, ", ", &tmpval);
-        str = strtok_r(NULL, ", ", &tmpval);
-        str = strtok_r(NULL, ", ", &tmpval);
-        //non-acked value
-        nonacked = atoi(str);
-        if (nonacked <= PACKET_SIZE_DELIVERY) {
-            //all data has been delivered to the server , if not wait and check again            
-            ret = 1;
-            break;
+/**
+ * Registers the handlers for the unsolicited result codes we act on
+ */
+void gsmRegisterURCs() {
+    atRegisterURC("CLOSED", gsm_session_urc);
+    atRegisterURC("+QIURC:", gsm_session_urc);
+    atRegisterURC("+PDP DEACT", gsm_session_urc);
+    atRegisterURC("RING", gsm_ring_urc);
+    atRegisterURC("+CMTI:", smsNewMessageURC);
+    atRegisterURC("+QIRDI:", gsm_data_urc);
+}
+
+/**
+ * Handles the unsolicited result codes which tell us the TCP session or
+ * PDP context has gone away
+ * @param pLine the URC line
+ */
+void gsm_session_urc(
+    const char* pLine
+) {
+    if ((strncmp(pLine, "+QIURC:", 7) == 0) &&
+        (strstr(pLine, "closed") == NULL)) {
+        // Some other TCP/IP event
+        return;
+    }
+    if (gsmSessionOpen) {
+        debug_println(F("gsm_session_urc: TCP session closed"));
+        gsmSessionOpen = false;
+        gsmSessionCloseCount += 1;
+    }
+}
+
+/**
+ * Handles the indication that server data has arrived which we did not ask
+ * for, e.g. an MQTT command, by getting the mqtt task to read it
+ * @param pLine the URC line
+ */
+void gsm_data_urc(
+    const char* pLine
+) {
+    schedulerSignal(schedulerFindTask(tasks, DIM(tasks), "mqtt"));
+}
+
+/**
+ * Handles an incoming call indication. We don't take calls, so we just
+ * let it ring.
+ * @param pLine the URC line
+ */
+void gsm_ring_urc(
+    const char* pLine
+) {
+    debug_println(F("gsm_ring_urc: incoming call ignored"));
+}
+
+/**
+ * Makes sure we have a session open to the server, reusing the current one
+ * if it is still open and is the socket type and port asked for
+ * @param pType the socket type, "TCP" or "UDP"
+ * @param pPort the server port
+ * @return true if the session is open, false if not
+ */
+bool gsmOpenSession(
+    const char* pType,
+    const char* pPort
+) {
+    bool rStat = true;
+    if (gsmSessionOpen &&
+            ((strcmp(gsmSessionType, pType) != 0) ||
+             (strcmp(gsmSessionPort, pPort) != 0))) {
+        // The transport has been changed
+        gsmCloseSession();
+    }
+    if (gsmSessionOpen) {
+        gsmSessionReuseCount += 1;
+    } else {
+        unsigned long tStart = millis();
+        if (gsmConnect(pType, pPort)) {
+            unsigned long setupTime = timeDiff(millis(), tStart);
+            gsmSessionOpen = true;
+            gsmSessionType = pType;
+            gsmSessionPort = pPort;
+            gsmTcpUnacked = 0;
+            gsmSessionSetupCount += 1;
+            gsmSessionSetupTotalTime += setupTime;
+            gsmSessionSetupMaxTime = MAX(gsmSessionSetupMaxTime, setupTime);
         } else {
-            debug_println(F("gsm_validate_tcp: data not yet delivered."));
+            // Drop the PDP context so the next attempt starts afresh
+            gsmSessionFailCount += 1;
+            gsmDisconnect(true);
+            rStat = false;
         }
     }
-    return ret;
+    return rStat;
 }
 
 /**
- * Sends one or more messages to the server
- * @param pServerMessages points to an array of pointers to messages. Each
- *        message is a '\0' terminated string
- * @return true if all messages set ok, false if not
+ * Closes the session to the server, leaving the PDP context active
  */
-bool gsmSendServerMessages(
-    const char** pServerMessages,
-    size_t count
+void gsmCloseSession() {
+    gsmSendModemCommand("AT+QICLOSE");
+    gsmSessionOpen = false;
+}
+
+/**
+ * Reports the TCP session and AT command statistics on the debug port
+ */
+void gsmReport() {
+    debug_print(F("gsm: sessions opened "));
+    debug_print(gsmSessionSetupCount);
+    debug_print(F(" reused "));
+    debug_print(gsmSessionReuseCount);
+    debug_print(F(" failed "));
+    debug_print(gsmSessionFailCount);
+    debug_print(F(" closed "));
+    debug_print(gsmSessionCloseCount);
+    debug_print(F(" setup ms avg "));
+    debug_print(gsmSessionSetupCount ?
+                gsmSessionSetupTotalTime / gsmSessionSetupCount : 0);
+    debug_print(F(" max "));
+    debug_println(gsmSessionSetupMaxTime);
+    debug_print(F("gsm: URCs "));
+    debug_print(atUrcCount);
+    debug_print(F(" command timeouts "));
+    debug_println(atTimeoutCount);
+    debug_print(F("gsm: TCP ack checks "));
+    debug_print(gsmTcpAckChecks);
+    debug_print(F(" window waits "));
+    debug_println(gsmTcpWindowWaits);
+    debug_print(F("gsm: UDP retransmits "));
+    debug_print(gsmUdpRetransmits);
+    debug_print(F(" stale acks "));
+    debug_println(gsmUdpStaleAcks);
+}
+
+/**
+ * Waits, running the background tasks
+ * @param ms how long to wait
+ */
+void gsmDelay(
+    unsigned long ms
 ) {
-    bool allSentOK = true;
-    if (!gsmDisconnect(true)) {
-        debug_println(F("gsmSendServerMessages: Error deactivating GPRS"));
+    unsigned long tStart = millis();
+    while (timeDiff(millis(), tStart) < ms) {
+        modemWaitIdle();
     }
-    // Disable TCP data echo
-    gsmSendModemCommand("AT+QISDE=0");
-    // Only allow a single TCP session
-    gsmSendModemCommand("AT+QIMUX=0");
-    // opening connection
-    if (gsmConnect()) {
-        // connection opened, send all messages
-        while (count--) {
-            if (!gsmSendServerMessage(*pServerMessages)) {
-                allSentOK = false;
+}
+
+/**
+ * Asks the modem how much of the data sent over the TCP session the server
+ * has not yet acknowledged
+ * @param pUnacked assigned the number of bytes not yet acknowledged
+ * @return true if the modem told us, false if not
+ */
+bool gsmGetTcpUnacked(
+    size_t* pUnacked
+) {
+    unsigned long sent = 0;
+    unsigned long acked = 0;
+    unsigned long unacked = 0;
+    gsmTcpAckChecks += 1;
+    if (!gsmSendModemCommand("AT+QISACK")) {
+        return false;
+    }
+    // +QISACK: <sent>, <acked>, <nAcked>
+    const char* pAck = strstr(modem_reply, "+QISACK:");
+    if ((pAck == NULL) ||
+        (sscanf(pAck + 8, "%lu ,%lu ,%lu", &sent, &acked, &unacked) != 3)) {
+        debug_println(F("gsmGetTcpUnacked: bad reply"));
+        return false;
+    }
+    *pUnacked = unacked;
+    return true;
+}
+
+/**
+ * Waits until the TCP send window has room for more data. The modem is
+ * only asked about acknowledgements when our count of bytes in flight says
+ * the window is full, and then with exponentially longer waits between
+ * checks whilst it stays full.
+ * @param len the number of bytes we want to send
+ * @return true if there is room, false if the server stopped acknowledging
+ *         data or the modem did not answer
+ */
+bool gsmWaitTcpWindow(
+    size_t len
+) {
+    unsigned long backoff = TCP_BACKOFF_MIN;
+    unsigned long tStart = millis();
+    while (gsmTcpUnacked + len > TCP_SEND_WINDOW) {
+        if (!gsmGetTcpUnacked(&gsmTcpUnacked)) {
+            return false;
+        }
+        if (gsmTcpUnacked + len > TCP_SEND_WINDOW) {
+            if (timeDiff(millis(), tStart) >= TCP_WINDOW_TIMEOUT) {
+                debug_println(F("gsmWaitTcpWindow: data not delivered"));
+                return false;
             }
-            ++pServerMessages;
+            gsmTcpWindowWaits += 1;
+            gsmDelay(backoff);
+            backoff = MIN(backoff * 2, TCP_BACKOFF_MAX);
         }
-        gsmDisconnect(true);
-    } else {
-        debug_println(F("Error, cannot send data, no connection"));
-        gsmDisconnect(true);
-        allSentOK = false;
     }
-    return allSentOK;
+    return true;
 }
 
 /**
- * Sends a single message to the server. Note that this call assumes we have
- * already connected to the server
- * @param pServerMsg points to an ASCIZ string containing the message to send
- * @return true if message sent ok
+ * Sends any data held in modem_data[] over the open TCP session, waiting
+ * first if the send window is full
+ * @return true if the modem accepted the data, false if not
  */
-bool gsmSendServerMessage(
-    const char* pServerMsg
-) {
-    debug_print(F("gsmSendServerMessage: sending data: "));
-    debug_println(pServerMsg);
-    // sending HTTP header
-    snprintf(modem_data, sizeof(modem_data), "%s%d%s", HTTP_HEADER1,
-        13 + strlen(config.imei) + strlen(config.key) + strlen(pServerMsg),
-        HTTP_HEADER2);
-    snprintf(modem_command, sizeof(modem_command), "AT+QISEND=%d",
-        strlen(modem_data));
-    gsmWriteCommand();
-    gsmWaitForReply(true);
-    gsm_send_tcp_data();
-    gsm_validate_tcp();
-    // sending imei and key first
-    snprintf(modem_data, sizeof(modem_data), "imei=%s&key=%s&d=%s", config.imei,
-        config.key, pServerMsg);
-    snprintf(modem_command, sizeof(modem_command), "AT+QISEND=%d",
-        strlen(modem_data));
-    gsmWriteCommand();
-    gsmWaitForReply(true);
-    gsm_send_tcp_data();
-    gsm_validate_tcp();
-}
-
-void gsm_get_reply() {
-    //get reply from the modem
-    size_t index = strlen(modem_reply);
-    while (gsm_port.available()) {
-        char inChar = gsm_port.read(); // Read a character
-        if (index == sizeof(modem_reply) - 1) {
-            break;
+bool gsmFlushTcpData() {
+    bool rStat = true;
+    if (modem_data_len > 0) {
+        if (modemLogging) {
+            debug_print(F("gsmFlushTcpData: bytes "));
+            debug_println(modem_data_len);
         }
-        modem_reply[index++] = inChar; // Store it
-        if (inChar == '\n') {
-            break;
+        rStat = gsmWaitTcpWindow(modem_data_len);
+        if (rStat) {
+            snprintf(modem_command, sizeof(modem_command), "AT+QISEND=%u",
+                modem_data_len);
+            rStat = (gsmSendCommandData(modem_data, modem_data_len) ==
+                     AT_RESULT_OK) &&
+                    (strstr(modem_reply, "SEND OK") != NULL);
+        }
+        if (rStat) {
+            gsmTcpUnacked += modem_data_len;
+            gsmDataBytesSent += modem_data_len;
         }
+        modem_data_len = 0;
     }
-    modem_reply[index] = '\0'; // Null terminate the string
+    return rStat;
 }
 
 /**
- * Waits for the modem to respond to a command
- * @param allowOK when true, indicates that a modem response of "OK" is enough
- *        to indicate the end of the modem response. Some commands send an
- *        "OK" response and then send some data, so for these you dont want
- *        to pass this is as true.
- * @return true if the modem response arrived within the timeout period
+ * Adds bytes to the TCP data to send, passing modem_data[] to the modem each
+ * time it fills up
+ * @param pData the data to send
+ * @param len the number of bytes to send
+ * @return true if all OK, false if the modem would not accept data
  */
-bool gsmWaitForReply(
-    bool allowOK
+bool gsmWriteTcpBytes(
+    const uint8_t* pData,
+    size_t len
 ) {
-    unsigned long timeout = millis();
-    bool gotReply = false;
-    modem_reply[0] = '\0';
-    gsm_get_reply();
-    while (!(gotReply = gsm_is_final_result(allowOK))) {
-        if ((millis() - timeout) >= (GSM_MODEM_COMMAND_TIMEOUT * 1000)) {
-            debug_println(F("Warning: timed out waiting for modem reply"));
-            break;
+    bool rStat = true;
+    while (rStat && len--) {
+        if (modem_data_len >= sizeof(modem_data)) {
+            rStat = gsmFlushTcpData();
         }
-        gsm_get_reply();
+        modem_data[modem_data_len++] = *pData++;
     }
-    show_modem_reply();
-    return gotReply;
+    return rStat;
 }
 
-void gsm_wait_at() {
-    unsigned long timeout = millis();
+/**
+ * Adds text to the TCP data to send
+ * @param pText the ASCIZ text to send
+ * @return true if all OK, false if the modem would not accept data
+ */
+bool gsmWriteTcpData(
+    const char* pText
+) {
+    return gsmWriteTcpBytes((const uint8_t*)pText, strlen(pText));
+}
 
-    modem_reply[0] = '\0';
-    while (!strncmp(modem_reply, "AT+", 3) == 0) {
-        if ((millis() - timeout) >= (GSM_MODEM_COMMAND_TIMEOUT * 1000)) {
-            debug_println(F("Warning: timed out waiting for last modem reply"));
-            break;
+/**
+ * Adds a server update message (see formServerUpdateMessage()) to the TCP
+ * data to send, formatting it straight into modem_data[]
+ * @param pServerData the server data record to send
+ * @return true if all OK, false if the modem would not accept data
+ */
+bool gsmWriteTcpMessage(
+    SERVER_DATA_T* pServerData
+) {
+    if (!formServerUpdateMessage(pServerData, modem_data + modem_data_len,
+                                 sizeof(modem_data) - modem_data_len)) {
+        // Not enough room left, so send what we have and start again
+        if (!gsmFlushTcpData() ||
+            !formServerUpdateMessage(pServerData, modem_data,
+                                     sizeof(modem_data))) {
+            return false;
+        }
+    }
+    modem_data_len += strlen(modem_data + modem_data_len);
+    return true;
+}
+
+/**
+ * Sends a batch of data to the server and waits for the server to
+ * acknowledge it. The session is opened if needed and is left open for the
+ * next call.
+ * @param pType the socket type, "TCP" or "UDP"
+ * @param pPort the server port
+ * @param sendFn writes the batch to the open session
+ * @param pBatch the batch, passed on to sendFn
+ * @param ackFn reads and checks the server's acknowledgement
+ * @return true if the server acknowledged the batch, false if not
+ */
+bool gsmSendServerTransaction(
+    const char* pType,
+    const char* pPort,
+    bool (*sendFn)(SERVER_BATCH_T* pBatch),
+    SERVER_BATCH_T* pBatch,
+    bool (*ackFn)(unsigned long timeout)
+) {
+    bool allSentOK = false;
+    bool reused = gsmSessionOpen;
+    for (bool tryAgain = true; tryAgain; ) {
+        tryAgain = false;
+        if (!gsmOpenSession(pType, pPort)) {
+            debug_println(F("Error, cannot send data, no connection"));
+        } else if (!sendFn(pBatch)) {
+            gsmCloseSession();
+            // The server may have closed an idle session just before we
+            // used it, so have one go with a fresh session
+            tryAgain = reused;
+            reused = false;
+            if (!tryAgain) {
+                debug_println(F("Error, failed to send data"));
+            }
+        } else if (ackFn(SERVER_ACK_TIMEOUT)) {
+            // The server has had all we sent, so the window is empty
+            gsmTcpUnacked = 0;
+            allSentOK = true;
+        } else {
+            // We don't know where the server got to in the response, so
+            // start the next batch with a fresh session
+            gsmCloseSession();
         }
-        gsm_get_reply();
     }
+    return allSentOK;
 }
 
-bool gsm_modem_reply_ends_with(const char* pText) {
-    bool rCode = false;
-    size_t reply_len = strlen(modem_reply);
-    if (reply_len >= strlen(pText)) {
-        if (strcmp(modem_reply + reply_len - 6, pText) == 0) {
-            rCode = true;
+/**
+ * Sends a batch of data to the server as one sequence numbered datagram
+ * (see SERVER_BINARY_VERSION_SEQ), resending it until the server acks that
+ * sequence number. There is no connection to set up, so a lost datagram
+ * only costs the wait for its ack. If the server never acks it the caller
+ * keeps the records in serverDataStore and they go again in a later batch.
+ * @param pPort the server port
+ * @param pBatch the records to send
+ * @return true if the server acknowledged the batch, false if not
+ */
+bool gsmSendServerDatagram(
+    const char* pPort,
+    SERVER_BATCH_T* pBatch
+) {
+    if (gsmUdpSequence == 0) {
+        // Start somewhere different after each boot, so the server does
+        // not take our first batches for resends of the last ones
+        gsmUdpSequence = (clockNow() ^ millis()) % SERVER_UDP_MAX_SEQUENCE;
+    }
+    gsmUdpSequence = gsmUdpSequence % SERVER_UDP_MAX_SEQUENCE + 1;
+    for (unsigned attempt = 0; attempt <= SERVER_UDP_RETRANSMITS; attempt++) {
+        if (!gsmOpenSession("UDP", pPort)) {
+            debug_println(F("Error, cannot send data, no connection"));
+            return false;
+        }
+        if (attempt > 0) {
+            gsmUdpRetransmits += 1;
+        }
+        debug_print(F("gsmSendServerDatagram: sending records: "));
+        debug_print(pBatch->count);
+        debug_print(F(" sequence: "));
+        debug_println(gsmUdpSequence);
+        // Datagrams have no send window to wait for
+        gsmTcpUnacked = 0;
+        modem_data_len = 0;
+        if (!formServerBinaryBatch(pBatch, gsmUdpSequence, gsmWriteTcpBytes) ||
+            !gsmFlushTcpData()) {
+            gsmCloseSession();
+        } else if (parse_receive_seq_ack(gsmUdpSequence,
+                                         SERVER_UDP_ACK_TIMEOUT)) {
+            return true;
         }
     }
-    return rCode;
+    debug_println(F("Error, datagram batch was not acknowledged"));
+    return false;
 }
 
-bool gsm_modem_reply_matches(size_t offset, const char* pMatch) {
-    bool rCode = false;
-    size_t reply_len = strlen(modem_reply);
-    size_t match_len = strlen(pMatch);
-    if (reply_len >= offset + match_len) {
-        if (strncmp(modem_reply + offset, pMatch, match_len) == 0) {
-            rCode = true;
+/**
+ * Writes a binary format batch to the open session
+ * @param pBatch the records to send
+ * @return true if the batch was sent OK
+ */
+bool gsmSendServerBinaryBatch(
+    SERVER_BATCH_T* pBatch
+) {
+    debug_print(F("gsmSendServerBinaryBatch: sending records: "));
+    debug_println(pBatch->count);
+    modem_data_len = 0;
+    return formServerBinaryBatch(pBatch, 0, gsmWriteTcpBytes) &&
+           gsmFlushTcpData();
+}
+
+/**
+ * Sends a batch of records to the server in one HTTP POST, formatting
+ * each record straight into the TCP data. The records are formatted twice,
+ * first to find the content length. Note that this call assumes we have
+ * already connected to the server.
+ * @param pBatch the records to send
+ * @return true if the batch was sent OK
+ */
+bool gsmSendServerBatch(
+    SERVER_BATCH_T* pBatch
+) {
+    SERVER_DATA_T serverData;
+    char lineStr[64];
+    size_t contentLen = 13 + strlen(config.imei) + strlen(config.key) +
+                        strlen(SERVER_BATCH_END);
+    debug_print(F("gsmSendServerBatch: sending records: "));
+    debug_println(pBatch->count);
+    dataSampleBattery();
+    serverBatchRewind(pBatch);
+    while (serverBatchRead(pBatch, &serverData)) {
+        // Nothing is waiting to be sent, so measure the message in place
+        if (!formServerUpdateMessage(&serverData, modem_data,
+                                     sizeof(modem_data))) {
+            return false;
         }
+        contentLen += strlen(modem_data) + strlen(SERVER_RECORD_SEPARATOR);
+    }
+    modem_data_len = 0;
+    snprintf(lineStr, sizeof(lineStr), "%u", contentLen);
+    bool rStat = gsmWriteTcpData(HTTP_HEADER1) &&
+                 gsmWriteTcpData(lineStr) &&
+                 gsmWriteTcpData(HTTP_HEADER2) &&
+                 gsmWriteTcpData("imei=") &&
+                 gsmWriteTcpData(config.imei) &&
+                 gsmWriteTcpData("&key=") &&
+                 gsmWriteTcpData(config.key) &&
+                 gsmWriteTcpData("&d=");
+    serverBatchRewind(pBatch);
+    while (rStat && serverBatchRead(pBatch, &serverData)) {
+        rStat = gsmWriteTcpMessage(&serverData) &&
+                gsmWriteTcpData(SERVER_RECORD_SEPARATOR);
     }
-    return rCode;
+    return rStat && gsmWriteTcpData(SERVER_BATCH_END) && gsmFlushTcpData();
 }
 
 void show_modem_reply() {
@@ -667,98 +1030,3 @@ void show_modem_reply() {
         debug_println("'");
     }
 }
-
-/*!
- * Locates the start of the last line in the modem reply buffer.
- * e.g.
- *    modem_reply = ""                      returns 0
- *    modem_reply = "\n"                    returns 0
- *    modem_reply = "\r\n"                  returns 0
- *    modem_reply = "hello\r\n"             returns 0
- *    modem_reply = "hello\r\nthere"        returns 7
- *    modem_reply = "hello\r\nthere\r\n")   returns 7
- * @return the offset into modem_reply[] of the start of the last line
- */
-size_t locate_last_line() {
-    /* "xxxxxx/r/nxxxxxx/r/n" */
-    /*            ^           */
-    size_t pos = 0;
-    size_t len = strlen(modem_reply);
-    if (len > 1) {
-        pos = len - 1;
-        if (modem_reply[pos] == '\n') {
-            pos -= 1;
-        }
-        while (pos > 0) {
-            if (modem_reply[pos] == '\n') {
-                ++pos;
-                break;
-            }
-            pos -= 1;
-        }
-    }
-    return pos;
-}
-
-bool gsm_is_final_result(bool allowOK) {
-    if (allowOK && gsm_modem_reply_ends_with("\r\nOK\r\n")) {
-        return true;
-    }
-    size_t last_line_index = locate_last_line();
-    switch (modem_reply[last_line_index]) {
-    case '+':
-        if (gsm_modem_reply_matches(last_line_index + 1, "CME ERROR:")) {
-            return true;
-        }
-        if (gsm_modem_reply_matches(last_line_index + 1, "CMS ERROR:")) {
-            return true;
-        }
-        if (gsm_modem_reply_matches(last_line_index + 1, "CPIN:")) {
-            return true;
-        }
-        return false;
-    case '>':
-        return gsm_modem_reply_matches(last_line_index + 1, " ");
-    case 'B':
-        return gsm_modem_reply_matches(last_line_index + 1, "USY\r\n");
-    case 'C':
-        if (gsm_modem_reply_matches(last_line_index + 1, "ONNECT OK\r\n")) {
-            return true;
-        }
-        if (gsm_modem_reply_matches(last_line_index + 1, "ONNECT FAIL\r\n")) {
-            return true;
-        }
-        if (gsm_modem_reply_matches(last_line_index + 1, "all Ready\r\n")) {
-            return true;
-        }
-        return false;
-    case 'D':
-        return gsm_modem_reply_matches(last_line_index + 1, "EACT OK\r\n");
-    case 'E':
-        return gsm_modem_reply_matches(last_line_index + 1, "RROR\r\n");
-    case 'N':
-        if (gsm_modem_reply_matches(last_line_index + 1, "O ANSWER\r\n")) {
-            return true;
-        }
-        if (gsm_modem_reply_matches(last_line_index + 1, "O CARRIER\r\n")) {
-            return true;
-        }
-        if (gsm_modem_reply_matches(last_line_index + 1, "O DIALTONE\r\n")) {
-            return true;
-        }
-        return false;
-    case 'O':
-        if (allowOK && gsm_modem_reply_matches(last_line_index + 1, "K\r\n")) {
-            return true;
-        }
-        return false;
-    case 'S':
-        if (gsm_modem_reply_matches(last_line_index + 1, "END ")) {
-            return true;
-        }
-        /* no break */
-    default:
-        return false;
-    }
-}
-
@@ -1,9 +1,22 @@
 //blink led  
 
+/**
+ * Number of fast led toggles still to show (set by blink_got_gps())
+ */
+unsigned gpsBlinkCount = 0;
+
 void status_led() {
     //blink led    
     unsigned long currentMillis = millis();
-    if (currentMillis - previousMillis > LED_INTERVAL) {
+    if (gpsBlinkCount > 0) {
+        // Show the fast got gps blink, without holding up the caller
+        if (currentMillis - previousMillis > 100) {
+            previousMillis = currentMillis;
+            ledState = (ledState == LOW) ? HIGH : LOW;
+            digitalWrite(PIN_POWER_LED, ledState);
+            gpsBlinkCount -= 1;
+        }
+    } else if (currentMillis - previousMillis > LED_INTERVAL) {
         // save the last time you blinked the LED 
         previousMillis = currentMillis;
         // if the LED is off turn it on and vice-versa:
@@ -41,15 +54,6 @@ void blink_debug() {
 }
 
 void blink_got_gps() {
-    //blink start      
-    for (int i = 0; i < 4; i++) {
-        if (ledState == LOW)
-            ledState = HIGH;
-        else
-            ledState = LOW;
-
-        digitalWrite(PIN_POWER_LED, ledState);   // set the LED on
-        delay(100);
-    }
+    //blink start (status_led() does the blinking)
+    gpsBlinkCount = 4;
 }
-
@@ -0,0 +1,159 @@
+/**
+ * Motion detection. Each GPS fix moves a state machine between moving,
+ * stopping and parked, which sets how often we report to the server:
+ *
+ *   MOVING   reports at the fast server interval. Drops to STOPPING as soon
+ *            as the speed falls below MOTION_STOP_SPEED.
+ *   STOPPING reports at the slow server interval. Goes back to MOVING once
+ *            MOTION_START_FIXES fixes in a row show MOTION_START_SPEED or a
+ *            displacement beyond the HDOP weighted radius of where we
+ *            stopped, otherwise parks after the dwell time (shorter with the
+ *            ignition off).
+ *   PARKED   reports where we parked once, then only sends heartbeats every
+ *            config.heartbeat_interval mins. Leaves as STOPPING does, or
+ *            for STOPPING when the engine starts.
+ *
+ * GPS wander whilst stopped stays within the radius and under the start
+ * speed so it no longer counts as movement.
+ */
+
+unsigned long motionStopTime = 0;  // millis() when we stopped
+unsigned motionMovingFixes = 0;    // consecutive fixes showing movement
+/**
+ * Statistics
+ */
+unsigned long motionParkCount = 0;  // times we have parked
+unsigned long motionHeartbeats = 0; // heartbeats sent
+
+/**
+ * Gets a motion state name for debug
+ * @param state the motion state
+ * @return the state name
+ */
+const char* motionStateName(
+    MOTION_STATE_T state
+) {
+    switch (state) {
+    case MOTION_MOVING:
+        return "moving";
+    case MOTION_STOPPING:
+        return "stopping";
+    case MOTION_PARKED:
+        return "parked";
+    }
+    return "?";
+}
+
+/**
+ * Changes the motion state and the server update period that goes with it
+ * @param state the new motion state
+ */
+void motionSetState(
+    MOTION_STATE_T state
+) {
+    debug_print(F("Motion state "));
+    debug_println(motionStateName(state));
+    motionState = state;
+    motionMovingFixes = 0;
+    motionParkPending = (state == MOTION_PARKED);
+    if (state == MOTION_PARKED) {
+        motionParkCount += 1;
+    }
+    serverUpdatePeriod = (state == MOTION_MOVING)
+        ? config.fast_server_interval : config.slow_server_interval;
+}
+
+/**
+ * Clamps a fix HDOP for the displacement test
+ * @param pFix the fix
+ * @return the HDOP in 100ths
+ */
+unsigned long motionHdop(
+    const GPSDATA_T* pFix
+) {
+    return MIN(pFix->hdop, (unsigned long)MOTION_MAX_HDOP);
+}
+
+/**
+ * Updates the motion state with a new GPS fix
+ * @param pFix the new fix
+ */
+void motionUpdate(
+    const GPSDATA_T* pFix
+) {
+    if (motionState == MOTION_MOVING) {
+        if (pFix->speed < MOTION_STOP_SPEED) {
+            motionRest = *pFix;
+            motionStopTime = millis();
+            motionSetState(MOTION_STOPPING);
+        }
+        return;
+    }
+    unsigned long distance = gps_distance_between(
+        motionRest.lat, motionRest.lon, pFix->lat, pFix->lon);
+    unsigned long radius = MOTION_RADIUS +
+        (motionHdop(&motionRest) + motionHdop(pFix)) * MOTION_UERE / 100;
+    if ((pFix->speed >= MOTION_START_SPEED) || (distance > radius)) {
+        motionMovingFixes += 1;
+        if (motionMovingFixes >= MOTION_START_FIXES) {
+            motionSetState(MOTION_MOVING);
+        }
+        return;
+    }
+    motionMovingFixes = 0;
+    if (motionHdop(pFix) < motionHdop(&motionRest)) {
+        // A better estimate of where we are
+        motionRest = *pFix;
+    }
+    if (motionState == MOTION_STOPPING) {
+        unsigned long dwell = ignState ? MOTION_DWELL : MOTION_DWELL_IGN_OFF;
+        if (timeDiff(millis(), motionStopTime) >= dwell) {
+            motionSetState(MOTION_PARKED);
+        }
+    }
+}
+
+/**
+ * Wakes us from parked when the engine starts, so the dwell time starts
+ * again and a pull away is reported promptly
+ */
+void motionWake() {
+    if (motionState == MOTION_PARKED) {
+        motionStopTime = millis();
+        motionSetState(MOTION_STOPPING);
+    }
+}
+
+/**
+ * Sends the server a heartbeat whilst we are parked. A heartbeat is a record
+ * without a position, so it carries just the time, battery level, ignition
+ * state and running time. Heartbeats that fail are not stored as they are
+ * only of interest now.
+ */
+void motionSendHeartbeat() {
+    SERVER_DATA_T serverData;
+    memset(&serverData, 0, sizeof(serverData));
+    serverData.gpsData.fixAge = TinyGPS::GPS_INVALID_AGE;
+    serverData.ignState = ignState;
+    serverData.engineRuntime = engineRunningTime;
+    serverData.captureTime = clockNow();
+    if ((gsmNetworkStatus == CONNECTED) &&
+            updateServerWithCurrentData(&serverData, 1)) {
+        debug_println(F("Heartbeat sent OK"));
+        motionHeartbeats += 1;
+    } else {
+        debug_println(F("Heartbeat failed"));
+    }
+}
+
+/**
+ * Reports the motion detection statistics
+ */
+void motionReport() {
+    debug_print(F("motionReport: state="));
+    debug_print(motionStateName(motionState));
+    debug_print(F(" parks="));
+    debug_print(motionParkCount);
+    debug_print(F(" heartbeats="));
+    debug_println(motionHeartbeats);
+}
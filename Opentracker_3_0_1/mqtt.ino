@@ -0,0 +1,457 @@
+/**
+ * MQTT 3.1.1 client for the mqtt transport, over the modem TCP session.
+ * We connect with a persistent session (clean session off) and the IMEI as
+ * the client id, so the broker keeps our command topic subscription, and
+ * any QoS 1 commands sent to it, whilst we are away. Each server batch is
+ * published as a binary format batch (see formServerBinaryBatch()) with
+ * QoS 1 and only counts as delivered when the broker's PUBACK arrives, so
+ * until then the records stay in (or go to) serverDataStore. Commands
+ * published to our command topic are run as if they came by SMS. Whilst
+ * the session is open the mqtt task pings the broker before the keepalive
+ * runs out and picks up commands as they arrive.
+ */
+
+/**
+ * Control packet types, as the first header byte
+ */
+#define MQTT_NONE 0x00          // reserved, for when we wait for no packet
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x82     // with the flags bits it must have
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+#define MQTT_TYPE_MASK 0xF0
+#define MQTT_PUBLISH_QOS1 0x02
+#define MQTT_PUBLISH_QOS_MASK 0x06
+#define MQTT_PROTOCOL_LEVEL 4   // 3.1.1
+#define MQTT_CONNECT_USERNAME 0x80
+#define MQTT_CONNECT_PASSWORD 0x40
+#define MQTT_CONNACK_SESSION_PRESENT 0x01
+#define MQTT_SUBACK_FAILURE 0x80
+
+uint8_t mqttRx[MQTT_RX_BUFFER_SIZE]; // received data not yet handled
+size_t mqttRxLen = 0;
+unsigned long mqttSessionId = 0;  // gsmSessionSetupCount when we connected
+bool mqttSessionPresent = false;  // broker kept our session, from CONNACK
+uint8_t mqttConnackCode = 0;      // CONNACK return code
+uint8_t mqttSubackCode = 0;       // SUBACK return code
+unsigned mqttPacketId = 0;        // id of the last packet we sent
+unsigned long mqttSendTime = 0;   // millis() when we last sent a packet
+bool mqttPublishStarted = false;  // see mqtt_write_publish()
+/**
+ * Statistics
+ */
+unsigned long mqttConnectCount = 0;   // connections the broker accepted
+unsigned long mqttPublishCount = 0;   // batches published
+unsigned long mqttPingCount = 0;      // keepalive pings sent
+unsigned long mqttCommandCount = 0;   // commands received
+
+/**
+ * Checks if we are connected to the broker over the open TCP session
+ * @return true if connected
+ */
+bool mqttConnected() {
+    // Any session opened since we connected was not to the broker
+    return gsmSessionOpen && (mqttSessionId == gsmSessionSetupCount);
+}
+
+/**
+ * Adds a 2 byte value, MSB first, to the TCP data to send
+ * @param value the value
+ * @return true if all OK, false if the modem would not accept data
+ */
+bool mqtt_write_u16(
+    unsigned value
+) {
+    uint8_t bytes[2] = { (uint8_t)(value >> 8), (uint8_t)(value & 0xFF) };
+    return gsmWriteTcpBytes(bytes, sizeof(bytes));
+}
+
+/**
+ * Adds a length prefixed string to the TCP data to send
+ * @param pText the ASCIZ string
+ * @return true if all OK, false if the modem would not accept data
+ */
+bool mqtt_write_string(
+    const char* pText
+) {
+    return mqtt_write_u16(strlen(pText)) && gsmWriteTcpData(pText);
+}
+
+/**
+ * Gets the length of one of our topic names
+ * @param pTopic MQTT_DATA_TOPIC or MQTT_COMMAND_TOPIC
+ * @return the topic name length
+ */
+size_t mqtt_topic_len(
+    const char* pTopic
+) {
+    return strlen(MQTT_TOPIC_PREFIX) + strlen(config.imei) + strlen(pTopic);
+}
+
+/**
+ * Adds one of our topic names, as a length prefixed string, to the TCP
+ * data to send
+ * @param pTopic MQTT_DATA_TOPIC or MQTT_COMMAND_TOPIC
+ * @return true if all OK, false if the modem would not accept data
+ */
+bool mqtt_write_topic(
+    const char* pTopic
+) {
+    return mqtt_write_u16(mqtt_topic_len(pTopic)) &&
+           gsmWriteTcpData(MQTT_TOPIC_PREFIX) &&
+           gsmWriteTcpData(config.imei) &&
+           gsmWriteTcpData(pTopic);
+}
+
+/**
+ * Starts a packet in the TCP data to send with its fixed header
+ * @param type the packet type and flags
+ * @param len the length of the rest of the packet
+ * @return true if all OK, false if the modem would not accept data
+ */
+bool mqtt_start_packet(
+    uint8_t type,
+    size_t len
+) {
+    uint8_t header[5];
+    size_t headerLen = 0;
+    header[headerLen++] = type;
+    do {
+        header[headerLen] = len & 0x7F;
+        len >>= 7;
+        if (len > 0) {
+            header[headerLen] |= 0x80;
+        }
+        headerLen += 1;
+    } while ((len > 0) && (headerLen < sizeof(header)));
+    modem_data_len = 0;
+    return gsmWriteTcpBytes(header, headerLen);
+}
+
+/**
+ * Sends the rest of a packet
+ * @return true if the modem accepted the data, false if not
+ */
+bool mqtt_end_packet() {
+    mqttSendTime = millis();
+    return gsmFlushTcpData();
+}
+
+/**
+ * Sends a packet which is just a packet id e.g. PUBACK
+ * @param type the packet type and flags
+ * @param id the packet id
+ * @return true if the modem accepted the data, false if not
+ */
+bool mqtt_send_id_packet(
+    uint8_t type,
+    unsigned id
+) {
+    return mqtt_start_packet(type, 2) && mqtt_write_u16(id) &&
+           mqtt_end_packet();
+}
+
+/**
+ * Gets the id for the next packet we send which needs an id
+ * @return the packet id, never 0
+ */
+unsigned mqtt_next_packet_id() {
+    mqttPacketId = mqttPacketId % 0xFFFF + 1;
+    return mqttPacketId;
+}
+
+/**
+ * Runs a command the broker sent us and acks it
+ * @param flags the PUBLISH fixed header flags
+ * @param pBody the PUBLISH packet after the fixed header
+ * @param bodyLen the number of bytes in pBody
+ */
+void mqtt_handle_publish(
+    uint8_t flags,
+    const uint8_t* pBody,
+    size_t bodyLen
+) {
+    if (bodyLen < 2) {
+        return;
+    }
+    size_t pos = 2 + ((pBody[0] << 8) | pBody[1]); // after the topic name
+    bool ackNeeded = ((flags & MQTT_PUBLISH_QOS_MASK) != 0);
+    unsigned id = 0;
+    if (ackNeeded && (pos + 2 <= bodyLen)) {
+        id = (pBody[pos] << 8) | pBody[pos + 1];
+        pos += 2;
+    }
+    if (pos > bodyLen) {
+        debug_println(F("mqtt_handle_publish: bad packet"));
+        return;
+    }
+    char command[MQTT_RX_BUFFER_SIZE];
+    char noPhone[] = "";
+    size_t commandLen = MIN(bodyLen - pos, sizeof(command) - 1);
+    memcpy(command, pBody + pos, commandLen);
+    command[commandLen] = '\0';
+    mqttCommandCount += 1;
+    // Checked against the SMS key and run just like an SMS command
+    sms_cmd(command, noPhone);
+    if (ackNeeded) {
+        mqtt_send_id_packet(MQTT_PUBACK, id);
+    }
+}
+
+/**
+ * Gets the length of the first packet in mqttRx[]
+ * @param pHeaderLen assigned the length of the packet's fixed header
+ * @return the packet length, 0 if it has not all been received yet
+ */
+size_t mqtt_packet_len(
+    size_t* pHeaderLen
+) {
+    size_t len = 0;
+    for (size_t idx = 1; (idx < mqttRxLen) && (idx <= 4); ++idx) {
+        len |= (size_t)(mqttRx[idx] & 0x7F) << (7 * (idx - 1));
+        if ((mqttRx[idx] & 0x80) == 0) {
+            *pHeaderLen = idx + 1;
+            len += idx + 1;
+            return (len <= mqttRxLen) ? len : 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Handles the packets received so far
+ * @param waitType the packet type we are waiting for
+ * @param waitId the packet id we are waiting for, 0 if it has none
+ * @return true if the packet we are waiting for was among them
+ */
+bool mqtt_handle_packets(
+    uint8_t waitType,
+    unsigned waitId
+) {
+    bool found = false;
+    size_t headerLen = 0;
+    size_t len;
+    while ((len = mqtt_packet_len(&headerLen)) > 0) {
+        uint8_t type = mqttRx[0] & MQTT_TYPE_MASK;
+        const uint8_t* pBody = mqttRx + headerLen;
+        size_t bodyLen = len - headerLen;
+        unsigned id = 0;
+        if (type == MQTT_PUBLISH) {
+            mqtt_handle_publish(mqttRx[0], pBody, bodyLen);
+        } else if ((type == MQTT_CONNACK) && (bodyLen >= 2)) {
+            mqttSessionPresent =
+                ((pBody[0] & MQTT_CONNACK_SESSION_PRESENT) != 0);
+            mqttConnackCode = pBody[1];
+        } else if ((type == MQTT_SUBACK) && (bodyLen >= 3)) {
+            id = (pBody[0] << 8) | pBody[1];
+            mqttSubackCode = pBody[2];
+        } else if ((type == MQTT_PUBACK) && (bodyLen >= 2)) {
+            id = (pBody[0] << 8) | pBody[1];
+        }
+        if ((type == (waitType & MQTT_TYPE_MASK)) && (id == waitId)) {
+            found = true;
+        }
+        mqttRxLen -= len;
+        memmove(mqttRx, mqttRx + len, mqttRxLen);
+    }
+    return found;
+}
+
+/**
+ * Reads what the broker has sent us, handling each packet, until the
+ * packet we are waiting for arrives
+ * @param waitType the packet type we are waiting for, MQTT_NONE to just
+ *        handle what has arrived
+ * @param waitId the packet id we are waiting for, 0 if it has none
+ * @param timeout how long (ms) to wait
+ * @return true if the packet we are waiting for arrived
+ */
+bool mqttReceive(
+    uint8_t waitType,
+    unsigned waitId,
+    unsigned long timeout
+) {
+    bool found = false;
+    unsigned long startTime = millis();
+    for (;;) {
+        if (mqttRxLen >= sizeof(mqttRx)) {
+            // A packet too long for us, which we cannot get past
+            debug_println(F("mqttReceive: packet too long"));
+            gsmCloseSession();
+            break;
+        }
+        size_t dataLen = parse_read_server_data((char*)mqttRx + mqttRxLen,
+                                                sizeof(mqttRx) - mqttRxLen);
+        mqttRxLen += dataLen;
+        found = mqtt_handle_packets(waitType, waitId);
+        if (found || (timeDiff(millis(), startTime) >= timeout)) {
+            break;
+        }
+        if (dataLen == 0) {
+            if (!gsmSessionOpen) {
+                break;
+            }
+            gsmDelay(100);
+        }
+    }
+    return found;
+}
+
+/**
+ * Connects to the broker over the open TCP session and, if the broker did
+ * not keep our session, subscribes to our command topic
+ * @return true if connected, false if not
+ */
+bool mqtt_connect() {
+    bool login = (strlen(config.key) > 0);
+    uint8_t varHeader[] = {
+        0, 4, 'M', 'Q', 'T', 'T', MQTT_PROTOCOL_LEVEL,
+        (uint8_t)(login ? (MQTT_CONNECT_USERNAME | MQTT_CONNECT_PASSWORD)
+                        : 0),
+        MQTT_KEEPALIVE >> 8, MQTT_KEEPALIVE & 0xFF
+    };
+    size_t len = sizeof(varHeader) + 2 + strlen(config.imei);
+    if (login) {
+        len += 2 + strlen(config.imei) + 2 + strlen(config.key);
+    }
+    debug_println(F("mqtt_connect: connecting to the broker"));
+    mqttRxLen = 0;
+    mqttConnackCode = 0;
+    if (!mqtt_start_packet(MQTT_CONNECT, len) ||
+        !gsmWriteTcpBytes(varHeader, sizeof(varHeader)) ||
+        !mqtt_write_string(config.imei) ||
+        (login && (!mqtt_write_string(config.imei) ||
+                   !mqtt_write_string(config.key))) ||
+        !mqtt_end_packet() ||
+        !mqttReceive(MQTT_CONNACK, 0, SERVER_ACK_TIMEOUT)) {
+        return false;
+    }
+    if (mqttConnackCode != 0) {
+        debug_print(F("mqtt_connect: refused, code "));
+        debug_println(mqttConnackCode);
+        return false;
+    }
+    if (!mqttSessionPresent) {
+        unsigned id = mqtt_next_packet_id();
+        len = 2 + 2 + mqtt_topic_len(MQTT_COMMAND_TOPIC) + 1;
+        uint8_t qos = 1;
+        if (!mqtt_start_packet(MQTT_SUBSCRIBE, len) ||
+            !mqtt_write_u16(id) ||
+            !mqtt_write_topic(MQTT_COMMAND_TOPIC) ||
+            !gsmWriteTcpBytes(&qos, 1) ||
+            !mqtt_end_packet() ||
+            !mqttReceive(MQTT_SUBACK, id, SERVER_ACK_TIMEOUT)) {
+            return false;
+        }
+        if (mqttSubackCode == MQTT_SUBACK_FAILURE) {
+            // We can still publish, so carry on without commands
+            debug_println(F("mqtt_connect: command subscription refused"));
+        }
+    }
+    mqttSessionId = gsmSessionSetupCount;
+    mqttConnectCount += 1;
+    return true;
+}
+
+/**
+ * Writes the next bytes of a binary batch as the payload of a PUBLISH,
+ * starting the packet on the first call, for formServerBinaryBatch()
+ * @param pData the bytes to write. The first call is passed the batch
+ *        header, which holds the payload length.
+ * @param len the number of bytes
+ * @return true if all OK, false if the modem would not accept data
+ */
+bool mqtt_write_publish(
+    const uint8_t* pData,
+    size_t len
+) {
+    if (!mqttPublishStarted) {
+        mqttPublishStarted = true;
+        size_t batchLen = SERVER_BINARY_HEADER_LEN +
+                          (pData[3] | (pData[4] << 8));
+        if (!mqtt_start_packet(MQTT_PUBLISH | MQTT_PUBLISH_QOS1,
+                2 + mqtt_topic_len(MQTT_DATA_TOPIC) + 2 + batchLen) ||
+            !mqtt_write_topic(MQTT_DATA_TOPIC) ||
+            !mqtt_write_u16(mqttPacketId)) {
+            return false;
+        }
+    }
+    return gsmWriteTcpBytes(pData, len);
+}
+
+/**
+ * Publishes a batch to the broker over the open TCP session, connecting to
+ * the broker first if need be
+ * @param pBatch the records to send
+ * @return true if the batch was sent OK
+ */
+bool mqttSendBatch(
+    SERVER_BATCH_T* pBatch
+) {
+    if (!mqttConnected() && !mqtt_connect()) {
+        return false;
+    }
+    debug_print(F("mqttSendBatch: sending records: "));
+    debug_println(pBatch->count);
+    mqtt_next_packet_id();
+    mqttPublishStarted = false;
+    mqttPublishCount += 1;
+    return formServerBinaryBatch(pBatch, 0, mqtt_write_publish) &&
+           mqtt_end_packet();
+}
+
+/**
+ * Waits for the broker to ack the batch mqttSendBatch() published
+ * @param timeout how long (ms) to wait for the ack
+ * @return true if the broker acknowledged the batch
+ */
+bool mqttReceivePuback(
+    unsigned long timeout
+) {
+    bool ret = mqttReceive(MQTT_PUBACK, mqttPacketId, timeout);
+    if (!ret) {
+        debug_println(F("Batch was not acknowledged by the broker."));
+    }
+    return ret;
+}
+
+/**
+ * Keeps the broker connection alive whilst the mqtt transport has it open
+ * and handles commands which arrive between server updates
+ * @param pTask the task
+ */
+void mqttCheck(
+    TASK_T* /* pTask */
+) {
+    if (!mqttConnected()) {
+        return;
+    }
+    if (timeDiff(millis(), mqttSendTime) < SECS(MQTT_KEEPALIVE / 2)) {
+        mqttReceive(MQTT_NONE, 0, 0);
+    } else {
+        mqttPingCount += 1;
+        if (!mqtt_start_packet(MQTT_PINGREQ, 0) || !mqtt_end_packet() ||
+            !mqttReceive(MQTT_PINGRESP, 0, SERVER_ACK_TIMEOUT)) {
+            debug_println(F("mqttCheck: broker did not answer ping"));
+            gsmCloseSession();
+        }
+    }
+}
+
+/**
+ * Reports the MQTT client statistics
+ */
+void mqttReport() {
+    debug_print(F("mqttReport: connects="));
+    debug_print(mqttConnectCount);
+    debug_print(F(" publishes="));
+    debug_print(mqttPublishCount);
+    debug_print(F(" pings="));
+    debug_print(mqttPingCount);
+    debug_print(F(" commands="));
+    debug_println(mqttCommandCount);
+}
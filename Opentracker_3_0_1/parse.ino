@@ -1,77 +1,197 @@
-//parse remote commands from server
-int parse_receive_reply(
+/**
+ * Copies the server data out of an AT+QIRD reply held in modem_reply[]
+ * e.g. '+QIRD: 1.2.3.4:80,TCP,5\r\nhello\r\nOK\r\n'
+ * @param pData where to copy the data to
+ * @param dataSize the storage size for pData
+ * @return the number of data bytes copied
+ */
+size_t parse_qird_data(
+    char* pData,
+    size_t dataSize
+) {
+    size_t len = 0;
+    char* pLine = strstr(modem_reply, "+QIRD:");
+    if (pLine != NULL) {
+        char* pStart = strstr(pLine, "\r\n");
+        char* pLen = pStart;
+        // The data length follows the last ',' on the +QIRD: line
+        while ((pLen != NULL) && (pLen > pLine) && (*pLen != ',')) {
+            --pLen;
+        }
+        if ((pStart != NULL) && (*pLen == ',')) {
+            len = MIN((size_t)atoi(pLen + 1), dataSize);
+            memcpy(pData, pStart + 2, len);
+        }
+    }
+    return len;
+}
+
+/**
+ * Reads any server data the modem is holding for us
+ * @param pData where to copy the data to
+ * @param dataSize the storage size for pData
+ * @return the number of data bytes copied
+ */
+size_t parse_read_server_data(
+    char* pData,
+    size_t dataSize
+) {
+    snprintf(modem_command, sizeof(modem_command), "AT+QIRD=0,1,0,%u",
+        dataSize);
+    gsmSendCommand(true);
+    return parse_qird_data(pData, dataSize);
+}
+
+/**
+ * Reads the server's HTTP response to a batch upload and checks that the
+ * server acknowledged the batch. Any commands the server sent back in the
+ * response body are passed on to parse_cmd().
+ * @param timeout how long (ms) to wait for the whole response
+ * @return true if the server acknowledged the batch
+ */
+bool parse_receive_reply(
     unsigned long timeout
 ) {
-    //receive reply from modem and parse it 
-    int ret = 0;
-    byte index = 0;
-    byte header = 0;
-    char inChar = -1; // Where to store the character read
-    char *tmp;
-    char *tmpcmd;
-    char cmd[100];  //remote commands stored here
+    bool ret = false;
+    char response[512];
+    size_t responseLen = 0;
+    char* pBody = NULL;
+    long contentLen = -1;
+    unsigned status = 0;
     unsigned long startTime = millis();
-    
+
     debug_println(F("parse_receive_reply() started"));
-    cmd[0] = '\0';
+    response[0] = '\0';
     while (timeDiff(millis(), startTime) < timeout) {
-        // Read upto 100 bytes of server return data
-        gsmSendModemCommand("AT+QIRD=0,1,0,100");
-        // check if no more data
-        tmp = strstr(modem_reply, "ERROR");
-        if (tmp != NULL) {
-            debug_println(F("No more data available."));
-            break;
-        }
-        if (header != 1) {
-            tmp = strstr(modem_reply, "close\r\n\r\n");
-            if (tmp != NULL) {
-                debug_println(F("Found header packet"));
-                header = 1;
-                //all data from this packet and all next packets can be commands
-                tmp = strstr(modem_reply, "\r\n\r\n");
-                tmp += strlen("\r\n\r\n");
-                tmpcmd = strtok(tmp, "OK");
-                for (index = 0; index < strlen(tmpcmd) - 2; index++) {
-                    cmd[index] = tmpcmd[index];
+        size_t dataLen = parse_read_server_data(
+            response + responseLen, sizeof(response) - 1 - responseLen);
+        responseLen += dataLen;
+        response[responseLen] = '\0';
+        if (pBody == NULL) {
+            pBody = strstr(response, "\r\n\r\n");
+            if (pBody != NULL) {
+                // Have the whole header, pick out the status and length
+                pBody += 4;
+                sscanf(response, "HTTP/%*u.%*u %u", &status);
+                for (char* pLine = response; pLine < pBody; ) {
+                    if (strncasecmp(pLine, "Content-Length:", 15) == 0) {
+                        contentLen = atol(pLine + 15);
+                    }
+                    pLine = strstr(pLine, "\r\n") + 2;
                 }
-                cmd[index] = '\0';
             }
-        } else {
-            //not header packet, get data from +QIRD ... \r\n till OK
-            tmp = strstr(modem_reply, "\r\n");
-            tmp += strlen("\r\n");
-            tmpcmd = strtok(tmp, "OK");
-            tmp = strstr(tmp, "\r\n");
-            tmp += strlen("\r\n");
-            tmpcmd = strtok(tmp, "\r\nOK");
-            for (int i = 0; i < strlen(tmpcmd); i++) {
-                cmd[index] = tmpcmd[i];
-                index++;
+        }
+        if (pBody != NULL) {
+            size_t bodyLen = responseLen - (pBody - response);
+            if ((contentLen >= 0) ? (bodyLen >= (size_t)contentLen)
+                                  : (strstr(pBody, SERVER_BATCH_END) != NULL)) {
+                // Have the whole response
+                break;
             }
-            cmd[index] = '\0';
+        }
+        if ((responseLen >= sizeof(response) - 1) ||
+            ((dataLen == 0) && !gsmSessionOpen)) {
+            // No more response data is going to fit or arrive
+            break;
+        }
+        if (dataLen == 0) {
+            gsmDelay(100);
         }
     }
-    if (SEND_RAW) {
-        debug_println(
-            F(
-                "RAW data mode enabled, not checking whether the packet was received or not."));
-        ret = 1;
+    if ((pBody != NULL) && (status == 200) &&
+        (strstr(pBody, SERVER_BATCH_END) != NULL)) {
+        //all data was received by server
+        debug_println(F("Batch was fully received by the server."));
+        ret = true;
+        parse_cmd(pBody);
     } else {
-        tmp = strstr((cmd), "eof");
-        if (tmp != NULL) {
-            //all data was received by server
-            debug_println(F("Data was fully received by the server."));
-            ret = 1;
-        } else {
-            debug_println(F("Data was not received by the server."));
-        }
+        debug_print(F("Batch was not received by the server, status: "));
+        debug_println(status);
     }
-    parse_cmd(cmd);
     debug_println(F("parse_receive_reply() completed"));
     return ret;
 }
 
+/**
+ * Waits for the raw TCP server to acknowledge a binary batch by sending
+ * back SERVER_BATCH_END
+ * @param timeout how long (ms) to wait for the acknowledgement
+ * @return true if the server acknowledged the batch
+ */
+bool parse_receive_ack(
+    unsigned long timeout
+) {
+    bool ret = false;
+    char response[32];
+    size_t responseLen = 0;
+    unsigned long startTime = millis();
+
+    while (!ret && (timeDiff(millis(), startTime) < timeout)) {
+        if (responseLen >= sizeof(response) - 1) {
+            // Not an ack, so discard it
+            responseLen = 0;
+        }
+        size_t dataLen = parse_read_server_data(
+            response + responseLen, sizeof(response) - 1 - responseLen);
+        responseLen += dataLen;
+        response[responseLen] = '\0';
+        ret = (strstr(response, SERVER_BATCH_END) != NULL);
+        if (!ret && (dataLen == 0)) {
+            if (!gsmSessionOpen) {
+                break;
+            }
+            gsmDelay(100);
+        }
+    }
+    if (!ret) {
+        debug_println(F("Batch was not acknowledged by the server."));
+    }
+    return ret;
+}
+
+/**
+ * Waits for the server to ack a datagram batch (see
+ * SERVER_BINARY_VERSION_SEQ). Acks for earlier sends may still turn up, so
+ * only an ack carrying the batch's sequence number counts.
+ * @param sequence the sequence number of the batch
+ * @param timeout how long (ms) to wait for the ack
+ * @return true if the server acknowledged the batch
+ */
+bool parse_receive_seq_ack(
+    unsigned sequence,
+    unsigned long timeout
+) {
+    bool ret = false;
+    char response[32];
+    size_t endLen = strlen(SERVER_BATCH_END);
+    unsigned long startTime = millis();
+
+    while (!ret && (timeDiff(millis(), startTime) < timeout)) {
+        // Each read returns at most one datagram
+        size_t dataLen = parse_read_server_data(response,
+                                                sizeof(response) - 1);
+        response[dataLen] = '\0';
+        if (dataLen == 0) {
+            if (!gsmSessionOpen) {
+                break;
+            }
+            gsmDelay(100);
+        } else if ((dataLen > endLen) &&
+                   (strncmp(response, SERVER_BATCH_END, endLen) == 0)) {
+            if (strtoul(response + endLen, NULL, 10) == sequence) {
+                ret = true;
+            } else {
+                gsmUdpStaleAcks += 1;
+            }
+        }
+    }
+    if (!ret) {
+        debug_print(F("Datagram was not acknowledged by the server: "));
+        debug_println(sequence);
+    }
+    return ret;
+}
+
 void parse_cmd(char *cmd) {
     //parse commands info received from the server
     debug_println(F("parse_cmd() started"));
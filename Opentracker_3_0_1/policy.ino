@@ -0,0 +1,126 @@
+/**
+ * Server update policy. Rather than only sampling at a fixed period, whilst
+ * moving the current fix is also sampled as soon as, since the last sample,
+ * we have travelled config.policy_distance meters, turned by
+ * config.policy_heading degrees or changed speed by config.policy_speed
+ * km/h. So corners and speed changes are caught when they happen and the
+ * update period only has to cover long straight runs, which the track
+ * simplifier then thins out. The distance, heading and speed triggers are
+ * only used when we are not capturing fixes between updates (see
+ * capture.ino).
+ */
+
+GPSDATA_T policyLast;            // fix of the last sample
+bool policyHaveLast = false;
+/**
+ * Number of samples each trigger caused
+ */
+unsigned long policyTriggerCounts[POLICY_TRIGGER_COUNT];
+
+/**
+ * Trigger names for debug, indexed by POLICY_TRIGGER_T
+ */
+const char* POLICY_TRIGGER_NAMES[POLICY_TRIGGER_COUNT] = {
+    "none", "time", "distance", "heading", "speed", "full"
+};
+
+/**
+ * Gets a trigger name for debug
+ * @param trigger the trigger
+ * @return the trigger name
+ */
+const char* policyTriggerName(
+    POLICY_TRIGGER_T trigger
+) {
+    return POLICY_TRIGGER_NAMES[trigger];
+}
+
+/**
+ * Checks if a server update is due
+ * @param elapsed time since the last server update in ms
+ * @param period the server update period in ms
+ * @return what triggered the update, POLICY_TRIGGER_NONE if none is due
+ */
+POLICY_TRIGGER_T policyCheck(
+    unsigned long elapsed,
+    unsigned long period
+) {
+    if (elapsed >= period) {
+        return POLICY_TRIGGER_TIME;
+    }
+    if (captureIsFull()) {
+        return POLICY_TRIGGER_FULL;
+    }
+    // Whilst capturing fixes between updates the track between them is
+    // already in the capture buffer, so the other triggers add nothing
+    const GPSDATA_T* pFix = &lastGoodGPSData;
+    if ((config.capture_interval != 0) ||
+            (motionState != MOTION_MOVING) || !policyHaveLast ||
+            (pFix->fixAge == TinyGPS::GPS_INVALID_AGE)) {
+        return POLICY_TRIGGER_NONE;
+    }
+    if ((config.policy_distance != 0) &&
+            (gps_distance_between(policyLast.lat, policyLast.lon,
+                                  pFix->lat, pFix->lon)
+                >= config.policy_distance)) {
+        return POLICY_TRIGGER_DISTANCE;
+    }
+    if ((config.policy_heading != 0) &&
+            (pFix->course != TinyGPS::GPS_INVALID_ANGLE) &&
+            (policyLast.course != TinyGPS::GPS_INVALID_ANGLE) &&
+            (pFix->speed >= TRACK_MIN_HEADING_SPEED) &&
+            (policyLast.speed >= TRACK_MIN_HEADING_SPEED)) {
+        long turn = ((long)pFix->course - (long)policyLast.course) % 36000;
+        if (turn < 0) {
+            turn += 36000;
+        }
+        if (turn > 18000) {
+            turn = 36000 - turn;
+        }
+        if (turn >= (long)config.policy_heading * 100) {
+            return POLICY_TRIGGER_HEADING;
+        }
+    }
+    if ((config.policy_speed != 0) &&
+            (pFix->speed != TinyGPS::GPS_INVALID_SPEED) &&
+            (policyLast.speed != TinyGPS::GPS_INVALID_SPEED)) {
+        // km/h to cm/s
+        unsigned long threshold = config.policy_speed * 1000UL / 36;
+        unsigned long change = (pFix->speed > policyLast.speed)
+            ? pFix->speed - policyLast.speed : policyLast.speed - pFix->speed;
+        if (change >= threshold) {
+            return POLICY_TRIGGER_SPEED;
+        }
+    }
+    return POLICY_TRIGGER_NONE;
+}
+
+/**
+ * Records that a fix was sampled for the server
+ * @param pFix the fix sampled
+ * @param trigger what triggered the sample
+ */
+void policySampled(
+    const GPSDATA_T* pFix,
+    POLICY_TRIGGER_T trigger
+) {
+    policyLast = *pFix;
+    policyHaveLast = true;
+    policyTriggerCounts[trigger] += 1;
+}
+
+/**
+ * Reports the server update policy statistics
+ */
+void policyReport() {
+    debug_print(F("policyReport: time="));
+    debug_print(policyTriggerCounts[POLICY_TRIGGER_TIME]);
+    debug_print(F(" distance="));
+    debug_print(policyTriggerCounts[POLICY_TRIGGER_DISTANCE]);
+    debug_print(F(" heading="));
+    debug_print(policyTriggerCounts[POLICY_TRIGGER_HEADING]);
+    debug_print(F(" speed="));
+    debug_print(policyTriggerCounts[POLICY_TRIGGER_SPEED]);
+    debug_print(F(" full="));
+    debug_println(policyTriggerCounts[POLICY_TRIGGER_FULL]);
+}
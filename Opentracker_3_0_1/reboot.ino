@@ -1,5 +1,9 @@
 void reboot() {
     debug_println(F("reboot() started"));
+    // keep the records we have not yet written to flash
+    captureStore();
+    trackFlush();
+    serverDataStore.flush();
     //reboot only works with normal power, without programming cable connected
     //turn off modem, GPS            
     gsmPowerOff();
@@ -0,0 +1,38 @@
+/**
+ * Definition of a cooperatively scheduled task. Each task is written as a
+ * resumable state machine: every call to taskFn runs one short step and
+ * then returns, using .state to remember where it got to. A step should
+ * check taskHasTime() and return as soon as its deadline has passed.
+ */
+typedef struct TASK_S {
+    const char* pName;              //!< Task name, used when reporting
+    void (*taskFn)(struct TASK_S* pTask); //!< Runs one step of the task
+    unsigned long period;           //!< ms between runs, 0 = every pass
+    unsigned long deadline;         //!< ms a single step may run for
+    unsigned state;                 //!< Task specific state machine state
+    bool signalled;                 //!< true if an event requested a run
+    unsigned long lastRunTime;      //!< millis() when the task last ran
+    unsigned long signalTime;       //!< millis() when the task was signalled
+    unsigned long runCount;         //!< Number of steps run
+    unsigned long overrunCount;     //!< Number of steps which ran past deadline
+    unsigned long maxRunTime;       //!< Worst case step run time in us
+    unsigned long maxLatency;       //!< Worst case ms between due and run
+} TASK_T;
+/**
+ * Helper macro for declaring a task table entry
+ * @param name the task name string
+ * @param fn the task step function
+ * @param period ms between runs (0 = every pass, TASK_NO_PERIOD = only
+ *        runs when signalled)
+ * @param deadline ms the task step is allowed to run for
+ */
+#define TASK(name, fn, period, deadline) \
+    { name, fn, period, deadline, 0, false, 0, 0, 0, 0, 0, 0 }
+/**
+ * Task state value which all tasks start in
+ */
+#define TASK_STATE_IDLE 0
+/**
+ * Task period value for tasks which only run when signalled
+ */
+#define TASK_NO_PERIOD ULONG_MAX
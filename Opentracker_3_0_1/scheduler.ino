@@ -0,0 +1,152 @@
+/**
+ * Cooperative task scheduler. loop() repeatedly calls schedulerRun() which
+ * runs one step of each task that is due. A task is due when its period has
+ * elapsed, when it has been signalled by an event or when it is part way
+ * through its state machine (state != TASK_STATE_IDLE).
+ */
+
+/**
+ * The task whose step is currently running (NULL between steps)
+ */
+TASK_T* pSchedulerTask = NULL;
+/**
+ * micros() value when the current task step started
+ */
+unsigned long schedulerStepStart = 0;
+
+/**
+ * Prepares the task table for scheduling
+ * @param pTasks points to the task table
+ * @param taskCount the number of entries in the task table
+ */
+void schedulerInit(
+    TASK_T* pTasks,
+    size_t taskCount
+) {
+    unsigned long timeNow = millis();
+    for (size_t idx = 0; idx < taskCount; ++idx) {
+        pTasks[idx].state = TASK_STATE_IDLE;
+        pTasks[idx].signalled = false;
+        pTasks[idx].lastRunTime = timeNow;
+        pTasks[idx].runCount = 0;
+        pTasks[idx].overrunCount = 0;
+        pTasks[idx].maxRunTime = 0;
+        pTasks[idx].maxLatency = 0;
+    }
+}
+
+/**
+ * Requests that a task is run on the next scheduler pass
+ * @param pTask the task to signal
+ */
+void schedulerSignal(
+    TASK_T* pTask
+) {
+    if (!pTask->signalled) {
+        pTask->signalTime = millis();
+        pTask->signalled = true;
+    }
+}
+
+/**
+ * Checks whether the running task step is still within its deadline. Task
+ * steps which loop should call this and return once it gives false.
+ * @param pTask the running task
+ * @return true if the task step may continue running
+ */
+bool taskHasTime(
+    const TASK_T* pTask
+) {
+    return timeDiff(micros(), schedulerStepStart) < pTask->deadline * 1000;
+}
+
+/**
+ * Finds a task by name
+ * @param pTasks points to the task table
+ * @param taskCount the number of entries in the task table
+ * @param pName the task name
+ * @return the task or NULL if there is no task with that name
+ */
+TASK_T* schedulerFindTask(
+    TASK_T* pTasks,
+    size_t taskCount,
+    const char* pName
+) {
+    for (size_t idx = 0; idx < taskCount; ++idx) {
+        if (strcmp(pTasks[idx].pName, pName) == 0) {
+            return pTasks + idx;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Runs one scheduler pass i.e. one step of each task which is due. A task
+ * step which has to wait (e.g. for the modem) may call this to run other
+ * tasks whilst it waits, provided those tasks never wait themselves.
+ * @param pTasks points to the task table
+ * @param taskCount the number of entries in the task table
+ */
+void schedulerRun(
+    TASK_T* pTasks,
+    size_t taskCount
+) {
+    // Remember the step we may have been called from
+    TASK_T* pCallingTask = pSchedulerTask;
+    unsigned long callingStepStart = schedulerStepStart;
+    for (size_t idx = 0; idx < taskCount; ++idx) {
+        TASK_T* pTask = pTasks + idx;
+        unsigned long timeNow = millis();
+        unsigned long sinceLastRun = timeDiff(timeNow, pTask->lastRunTime);
+        unsigned long latency = 0;
+        if (pTask->signalled) {
+            latency = timeDiff(timeNow, pTask->signalTime);
+        } else if (pTask->state != TASK_STATE_IDLE) {
+            // Part way through its state machine, so resume straight away
+        } else if ((pTask->period != TASK_NO_PERIOD) &&
+                   (sinceLastRun >= pTask->period)) {
+            latency = sinceLastRun - pTask->period;
+        } else {
+            // Not due
+            continue;
+        }
+        pTask->signalled = false;
+        pTask->lastRunTime = timeNow;
+        pSchedulerTask = pTask;
+        schedulerStepStart = micros();
+        pTask->taskFn(pTask);
+        unsigned long runTime = timeDiff(micros(), schedulerStepStart);
+        pTask->runCount += 1;
+        if (runTime > pTask->deadline * 1000) {
+            pTask->overrunCount += 1;
+        }
+        pTask->maxRunTime = MAX(pTask->maxRunTime, runTime);
+        pTask->maxLatency = MAX(pTask->maxLatency, latency);
+    }
+    pSchedulerTask = pCallingTask;
+    schedulerStepStart = callingStepStart;
+}
+
+/**
+ * Reports the per task run statistics to the debug port
+ * @param pTasks points to the task table
+ * @param taskCount the number of entries in the task table
+ */
+void schedulerReport(
+    const TASK_T* pTasks,
+    size_t taskCount
+) {
+    debug_println(F("schedulerReport: task runs overruns maxRun(us) maxLatency(ms)"));
+    for (size_t idx = 0; idx < taskCount; ++idx) {
+        debug_print(F("schedulerReport: "));
+        debug_print(pTasks[idx].pName);
+        debug_print(F(" "));
+        debug_print(pTasks[idx].runCount);
+        debug_print(F(" "));
+        debug_print(pTasks[idx].overrunCount);
+        debug_print(F(" "));
+        debug_print(pTasks[idx].maxRunTime);
+        debug_print(F(" "));
+        debug_println(pTasks[idx].maxLatency);
+    }
+}
@@ -16,6 +16,13 @@ void settings_load() {
         config.sms_send_flags = SMS_SEND_DEFAULT;
         config.server_send_flags = SERVER_SEND_DEFAULT;
         config.reboot_interval = REBOOT_INTERVAL;
+        config.track_tolerance = TRACK_TOLERANCE;
+        config.track_heading_tolerance = TRACK_HEADING_TOLERANCE;
+        config.heartbeat_interval = HEARTBEAT_INTERVAL;
+        config.policy_distance = POLICY_DISTANCE;
+        config.policy_heading = POLICY_HEADING;
+        config.policy_speed = POLICY_SPEED;
+        config.capture_interval = CAPTURE_INTERVAL;
         storageSaveSettings(&config);
     }
     debug_println(F("settings_load() finished"));
@@ -17,6 +17,12 @@ SMS_CMD_HANDLER_T smsCommands[] = {
     { "pin", sms_pin_handler },
     { "sint", sms_sint_handler },
     { "fint", sms_fint_handler },
+    { "dint", sms_dint_handler },
+    { "hint", sms_hint_handler },
+    { "vint", sms_vint_handler },
+    { "cint", sms_cint_handler },
+    { "track", sms_track_handler },
+    { "hbint", sms_hbint_handler },
     { "locate", sms_locate_handler },
     { "smsnumber", sms_smsnumber_handler },
     { "smsfreq", sms_smsfreq_handler },
@@ -30,6 +36,15 @@ SMS_CMD_HANDLER_T smsCommands[] = {
  * Max size of an SMS command string
  */
 const size_t SMS_MAX_CMD_LEN = 144;
+SMS_PENDING_T smsPending[SMS_PENDING_MAX];
+size_t smsPendingCount = 0;
+bool smsPendingText = false;    // true if next listing line is message text
+bool smsPendingFull = false;    // true if the listing had too many messages
+unsigned smsDiscarded[SMS_PENDING_MAX]; // indexes of messages not understood
+size_t smsDiscardedCount = 0;
+unsigned smsIndicated[SMS_PENDING_MAX]; // indexes from +CMTI indications
+size_t smsIndicatedCount = 0;
+bool smsIndicatedLost = false;  // true if indications arrived when full
 /**
  * The value strings for ON/OFF configuration fields
  */
@@ -61,6 +76,11 @@ typedef struct SMS_FIELD_SPEC_S {
  * The value strings for the location format field
  */
 const char* LOCFMT_VALUES[] = {"web", "map", "val", NULL};
+/**
+ * The value strings for the server transport field, indexed by
+ * SERVER_SEND_TRANSPORT_xxx
+ */
+const char* SRVPROTO_VALUES[] = {"http", "tcp", "udp", "mqtt", NULL};
 /**
  * Declare the known SMS configuration field names and bit positions, along
  * with the set of allowed values (mapped to strings)
@@ -90,7 +110,8 @@ SMS_FIELD_SPEC_T sms_server_config_fields[] = {
     SMS_ONOFF_FIELD("nsat", SERVER, NSAT),
     SMS_ONOFF_FIELD("bat", SERVER, BATT),
     SMS_ONOFF_FIELD("ign", SERVER, IGN),
-    SMS_ONOFF_FIELD("run", SERVER, RUNTIME)
+    SMS_ONOFF_FIELD("run", SERVER, RUNTIME),
+    SMS_FIELD("proto", SERVER, TRANSPORT, SRVPROTO_VALUES)
 };
 
 /*
@@ -391,19 +412,26 @@ void sms_form_sms_update_str(
     if (((config.sms_send_flags >> SMS_SEND_ALT_POS)
                                  & SMS_SEND_ALT_MASK)
                                 == SMS_SEND_ALT_ON) {
+        char altStr[14];
         pos = calc_snprintf_return_pointer(
                 pos, strSize - (pos - pStr),
                 snprintf(pos, strSize - (pos - pStr),
-                "%salt=%.1f", pos == lineStart ? "" : ",", pGPSData->alt)
+                "%salt=%s", pos == lineStart ? "" : ",",
+                gps_form_fixed_str(altStr, DIM(altStr), pGPSData->alt,
+                                   GPS_CENTI_DIGITS, 1))
               );
     }
     if (((config.sms_send_flags >> SMS_SEND_SPEED_POS)
                                  & SMS_SEND_SPEED_MASK)
                                 == SMS_SEND_SPEED_ON) {
+        char speedStr[14];
         pos = calc_snprintf_return_pointer(
                 pos, strSize - (pos - pStr),
                 snprintf(pos, strSize - (pos - pStr),
-                "%sspeed=%.1f", pos == lineStart ? "" : ",", pGPSData->speed)
+                "%sspeed=%s", pos == lineStart ? "" : ",",
+                gps_form_fixed_str(speedStr, DIM(speedStr),
+                                   gps_cms_to_kmph100(pGPSData->speed),
+                                   GPS_CENTI_DIGITS, 1))
               );
     }
     if (((config.sms_send_flags >> SMS_SEND_IGN_POS)
@@ -552,6 +580,151 @@ void sms_fint_handler(
     }
 }
 
+/**
+ * Parses an SMS server update policy threshold
+ * @param pValue points to the threshold string value, 0 for off
+ * @param maxValue the largest valid threshold
+ * @param pThreshold assigned the threshold if it is valid
+ * @return true if the threshold is valid
+ */
+bool sms_parse_threshold(
+    const char* pValue,
+    unsigned long maxValue,
+    unsigned short* pThreshold
+) {
+    char* pEnd = NULL;
+    unsigned long value = pValue ? strtoul(pValue, &pEnd, 0) : 0;
+    if ((pEnd == NULL) || (pEnd == pValue) || (*pEnd != '\0') ||
+            (value > maxValue)) {
+        return false;
+    }
+    *pThreshold = value;
+    return true;
+}
+
+/**
+ * Handles the SMS set dint command
+ * @param pPhoneNumber points to the text phone number we send any response to
+ * @param pValue points to the new distance string value (in meters) after
+ *        which to update the server, 0 for off
+ */
+void sms_dint_handler(
+    const char* pPhoneNumber,
+    const char* pValue
+) {
+    if (!sms_parse_threshold(pValue, USHRT_MAX, &config.policy_distance)) {
+        sms_send_msg("Error: bad update distance", pPhoneNumber);
+    } else {
+        saveConfig = true;
+        sms_send_msg("Update distance saved", pPhoneNumber);
+    }
+}
+
+/**
+ * Handles the SMS set hint command
+ * @param pPhoneNumber points to the text phone number we send any response to
+ * @param pValue points to the new course change string value (in degrees)
+ *        after which to update the server, 0 for off
+ */
+void sms_hint_handler(
+    const char* pPhoneNumber,
+    const char* pValue
+) {
+    if (!sms_parse_threshold(pValue, 180, &config.policy_heading)) {
+        sms_send_msg("Error: bad update heading change", pPhoneNumber);
+    } else {
+        saveConfig = true;
+        sms_send_msg("Update heading change saved", pPhoneNumber);
+    }
+}
+
+/**
+ * Handles the SMS set vint command
+ * @param pPhoneNumber points to the text phone number we send any response to
+ * @param pValue points to the new speed change string value (in km/h) after
+ *        which to update the server, 0 for off
+ */
+void sms_vint_handler(
+    const char* pPhoneNumber,
+    const char* pValue
+) {
+    if (!sms_parse_threshold(pValue, 1000, &config.policy_speed)) {
+        sms_send_msg("Error: bad update speed change", pPhoneNumber);
+    } else {
+        saveConfig = true;
+        sms_send_msg("Update speed change saved", pPhoneNumber);
+    }
+}
+
+/**
+ * Handles the SMS set cint command
+ * @param pPhoneNumber points to the text phone number we send any response to
+ * @param pValue points to the new time string value (in secs) for the fix
+ *        capture interval, 0 for off
+ */
+void sms_cint_handler(
+    const char* pPhoneNumber,
+    const char* pValue
+) {
+    if (!sms_parse_threshold(pValue, USHRT_MAX, &config.capture_interval)) {
+        sms_send_msg("Error: bad capture interval", pPhoneNumber);
+    } else {
+        saveConfig = true;
+        sms_send_msg("Capture interval saved", pPhoneNumber);
+    }
+}
+
+/**
+ * Handles the SMS set hbint command
+ * @param pPhoneNumber points to the text phone number we send any response to
+ * @param pValue points to the new time string value (in mins) for the parked
+ *        heartbeat interval
+ */
+void sms_hbint_handler(
+    const char* pPhoneNumber,
+    const char* pValue
+) {
+    unsigned long updateMins = pValue ? strtoul(pValue, NULL, 0) : 0;
+    if ((updateMins == 0) || (updateMins > USHRT_MAX)) {
+        sms_send_msg("Error: bad heartbeat interval", pPhoneNumber);
+    } else {
+        config.heartbeat_interval = updateMins;
+        saveConfig = true;
+        sms_send_msg("Heartbeat interval saved", pPhoneNumber);
+    }
+}
+
+/**
+ * Handles the SMS set track command
+ * @param pPhoneNumber points to the text phone number we send any response to
+ * @param pValue points to the new track tolerance string value (in meters),
+ *        optionally followed by a comma and the heading tolerance (in
+ *        degrees). A value of 0 turns that test off.
+ */
+void sms_track_handler(
+    const char* pPhoneNumber,
+    const char* pValue
+) {
+    char* pEnd = NULL;
+    unsigned long tolerance = pValue ? strtoul(pValue, &pEnd, 0) : 0;
+    unsigned long headingTolerance = config.track_heading_tolerance;
+    bool valid = (pEnd != NULL) && (pEnd != pValue);
+    if (valid && (*pEnd == ',')) {
+        const char* pHeading = pEnd + 1;
+        headingTolerance = strtoul(pHeading, &pEnd, 0);
+        valid = (pEnd != pHeading);
+    }
+    if (!valid || (*pEnd != '\0') ||
+            (tolerance > USHRT_MAX) || (headingTolerance > 180)) {
+        sms_send_msg("Error: bad track tolerance", pPhoneNumber);
+    } else {
+        config.track_tolerance = tolerance;
+        config.track_heading_tolerance = headingTolerance;
+        saveConfig = true;
+        sms_send_msg("Track tolerance saved", pPhoneNumber);
+    }
+}
+
 /**
  * Handles the SMS locate command
  * @param pPhoneNumber points to the text phone number we send any response to
@@ -851,6 +1024,7 @@ void sms_smssend_handler(
  *          batn:<on,off>
  *          ign:<on,off>
  *          run:<on,off>
+ *          proto:<http,tcp,udp,mqtt>
  *        There is also the special field name 'default' which restores the
  *        default configuration values
  *          default:on
@@ -900,14 +1074,23 @@ void sms_srvsend_handler(
 
 /*
  * Checks for having received a new text message and processes each new
- * message.
+ * message. The modem tells us about each new message with a +CMTI
+ * indication (see smsNewMessageURC()) and we read just that message with
+ * AT+CMGR. When there are no indications to handle, which is the case each
+ * time the task runs on its (slow) interval, we list any unread messages
+ * with AT+CMGL as a safety net for lost indications.
  * NOTE:
- *  We issue the modem AT+CMGL="REC UNREAD" command, which responds with:
- *    AT+CMGL="REC UNREAD"<CR>
+ *  AT+CMGR=<index> responds with:
+ *    AT+CMGR=<index><CR>
+ *    +CMGR: <stat>,<oa>,[<alpha>],[<scts>]<CR><LF><data><CR><LF>
+ *    <CR><LF>OK<CR><LF>
+ *  AT+CMGL="REC UNREAD",1 (the 1 leaves the message status unchanged)
+ *  responds with:
+ *    AT+CMGL="REC UNREAD",1<CR>
  *    *{+CMGL: <index>,<stat>,<oa>,[<alpha>],[<scts>]<CR><LF><data><CR><LF>}
  *    <CR><LF>OK<CR><LF>
  *  Where:
- *    <stat>: Status = "REC UNREAD"
+ *    <stat>: Status e.g. "REC UNREAD"
  *    <index>: Index number of the message
  *    <oa>: Originator address (telephone number)
  *    <alpha>: Originator name (if available in the phonebook)
@@ -916,67 +1099,151 @@ void sms_srvsend_handler(
  *    <CR>: ASCII character 13
  *    <LF>: ASCII character 10
  *  e.g.
- *    AT+CMGL="REC UNREAD"\r\r\n+CMGL: 1,"REC UNREAD","+44xxxxxxxxxx","","2015/07/28 16:34:03+04"\r\n#xxxx,locate\r\n\r\nOK\r\n
+ *    AT+CMGL="REC UNREAD",1\r\r\n+CMGL: 1,"REC UNREAD","+44xxxxxxxxxx","","2015/07/28 16:34:03+04"\r\n#xxxx,locate\r\n\r\nOK\r\n
+ *  The reply is consumed a line at a time as it arrives so it does not
+ *  need to fit in modem_reply[]. Each message is deleted once it has been
+ *  run.
  */
-void smsRequestCheck() {
-    // Issue command to modem to read all unread messages
-    gsmSendModemCommand("AT+CMGL=\"REC UNREAD\"");
-    const char* msgStart = modem_reply;
-    unsigned int msgCount = 0;
-    while (msgStart != NULL) {
-        // Locate start of next message response
-        msgStart = strstr(msgStart, "+CMGL:");
-        // If found ...
-        if (msgStart != NULL) {
-            // ... process the message and move past it
-            msgStart = sms_process(msgStart);
-            ++msgCount;
+void smsRequestCheck(
+    TASK_T* pTask
+) {
+    smsPendingCount = 0;
+    smsPendingText = false;
+    smsPendingFull = false;
+    smsDiscardedCount = 0;
+    if (smsIndicatedCount > 0) {
+        // Read just the indicated messages
+        for (size_t idx = 0; idx < smsIndicatedCount; ++idx) {
+            snprintf(modem_command, sizeof(modem_command),
+                "AT+CMGR=%u", smsIndicated[idx]);
+            size_t pendingCount = smsPendingCount;
+            if (gsmSendCommandLines(sms_read_line) != AT_RESULT_OK) {
+                smsPendingCount = pendingCount;
+            } else if (smsPendingCount > pendingCount) {
+                smsPending[pendingCount].index = smsIndicated[idx];
+            } else {
+                // Read but not understood, AT+CMGR has marked it read
+                sms_discard(smsIndicated[idx]);
+            }
+        }
+        smsIndicatedCount = 0;
+        if (smsIndicatedLost) {
+            // List the messages we had no room to note
+            smsIndicatedLost = false;
+            smsPendingFull = true;
+        }
+    } else {
+        snprintf(modem_command, sizeof(modem_command),
+            "AT+CMGL=\"REC UNREAD\",1");
+        if (gsmSendCommandLines(sms_read_line) != AT_RESULT_OK) {
+            return;
         }
     }
-    if (msgCount > 0) {
+    for (size_t idx = 0; idx < smsPendingCount; ++idx) {
+        sms_cmd(smsPending[idx].message, smsPending[idx].phoneNumber);
+        snprintf(modem_command, sizeof(modem_command),
+            "AT+CMGD=%u", smsPending[idx].index);
+        gsmSendCommand(true);
+    }
+    for (size_t idx = 0; idx < smsDiscardedCount; ++idx) {
+        // Otherwise they would be listed again on every check
+        snprintf(modem_command, sizeof(modem_command),
+            "AT+CMGD=%u", smsDiscarded[idx]);
+        gsmSendCommand(true);
+    }
+    if (smsPendingCount > 0) {
         debug_print(F("Processed "));
-        debug_print(msgCount);
+        debug_print(smsPendingCount);
         debug_println(F(" SMS messages"));
-        // remove all READ and SENT sms
-        gsmSendModemCommand("AT+QMGDA=\"DEL READ\"");
-        gsmSendModemCommand("AT+QMGDA=\"DEL SENT\"");
+    }
+    if (smsPendingFull) {
+        // Come straight back for the messages we had no room for
+        schedulerSignal(pTask);
     }
 }
 
 /*
- * Consumes the modem response for one SMS message and returns a
- * pointer to just after the end of the consumed message.
- * @param msgStart points to the start of the message (->"+CMGL")
- *    +CMGL: <index>,<stat>,<oa>,[<alpha>],[<scts>]<CR><LF><data><CR><LF>
- *    e.g.
+ * Consumes one line of an AT+CMGR or AT+CMGL reply, saving each message (up
+ * to SMS_PENDING_MAX of them) to smsPending[]
+ * @param pLine the line, which is either a message header e.g.
  *    +CMGL: 1,"REC UNREAD","+31628870634",,"11/01/09,10:26:26+04"
+ *    +CMGR: "REC UNREAD","+31628870634",,"11/01/09,10:26:26+04"
+ *    or the message text following a header e.g.
  *    This is text message 1
- * @return pointer to the character after the processed message
+ * @return 1 after a header, as the message text which follows it is not
+ *    to be taken for a result code or URC (e.g. a message of "OK"), else 0
+ */
+unsigned sms_read_line(
+    const char* pLine
+) {
+    if ((strncmp(pLine, "+CMGL:", 6) == 0) ||
+        (strncmp(pLine, "+CMGR:", 6) == 0)) {
+        smsPendingText = false;
+        if (smsPendingCount >= SMS_PENDING_MAX) {
+            smsPendingFull = true;
+        } else if (sms_process(pLine, &smsPending[smsPendingCount])) {
+            smsPendingText = true;
+        } else if (strncmp(pLine, "+CMGL:", 6) == 0) {
+            sms_discard(atoi(pLine + 6));
+        }
+        return 1;
+    }
+    if (smsPendingText) {
+        SMS_PENDING_T* pPending = &smsPending[smsPendingCount];
+        sms_extract_field(
+            pLine, pPending->message, DIM(pPending->message), "\r\n");
+        smsPendingText = false;
+        ++smsPendingCount;
+    }
+    return 0;
+}
+
+/*
+ * Notes a message which was not understood, so it is deleted unread
+ * @param index the message index
+ */
+void sms_discard(
+    unsigned index
+) {
+    if (smsDiscardedCount >= DIM(smsDiscarded)) {
+        // Come back for it, it is still unread
+        smsPendingFull = true;
+    } else {
+        smsDiscarded[smsDiscardedCount++] = index;
+    }
+}
+
+/*
+ * Extracts the message index and phone number from an AT+CMGL or AT+CMGR
+ * message header line.
+ * @param pHeader points to the header line
+ *    +CMGL: <index>,<stat>,<oa>,[<alpha>],[<scts>]
+ *    +CMGR: <stat>,<oa>,[<alpha>],[<scts>]
+ *    e.g.
+ *    +CMGL: 1,"REC UNREAD","+31628870634",,"11/01/09,10:26:26+04"
+ * @param pPending the pending message to fill in. The index is only set
+ *        for AT+CMGL headers.
+ * @return true if the header was understood
  */
-const char* sms_process(
-    const char* msgStart
+bool sms_process(
+    const char* pHeader,
+    SMS_PENDING_T* pPending
 ) {
-    char phoneNumber[MAX_PHONE_NUMBER_LEN + 1];
-    char message[SMS_MAX_CMD_LEN + 1];
-    const char* pos = strchr(msgStart, ','); // after <index>,
+    const char* pos = pHeader + 6;
+    if (strncmp(pHeader, "+CMGL:", 6) == 0) {
+        pPending->index = atoi(pos);
+        pos = strchr(pos, ','); // after <index>,
+    }
     if (pos != NULL) {
         pos = strchr(pos + 1, ','); // after <stat>,
-        if (pos != NULL) {
-            if (pos[1] == '"') {
-                pos += 2; // start of phone number
-                pos = sms_extract_field(
-                    pos, phoneNumber, DIM(phoneNumber), "\"");
-                pos = strchr(pos, LF);
-                if (pos != NULL) {
-                    pos += 1; // start of <data>
-                    pos = sms_extract_field(
-                        pos, message, DIM(message), "\r");
-                    sms_cmd(message, phoneNumber);
-                }
-            }
+        if ((pos != NULL) && (pos[1] == '"')) {
+            pos += 2; // start of phone number
+            sms_extract_field(pos, pPending->phoneNumber,
+                DIM(pPending->phoneNumber), "\"");
+            return true;
         }
     }
-    return pos;
+    return false;
 }
 
 /*
@@ -1062,28 +1329,47 @@ void sms_cmd_run(
 /**
  * Sends a plain English SMS message to a phone number
  * @param pMsg points to the plain English text to send
- * @param pPhoneNumber points to the phone number
+ * @param pPhoneNumber points to the phone number, "" for commands which
+ *        did not come by SMS, which get no reply
  */
 void sms_send_msg(
     const char *pMsg,
     const char *pPhoneNumber
 ) {
+    if (*pPhoneNumber == '\0') {
+        debug_print(F("No SMS reply: "));
+        debug_println(pMsg);
+        return;
+    }
     //send SMS message to number
     debug_print(F("Sending SMS to:"));
     debug_print(pPhoneNumber);
     debug_print(F(" : "));
     debug_println(pMsg);
 
+    char smsText[MAX_SMS_MSG_LEN + 2];
+    strncopy(smsText, pMsg, MAX_SMS_MSG_LEN + 1);
+    //ctrl+z ends the message text
+    strcat(smsText, "\x1A");
     snprintf(modem_command, sizeof(modem_command),
         "AT+CMGS=\"%s\"", pPhoneNumber);
-    gsmWriteCommand();
-    gsmWaitForReply(false);
-    char *tmp = strstr(modem_reply, ">");
-    if (tmp != NULL) {
-        gsm_port.print(pMsg);
-        //sending ctrl+z
-        gsm_port.print("\x1A");
-        gsmWaitForReply(true);
+    gsmSendCommandData(smsText, strlen(smsText));
+}
+
+/**
+ * Handles the new SMS message indication by noting the message index and
+ * getting the SMS request task to run straight away
+ * @param pLine the URC line e.g. '+CMTI: "SM",3'
+ */
+void smsNewMessageURC(
+    const char* pLine
+) {
+    const char* pIndex = strrchr(pLine, ',');
+    if ((pIndex == NULL) || (smsIndicatedCount >= SMS_PENDING_MAX)) {
+        smsIndicatedLost = true;
+    } else {
+        smsIndicated[smsIndicatedCount++] = atoi(pIndex + 1);
     }
+    schedulerSignal(schedulerFindTask(tasks, DIM(tasks), "smsrx"));
 }
 
@@ -10,71 +10,223 @@ typedef struct STORED_SETTINGS_S {
     uint32_t crc32;         //!< CRC of settings record
 } STORED_SETTINGS_T;
 /**
- * Definition of how the GPS data is stored into flash.
- * Note that we need the length of each stored record to divisible by 4
+ * The server data store is written a page at a time. This is the SAM3X
+ * flash page size, the unit the flash is erased and written in.
  */
-typedef union STORED_SERVER_DATA_S {
-    uint8_t blockData[(sizeof(uint32_t) + sizeof(GPSDATA_T) + 3) / 4];
-    struct {
-        uint32_t marker;    //!< One of the STORED_GPSDATA_xxx values
-        SERVER_DATA_T serverData; //!< The actual server data
-    };
-} STORED_SERVER_DATA_T;
+#define STORE_PAGE_SIZE 256
+/**
+ * Header at the start of each page of the server data store. Records are
+ * given consecutive sequence numbers as they are written, so a page holds
+ * records firstSeq..firstSeq+count-1.
+ */
+typedef struct STORED_PAGE_HEADER_S {
+    uint32_t marker;        //!< STORED_PAGE_VALID if the page is in use
+    uint32_t pageSeq;       //!< Increments with each new page written
+    uint32_t firstSeq;      //!< Sequence number of the first record
+    uint32_t oldestSeq;     //!< Oldest unsent record when page was written
+    uint16_t count;         //!< Number of records in the page
+    uint16_t used;          //!< Number of record data bytes in the page
+    uint32_t crc32;         //!< CRC of the above
+} STORED_PAGE_HEADER_T;
+/**
+ * Each record in a page starts with this many bytes of header:
+ *   byte 0     record length in bytes, including the header
+ *   byte 1,2   low 16 bits of the record sequence number, little endian
+ *   byte 3,4   CRC16 of the record, with these bytes taken as 0
+ */
+#define STORE_RECORD_HEADER_SIZE 5
+/**
+ * The server data follows the record header packed by
+ * storagePackServerData(), as a varint of STORE_RECORD_xxx flags then a
+ * zig-zag varint delta (see data_put_delta()) for each STORE_VALUE_xxx
+ * value from the same value in the previous record of the page. The GPS
+ * values are left out if the record has no GPS fix. The first record of a
+ * page is coded against zero values.
+ */
+#define STORE_RECORD_GPS_VALID 0x01 //!< The record has GPS values
+#define STORE_RECORD_IGN_ON    0x02 //!< The ignition was on
+#define STORE_VALUE_CAPTURE_TIME 0  //!< captureTime
+#define STORE_VALUE_RUNTIME      1  //!< engineRuntime
+#define STORE_VALUE_DATE         2  //!< GPS date, the first GPS value
+#define STORE_VALUE_TIME         3  //!< GPS time in 100ths of a second
+#define STORE_VALUE_LATITUDE     4  //!< lat in 1e-7 degrees
+#define STORE_VALUE_LONGITUDE    5  //!< lon in 1e-7 degrees
+#define STORE_VALUE_ALTITUDE     6  //!< alt in cm
+#define STORE_VALUE_HEADING      7  //!< course in 100ths of a degree
+#define STORE_VALUE_SPEED        8  //!< speed in cm/s
+#define STORE_VALUE_HDOP         9  //!< hdop in 100ths
+#define STORE_VALUE_NSAT         10 //!< nsats
+#define STORE_VALUE_COUNT        11
+/**
+ * Definition of a page of the server data store
+ */
+typedef struct STORED_PAGE_S {
+    STORED_PAGE_HEADER_T header;
+    uint8_t data[STORE_PAGE_SIZE - sizeof(STORED_PAGE_HEADER_T)];
+} STORED_PAGE_T;
+/**
+ * Number of pages at the end of the server data store which hold
+ * checkpoints rather than records. Checkpoints are written to each in turn.
+ */
+#define STORE_CHECKPOINT_PAGES 2
+/**
+ * Checkpoint of the store index. This saves the oldest unsent record when
+ * we have sent records but not written a page since, and gives the page
+ * which was newest when it was written, so boot can go straight to it.
+ */
+typedef struct STORED_CHECKPOINT_S {
+    uint32_t marker;        //!< STORED_CHECKPOINT_VALID if in use
+    uint32_t checkpointSeq; //!< Increments with each checkpoint written
+    uint32_t newestPage;    //!< The page being filled
+    uint32_t newestPageSeq; //!< The pageSeq of newestPage
+    uint32_t oldestSeq;     //!< Oldest unsent record
+    uint32_t crc32;         //!< CRC of the above
+} STORED_CHECKPOINT_T;
+/**
+ * A position in the store, at a record or at the end of the records. As
+ * records are delta coded the position carries the values of the record
+ * before it in the page.
+ */
+typedef struct STORE_POSITION_S {
+    size_t page;            //!< Page number
+    size_t offset;          //!< Offset of the record in the page data
+    uint32_t seq;           //!< Sequence number of the record
+    bool chained;           //!< false if an earlier record was damaged
+    uint32_t skipped;       //!< Damaged records skipped to get here
+    long values[STORE_VALUE_COUNT]; //!< Values of the previous record
+} STORE_POSITION_T;
+/**
+ * A cursor for reading the stored records in place, oldest first, see
+ * ServerDataStore::startCursor()
+ */
+typedef STORE_POSITION_T STORE_CURSOR_T;
+/**
+ * A batch of server data records to send to the server, either from an
+ * array or from the store. The records are read from their source each
+ * time the batch is written, see serverBatchRead(), rather than being
+ * gathered together in RAM.
+ */
+typedef struct SERVER_BATCH_S {
+    const SERVER_DATA_T* pServerData; //!< The records, NULL if in the store
+    STORE_CURSOR_T start;             //!< The first record, if in the store
+    size_t count;                     //!< Number of records in the batch
+    size_t readCount;                 //!< Number of records read so far
+    STORE_CURSOR_T cursor;            //!< The next record, if in the store
+} SERVER_BATCH_T;
 /**
  * The index data we maintain for the currently stored server data
  */
 typedef struct STORED_SERVER_DATA_INDEX_S {
-    bool storeValid;            //!< if false, we dont use the flash store
+    bool storeValid;            //!< if false, we dont use the store
     size_t count;               //!< How many stored entries
-    STORED_SERVER_DATA_T* pOldest;  //!< Oldest entry in the store
+    uint32_t nextSeq;           //!< Sequence number for the next record
+    uint32_t nextPageSeq;       //!< Page sequence number for the next page
+    size_t headPage;            //!< Page being filled, held in pageBuffer
+    bool headStored;            //!< true if pageBuffer matches the medium
+    long headValues[STORE_VALUE_COUNT]; //!< Values of the last record added
+    STORE_POSITION_T tail;      //!< Where the oldest record is
+    uint32_t headSkipped;       //!< tail.skipped plus the damaged records
+                                //!< from the tail to the newest record
+    uint32_t savedOldestSeq;    //!< Oldest unsent record held by the medium
+    uint32_t savedNextSeq;      //!< Records before this are on the medium
+    uint32_t checkpointSeq;     //!< Sequence number of the last checkpoint
 } STORED_SERVER_DATA_INDEX_T;
+/**
+ * Counters for how hard we are working the store medium
+ */
+typedef struct STORED_SERVER_DATA_STATS_S {
+    unsigned long pageWrites;   //!< Number of pages written
+    unsigned long recordBytes;  //!< Record bytes passed to the store
+    unsigned long droppedCount; //!< Records overwritten before being sent
+    unsigned long damagedCount; //!< Damaged records found
+    unsigned long checkpointWrites; //!< Number of checkpoints written
+    unsigned long scanTime;     //!< us taken to rebuild the index at boot
+} STORED_SERVER_DATA_STATS_T;
 
 /**
  * Base class for managing server data which is persisted until such time
  * as we can send it to the server. To specialise this class for a specific
  * storage medium, subclass it and implement the abstract methods.
+ *
+ * The store is a log of whole pages, written in turn around the storage
+ * area so each page is erased equally often. New records are collected in
+ * a RAM page buffer which is written once full (or on flush()). Records
+ * are retired by moving the index past them, nothing is written, and the
+ * oldest unsent record is saved in the header of each page written (or in
+ * a checkpoint once the store has been emptied or is flushed).
+ *
+ * Page i always holds a pageSeq of i+1 modulo the page count, so at boot
+ * the newest page, and the page holding the oldest record, are found by
+ * binary search of the page headers.
+ *
+ * Page headers and records carry their own CRC. Damaged pages and records
+ * (e.g. from a write torn by a brownout) are found whilst the index is
+ * rebuilt at boot, left out of the record count and skipped when reached,
+ * rather than the store being wiped. As records are delta coded, the
+ * records after a damaged record in its page are lost with it.
  */
 class ServerDataStore {
 public:
     ServerDataStore(size_t size) {
         this->storeSize = size;
-        this->indexData.count = 0;
+        memset(&this->indexData, 0, sizeof(this->indexData));
+        memset(&this->stats, 0, sizeof(this->stats));
+        memset(&this->pageBuffer, 0, sizeof(this->pageBuffer));
         this->indexData.storeValid = true;
-        this->indexData.pOldest = NULL;
     }
     void init();
     bool writeServerData(const SERVER_DATA_T* pServerData);
     size_t getStoredServerDataCount();
-    bool readOldestServerData(SERVER_DATA_T* pServerData);
-    bool readOldestServerDataBlock(
-        SERVER_DATA_T* pServerData,
-        size_t dimServerData,
-        size_t* pUsed);
-    bool forgetOldestServerData(size_t count);
+    bool startCursor(STORE_CURSOR_T* pCursor);
+    bool readCursor(STORE_CURSOR_T* pCursor, SERVER_DATA_T* pServerData);
+    bool commitCursor(const STORE_CURSOR_T* pCursor);
+    bool flush();
+    void report();
 protected:
     size_t size() { return this->storeSize; }
-    size_t maxRecordCount() { return size()/sizeof(STORED_SERVER_DATA_T); }
+    size_t pageCount() {
+        return size() / STORE_PAGE_SIZE - STORE_CHECKPOINT_PAGES;
+    }
     virtual byte read(uint32_t address)=0;
     virtual byte* readAddress(uint32_t address)=0;
     virtual boolean write(uint32_t address, byte value)=0;
     virtual boolean write(uint32_t address, byte *data, uint32_t dataLength)=0;
-    STORED_SERVER_DATA_T* getFirst();
-    STORED_SERVER_DATA_T* getLast();
-    STORED_SERVER_DATA_T* getNext(STORED_SERVER_DATA_T* pServerData);
-    STORED_SERVER_DATA_T* getPrev(STORED_SERVER_DATA_T* pServerData);
+    const STORED_PAGE_T* getStoredPage(size_t pageIdx);
+    const STORED_PAGE_T* getPage(size_t pageIdx);
+    size_t getNextPage(size_t pageIdx);
+    size_t getPrevPage(size_t pageIdx);
+    bool isPageValid(const STORED_PAGE_T* pPage);
+    size_t getRecordSize(const STORED_PAGE_T* pPage, size_t offset);
+    bool checkRecord(const STORE_POSITION_T* pPos);
+    void startPosition(STORE_POSITION_T* pPos, size_t pageIdx);
+    size_t seekRecord(STORE_POSITION_T* pPos);
+    void stepRecord(STORE_POSITION_T* pPos, SERVER_DATA_T* pServerData);
+    void moveTail();
+    void countRecords();
+    uint32_t getPageKey(size_t pageIdx);
+    uint32_t getSearchKey(size_t pageIdx);
+    bool isNewestPage(size_t pageIdx);
+    bool isRunPage(size_t newestPage, size_t n);
+    size_t getRunPage(size_t newestPage, size_t n);
+    bool findNewestPage(
+        const STORED_CHECKPOINT_T* pCheckpoint,
+        size_t* pNewestPage);
+    size_t findTailPage(size_t newestPage, uint32_t* pOldestSeq);
+    bool readCheckpoint(STORED_CHECKPOINT_T* pCheckpoint);
+    bool writeCheckpoint();
     void scan();
-    bool wipe();
-    bool writeServerDataToStore(
-        const STORED_SERVER_DATA_T* pServerDataLocation,
-        unsigned long marker,
-        const SERVER_DATA_T* pServerData);
+    bool writeHeadPage();
+    void startHeadPage(size_t pageIdx);
+    void dropTailPage();
 private:
     /**
-     * STORED_SERVER_DATA_T.marker values
+     * STORED_PAGE_HEADER_T.marker value
+     */
+    static const uint32_t STORED_PAGE_VALID = 0x5A6E0C01;
+    /**
+     * STORED_CHECKPOINT_T.marker value
      */
-    static const uint32_t STORED_SERVER_DATA_START = 0x11111111;
-    static const uint32_t STORED_SERVER_DATA_VALID = 0xAA557700;
-    static const uint32_t STORED_SERVER_DATA_EMPTY = 0xFFFFFFFF;
+    static const uint32_t STORED_CHECKPOINT_VALID = 0xC4EC0C01;
     /**
      * The size of the storage in bytes
      */
@@ -83,6 +235,11 @@ private:
      * Tracks what is currently stored
      */
     STORED_SERVER_DATA_INDEX_T indexData;
+    STORED_SERVER_DATA_STATS_T stats;
+    /**
+     * The page currently being filled
+     */
+    STORED_PAGE_T pageBuffer;
 };
 
 /**
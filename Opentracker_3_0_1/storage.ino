@@ -10,8 +10,8 @@
  * |  Location data       |  |
  * |  stored whilst no    |  |
  * |  GSM connection      | 64K
- * |  available           |  |
- * |                      |  |
+ * |  available, as a log |  |
+ * |  of 256 byte pages   |  |
  * |                      |  v
  * +----------------------+ +0x00014000 (+65K)
  * |                      |
@@ -56,6 +56,29 @@ uint32_t calcCRC32(
     return ~crc;
 }
 
+/**
+ * Calculates the 16 bit CRC (CCITT) of a memory block. Blocks can be
+ * chained by passing the CRC of the previous block.
+ * @param crc 0xFFFF to start a CRC or the CRC of the previous block
+ * @param pData points to the data to calculate the CRC for
+ * @param length the number of bytes in the data block
+ * @return the 16 bit CRC
+ */
+uint16_t calcCRC16(
+    uint16_t crc,
+    const void* pData,
+    size_t length
+) {
+    const unsigned char* pMsg = (const unsigned char*)pData;
+    while (length-- != 0) {
+        crc ^= (uint16_t)(*pMsg++) << 8;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
 /**
  * Saves the configuration settings to flash
  * @param pSettings the settings to save
@@ -121,208 +144,725 @@ bool storageLoadSettings(
 }
 
 /**
- * Gets a pointer to the first block of stored server data
- * @return a pointer to the first block of stored server data
+ * Gets a page as it is held in the storage medium
+ * @param pageIdx the page number 0..pageCount()-1
+ * @return a pointer to the page
+ */
+const STORED_PAGE_T* ServerDataStore::getStoredPage(
+    size_t pageIdx
+) {
+    return (const STORED_PAGE_T*)readAddress(pageIdx * STORE_PAGE_SIZE);
+}
+
+/**
+ * Gets a page of the store, taking in to account that the page being
+ * filled is held in RAM
+ * @param pageIdx the page number 0..pageCount()-1
+ * @return a pointer to the page
+ */
+const STORED_PAGE_T* ServerDataStore::getPage(
+    size_t pageIdx
+) {
+    if (pageIdx == this->indexData.headPage) {
+        return &this->pageBuffer;
+    }
+    return getStoredPage(pageIdx);
+}
+
+/**
+ * Gets the page which follows a page, taking in to account any wrap at the
+ * end of the storage area
+ * @param pageIdx the page number
+ * @return the following page number
  */
-STORED_SERVER_DATA_T* ServerDataStore::getFirst(
+size_t ServerDataStore::getNextPage(
+    size_t pageIdx
 ) {
-    return (STORED_SERVER_DATA_T*)readAddress(0);
+    return (pageIdx + 1 == pageCount()) ? 0 : pageIdx + 1;
 }
 
 /**
- * Gets a pointer to the last block of stored server data
- * @return a pointer to the last block of stored server data
+ * Gets the page which comes before a page, taking in to account any wrap
+ * at the start of the storage area
+ * @param pageIdx the page number
+ * @return the previous page number
  */
-STORED_SERVER_DATA_T* ServerDataStore::getLast(
+size_t ServerDataStore::getPrevPage(
+    size_t pageIdx
 ) {
-    return getFirst() + size()/sizeof(STORED_SERVER_DATA_T) - 1;
+    return (pageIdx == 0) ? pageCount() - 1 : pageIdx - 1;
 }
 
 /**
- * Given a pointer to an existing stored server data block we return a pointer
- * to the following data block. This takes in to account any wrap at the end
- * of the storage area.
- * @param pServerData a pointer to a server data block in the storage area
- * @return a pointer to the record which follows pServerData, taking in to
- *         account any buffer wrap
+ * Checks a page header is intact
+ * @param pPage the page
+ * @return true if the page is in use and its header is intact
  */
-STORED_SERVER_DATA_T* ServerDataStore::getNext(
-    STORED_SERVER_DATA_T* pServerData
+bool ServerDataStore::isPageValid(
+    const STORED_PAGE_T* pPage
 ) {
-    if (pServerData == getLast()) {
-        return getFirst();
+    if (pPage == &this->pageBuffer) {
+        return true;
     }
-    return pServerData + 1;
+    return (pPage->header.marker == STORED_PAGE_VALID) &&
+           (pPage->header.used <= sizeof(pPage->data)) &&
+           (pPage->header.crc32 == calcCRC32(&pPage->header,
+                offsetof(STORED_PAGE_HEADER_T, crc32)));
 }
 
 /**
- * Given a pointer to an existing stored server data block we return a pointer
- * to the previous data block. This takes in to account any wrap at the start
- * of the storage area.
- * @param pServerData a pointer to a server data block in the storage area
- * @return a pointer to the record which follows pServerData, taking in to
- *         account any buffer wrap
+ * Gets the size of a stored record. If the record length is damaged the
+ * rest of the page is taken as the record.
+ * @param pPage the page holding the record
+ * @param offset the offset of the record in the page data
+ * @return the number of bytes the record uses in its page
  */
-STORED_SERVER_DATA_T* ServerDataStore::getPrev(
-    STORED_SERVER_DATA_T* pServerData
+size_t ServerDataStore::getRecordSize(
+    const STORED_PAGE_T* pPage,
+    size_t offset
 ) {
-    if (pServerData == getFirst()) {
-        return getLast();
+    size_t size = pPage->data[offset];
+    if ((size < STORE_RECORD_HEADER_SIZE) ||
+        (offset + size > pPage->header.used)) {
+        size = pPage->header.used - offset;
     }
-    return pServerData - 1;
+    return size;
 }
 
 /**
- * Checks the flash store is valid and assigns the flash index data
+ * Calculates the CRC of a record
+ * @param pRecord the record, starting with its header
+ * @param size the record length
+ * @return the CRC, with the CRC bytes taken as 0
  */
-void ServerDataStore::scan() {
-    STORED_SERVER_DATA_T* pServerFirst = getFirst();
-    STORED_SERVER_DATA_T* pServerData = pServerFirst;
-    this->indexData.count = 0;
-    this->indexData.storeValid = true;
-    this->indexData.pOldest = NULL;
-    bool scanComplete = false;
-    // Scan the complete store looking for a _single_ oldest record and
-    // checking for presence of invalid marker values (indicating corrupt store)
-    while (!scanComplete) {
-        switch (pServerData->marker) {
-        case STORED_SERVER_DATA_START:
-            // Have located the oldest record
-            if (this->indexData.pOldest == NULL) {
-                debug_println(F("storageServerScan: located oldest record"));
-                // Record 1st oldest marker record
-                this->indexData.pOldest = pServerData;
-                this->indexData.count += 1;
-            } else {
-                debug_println(F("storageServerScan: found multiple oldest records!"));
-                // There can be only one
-                this->indexData.storeValid = false;
-                scanComplete = true;
+uint16_t storageRecordCRC(
+    const uint8_t* pRecord,
+    size_t size
+) {
+    static const uint8_t NO_CRC[2] = { 0, 0 };
+    uint16_t crc = calcCRC16(0xFFFF, pRecord, 3);
+    crc = calcCRC16(crc, NO_CRC, sizeof(NO_CRC));
+    return calcCRC16(crc, pRecord + STORE_RECORD_HEADER_SIZE,
+                     size - STORE_RECORD_HEADER_SIZE);
+}
+
+/**
+ * Gets the values we store for a server data record
+ * @param pServerData the server data
+ * @param pValues assigned the STORE_VALUE_COUNT STORE_VALUE_xxx values
+ */
+void storageGetValues(
+    const SERVER_DATA_T* pServerData,
+    long* pValues
+) {
+    const GPSDATA_T* pGPS = &pServerData->gpsData;
+    pValues[STORE_VALUE_CAPTURE_TIME] = pServerData->captureTime;
+    pValues[STORE_VALUE_RUNTIME] = pServerData->engineRuntime;
+    pValues[STORE_VALUE_DATE] = pGPS->date;
+    // hhmmsscc in 100ths of a second since midnight, so it deltas evenly
+    pValues[STORE_VALUE_TIME] = (pGPS->time / 1000000) * 360000 +
+        ((pGPS->time / 10000) % 100) * 6000 + (pGPS->time % 10000);
+    pValues[STORE_VALUE_LATITUDE] = pGPS->lat;
+    pValues[STORE_VALUE_LONGITUDE] = pGPS->lon;
+    pValues[STORE_VALUE_ALTITUDE] = pGPS->alt;
+    pValues[STORE_VALUE_HEADING] = pGPS->course;
+    pValues[STORE_VALUE_SPEED] = pGPS->speed;
+    pValues[STORE_VALUE_HDOP] = pGPS->hdop;
+    pValues[STORE_VALUE_NSAT] = pGPS->nsats;
+}
+
+/**
+ * Packs a server data record for the store
+ * @param pPos where to write the packed record
+ * @param pEnd the end of the space available
+ * @param pServerData the server data to pack
+ * @param pValues the values of the previous record in the page, updated
+ *        to the values of this record
+ * @return the position after the packed record or NULL if it did not fit
+ */
+uint8_t* storagePackServerData(
+    uint8_t* pPos,
+    const uint8_t* pEnd,
+    const SERVER_DATA_T* pServerData,
+    long* pValues
+) {
+    bool gpsValid = (pServerData->gpsData.fixAge != TinyGPS::GPS_INVALID_AGE);
+    long values[STORE_VALUE_COUNT];
+    storageGetValues(pServerData, values);
+    pPos = data_put_varint(pPos, pEnd,
+        (gpsValid ? STORE_RECORD_GPS_VALID : 0) |
+        (pServerData->ignState ? STORE_RECORD_IGN_ON : 0));
+    size_t valueCount = gpsValid ? STORE_VALUE_COUNT : STORE_VALUE_DATE;
+    for (size_t value = 0; value < valueCount; ++value) {
+        pPos = data_put_delta(pPos, pEnd, values[value], &pValues[value]);
+    }
+    return pPos;
+}
+
+/**
+ * Unpacks a server data record packed by storagePackServerData()
+ * @param pPos the packed record
+ * @param pEnd the end of the packed record
+ * @param pServerData where to write the server data, NULL if not wanted
+ * @param pValues the values of the previous record in the page, updated
+ *        to the values of this record
+ * @return the position after the packed record or NULL if it is damaged
+ */
+const uint8_t* storageUnpackServerData(
+    const uint8_t* pPos,
+    const uint8_t* pEnd,
+    SERVER_DATA_T* pServerData,
+    long* pValues
+) {
+    unsigned long flags = 0;
+    pPos = data_get_varint(pPos, pEnd, &flags);
+    bool gpsValid = (flags & STORE_RECORD_GPS_VALID) != 0;
+    size_t valueCount = gpsValid ? STORE_VALUE_COUNT : STORE_VALUE_DATE;
+    for (size_t value = 0; value < valueCount; ++value) {
+        pPos = data_get_delta(pPos, pEnd, &pValues[value]);
+    }
+    if ((pPos != NULL) && (pServerData != NULL)) {
+        GPSDATA_T* pGPS = &pServerData->gpsData;
+        unsigned long time = pValues[STORE_VALUE_TIME];
+        // Only the validity of the fix is kept, not its age
+        pGPS->fixAge = gpsValid ? 0 : (unsigned long)TinyGPS::GPS_INVALID_AGE;
+        pGPS->lat = pValues[STORE_VALUE_LATITUDE];
+        pGPS->lon = pValues[STORE_VALUE_LONGITUDE];
+        pGPS->alt = pValues[STORE_VALUE_ALTITUDE];
+        pGPS->course = pValues[STORE_VALUE_HEADING];
+        pGPS->speed = pValues[STORE_VALUE_SPEED];
+        pGPS->hdop = pValues[STORE_VALUE_HDOP];
+        pGPS->time = (time / 360000) * 1000000 +
+            ((time / 6000) % 60) * 10000 + (time % 6000);
+        pGPS->date = pValues[STORE_VALUE_DATE];
+        pGPS->nsats = pValues[STORE_VALUE_NSAT];
+        pServerData->ignState = (flags & STORE_RECORD_IGN_ON) != 0;
+        pServerData->engineRuntime = pValues[STORE_VALUE_RUNTIME];
+        pServerData->captureTime = pValues[STORE_VALUE_CAPTURE_TIME];
+    }
+    return pPos;
+}
+
+/**
+ * Checks the record at a position is intact
+ * @param pPos the position
+ * @return true if the record length, sequence number and CRC are good
+ */
+bool ServerDataStore::checkRecord(
+    const STORE_POSITION_T* pPos
+) {
+    const STORED_PAGE_T* pPage = getPage(pPos->page);
+    const uint8_t* pRecord = pPage->data + pPos->offset;
+    size_t size = pRecord[0];
+    return (size >= STORE_RECORD_HEADER_SIZE) &&
+           (pPos->offset + size <= pPage->header.used) &&
+           (pRecord[1] == (uint8_t)pPos->seq) &&
+           (pRecord[2] == (uint8_t)(pPos->seq >> 8)) &&
+           (pRecord[3] + (pRecord[4] << 8) == storageRecordCRC(pRecord, size));
+}
+
+/**
+ * Sets a position to the start of a page
+ * @param pPos the position
+ * @param pageIdx the page number
+ */
+void ServerDataStore::startPosition(
+    STORE_POSITION_T* pPos,
+    size_t pageIdx
+) {
+    pPos->page = pageIdx;
+    pPos->offset = 0;
+    pPos->chained = true;
+    memset(pPos->values, 0, sizeof(pPos->values));
+}
+
+/**
+ * Moves a position on to the next record, if it is not already at one,
+ * skipping any damaged records and pages, and the records after a damaged
+ * record in its page as they can not be decoded
+ * @param pPos the position, its skipped count increased by the number of
+ *        records skipped
+ * @return the number of records skipped
+ */
+size_t ServerDataStore::seekRecord(
+    STORE_POSITION_T* pPos
+) {
+    size_t skipped = 0;
+    while (pPos->seq < this->indexData.nextSeq) {
+        const STORED_PAGE_T* pPage = getPage(pPos->page);
+        bool pageValid = isPageValid(pPage);
+        if (pageValid && (pPos->offset == 0) &&
+            (pPage->header.firstSeq != pPos->seq)) {
+            if ((pPage->header.firstSeq > pPos->seq) &&
+                (pPage->header.firstSeq <= this->indexData.nextSeq)) {
+                // The records before this page were in a damaged page
+                skipped += pPage->header.firstSeq - pPos->seq;
+                pPos->seq = pPage->header.firstSeq;
+                continue;
             }
-            break;
-        case STORED_SERVER_DATA_VALID:
-            this->indexData.count += 1;
-            break;
-        case STORED_SERVER_DATA_EMPTY:
-            break;
-        default:
-            debug_print(F("storageServerScan: found corrupt store at index: "));
-            debug_println(pServerData - pServerFirst);
-            // Invalid marker = duff flash (or maybe we have changed the record
-            // format)
-            this->indexData.storeValid = false;
-            scanComplete = true;
+            pageValid = false;
+        }
+        if (!pageValid || (pPos->offset >= pPage->header.used)) {
+            if (pageValid) {
+                // Anything the page header says we have not yet reached
+                // was lost with a damaged record length
+                uint32_t endSeq = pPage->header.firstSeq + pPage->header.count;
+                if (endSeq > pPos->seq) {
+                    skipped += endSeq - pPos->seq;
+                    pPos->seq = endSeq;
+                }
+            }
+            if (pPos->page == this->indexData.headPage) {
+                skipped += this->indexData.nextSeq - pPos->seq;
+                pPos->seq = this->indexData.nextSeq;
+                break;
+            }
+            startPosition(pPos, getNextPage(pPos->page));
+            continue;
+        }
+        if (pPos->chained && checkRecord(pPos)) {
             break;
         }
-        pServerData = getNext(pServerData);
-        // Detect back at start i.e. all done
-        if (pServerData == pServerFirst) {
-            scanComplete = true;
+        skipped += 1;
+        pPos->chained = false;
+        stepRecord(pPos, NULL);
+    }
+    pPos->skipped += skipped;
+    return skipped;
+}
+
+/**
+ * Moves a position past the record it is at, decoding the record
+ * @param pPos the position
+ * @param pServerData where to write the record, NULL if not wanted
+ */
+void ServerDataStore::stepRecord(
+    STORE_POSITION_T* pPos,
+    SERVER_DATA_T* pServerData
+) {
+    const STORED_PAGE_T* pPage = getPage(pPos->page);
+    const uint8_t* pRecord = pPage->data + pPos->offset;
+    size_t size = getRecordSize(pPage, pPos->offset);
+    if (pPos->chained) {
+        pPos->chained = (storageUnpackServerData(
+            pRecord + STORE_RECORD_HEADER_SIZE, pRecord + size,
+            pServerData, pPos->values) != NULL);
+    }
+    pPos->offset += size;
+    pPos->seq += 1;
+}
+
+/**
+ * Moves the oldest record on past any damaged records, and updates the
+ * record count to match
+ */
+void ServerDataStore::moveTail() {
+    seekRecord(&this->indexData.tail);
+    countRecords();
+}
+
+/**
+ * Sets the record count to the records from the oldest record on, less
+ * the damaged ones
+ */
+void ServerDataStore::countRecords() {
+    STORE_POSITION_T* pTail = &this->indexData.tail;
+    if (pTail->skipped > this->indexData.headSkipped) {
+        // Damaged since the index was rebuilt
+        this->stats.damagedCount +=
+            pTail->skipped - this->indexData.headSkipped;
+        this->indexData.headSkipped = pTail->skipped;
+    }
+    this->indexData.count = this->indexData.nextSeq - pTail->seq -
+        (this->indexData.headSkipped - pTail->skipped);
+}
+
+/**
+ * Gets the value we order pages by when searching for the newest page
+ * @param pageIdx the page number
+ * @return the pageSeq of the page, or 0 if the page is not in use
+ */
+uint32_t ServerDataStore::getPageKey(
+    size_t pageIdx
+) {
+    const STORED_PAGE_T* pPage = getStoredPage(pageIdx);
+    return isPageValid(pPage) ? pPage->header.pageSeq : 0;
+}
+
+/**
+ * Checks whether a page is the newest page i.e. it is in use and was not
+ * followed by another page
+ * @param pageIdx the page number
+ * @return true if pageIdx is the newest page
+ */
+bool ServerDataStore::isNewestPage(
+    size_t pageIdx
+) {
+    uint32_t key = getPageKey(pageIdx);
+    return (key != 0) && (getPageKey(getNextPage(pageIdx)) != key + 1);
+}
+
+/**
+ * Gets the key of the first undamaged page at or after a page, without
+ * wrapping, so damaged pages do not upset the binary search
+ * @param pageIdx the page number
+ * @return the key or 0 if there are no pages in use from pageIdx onwards
+ */
+uint32_t ServerDataStore::getSearchKey(
+    size_t pageIdx
+) {
+    for (; pageIdx < pageCount(); ++pageIdx) {
+        uint32_t key = getPageKey(pageIdx);
+        if (key != 0) {
+            return key;
         }
     }
-    if (this->indexData.storeValid) {
-        if (this->indexData.pOldest == NULL) {
-            // Didnt find a start (oldest) record, so should not have seen
-            // and valid records
-            if (this->indexData.count > 0) {
-                this->indexData.storeValid = false;
+    return 0;
+}
+
+/**
+ * Finds the most recently written page. We try the page the checkpoint
+ * gives first, then a binary search for where the page keys drop, and
+ * only if neither works (the store was not written by us) check every
+ * page.
+ * @param pCheckpoint the last checkpoint or NULL if there is none
+ * @param pNewestPage assigned the newest page number
+ * @return true if found, false if the store is empty
+ */
+bool ServerDataStore::findNewestPage(
+    const STORED_CHECKPOINT_T* pCheckpoint,
+    size_t* pNewestPage
+) {
+    if ((pCheckpoint != NULL) && (pCheckpoint->newestPage < pageCount()) &&
+        isNewestPage(pCheckpoint->newestPage)) {
+        *pNewestPage = pCheckpoint->newestPage;
+        return true;
+    }
+    // Keys rise from page 0 to the newest page and then drop to those
+    // written a turn earlier (or not yet written) so find the last page
+    // with a key at least that of page 0
+    uint32_t firstKey = getSearchKey(0);
+    if (firstKey != 0) {
+        size_t lo = 0;
+        size_t hi = pageCount() - 1;
+        while (lo < hi) {
+            size_t mid = (lo + hi + 1) / 2;
+            if (getSearchKey(mid) >= firstKey) {
+                lo = mid;
             } else {
-                // Store is empty so we choose the oldest location as the start
-                this->indexData.pOldest = getFirst();
-            }
-        } else {
-            // Did find a start (oldest) record, so check we got a consecutive
-            // sequence of valid records following it. This checks we see
-            // something like EEEESVVVEEEE and not EEEESVVVEVEE.
-            pServerFirst = this->indexData.pOldest;
-            pServerData = pServerFirst;
-            size_t validCount = 0;
-            scanComplete = false;
-            while (!scanComplete) {
-                switch (pServerData->marker) {
-                case STORED_SERVER_DATA_START:
-                case STORED_SERVER_DATA_VALID:
-                    validCount += 1;
-                    break;
-                case STORED_SERVER_DATA_EMPTY:
-                default:
-                    scanComplete = true;
-                    break;
-                }
-                pServerData = getNext(pServerData);
-                if (pServerData == pServerFirst) {
-                    scanComplete = true;
-                }
-            }
-            if (validCount != this->indexData.count) {
-                this->indexData.storeValid = false;
+                hi = mid - 1;
             }
         }
+        if (isNewestPage(lo)) {
+            *pNewestPage = lo;
+            return true;
+        }
+    }
+    debug_println(F("storageServerScan: checking all pages"));
+    uint32_t newestKey = 0;
+    for (size_t idx = 0; idx < pageCount(); ++idx) {
+        uint32_t key = getPageKey(idx);
+        if (key > newestKey) {
+            newestKey = key;
+            *pNewestPage = idx;
+        }
     }
+    return (newestKey != 0);
 }
 
 /**
- * Erases the data store. This effectively marks the store full of
- * STORED_SERVER_DATA_EMPTY markers.
- * @return true if the store wiped OK, false if not
+ * Checks whether a page is undamaged and was written in the last turn
+ * around the store up to the newest page
+ * @param newestPage the newest page number
+ * @param n the number of pages from the page after the newest page
+ * @return true if the page is one we hold records in
  */
-bool ServerDataStore::wipe() {
-    bool wipeOK = true;
-    byte wipeData[256];
-    memset(wipeData, 0xFF, sizeof(wipeData));
+bool ServerDataStore::isRunPage(
+    size_t newestPage,
+    size_t n
+) {
+    uint32_t newestKey = getPageKey(newestPage);
+    uint32_t key = getPageKey((newestPage + 1 + n) % pageCount());
+    return (key != 0) && (key <= newestKey) &&
+           (newestKey - key < pageCount());
+}
+
+/**
+ * Gets the first page we hold records in, counting from the page after the
+ * newest page
+ * @param newestPage the newest page number
+ * @param n the number of pages from the page after the newest page to
+ *        start at
+ * @return the number of pages from the page after the newest page to the
+ *         first page at or after n we hold records in
+ */
+size_t ServerDataStore::getRunPage(
+    size_t newestPage,
+    size_t n
+) {
+    while ((n < pageCount() - 1) && !isRunPage(newestPage, n)) {
+        ++n;
+    }
+    return n;
+}
 
-    size_t wipeLeft = size();
-    size_t wipeOffset = 0;
-    while (wipeOK && (wipeLeft > 0)) {
-        size_t wipeSize = MIN(sizeof(wipeData), wipeLeft);
-        if (!write(wipeOffset, wipeData, wipeSize)) {
-            debug_println(F("storageWipeServerData: failed to wipe flash"));
-            wipeOK = false;
+/**
+ * Finds the page holding the oldest unsent record. Pages written in the
+ * turn before the newest page (or not yet written) come first, followed
+ * by pages holding increasing record numbers, so this is a binary search
+ * for the first page which starts after the oldest record.
+ * @param newestPage the newest page number
+ * @param pOldestSeq the oldest unsent record. If this has been overwritten
+ *        it is changed to the oldest record we still have.
+ * @return the page number holding the oldest record
+ */
+size_t ServerDataStore::findTailPage(
+    size_t newestPage,
+    uint32_t* pOldestSeq
+) {
+    size_t lo = 0;
+    size_t hi = pageCount();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        size_t pageIdx =
+            (newestPage + 1 + getRunPage(newestPage, mid)) % pageCount();
+        if (getStoredPage(pageIdx)->header.firstSeq > *pOldestSeq) {
+            hi = mid;
         } else {
-            wipeLeft -= wipeSize;
-            wipeOffset += wipeSize;
+            lo = mid + 1;
+        }
+    }
+    // The oldest record is in the last page in use before this
+    for (size_t n = lo; n-- > 0;) {
+        if (isRunPage(newestPage, n)) {
+            return (newestPage + 1 + n) % pageCount();
+        }
+    }
+    // Oldest record has been overwritten
+    size_t tailPage =
+        (newestPage + 1 + getRunPage(newestPage, lo)) % pageCount();
+    *pOldestSeq = getStoredPage(tailPage)->header.firstSeq;
+    return tailPage;
+}
+
+/**
+ * Reads the most recent checkpoint
+ * @param pCheckpoint where to write the checkpoint
+ * @return true if there is a valid checkpoint
+ */
+bool ServerDataStore::readCheckpoint(
+    STORED_CHECKPOINT_T* pCheckpoint
+) {
+    bool found = false;
+    for (size_t idx = 0; idx < STORE_CHECKPOINT_PAGES; ++idx) {
+        const STORED_CHECKPOINT_T* pStored = (const STORED_CHECKPOINT_T*)
+            readAddress((pageCount() + idx) * STORE_PAGE_SIZE);
+        if ((pStored->marker == STORED_CHECKPOINT_VALID) &&
+            (pStored->crc32 == calcCRC32(pStored,
+                offsetof(STORED_CHECKPOINT_T, crc32))) &&
+            (!found || (pStored->checkpointSeq > pCheckpoint->checkpointSeq))) {
+            *pCheckpoint = *pStored;
+            found = true;
         }
     }
-    return wipeOK;
+    return found;
 }
 
 /**
- * Writes a GPS record to flash
- * @param pServerDataLocation points to where in the store to write to
- * @param marker the marker to use for this record
- * @param pServerData the server data record to write
+ * Writes a checkpoint of the index, to the checkpoint page not holding the
+ * last one
  * @return true if written OK, false if not
  */
-bool ServerDataStore::writeServerDataToStore(
-    const STORED_SERVER_DATA_T* pServerDataLocation,
-    unsigned long marker,
-    const SERVER_DATA_T* pServerData
+bool ServerDataStore::writeCheckpoint() {
+    STORED_CHECKPOINT_T checkpoint;
+    checkpoint.marker = STORED_CHECKPOINT_VALID;
+    checkpoint.checkpointSeq = ++this->indexData.checkpointSeq;
+    checkpoint.newestPage = this->indexData.headPage;
+    checkpoint.newestPageSeq = this->pageBuffer.header.pageSeq;
+    checkpoint.oldestSeq = this->indexData.tail.seq;
+    checkpoint.crc32 = calcCRC32(&checkpoint,
+                                 offsetof(STORED_CHECKPOINT_T, crc32));
+    this->indexData.savedOldestSeq = checkpoint.oldestSeq;
+    this->stats.checkpointWrites += 1;
+    size_t pageIdx = pageCount() +
+                     (checkpoint.checkpointSeq % STORE_CHECKPOINT_PAGES);
+    return write(pageIdx * STORE_PAGE_SIZE,
+        (byte*)&checkpoint, sizeof(checkpoint));
+}
+
+/**
+ * Locates the newest page and the oldest unsent record and assigns the
+ * index data from them. The newest page becomes the page we carry on
+ * filling.
+ */
+void ServerDataStore::scan() {
+    memset(&this->indexData, 0, sizeof(this->indexData));
+    this->indexData.storeValid =
+        (size() >= (STORE_CHECKPOINT_PAGES + 2) * STORE_PAGE_SIZE);
+    if (!this->indexData.storeValid) {
+        return;
+    }
+    STORED_CHECKPOINT_T checkpoint;
+    bool haveCheckpoint = readCheckpoint(&checkpoint);
+    if (haveCheckpoint) {
+        this->indexData.checkpointSeq = checkpoint.checkpointSeq;
+    }
+    size_t newestPage;
+    if (!findNewestPage(haveCheckpoint ? &checkpoint : NULL, &newestPage)) {
+        debug_println(F("storageServerScan: store is empty"));
+        this->indexData.nextSeq = 1;
+        this->indexData.nextPageSeq = 1;
+        this->indexData.savedNextSeq = 1;
+        startHeadPage(0);
+        return;
+    }
+    const STORED_PAGE_T* pNewest = getStoredPage(newestPage);
+    uint32_t nextSeq = pNewest->header.firstSeq + pNewest->header.count;
+    uint32_t oldestSeq = pNewest->header.oldestSeq;
+    // Use the checkpoint if it was written whilst the newest page (or the
+    // page after it) was being filled. It may be past the records we hold,
+    // if records only held in RAM had been sent too.
+    if (haveCheckpoint &&
+        ((checkpoint.newestPageSeq == pNewest->header.pageSeq) ||
+         (checkpoint.newestPageSeq == pNewest->header.pageSeq + 1)) &&
+        (checkpoint.oldestSeq > oldestSeq)) {
+        oldestSeq = checkpoint.oldestSeq;
+    }
+    if (oldestSeq > nextSeq) {
+        oldestSeq = nextSeq;
+    }
+    size_t tailPage = findTailPage(newestPage, &oldestSeq);
+    // Carry on filling the newest page
+    this->pageBuffer = *pNewest;
+    this->indexData.headPage = newestPage;
+    this->indexData.headStored = true;
+    this->indexData.nextPageSeq = pNewest->header.pageSeq + 1;
+    this->indexData.nextSeq = nextSeq;
+    this->indexData.savedOldestSeq = oldestSeq;
+    this->indexData.savedNextSeq = nextSeq;
+    // Locate the oldest record within its page
+    STORE_POSITION_T* pTail = &this->indexData.tail;
+    startPosition(pTail, tailPage);
+    pTail->seq = getPage(tailPage)->header.firstSeq;
+    while (pTail->seq < oldestSeq) {
+        seekRecord(pTail);
+        if (pTail->seq < oldestSeq) {
+            stepRecord(pTail, NULL);
+        }
+    }
+    // Check every record we hold, so the count leaves out damaged ones
+    pTail->skipped = 0;
+    STORE_POSITION_T check = *pTail;
+    seekRecord(&check);
+    while (check.seq < nextSeq) {
+        stepRecord(&check, NULL);
+        seekRecord(&check);
+    }
+    this->indexData.headSkipped = check.skipped;
+    this->stats.damagedCount += check.skipped;
+    moveTail();
+    // Decode the newest page to carry on delta coding from its last record
+    STORE_POSITION_T head;
+    startPosition(&head, newestPage);
+    head.seq = pNewest->header.firstSeq;
+    while (head.chained && (head.offset < pNewest->header.used)) {
+        head.chained = checkRecord(&head);
+        stepRecord(&head, NULL);
+    }
+    memcpy(this->indexData.headValues, head.values, sizeof(head.values));
+    if (!head.chained) {
+        // Not safe to add to, so move on to a new page
+        startHeadPage(getNextPage(newestPage));
+    }
+    if (haveCheckpoint && (checkpoint.oldestSeq != oldestSeq)) {
+        // Records held in RAM were lost, so their numbers will be used
+        // again. Replace the checkpoint so it can not be mistaken for one
+        // written for the new records.
+        writeCheckpoint();
+    }
+}
+
+/**
+ * Writes the page being filled to the storage medium
+ * @return true if written OK, false if not
+ */
+bool ServerDataStore::writeHeadPage() {
+    this->pageBuffer.header.marker = STORED_PAGE_VALID;
+    this->pageBuffer.header.oldestSeq = this->indexData.tail.seq;
+    this->pageBuffer.header.crc32 = calcCRC32(&this->pageBuffer.header,
+        offsetof(STORED_PAGE_HEADER_T, crc32));
+    this->indexData.savedOldestSeq = this->pageBuffer.header.oldestSeq;
+    this->indexData.savedNextSeq = this->indexData.nextSeq;
+    this->stats.pageWrites += 1;
+    this->indexData.headStored = true;
+    return write(this->indexData.headPage * STORE_PAGE_SIZE,
+        (byte*)&this->pageBuffer, STORE_PAGE_SIZE);
+}
+
+/**
+ * Starts filling a new page. If the page still holds unsent records they
+ * are dropped, as it will be overwritten.
+ * @param pageIdx the page number to fill
+ */
+void ServerDataStore::startHeadPage(
+    size_t pageIdx
 ) {
-    STORED_SERVER_DATA_T storedServerData;
-    storedServerData.marker = marker;
-    storedServerData.serverData = *pServerData;
-    size_t byteOffset = (pServerDataLocation - getFirst()) *
-                        sizeof(STORED_SERVER_DATA_T);
-    return write(byteOffset,
-        (byte*)&storedServerData, sizeof(STORED_SERVER_DATA_T));
+    if ((this->indexData.count > 0) && (pageIdx == this->indexData.tail.page)) {
+        dropTailPage();
+    }
+    this->indexData.headPage = pageIdx;
+    this->indexData.headStored = false;
+    memset(&this->pageBuffer, 0xFF, sizeof(this->pageBuffer));
+    this->pageBuffer.header.pageSeq = this->indexData.nextPageSeq++;
+    this->pageBuffer.header.firstSeq = this->indexData.nextSeq;
+    this->pageBuffer.header.count = 0;
+    this->pageBuffer.header.used = 0;
+    memset(this->indexData.headValues, 0, sizeof(this->indexData.headValues));
+    if (this->indexData.count == 0) {
+        startPosition(&this->indexData.tail, pageIdx);
+        this->indexData.tail.seq = this->indexData.nextSeq;
+        this->indexData.tail.skipped = this->indexData.headSkipped;
+    }
+}
+
+/**
+ * Forgets the unsent records in the oldest page
+ */
+void ServerDataStore::dropTailPage() {
+    STORE_POSITION_T* pTail = &this->indexData.tail;
+    size_t pageIdx = pTail->page;
+    uint32_t seq = pTail->seq;
+    uint32_t skipped = pTail->skipped;
+    // Step through the page so damaged records are not counted as dropped
+    seekRecord(pTail);
+    while ((pTail->page == pageIdx) &&
+           (pTail->seq < this->indexData.nextSeq)) {
+        stepRecord(pTail, NULL);
+        seekRecord(pTail);
+    }
+    this->stats.droppedCount +=
+        (pTail->seq - seq) - (pTail->skipped - skipped);
+    countRecords();
 }
 
 /**
- * Call after boot to initialise our storage index data and to check the
- * flash content is valid. If flash is not valid we erase it all and
- * prepare it for use.
+ * Call after boot to initialise our storage index data from what is held
+ * in the store
  */
 void ServerDataStore::init() {
+    unsigned long timeStart = micros();
     scan();
+    this->stats.scanTime = micros() - timeStart;
     if (!this->indexData.storeValid) {
-        debug_println(F("storageServerDataInit: wiping flash"));
-        this->indexData.count = 0;
-        this->indexData.pOldest = getFirst();
-        this->indexData.storeValid = wipe();
+        debug_println(F("storageServerDataInit: store is too small to use"));
     } else {
-        debug_print(F("storageServerDataInit: flash is OK and holding "));
+        debug_print(F("storageServerDataInit: store is holding "));
         debug_print(this->indexData.count);
-        debug_println(F(" records"));
+        debug_print(F(" records, dropped "));
+        debug_print(this->stats.damagedCount);
+        debug_print(F(" damaged records, found in "));
+        debug_print(this->stats.scanTime);
+        debug_println(F("us"));
     }
 }
 
@@ -336,37 +876,50 @@ bool ServerDataStore::writeServerData(
 ) {
     bool writtenOK = false;
     if (this->indexData.storeValid) {
-        if (this->indexData.count == 0) {
-            // Store is empty so use first slot
-            STORED_SERVER_DATA_T* pStoredServerData = getFirst();
-            writtenOK = writeServerDataToStore(
-                            pStoredServerData, STORED_SERVER_DATA_START,
-                            pServerData);
-            this->indexData.count = 1;
-            this->indexData.pOldest = pStoredServerData;
-        } else if (this->indexData.count == maxRecordCount()) {
-            // Store is full so overwrite oldest slot
-            STORED_SERVER_DATA_T* pStoredServerData = this->indexData.pOldest;
-            writtenOK = writeServerDataToStore(
-                            pStoredServerData, STORED_SERVER_DATA_VALID,
-                            pServerData);
-            // Mark the following slot as the oldest
-            pStoredServerData = getNext(pStoredServerData);
-            writtenOK = writtenOK && writeServerDataToStore(
-                           pStoredServerData, STORED_SERVER_DATA_START,
-                           &pStoredServerData->serverData);
-            this->indexData.pOldest = pStoredServerData;
-        } else {
-            // Locate next free slot as oldest+count
-            STORED_SERVER_DATA_T* pStoredServerData = this->indexData.pOldest;
-            for (size_t idx=0; idx < this->indexData.count; ++idx) {
-                pStoredServerData = getNext(pStoredServerData);
+        const uint8_t* pEnd = this->pageBuffer.data +
+                              sizeof(this->pageBuffer.data);
+        uint8_t* pRecord = this->pageBuffer.data + this->pageBuffer.header.used;
+        long values[STORE_VALUE_COUNT];
+        memcpy(values, this->indexData.headValues, sizeof(values));
+        uint8_t* pRecordEnd = storagePackServerData(
+            pRecord + STORE_RECORD_HEADER_SIZE, pEnd, pServerData, values);
+        writtenOK = true;
+        if (pRecordEnd == NULL) {
+            // Page is full so store it and move on to the next
+            memset(pRecord, 0xFF, pEnd - pRecord);
+            if (!this->indexData.headStored) {
+                writtenOK = writeHeadPage();
             }
-            writtenOK = writeServerDataToStore(
-                            pStoredServerData, STORED_SERVER_DATA_VALID,
-                            pServerData);
-            this->indexData.count += 1;
+            startHeadPage(getNextPage(this->indexData.headPage));
+            pRecord = this->pageBuffer.data;
+            memset(values, 0, sizeof(values));
+            pRecordEnd = storagePackServerData(
+                pRecord + STORE_RECORD_HEADER_SIZE, pEnd, pServerData, values);
+        }
+        if (this->indexData.count == 0) {
+            STORE_POSITION_T* pTail = &this->indexData.tail;
+            pTail->page = this->indexData.headPage;
+            pTail->offset = this->pageBuffer.header.used;
+            pTail->seq = this->indexData.nextSeq;
+            pTail->chained = true;
+            pTail->skipped = this->indexData.headSkipped;
+            memcpy(pTail->values, this->indexData.headValues,
+                   sizeof(pTail->values));
         }
+        memcpy(this->indexData.headValues, values, sizeof(values));
+        size_t recordSize = pRecordEnd - pRecord;
+        pRecord[0] = recordSize;
+        pRecord[1] = (uint8_t)this->indexData.nextSeq;
+        pRecord[2] = (uint8_t)(this->indexData.nextSeq >> 8);
+        uint16_t crc = storageRecordCRC(pRecord, recordSize);
+        pRecord[3] = (uint8_t)crc;
+        pRecord[4] = (uint8_t)(crc >> 8);
+        this->pageBuffer.header.used += recordSize;
+        this->pageBuffer.header.count += 1;
+        this->indexData.nextSeq += 1;
+        this->indexData.count += 1;
+        this->indexData.headStored = false;
+        this->stats.recordBytes += recordSize;
         if (!writtenOK) {
             debug_println(F("storageSaveServerData: failed to update flash"));
             this->indexData.storeValid = false;
@@ -384,155 +937,123 @@ size_t ServerDataStore::getStoredServerDataCount() {
 }
 
 /**
- * Returns the oldest GPS data record from flash
- * @param pServerData where to write the GPS data
- * @return true if pServerData assigned ok, false if there is no data to return
+ * Starts reading the stored records from the oldest. Records are decoded
+ * from the store as they are read, so reading them takes no more memory
+ * however many there are. Reading does not remove records, see
+ * commitCursor().
+ * @param pCursor assigned the position of the oldest record
+ * @return true if there are records to read, false if not
  */
-bool ServerDataStore::readOldestServerData(
+bool ServerDataStore::startCursor(
+    STORE_CURSOR_T* pCursor
+) {
+    *pCursor = this->indexData.tail;
+    return this->indexData.storeValid && (this->indexData.count > 0);
+}
+
+/**
+ * Reads the record at a cursor and moves the cursor on to the next record.
+ * If the record at the cursor has been removed since the cursor was
+ * started, the cursor moves on to the oldest record.
+ * @param pCursor the cursor
+ * @param pServerData where to write the record
+ * @return true if pServerData assigned ok, false if there are no more
+ *         records
+ */
+bool ServerDataStore::readCursor(
+    STORE_CURSOR_T* pCursor,
     SERVER_DATA_T* pServerData
 ) {
-    if (!this->indexData.storeValid)
+    if (!this->indexData.storeValid) {
         return false;
-    if (this->indexData.count == 0)
+    }
+    if (pCursor->seq < this->indexData.tail.seq) {
+        *pCursor = this->indexData.tail;
+    }
+    seekRecord(pCursor);
+    if (pCursor->seq >= this->indexData.nextSeq) {
         return false;
-    *pServerData = this->indexData.pOldest->serverData;
+    }
+    stepRecord(pCursor, pServerData);
     return true;
 }
 
 /**
- * Returns the oldest GPS data record from flash
- * @param pServerData an array into which we write the server data
- * @param dimServerData the size of the pServerData array
- * @param pUsed assigned the number of array entries assigned
- * @return true if pServerData assigned ok, false if there is no data to return
+ * Removes the records before a cursor e.g. once the server has
+ * acknowledged the records read with it. Nothing is written, the oldest
+ * unsent record is saved with the next page written, or with a checkpoint
+ * if this empties the store of records the medium still holds as unsent.
+ * Records only ever held in RAM need no checkpoint, so an outage which
+ * never fills a page costs no checkpoint page erase.
+ * @param pCursor the cursor, just after the last record to remove
+ * @return true if removed OK, false if there is no data in the store or we
+ *         failed to write the checkpoint
  */
-bool ServerDataStore::readOldestServerDataBlock(
-    SERVER_DATA_T* pServerData,
-    size_t dimServerData,
-    size_t* pUsed
+bool ServerDataStore::commitCursor(
+    const STORE_CURSOR_T* pCursor
 ) {
-    if (!this->indexData.storeValid)
+    if (!this->indexData.storeValid || (this->indexData.count == 0)) {
         return false;
-    if (this->indexData.count == 0)
-        return false;
-    size_t usedEntries = 0;
-    STORED_SERVER_DATA_T* pStoredData = this->indexData.pOldest;
-    while (usedEntries < dimServerData) {
-        *pServerData++ = pStoredData->serverData;
-        pStoredData = getNext(pStoredData);
-        ++usedEntries;
     }
-    if (pUsed) {
-        *pUsed = usedEntries;
+    // Records may have been dropped since the cursor was read
+    if (pCursor->seq > this->indexData.tail.seq) {
+        this->indexData.tail = *pCursor;
+        moveTail();
+    }
+    if ((this->indexData.count == 0) &&
+        (this->indexData.savedOldestSeq < this->indexData.savedNextSeq)) {
+        return writeCheckpoint();
     }
     return true;
 }
 
 /**
- * Removes the oldest server data record(s) from flash
- * @param the number to server data entries to remove
- * @return true if removed OK, false if no GPS data in flash or we failed
- *         to update the flash
+ * Writes any records, and the oldest unsent record, held in RAM to the
+ * storage medium e.g. before a reboot
+ * @return true if written OK, false if not
  */
-bool ServerDataStore::forgetOldestServerData(
-    size_t count
-) {
-    bool writtenOK = false;
-    if (this->indexData.storeValid && (this->indexData.count != 0)) {
-        STORED_SERVER_DATA_T* pStoredData = this->indexData.pOldest;
-        while (count-- && this->indexData.count) {
-            // Mark this slot as empty
-            writtenOK = writeServerDataToStore(
-                            pStoredData, STORED_SERVER_DATA_EMPTY,
-                            &pStoredData->serverData);
-            pStoredData = getNext(pStoredData);
-            this->indexData.count -= 1;
-        }
-        if (this->indexData.count > 0) {
-            // Mark the last slot as the 'new' oldest
-            writtenOK = writtenOK && writeServerDataToStore(
-                           pStoredData, STORED_SERVER_DATA_START,
-                           &pStoredData->serverData);
-        }
-        this->indexData.pOldest = pStoredData;
+bool ServerDataStore::flush() {
+    if (!this->indexData.storeValid) {
+        return true;
     }
-    return writtenOK;
+    if (!this->indexData.headStored) {
+        return writeHeadPage();
+    }
+    if (this->indexData.savedOldestSeq != this->indexData.tail.seq) {
+        return writeCheckpoint();
+    }
+    return true;
 }
 
-/*
- * If the server storage block had space for 4 entries, these diagrams show all
- * possible valid states of the storage area.
- *   E = empty, S = start (oldest), V = Valid
- * When adding, scanning or removing entries make sure your algorithm copes
- * with all these states.
- *
- *   0   1   2   3
- * +---+---+---+---+
- * | E | E | E | E | serverDataIndex.count=0, serverDataIndex.oldestIdx=x
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | S | E | E | E | serverDataIndex.count=1, serverDataIndex.oldestIdx=0
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | E | S | E | E | serverDataIndex.count=1, serverDataIndex.oldestIdx=1
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | E | E | S | E | serverDataIndex.count=1, serverDataIndex.oldestIdx=2
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | E | E | E | S | serverDataIndex.count=1, serverDataIndex.oldestIdx=3
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | S | V | E | E | serverDataIndex.count=2, serverDataIndex.oldestIdx=0
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | E | S | V | E | serverDataIndex.count=2, serverDataIndex.oldestIdx=1
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | E | E | S | V | serverDataIndex.count=2, serverDataIndex.oldestIdx=2
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | V | E | E | S | serverDataIndex.count=2, serverDataIndex.oldestIdx=3
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | S | V | V | E | serverDataIndex.count=3, serverDataIndex.oldestIdx=0
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | E | S | V | V | serverDataIndex.count=3, serverDataIndex.oldestIdx=1
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | V | E | S | V | serverDataIndex.count=3, serverDataIndex.oldestIdx=2
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | V | V | E | S | serverDataIndex.count=3, serverDataIndex.oldestIdx=3
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | S | V | V | V | serverDataIndex.count=4, serverDataIndex.oldestIdx=0
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | V | S | V | V | serverDataIndex.count=4, serverDataIndex.oldestIdx=1
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | V | V | S | V | serverDataIndex.count=4, serverDataIndex.oldestIdx=2
- * +---+---+---+---+
- *
- * +---+---+---+---+
- * | V | V | V | S | serverDataIndex.count=4, serverDataIndex.oldestIdx=3
- * +---+---+---+---+
+/**
+ * Reports how the store is being used
  */
-
+void ServerDataStore::report() {
+    debug_print(F("store: records "));
+    debug_print(this->indexData.count);
+    debug_print(F(" dropped "));
+    debug_print(this->stats.droppedCount);
+    debug_print(F(" damaged "));
+    debug_print(this->stats.damagedCount);
+    debug_print(F(" page writes "));
+    debug_print(this->stats.pageWrites);
+    debug_print(F(" checkpoints "));
+    debug_print(this->stats.checkpointWrites);
+    // Every page has been erased about this many times
+    debug_print(F(" wear "));
+    debug_print(this->pageBuffer.header.pageSeq / pageCount());
+    // Bytes written to the medium for each record byte stored, a
+    // checkpoint costing a page as it is erased like one
+    unsigned long amplification = 0;
+    if (this->stats.recordBytes > 0) {
+        unsigned long pagesWritten =
+            this->stats.pageWrites + this->stats.checkpointWrites;
+        amplification = (pagesWritten * STORE_PAGE_SIZE * 100) /
+                        this->stats.recordBytes;
+    }
+    debug_print(F(" write amplification "));
+    debug_print(amplification / 100);
+    debug_print(F("."));
+    debug_print((amplification / 10) % 10);
+    debug_println(amplification % 10);
+}
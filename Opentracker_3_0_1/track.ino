@@ -0,0 +1,256 @@
+/**
+ * Track simplification. Samples are fed in as they are taken and only the
+ * points needed to redraw the track to within config.track_tolerance meters
+ * are passed on to be sent or stored.
+ *
+ * This is a streaming (sleeve) variant of line simplification that needs no
+ * point history. From the last emitted point (the anchor) every sample
+ * further than the tolerance away narrows a cone of bearings along which a
+ * straight line still passes within the tolerance of it. Whilst the next
+ * sample lies inside the cone the previous one (the held point) is dropped.
+ * Once a sample falls outside it, turns by more than
+ * config.track_heading_tolerance or the anchor gets older than
+ * config.slow_server_interval, the held point is emitted and becomes the new
+ * anchor. The cost is that the last point of each straight run is reported
+ * one sample late.
+ */
+
+/**
+ * Last point emitted
+ */
+SERVER_DATA_T trackAnchor;
+bool trackHaveAnchor = false;
+/**
+ * Last point seen, emitted only if the track bends after it
+ */
+SERVER_DATA_T trackHeld;
+bool trackHaveHeld = false;
+/**
+ * Cone of bearings from the anchor the track may still follow, as right
+ * and left edge vectors east and north in 1/10ths of a meter
+ */
+bool trackConeOpen = true;  // no sample has narrowed the cone yet
+int64_t trackConeRight[2];
+int64_t trackConeLeft[2];
+int64_t trackConeReach;     // furthest narrowing sample from the anchor
+/**
+ * Statistics
+ */
+unsigned long trackKeptCount = 0;    // points emitted
+unsigned long trackDroppedCount = 0; // points dropped
+
+/**
+ * Z component of the cross product of two vectors, positive if b is
+ * anticlockwise of a
+ */
+int64_t track_cross(
+    const int64_t* a,
+    const int64_t* b
+) {
+    return a[0] * b[1] - a[1] * b[0];
+}
+
+/**
+ * Makes a point the anchor of a new track segment
+ * @param pPoint the point to anchor the segment at
+ */
+void trackSetAnchor(
+    const SERVER_DATA_T* pPoint
+) {
+    trackAnchor = *pPoint;
+    trackHaveAnchor = true;
+    trackHaveHeld = false;
+    trackConeOpen = true;
+}
+
+/**
+ * Works out the offset of a point from the anchor
+ * @param pPoint the point
+ * @param pOffset assigned the offset east and north in 1/10ths of a meter
+ * @return the distance of the point from the anchor in 1/10ths of a meter
+ */
+int64_t trackOffset(
+    const SERVER_DATA_T* pPoint,
+    int64_t* pOffset
+) {
+    gps_offset_between(trackAnchor.gpsData.lat, trackAnchor.gpsData.lon,
+        pPoint->gpsData.lat, pPoint->gpsData.lon, &pOffset[0], &pOffset[1]);
+    return gps_isqrt((uint64_t)(pOffset[0] * pOffset[0] +
+                                pOffset[1] * pOffset[1]));
+}
+
+/**
+ * Checks if a point's course has turned away from the anchor's course by
+ * more than the heading tolerance
+ * @param pPoint the point to check
+ * @return true if the point has turned
+ */
+bool trackHasTurned(
+    const SERVER_DATA_T* pPoint
+) {
+    if ((config.track_heading_tolerance == 0) ||
+            (pPoint->gpsData.course == TinyGPS::GPS_INVALID_ANGLE) ||
+            (trackAnchor.gpsData.course == TinyGPS::GPS_INVALID_ANGLE) ||
+            (pPoint->gpsData.speed < TRACK_MIN_HEADING_SPEED) ||
+            (trackAnchor.gpsData.speed < TRACK_MIN_HEADING_SPEED)) {
+        // Course is meaningless when we are barely moving
+        return false;
+    }
+    long turn = ((long)pPoint->gpsData.course -
+                 (long)trackAnchor.gpsData.course) % 36000;
+    if (turn < 0) {
+        turn += 36000;
+    }
+    if (turn > 18000) {
+        turn = 36000 - turn;
+    }
+    return turn > (long)config.track_heading_tolerance * 100;
+}
+
+/**
+ * Checks if a point ends the current track segment, i.e. the line from the
+ * anchor to it would pass outside the tolerance of a dropped point
+ * @param pPoint the point to check
+ * @return true if the held point must be emitted before this one
+ */
+bool trackIsBreak(
+    const SERVER_DATA_T* pPoint
+) {
+    if (timeDiff(pPoint->captureTime, trackAnchor.captureTime) >=
+            config.slow_server_interval) {
+        return true;
+    }
+    if (trackHasTurned(pPoint)) {
+        return true;
+    }
+    if (trackConeOpen) {
+        return false;
+    }
+    // The line must also reach back past the samples it replaces
+    int64_t offset[2];
+    int64_t dist = trackOffset(pPoint, offset);
+    if (dist + (int64_t)config.track_tolerance * 10 < trackConeReach) {
+        return true;
+    }
+    return (track_cross(trackConeRight, offset) < 0) ||
+           (track_cross(offset, trackConeLeft) < 0);
+}
+
+/**
+ * Narrows the cone to the bearings from the anchor that pass within the
+ * tolerance of a point
+ * @param pPoint the point
+ */
+void trackNarrowCone(
+    const SERVER_DATA_T* pPoint
+) {
+    int64_t offset[2];
+    int64_t dist = trackOffset(pPoint, offset);
+    int64_t tol = (int64_t)config.track_tolerance * 10;
+    if (dist <= tol) {
+        // Any line from the anchor passes close enough
+        return;
+    }
+    // Rotate the offset either way by asin(tol / dist)
+    int64_t adj = gps_isqrt((uint64_t)(dist * dist - tol * tol));
+    int64_t right[2] = {
+        (offset[0] * adj + offset[1] * tol) / dist,
+        (offset[1] * adj - offset[0] * tol) / dist
+    };
+    int64_t left[2] = {
+        (offset[0] * adj - offset[1] * tol) / dist,
+        (offset[1] * adj + offset[0] * tol) / dist
+    };
+    if (trackConeOpen) {
+        memcpy(trackConeRight, right, sizeof(right));
+        memcpy(trackConeLeft, left, sizeof(left));
+        trackConeOpen = false;
+        trackConeReach = dist;
+    } else {
+        trackConeReach = MAX(trackConeReach, dist);
+        // The point lies inside the cone so the two overlap
+        if (track_cross(trackConeRight, right) > 0) {
+            memcpy(trackConeRight, right, sizeof(right));
+        }
+        if (track_cross(left, trackConeLeft) > 0) {
+            memcpy(trackConeLeft, left, sizeof(left));
+        }
+    }
+}
+
+/**
+ * Adds a sample to the track
+ * @param pPoint the sample
+ * @param pEmit assigned the points to send or store, oldest first, has room
+ *        for TRACK_MAX_EMIT points
+ * @return the number of points assigned to pEmit, may be 0
+ */
+size_t trackAddPoint(
+    const SERVER_DATA_T* pPoint,
+    SERVER_DATA_T* pEmit
+) {
+    if (!trackHaveAnchor || (config.track_tolerance == 0) ||
+            (pPoint->gpsData.fixAge == TinyGPS::GPS_INVALID_AGE) ||
+            (trackAnchor.gpsData.fixAge == TinyGPS::GPS_INVALID_AGE) ||
+            (pPoint->ignState != trackAnchor.ignState)) {
+        // Not simplifying, or the point marks an event, so report it now
+        return trackEndSegment(pPoint, pEmit);
+    }
+    size_t count = 0;
+    if (trackHaveHeld) {
+        if (trackIsBreak(pPoint)) {
+            pEmit[count++] = trackHeld;
+            trackSetAnchor(&trackHeld);
+        } else {
+            trackDroppedCount += 1;
+        }
+    }
+    trackNarrowCone(pPoint);
+    trackHeld = *pPoint;
+    trackHaveHeld = true;
+    trackKeptCount += count;
+    return count;
+}
+
+/**
+ * Adds a sample to the track which must be reported now, e.g. where we
+ * parked, and starts a new track segment from it
+ * @param pPoint the sample
+ * @param pEmit assigned the points to send or store, oldest first, has room
+ *        for TRACK_MAX_EMIT points
+ * @return the number of points assigned to pEmit
+ */
+size_t trackEndSegment(
+    const SERVER_DATA_T* pPoint,
+    SERVER_DATA_T* pEmit
+) {
+    size_t count = 0;
+    if (trackHaveHeld) {
+        pEmit[count++] = trackHeld;
+    }
+    pEmit[count++] = *pPoint;
+    trackSetAnchor(pPoint);
+    trackKeptCount += count;
+    return count;
+}
+
+/**
+ * Stores the held point so it is not lost, e.g. before a reboot
+ */
+void trackFlush() {
+    if (trackHaveHeld) {
+        serverDataStore.writeServerData(&trackHeld);
+        trackKeptCount += 1;
+        trackSetAnchor(&trackHeld);
+    }
+}
+
+/**
+ * Reports the track simplification statistics
+ */
+void trackReport() {
+    debug_print(F("trackReport: kept="));
+    debug_print(trackKeptCount);
+    debug_print(F(" dropped="));
+    debug_println(trackDroppedCount);
+}
@@ -21,10 +21,23 @@ const char* BAD_TIME = "?TIME?";
                                      // data when we are moving
 #define SLOW_SERVER_INTERVAL (10*60) // how often, in secs, to update the server
                                      // data when we are stopped
+#define CAPTURE_INTERVAL 1           // how often, in secs, to capture a fix
+                                     // between server updates, 0 for off
+#define POLICY_DISTANCE 500          // distance, in m, after which to update
+                                     // the server, 0 for off
+#define POLICY_HEADING 30            // course change, in degrees, after which
+                                     // to update the server, 0 for off
+#define POLICY_SPEED 20              // speed change, in km/h, after which to
+                                     // update the server, 0 for off
+#define HEARTBEAT_INTERVAL 60        // how often, in mins, to send the server
+                                     // a heartbeat when we are parked
 #define SMS_SEND_INTERVAL (24*60)    // how often, in mins, to send a location
                                      // SMS message
 #define REBOOT_INTERVAL (7*24*60)    // auto reboot every week
-#define DATA_LIMIT 2500     //current data limit, data collected before sending to remote server can not exceed this
+#define TRACK_TOLERANCE 15           // max distance, in m, a dropped point may
+                                     // be from the reported track, 0 for off
+#define TRACK_HEADING_TOLERANCE 30   // max course change, in degrees, before a
+                                     // point is reported, 0 for off
 // SMS related definitions
 #define MAX_SMS_MSG_LEN 144
 #define MAX_SMS_KEY_LEN 12  // SMS key cant be longer than this
@@ -69,9 +82,13 @@ const char* BAD_TIME = "?TIME?";
 #define GSM_MODEM_COMMAND_TIMEOUT 20
 #define GSM_SEND_FAILURES_REBOOT 0  // 0 == disabled, increase to set the number of GSM failures that will trigger a reboot of the opentracker device
 
-#define SEND_RAW 0 // enable to use the new raw tcp send method to minimise data use
-#define SEND_RAW_INCLUDE_KEY 1
-#define SEND_RAW_INCLUDE_TIMESTAMP 0
+// Server transports compiled in (see transport.h), set any not wanted to 0
+// to leave them out of flash. The first one compiled in is used if the
+// configured one is not.
+#define TRANSPORT_HTTP_ENABLED 1
+#define TRANSPORT_TCP_ENABLED 1
+#define TRANSPORT_UDP_ENABLED 1
+#define TRANSPORT_MQTT_ENABLED 1
 
 // Macro to help with forming SERVER_SEND bit data values
 #define SERVER_SEND(name, val) \
@@ -125,6 +142,16 @@ const char* BAD_TIME = "?TIME?";
 #define SERVER_SEND_RUNTIME_MASK  1
 #define     SERVER_SEND_RUNTIME_ON  1
 #define     SERVER_SEND_RUNTIME_OFF 0
+#define SERVER_SEND_TRANSPORT_POS   12
+#define SERVER_SEND_TRANSPORT_MASK  0x03
+#define     SERVER_SEND_TRANSPORT_HTTP 0 // text batches as HTTP POSTs
+#define     SERVER_SEND_TRANSPORT_TCP  1 // binary batches over raw TCP
+#define     SERVER_SEND_TRANSPORT_UDP  2 // binary batches as UDP datagrams
+#define     SERVER_SEND_TRANSPORT_MQTT 3 // binary batches to an MQTT broker
+// Number of data field bits (GPSDATE..RUNTIME) in settings.server_send_flags.
+// The GPS data fields are those below SERVER_SEND_BATT_POS.
+#define SERVER_SEND_FIELD_COUNT 12
+#define SERVER_SEND_FIELDS_MASK ((1UL << SERVER_SEND_FIELD_COUNT) - 1)
 
 // Default value for settings.SERVER_send_flags
 #define SERVER_SEND_DEFAULT \
@@ -139,33 +166,115 @@ const char* BAD_TIME = "?TIME?";
     SERVER_SEND(NSAT, ON) | \
     SERVER_SEND(BATT, OFF) | \
     SERVER_SEND(IGN, OFF) | \
-    SERVER_SEND(RUNTIME, OFF)
+    SERVER_SEND(RUNTIME, OFF) | \
+    SERVER_SEND(TRANSPORT, HTTP)
 
 #define HOSTNAME "updates.geolink.io"
-#define PROTO "TCP"
-#define HTTP_PORT "80"
+#define SERVER_HTTP_PORT "80"   // port for the http transport
+#define SERVER_TCP_PORT "80"    // port for the tcp transport
+#define SERVER_UDP_PORT "80"    // port for the udp transport
+#define SERVER_MQTT_PORT "1883" // port for the mqtt transport
 #define URL "/index.php"
 
 const char HTTP_HEADER1[] =
-    "POST /index.php  HTTP/1.0\r\nHost: updates.geolink.io\r\nContent-type: application/x-www-form-urlencoded\r\nContent-length:"; //HTTP header line before length
+    "POST /index.php HTTP/1.1\r\nHost: updates.geolink.io\r\nContent-type: application/x-www-form-urlencoded\r\nContent-length:"; //HTTP header line before length
 const char HTTP_HEADER2[] =
-    "\r\nUser-Agent:OpenTracker3.0\r\nConnection: close\r\n\r\n"; //HTTP header line after length
+    "\r\nUser-Agent:OpenTracker3.0\r\nConnection: keep-alive\r\n\r\n"; //HTTP header line after length
+/**
+ * A batch of records is sent in a single POST body as
+ * imei=<imei>&key=<key>&d=<record>#<record>#...#eof
+ * and the server acknowledges the whole batch by replying with "eof" in
+ * the response body
+ */
+#define SERVER_RECORD_SEPARATOR "#"
+#define SERVER_BATCH_END "eof"
+#define SERVER_TEXT_MAX_RECORDS 10  // records per POST
+#define SERVER_ACK_TIMEOUT SECS(20) // how long we wait for the batch ack
+/**
+ * Binary server batch format, sent by the tcp transport over a raw TCP
+ * session and by the udp transport as one datagram. The server acks each
+ * batch with SERVER_BATCH_END:
+ *   batch:   'O' 'T' <version> <payload length, 2 bytes LSB first> <payload>
+ *   payload: [<sequence>] <imei length> <imei> <key length> <key>
+ *            <field mask> <record count> <record>...
+ *   record:  <flags> <captureTime> <field>...
+ * All values after the length are varints (7 bits per byte, least
+ * significant first, top bit set on all but the last byte). The field mask
+ * holds the server_send_flags data field bits and each record carries the
+ * fields present in the mask (GPS fields only if flags has
+ * SERVER_RECORD_GPS_VALID), in bit order, except IGN which is a flag.
+ * captureTime and fields are sent as zig-zag coded deltas from the same
+ * value in the previous record of the batch (from 0 for the first).
+ * Field units: date days since 2000, time 100ths of a sec since midnight,
+ * lat/lon 1e-7 degrees, speed cm/s, alt cm, heading 100ths of a degree,
+ * battery mV and captureTime secs since 2000.
+ * Datagram batches are SERVER_BINARY_VERSION_SEQ and carry a sequence
+ * number (1..SERVER_UDP_MAX_SEQUENCE), which the server acks as
+ * SERVER_BATCH_END ' ' <sequence in decimal>, e.g. "eof 42". A resent
+ * datagram keeps its sequence number so the server can drop duplicates.
+ */
+#define SERVER_BINARY_MAGIC1 'O'
+#define SERVER_BINARY_MAGIC2 'T'
+#define SERVER_BINARY_VERSION 1
+#define SERVER_BINARY_VERSION_SEQ 2
+#define SERVER_BINARY_HEADER_LEN 5
+#define SERVER_BINARY_MAX_RECORDS 127   // so the count fits in one byte
+// so a batch of records as long as they can be fits in one PACKET_SIZE
+// datagram
+#define SERVER_UDP_MAX_RECORDS 20
+#define SERVER_UDP_MAX_SEQUENCE 0xFFFF
+#define SERVER_UDP_ACK_TIMEOUT SECS(5) // how long we wait for each ack
+#define SERVER_UDP_RETRANSMITS 3    // resends of a datagram not acked
+/**
+ * The mqtt transport publishes batches to MQTT_TOPIC_PREFIX <imei>
+ * MQTT_DATA_TOPIC and takes SMS style commands e.g. "#<sms key>,fint=60"
+ * from MQTT_TOPIC_PREFIX <imei> MQTT_COMMAND_TOPIC
+ */
+#define MQTT_TOPIC_PREFIX "opentracker/"
+#define MQTT_DATA_TOPIC "/data"
+#define MQTT_COMMAND_TOPIC "/cmd"
+#define MQTT_KEEPALIVE 300          // secs, we ping when idle for half this
+#define MQTT_RX_BUFFER_SIZE 256     // longest packet we can receive
+// flags, captureTime and every field as the longest (5 byte) varints
+#define SERVER_BINARY_MAX_RECORD_LEN (1 + 5 * (SERVER_SEND_FIELD_COUNT + 1))
+#define SERVER_RECORD_GPS_VALID 0x01
+#define SERVER_RECORD_IGN_ON 0x02
+
+/**
+ * Size of the GPS receive ring buffer which the USART PDC writes into. The
+ * PDC fills one half whilst we consume the other, so gpsCheck() must run at
+ * least once every GPS_RX_BUFFER_SIZE/2 bytes (~0.5s at 9600 baud).
+ */
+#define GPS_RX_BUFFER_SIZE 1024
 
 #define PACKET_SIZE 1400    //TCP data chunk size, modem accept max 1460 bytes per send
-#define PACKET_SIZE_DELIVERY 3000    //in case modem has this number of bytes undelivered, wait till sending new data (3000 bytes default, max sending TCP buffer is 7300)
+/**
+ * TCP send flow control. We keep sending whilst the data the server has
+ * not yet acknowledged (AT+QISACK) fits in the window, which is the
+ * modem's TCP send buffer, and back off exponentially whilst it is full.
+ */
+#define TCP_SEND_WINDOW 7300        // max bytes in flight
+#define TCP_BACKOFF_MIN 50          // first wait (ms) for the window to open
+#define TCP_BACKOFF_MAX SECS(2)     // longest wait between AT+QISACK checks
+#define TCP_WINDOW_TIMEOUT SECS(60) // give up if the window stays full
 
 #define CONNECT_RETRY 5    //how many time to retry connecting to remote server
 
+/**
+ * Number of decimal places held in the fixed point GPSDATA_T values
+ */
+#define GPS_LATLON_DIGITS 7 // lat/lon in 1e-7 degrees
+#define GPS_CENTI_DIGITS 2  // alt in cm, course in 100ths of a degree
 /**
  * Definition of data collected from each gps update
  */
 typedef struct GPSDATA_S {
 	unsigned long fixAge;  // age of this fix in ms or TinyGPS::GPS_INVALID_AGE
-    float lat;              // latitude
-    float lon;              // longitude
-    float alt;              // altitude in meters (+/-)
-    float course;           // course/direction in degrees
-    float speed;            // speed in km/h
+    long lat;              // latitude in 1e-7 degrees
+    long lon;              // longitude in 1e-7 degrees
+    long alt;              // altitude in cm (+/-)
+    unsigned long course;  // course/direction in 100ths of a degree
+    unsigned long speed;   // speed in cm/s
     unsigned long hdop;    // horizontal dilution of precision in 100ths
     unsigned long time;    // GPS time
     unsigned long date;    // GPS date
@@ -178,7 +287,60 @@ typedef struct SERVER_DATA_S {
     GPSDATA_T gpsData;  //!< The actual gps data
     bool ignState;     //!< State of the ignition switch
     unsigned long engineRuntime; //<! How long engine has been running
+    unsigned long captureTime; //!< When captured, secs since 2000 UTC
 } SERVER_DATA_T;
+/**
+ * Most track points trackAddPoint() emits for one sample: the held point
+ * ending the previous segment plus the sample itself
+ */
+#define TRACK_MAX_EMIT 2
+/**
+ * Min speed, in cm/s, at which the GPS course is trusted for the track
+ * heading tolerance test
+ */
+#define TRACK_MIN_HEADING_SPEED 300
+/**
+ * Motion states, see motion.ino
+ */
+typedef enum MOTION_STATE_E {
+    MOTION_MOVING = 0,      // Reporting at the fast server interval
+    MOTION_STOPPING = 1,    // Stopped, waiting out the dwell time
+    MOTION_PARKED = 2       // Only sending heartbeats
+} MOTION_STATE_T;
+/**
+ * Motion detection thresholds. Speeds have hysteresis so we do not flap
+ * between states, and a fix only counts as displaced if it is further from
+ * where we stopped than MOTION_RADIUS plus the GPS error the two fixes' HDOP
+ * allows for.
+ */
+#define MOTION_START_SPEED 300  // speed, in cm/s, at which we are moving
+#define MOTION_STOP_SPEED 100   // speed, in cm/s, below which we are stopping
+#define MOTION_START_FIXES 3    // consecutive moving fixes needed to move off
+#define MOTION_RADIUS 20        // displacement, in m, always put down to wander
+#define MOTION_UERE 5           // GPS error, in m, for each unit of HDOP
+#define MOTION_MAX_HDOP 2000    // HDOP, in 100ths, used for worse or no HDOP
+#define MOTION_DWELL MINS(5)    // stopped time before we park, ignition on
+#define MOTION_DWELL_IGN_OFF MINS(1) // stopped time before we park, ignition off
+/**
+ * What triggered a server update, see policy.ino
+ */
+typedef enum POLICY_TRIGGER_E {
+    POLICY_TRIGGER_NONE = 0,
+    POLICY_TRIGGER_TIME = 1,     // server update period elapsed
+    POLICY_TRIGGER_DISTANCE = 2, // moved config.policy_distance
+    POLICY_TRIGGER_HEADING = 3,  // turned config.policy_heading
+    POLICY_TRIGGER_SPEED = 4,    // speed changed by config.policy_speed
+    POLICY_TRIGGER_FULL = 5,     // capture buffer full
+    POLICY_TRIGGER_COUNT = 6
+} POLICY_TRIGGER_T;
+/**
+ * Number of records the capture buffer holds, see capture.ino
+ */
+#define CAPTURE_BUFFER_SIZE 64
+/**
+ * Device clock time value used when the time is not known
+ */
+#define CLOCK_INVALID_TIME 0
 /**
  * Time spec setting:
  *
@@ -258,6 +420,13 @@ typedef struct SETTINGS_S {
     unsigned long sms_send_flags; // Bit set of what data to send in SMS message
     TIMESPEC reboot_interval; // How often (in mins) to reboot the system
     TIMESPEC sms_quiet_period; // Do not send any SMS messages during this period
+    unsigned short track_tolerance; // track simplification tolerance in m
+    unsigned short track_heading_tolerance; // track course tolerance in degrees
+    unsigned short heartbeat_interval; // parked heartbeat interval in mins
+    unsigned short policy_distance; // report distance trigger in m
+    unsigned short policy_heading; // report course change trigger in degrees
+    unsigned short policy_speed; // report speed change trigger in km/h
+    unsigned short capture_interval; // fix capture interval in s, 0 for off
 } SETTINGS_T;
 /**
  * Values for the GSM status
@@ -268,3 +437,16 @@ typedef enum GSMSTATUS_E {
     LIMITED = 2,        // Only a limited sevice available
     NOT_READY = 255     // Not ready to retrieve network status
 } GSMSTATUS_T;
+/**
+ * Max number of received SMS messages we handle per AT+CMGL listing. Any
+ * more are left unread on the SIM and picked up by the next listing.
+ */
+#define SMS_PENDING_MAX 4
+/**
+ * A received SMS message taken from the AT+CMGL listing, waiting to be run
+ */
+typedef struct SMS_PENDING_S {
+    unsigned index;                             //!< SIM storage index
+    char phoneNumber[MAX_PHONE_NUMBER_LEN + 1]; //!< Sender
+    char message[MAX_SMS_MSG_LEN + 1];          //!< Message text
+} SMS_PENDING_T;
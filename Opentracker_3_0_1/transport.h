@@ -0,0 +1,108 @@
+/**
+ * Statistics kept by each server transport, so transports can be compared
+ * on bytes per record and delivery latency
+ */
+typedef struct TRANSPORT_STATS_S {
+    unsigned long batches;      //!< Batches the server acknowledged
+    unsigned long failures;     //!< Batches the server did not acknowledge
+    unsigned long records;      //!< Records the server acknowledged
+    unsigned long bytes;        //!< Bytes sent, including failed batches
+    unsigned long totalLatency; //!< ms from send to ack, acknowledged batches
+    unsigned long maxLatency;   //!< Longest ms from send to ack
+} TRANSPORT_STATS_T;
+
+/**
+ * Base class for sending batches of server data to the server. To add a
+ * transport, write a protocol policy class for ProtocolTransport (or
+ * subclass this and implement the abstract methods), instantiate it in the
+ * main sketch and add it to serverTransports[].
+ */
+class ServerTransport {
+public:
+    ServerTransport(unsigned id, const char* pName) {
+        this->id = id;
+        this->pName = pName;
+        memset(&this->stats, 0, sizeof(this->stats));
+    }
+    unsigned getId() { return this->id; }
+    const char* getName() { return this->pName; }
+    bool send(SERVER_BATCH_T* pBatch);
+    virtual size_t getMaxRecords()=0;
+    void report();
+protected:
+    virtual bool sendBatch(SERVER_BATCH_T* pBatch)=0;
+private:
+    /**
+     * The SERVER_SEND_TRANSPORT_xxx value which selects this transport
+     */
+    unsigned id;
+    const char* pName;
+    TRANSPORT_STATS_T stats;
+};
+
+/**
+ * Transport which sends batches as described by a protocol policy class.
+ * The policy class has no state, just static members:
+ *   ID             the SERVER_SEND_TRANSPORT_xxx value
+ *   name()         the transport name
+ *   maxRecords()   the most records sent in one batch
+ *   sendBatch()    sends a batch and waits for the server ack
+ * Only the protocols a transport is instantiated for are compiled in.
+ */
+template <class PROTOCOL>
+class ProtocolTransport : public ServerTransport {
+public:
+    ProtocolTransport() : ServerTransport(PROTOCOL::ID, PROTOCOL::name()) {
+    }
+    virtual size_t getMaxRecords() { return PROTOCOL::maxRecords(); }
+protected:
+    virtual bool sendBatch(SERVER_BATCH_T* pBatch) {
+        return PROTOCOL::sendBatch(pBatch);
+    }
+};
+
+/**
+ * Text batches (see formServerUpdateMessage()) as HTTP POSTs
+ */
+class HttpProtocol {
+public:
+    static const unsigned ID = SERVER_SEND_TRANSPORT_HTTP;
+    static const char* name() { return "http"; }
+    static size_t maxRecords() { return SERVER_TEXT_MAX_RECORDS; }
+    static bool sendBatch(SERVER_BATCH_T* pBatch);
+};
+
+/**
+ * Binary batches (see formServerBinaryBatch()) over a raw TCP session
+ */
+class TcpProtocol {
+public:
+    static const unsigned ID = SERVER_SEND_TRANSPORT_TCP;
+    static const char* name() { return "tcp"; }
+    static size_t maxRecords() { return SERVER_BINARY_MAX_RECORDS; }
+    static bool sendBatch(SERVER_BATCH_T* pBatch);
+};
+
+/**
+ * Binary batches (see formServerBinaryBatch()), each as one sequence
+ * numbered UDP datagram which is resent until the server acks it
+ */
+class UdpProtocol {
+public:
+    static const unsigned ID = SERVER_SEND_TRANSPORT_UDP;
+    static const char* name() { return "udp"; }
+    static size_t maxRecords() { return SERVER_UDP_MAX_RECORDS; }
+    static bool sendBatch(SERVER_BATCH_T* pBatch);
+};
+
+/**
+ * Binary batches (see formServerBinaryBatch()) published with QoS 1 to an
+ * MQTT broker, see mqtt.ino
+ */
+class MqttProtocol {
+public:
+    static const unsigned ID = SERVER_SEND_TRANSPORT_MQTT;
+    static const char* name() { return "mqtt"; }
+    static size_t maxRecords() { return SERVER_BINARY_MAX_RECORDS; }
+    static bool sendBatch(SERVER_BATCH_T* pBatch);
+};
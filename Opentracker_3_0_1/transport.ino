@@ -0,0 +1,74 @@
+/**
+ * Sends a batch to the server, keeping the transport statistics
+ * @param pBatch the records to send
+ * @return true if the server acknowledged the batch, false if not
+ */
+bool ServerTransport::send(
+    SERVER_BATCH_T* pBatch
+) {
+    unsigned long tStart = millis();
+    unsigned long bytesStart = gsmDataBytesSent;
+    bool sentOK = this->sendBatch(pBatch);
+    unsigned long latency = timeDiff(millis(), tStart);
+    this->stats.bytes += gsmDataBytesSent - bytesStart;
+    if (sentOK) {
+        this->stats.batches += 1;
+        this->stats.records += pBatch->count;
+        this->stats.totalLatency += latency;
+        this->stats.maxLatency = MAX(this->stats.maxLatency, latency);
+    } else {
+        this->stats.failures += 1;
+    }
+    return sentOK;
+}
+
+/**
+ * Reports the transport statistics
+ */
+void ServerTransport::report() {
+    debug_print(F("transport "));
+    debug_print(this->pName);
+    debug_print(F(": batches="));
+    debug_print(this->stats.batches);
+    debug_print(F(" failed="));
+    debug_print(this->stats.failures);
+    debug_print(F(" records="));
+    debug_print(this->stats.records);
+    debug_print(F(" bytes="));
+    debug_print(this->stats.bytes);
+    debug_print(F(" bytes/record="));
+    debug_print(this->stats.records ?
+                this->stats.bytes / this->stats.records : 0);
+    debug_print(F(" latency ms avg="));
+    debug_print(this->stats.batches ?
+                this->stats.totalLatency / this->stats.batches : 0);
+    debug_print(F(" max="));
+    debug_println(this->stats.maxLatency);
+}
+
+bool HttpProtocol::sendBatch(
+    SERVER_BATCH_T* pBatch
+) {
+    return gsmSendServerTransaction("TCP", SERVER_HTTP_PORT,
+        gsmSendServerBatch, pBatch, parse_receive_reply);
+}
+
+bool TcpProtocol::sendBatch(
+    SERVER_BATCH_T* pBatch
+) {
+    return gsmSendServerTransaction("TCP", SERVER_TCP_PORT,
+        gsmSendServerBinaryBatch, pBatch, parse_receive_ack);
+}
+
+bool UdpProtocol::sendBatch(
+    SERVER_BATCH_T* pBatch
+) {
+    return gsmSendServerDatagram(SERVER_UDP_PORT, pBatch);
+}
+
+bool MqttProtocol::sendBatch(
+    SERVER_BATCH_T* pBatch
+) {
+    return gsmSendServerTransaction("TCP", SERVER_MQTT_PORT,
+        mqttSendBatch, pBatch, mqttReceivePuback);
+}
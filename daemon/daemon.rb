@@ -11,9 +11,32 @@ require 'uri'
 
 load './daemon_config.rb'
 
+# Binary batch format sent by the tracker when its server proto setting is
+# 'tcp', or as sequence numbered datagrams when it is 'udp' (see
+# SERVER_BINARY_VERSION and SERVER_BINARY_VERSION_SEQ in tracker.h)
+BINARY_MAGIC = "OT"
+BINARY_VERSION = 1
+BINARY_VERSION_SEQ = 2
+BINARY_HEADER_LEN = 5
+BINARY_ACK = "eof"
+# server_send_flags data field bit positions, in the order fields are sent
+BINARY_FIELDS = ['gps_date', 'gps_time', 'latitude', 'longitude', 'speed',
+                 'altitude', 'heading', 'hdop', 'satellites',
+                 'battery_level', 'ignition_state', 'running_time']
+BINARY_GPS_FIELDS = 9       # fields before battery_level are GPS fields
+BINARY_IGN_FIELD = 10       # ignition state is sent in the record flags
+BINARY_RECORD_GPS_VALID = 0x01
+BINARY_RECORD_IGN_ON = 0x02
+BINARY_EPOCH = Time.utc(2000, 1, 1)
+
 class OpenTrackerDaemon
     def initialize
         @server = TCPServer.new($server, $port)
+        @udp = UDPSocket.new
+        @udp.bind($server, $udp_port)
+        # imei => { sequence => Time logged } for the datagram batches
+        # logged in the last $udp_duplicate_window secs
+        @udp_logged = {}
 
         Process::Sys.setuid $user
         Process::Sys.seteuid $group
@@ -38,16 +61,26 @@ class OpenTrackerDaemon
     end
 
     def start_server
+        Thread.start { serve_udp }
+
         while (session = @server.accept)
             unless session.peeraddr.nil?
-                Thread.start do
-                    input = session.gets
-
-                    $show_received and puts "#{input}"
+                # Each thread has its own session, the next accept
+                # reassigns this one
+                Thread.start(session) do |session|
+                    input = session.read(BINARY_MAGIC.length)
 
                     load './daemon_config.rb'
 
-                    handle_request input, session.peeraddr[2]
+                    if input == BINARY_MAGIC
+                        handle_binary_session session, session.peeraddr[2]
+                    else
+                        input = input.to_s + session.gets.to_s
+
+                        $show_received and puts "#{input}"
+
+                        handle_request input, session.peeraddr[2]
+                    end
 
                     session.close
                 end
@@ -178,6 +211,187 @@ class OpenTrackerDaemon
 
     end
 
+    # Handles binary batches until the tracker closes the session. The
+    # session has already had the magic of the first batch read from it.
+    def handle_binary_session(session, ipaddr)
+        magic = BINARY_MAGIC
+        while magic == BINARY_MAGIC
+            header = session.read(3)
+            break if header.nil? or header.length < 3
+
+            version, length = header.unpack("Cv")
+            payload = session.read(length)
+            break if payload.nil? or payload.length < length
+
+            if version != BINARY_VERSION and version != BINARY_VERSION_SEQ
+                puts "Error: unsupported binary batch version #{version}"
+                break
+            end
+
+            batch = decode_binary_batch(payload, version)
+            batch[:lines].each do |line|
+                $show_received and puts "#{line}"
+                handle_request line, ipaddr
+            end
+            session.write BINARY_ACK
+
+            magic = session.read(BINARY_MAGIC.length)
+        end
+    end
+
+    # Handles binary batches sent as UDP datagrams. Every batch is acked
+    # with its sequence number. If the tracker did not get our ack it sends
+    # the batch again, which is acked again but not logged twice.
+    def serve_udp
+        loop do
+            datagram, addr = @udp.recvfrom(65535)
+            ipaddr = addr[3]
+            begin
+                load './daemon_config.rb'
+
+                magic, version, length = datagram.unpack("a2Cv")
+                payload = datagram[BINARY_HEADER_LEN, length.to_i]
+                if magic != BINARY_MAGIC or version != BINARY_VERSION_SEQ or
+                        payload.nil? or payload.length < length
+                    $debug and puts "Error: bad datagram from #{ipaddr}"
+                    next
+                end
+
+                batch = decode_binary_batch(payload, version)
+                if udp_logged?(batch[:imei], batch[:sequence])
+                    $debug and puts "duplicate batch #{batch[:imei]} sequence #{batch[:sequence]}"
+                else
+                    batch[:lines].each do |line|
+                        $show_received and puts "#{line}"
+                        handle_request line, ipaddr
+                    end
+                    @udp_logged[batch[:imei]][batch[:sequence]] = Time.now
+                end
+                @udp.send "#{BINARY_ACK} #{batch[:sequence]}", 0, ipaddr, addr[1]
+            rescue => e
+                puts "Error: datagram from #{ipaddr}: #{e.message}"
+            end
+        end
+    end
+
+    # Checks if a datagram batch has already been logged, forgetting the
+    # batches logged too long ago to be resent
+    def udp_logged?(imei, sequence)
+        now = Time.now
+        logged = (@udp_logged[imei] ||= {})
+        logged.delete_if { |seq, time| now - time > $udp_duplicate_window }
+        logged.key? sequence
+    end
+
+    # Decodes a binary batch payload into its sequence number (nil unless
+    # version is BINARY_VERSION_SEQ), imei and the same text lines which
+    # handle_request accepts, one for each record
+    def decode_binary_batch(payload, version)
+        bytes = payload.unpack("C*")
+        pos = 0
+
+        read_varint = lambda do
+            value = 0
+            shift = 0
+            loop do
+                byte = bytes[pos]
+                raise "binary batch truncated" if byte.nil?
+                pos += 1
+                value |= (byte & 0x7f) << shift
+                shift += 7
+                break if byte < 0x80
+            end
+            value
+        end
+        read_string = lambda do
+            len = read_varint.call
+            str = bytes[pos, len].pack("C*")
+            pos += len
+            str
+        end
+
+        sequence = (version == BINARY_VERSION_SEQ) ? read_varint.call : nil
+        imei = read_string.call
+        key = read_string.call
+        mask = read_varint.call
+        count = read_varint.call
+
+        $debug and puts "binary batch imei #{imei} sequence #{sequence} mask #{mask} records #{count}"
+
+        lines = []
+        prev = Array.new(BINARY_FIELDS.length + 1, 0)
+        count.times do
+            flags = read_varint.call
+            values = {}
+            fields = BINARY_FIELDS.length.times.select do |field|
+                mask[field] == 1 and field != BINARY_IGN_FIELD and
+                    (flags & BINARY_RECORD_GPS_VALID != 0 or field >= BINARY_GPS_FIELDS)
+            end
+            [BINARY_FIELDS.length].concat(fields).each do |field|
+                zz = read_varint.call
+                # The tracker sums the deltas in a 32-bit long, so they wrap
+                # e.g. where the longitude crosses 180 degrees
+                value = (prev[field] + ((zz >> 1) ^ -(zz & 1))) & 0xFFFFFFFF
+                prev[field] = (value >= 0x80000000) ? value - 0x100000000 : value
+            end
+            fields.each { |field| values[BINARY_FIELDS[field]] = prev[field] }
+            capture_time = BINARY_EPOCH + prev[BINARY_FIELDS.length]
+            if mask[BINARY_IGN_FIELD] == 1
+                values['ignition_state'] = (flags & BINARY_RECORD_IGN_ON != 0) ? 1 : 0
+            end
+
+            if flags & BINARY_RECORD_GPS_VALID == 0
+                # A parked tracker sends records without a position as a
+                # heartbeat, there is nothing to log for them
+                $debug and puts "binary batch heartbeat #{imei} at #{capture_time}"
+                next
+            end
+
+            line = binary_record_line(key, capture_time, values)
+            if line
+                lines.push line
+            else
+                $debug and puts "binary record missing configured fields: #{values.inspect}"
+            end
+        end
+        { :sequence => sequence, :imei => imei, :lines => lines }
+    end
+
+    # Forms the text line for a decoded binary record, or nil if the record
+    # is missing a configured attribute
+    def binary_record_line(key, capture_time, values)
+        segments = []
+        @attributes.each do |attribute|
+            case attribute
+            when 'key'
+                segments.push key
+            when 'timestamp'
+                segments.push capture_time.strftime("%y/%m/%d,%H:%M:%S")
+            else
+                value = values[attribute]
+                return nil if value.nil?
+                case attribute
+                when 'gps_date'
+                    segments.push (BINARY_EPOCH + value * 86400).strftime("%d%m%y")
+                when 'gps_time'
+                    secs, cs = value.divmod(100)
+                    segments.push sprintf("%d%02d%02d%02d", secs / 3600, (secs / 60) % 60, secs % 60, cs)
+                when 'latitude', 'longitude'
+                    segments.push sprintf("%.6f", value / 1e7)
+                when 'speed'
+                    segments.push sprintf("%.2f", value * 0.036)
+                when 'altitude', 'heading'
+                    segments.push sprintf("%.2f", value / 100.0)
+                when 'battery_level'
+                    segments.push sprintf("%.2f", value / 1000.0)
+                else
+                    segments.push value.to_s
+                end
+            end
+        end
+        segments.join(",")
+    end
+
     def query(con, sql)
         res = con.query(sql)
 
@@ -0,0 +1,425 @@
+/**
+ * Replays modem transcripts through the AT command engine (atcmd.ino), and
+ * through the reply handling it replaced (gsm_get_reply() and
+ * gsm_is_final_result(), copied below from gsm.ino as they were), and
+ * reports the time taken per command and per received byte on the host,
+ * and the replies each got wrong.
+ *
+ * Usage: bench_atcmd [transcript ...]
+ * With no files data/m95_session.txt is replayed. See that file for the
+ * transcript format.
+ */
+#include <vector>
+#include "sketch.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_TICKS() __rdtsc()
+#else
+#define BENCH_TICKS() 0
+#endif
+
+char modem_reply[1024];
+bool modemLogging = false;
+
+void modemWaitIdle() {
+    delay(1);
+}
+
+#include "atcmd.ino"
+
+#define BENCH_PASSES 2000
+
+/**
+ * A command and the modem's reply
+ */
+typedef struct {
+    std::string command;
+    std::string payload;            // sent at the "> " prompt, if any
+    std::string reply;              // everything received until the next
+    bool allowOK;
+} EXCHANGE_T;
+
+/**
+ * Reads a transcript
+ * @return false if the file could not be read
+ */
+static bool read_transcript(
+    const char* pFileName,
+    std::vector<EXCHANGE_T>* pExchanges
+) {
+    FILE* pFile = fopen(pFileName, "r");
+    if (pFile == NULL) {
+        perror(pFileName);
+        return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), pFile) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if ((strncmp(line, "TX: ", 4) != 0) &&
+            (strncmp(line, "RX: ", 4) != 0)) {
+            continue;
+        }
+        std::string data;
+        for (const char* p = line + 4; *p != '\0'; ++p) {
+            if ((p[0] == '\\') && (p[1] == 'r')) {
+                data += '\r';
+                ++p;
+            } else if ((p[0] == '\\') && (p[1] == 'n')) {
+                data += '\n';
+                ++p;
+            } else if ((p[0] == '\\') && (p[1] == 'x') && isxdigit(p[2]) &&
+                       isxdigit(p[3])) {
+                char hex[3] = { p[2], p[3], '\0' };
+                data += (char)strtoul(hex, NULL, 16);
+                p += 3;
+            } else {
+                data += *p;
+            }
+        }
+        if (line[0] == 'R') {
+            if (!pExchanges->empty()) {
+                pExchanges->back().reply += data;
+            }
+        } else if (!data.empty() && (data[data.size() - 1] == '\r')) {
+            EXCHANGE_T exchange;
+            exchange.command = data.substr(0, data.size() - 1);
+            // As gsm.ino sends them, these have an "OK" before the result
+            exchange.allowOK =
+                (exchange.command.compare(0, 9, "AT+QIOPEN") != 0) &&
+                (exchange.command.compare(0, 10, "AT+QIDEACT") != 0);
+            pExchanges->push_back(exchange);
+        } else if (!pExchanges->empty()) {
+            pExchanges->back().payload = data;
+        }
+    }
+    fclose(pFile);
+    return true;
+}
+
+/**
+ * The SMS text follows each "+CMGL:" line, as for sms_read_line()
+ */
+static unsigned sms_lines(
+    const char* pLine
+) {
+    return (strncmp(pLine, "+CMGL:", 6) == 0) ? 1 : 0;
+}
+
+static const std::string* pPendingReply = NULL;
+
+/**
+ * Plays the modem: the reply arrives once the command has been written
+ */
+static void modem_respond(
+    Stream* pPort
+) {
+    if (pPendingReply != NULL) {
+        pPort->rx = *pPendingReply;
+        pPort->rxPos = 0;
+        pPendingReply = NULL;
+    }
+}
+
+static unsigned long urcCount = 0;
+
+static void count_urc(
+    const char* /* pLine */
+) {
+    urcCount += 1;
+}
+
+/**
+ * Runs an exchange through the AT command engine
+ * @return true if the whole reply was read and the command completed OK
+ */
+static bool run_engine(
+    const EXCHANGE_T* pExchange
+) {
+    pPendingReply = &pExchange->reply;
+    bool isList = (pExchange->command.compare(0, 7, "AT+CMGL") == 0);
+    unsigned long id = atQueueCommand(pExchange->command.c_str(),
+        pExchange->allowOK, 1000,
+        pExchange->payload.empty() ? NULL : pExchange->payload.data(),
+        pExchange->payload.size(), isList ? sms_lines : NULL, NULL);
+    while (atDoneId != id) {
+        atService();
+        if ((atDoneId != id) && (Serial2.available() == 0)) {
+            // Waiting for more of the reply, so a reply the engine gets
+            // wrong times out
+            delay(1);
+        }
+    }
+    return (atDoneResult == AT_RESULT_OK) && (Serial2.available() == 0);
+}
+
+//
+// The reply handling before the AT command engine, from gsm.ino
+//
+
+bool gsm_modem_reply_ends_with(const char* pText) {
+    bool rCode = false;
+    size_t reply_len = strlen(modem_reply);
+    if (reply_len >= strlen(pText)) {
+        if (strcmp(modem_reply + reply_len - 6, pText) == 0) {
+            rCode = true;
+        }
+    }
+    return rCode;
+}
+
+bool gsm_modem_reply_matches(size_t offset, const char* pMatch) {
+    bool rCode = false;
+    size_t reply_len = strlen(modem_reply);
+    size_t match_len = strlen(pMatch);
+    if (reply_len >= offset + match_len) {
+        if (strncmp(modem_reply + offset, pMatch, match_len) == 0) {
+            rCode = true;
+        }
+    }
+    return rCode;
+}
+
+size_t locate_last_line() {
+    size_t pos = 0;
+    size_t len = strlen(modem_reply);
+    if (len > 1) {
+        pos = len - 1;
+        if (modem_reply[pos] == '\n') {
+            pos -= 1;
+        }
+        while (pos > 0) {
+            if (modem_reply[pos] == '\n') {
+                ++pos;
+                break;
+            }
+            pos -= 1;
+        }
+    }
+    return pos;
+}
+
+bool gsm_is_final_result(bool allowOK) {
+    if (allowOK && gsm_modem_reply_ends_with("\r\nOK\r\n")) {
+        return true;
+    }
+    size_t last_line_index = locate_last_line();
+    switch (modem_reply[last_line_index]) {
+    case '+':
+        if (gsm_modem_reply_matches(last_line_index + 1, "CME ERROR:")) {
+            return true;
+        }
+        if (gsm_modem_reply_matches(last_line_index + 1, "CMS ERROR:")) {
+            return true;
+        }
+        if (gsm_modem_reply_matches(last_line_index + 1, "CPIN:")) {
+            return true;
+        }
+        return false;
+    case '>':
+        return gsm_modem_reply_matches(last_line_index + 1, " ");
+    case 'B':
+        return gsm_modem_reply_matches(last_line_index + 1, "USY\r\n");
+    case 'A':
+        return gsm_modem_reply_matches(last_line_index + 1,
+                                       "LREADY CONNECT\r\n");
+    case 'C':
+        if (gsm_modem_reply_matches(last_line_index + 1, "LOSE OK\r\n")) {
+            return true;
+        }
+        if (gsm_modem_reply_matches(last_line_index + 1, "ONNECT OK\r\n")) {
+            return true;
+        }
+        if (gsm_modem_reply_matches(last_line_index + 1, "ONNECT FAIL\r\n")) {
+            return true;
+        }
+        if (gsm_modem_reply_matches(last_line_index + 1, "all Ready\r\n")) {
+            return true;
+        }
+        return false;
+    case 'D':
+        return gsm_modem_reply_matches(last_line_index + 1, "EACT OK\r\n");
+    case 'E':
+        return gsm_modem_reply_matches(last_line_index + 1, "RROR\r\n");
+    case 'N':
+        if (gsm_modem_reply_matches(last_line_index + 1, "O ANSWER\r\n")) {
+            return true;
+        }
+        if (gsm_modem_reply_matches(last_line_index + 1, "O CARRIER\r\n")) {
+            return true;
+        }
+        if (gsm_modem_reply_matches(last_line_index + 1, "O DIALTONE\r\n")) {
+            return true;
+        }
+        return false;
+    case 'O':
+        if (allowOK && gsm_modem_reply_matches(last_line_index + 1, "K\r\n")) {
+            return true;
+        }
+        return false;
+    case 'S':
+        if (gsm_modem_reply_matches(last_line_index + 1, "END ")) {
+            return true;
+        }
+        /* fall through */
+    default:
+        return false;
+    }
+}
+
+void gsm_get_reply() {
+    //get reply from the modem
+    size_t index = strlen(modem_reply);
+    while (gsm_port.available()) {
+        char inChar = gsm_port.read(); // Read a character
+        if (index == sizeof(modem_reply) - 1) {
+            break;
+        }
+        modem_reply[index++] = inChar; // Store it
+        if (inChar == '\n') {
+            break;
+        }
+    }
+    modem_reply[index] = '\0'; // Null terminate the string
+}
+
+/**
+ * gsmWaitForReply() as it was, without the timeout as all the reply is
+ * already received
+ * @return false if the reply filled modem_reply[] without a final result
+ */
+static bool old_wait_for_reply(
+    bool allowOK
+) {
+    modem_reply[0] = '\0';
+    gsm_get_reply();
+    while (!gsm_is_final_result(allowOK)) {
+        if (!gsm_port.available()) {
+            return false;
+        }
+        gsm_get_reply();
+    }
+    return true;
+}
+
+/**
+ * Runs an exchange through the old reply handling
+ * @return true if the whole reply was read and ended in a final result
+ */
+static bool run_old(
+    const EXCHANGE_T* pExchange
+) {
+    pPendingReply = &pExchange->reply;
+    gsm_port.print(pExchange->command.c_str());
+    gsm_port.print("\r");
+    bool rStat = old_wait_for_reply(pExchange->allowOK);
+    if (rStat && !pExchange->payload.empty()) {
+        gsm_port.write((const uint8_t*)pExchange->payload.data(),
+                       pExchange->payload.size());
+        rStat = old_wait_for_reply(pExchange->allowOK);
+    }
+    return rStat && (Serial2.available() == 0);
+}
+
+/**
+ * Times replaying the exchanges
+ */
+static void replay(
+    const char* pName,
+    const std::vector<EXCHANGE_T>& exchanges,
+    bool (*runFn)(const EXCHANGE_T* pExchange)
+) {
+    size_t bytes = 0;
+    for (size_t idx = 0; idx < exchanges.size(); ++idx) {
+        bytes += exchanges[idx].reply.size();
+    }
+    size_t wrong = 0;
+    uint64_t ns = hostNanos();
+    uint64_t ticks = BENCH_TICKS();
+    for (unsigned pass = 0; pass < BENCH_PASSES; ++pass) {
+        for (size_t idx = 0; idx < exchanges.size(); ++idx) {
+            bool ok = runFn(&exchanges[idx]);
+            if ((pass == 0) && !ok) {
+                if (wrong++ == 0) {
+                    printf("  %s got wrong:", pName);
+                }
+                printf(" %s", exchanges[idx].command.c_str());
+            }
+        }
+    }
+    ns = hostNanos() - ns;
+    ticks = BENCH_TICKS() - ticks;
+    if (wrong != 0) {
+        printf("\n");
+    }
+    double count = (double)BENCH_PASSES * exchanges.size();
+    printf("  %-12s %8.1f ns %9.1f ticks per command, %6.1f ns per byte, "
+           "%zu/%zu replies wrong\n", pName, ns / count, ticks / count,
+           ns / ((double)BENCH_PASSES * bytes), wrong, exchanges.size());
+}
+
+/**
+ * Times AT+CMGL replies listing more and more messages
+ */
+static void replay_long_replies() {
+    static const char* HEADER =
+        "+CMGL: 1,\"REC UNREAD\",\"+447700900123\",\"\",\"17/09/26,10:01:12+04\"\r\n";
+    static const char* TEXT = "#imei:861234567890123#key:abcdefghijkl#status\r\n";
+    EXCHANGE_T exchange;
+    exchange.command = "AT+CMGL=\"ALL\"";
+    exchange.allowOK = true;
+    for (unsigned messages = 1; messages <= 32; messages *= 2) {
+        exchange.reply = exchange.command + "\r\r\n";
+        for (unsigned n = 0; n < messages; ++n) {
+            exchange.reply += HEADER;
+            exchange.reply += TEXT;
+        }
+        exchange.reply += "\r\nOK\r\n";
+        bool engineOK = true;
+        uint64_t engineNs = hostNanos();
+        for (unsigned pass = 0; pass < BENCH_PASSES; ++pass) {
+            engineOK = run_engine(&exchange) && engineOK;
+        }
+        engineNs = hostNanos() - engineNs;
+        bool oldOK = true;
+        uint64_t oldNs = hostNanos();
+        for (unsigned pass = 0; pass < BENCH_PASSES; ++pass) {
+            oldOK = run_old(&exchange) && oldOK;
+        }
+        oldNs = hostNanos() - oldNs;
+        printf("  %2u messages, %4zu bytes: engine %5.1f ns per byte%s, "
+               "before %5.1f ns per byte%s\n", messages, exchange.reply.size(),
+               (double)engineNs / BENCH_PASSES / exchange.reply.size(),
+               engineOK ? "" : " (wrong)",
+               (double)oldNs / BENCH_PASSES / exchange.reply.size(),
+               oldOK ? "" : " (wrong)");
+    }
+}
+
+int main(
+    int argc,
+    char* argv[]
+) {
+    Serial2.capture = false;
+    Serial2.onWrite = modem_respond;
+    atRegisterURC("+CMTI:", count_urc);
+    static const char* DEFAULT_FILES[] = { "data/m95_session.txt" };
+    const char** pFiles = (argc > 1) ? (const char**)argv + 1 : DEFAULT_FILES;
+    int fileCount = (argc > 1) ? argc - 1 : 1;
+    for (int file = 0; file < fileCount; ++file) {
+        std::vector<EXCHANGE_T> exchanges;
+        if (!read_transcript(pFiles[file], &exchanges)) {
+            return 1;
+        }
+        size_t bytes = 0;
+        for (size_t idx = 0; idx < exchanges.size(); ++idx) {
+            bytes += exchanges[idx].reply.size();
+        }
+        printf("%s: %zu commands, %zu bytes received\n", pFiles[file],
+               exchanges.size(), bytes);
+        replay("engine", exchanges, run_engine);
+        replay("before", exchanges, run_old);
+    }
+    printf("AT+CMGL replies:\n");
+    replay_long_replies();
+    return 0;
+}
@@ -0,0 +1,179 @@
+/**
+ * Compares the cost of forming a server record, and of the distance check,
+ * with float positions (as before the fixed point change) and with fixed
+ * point positions (formServerUpdateMessage() and gps_distance_between()).
+ * The host has an FPU, which the SAM3X does not, so the float figures here
+ * flatter the old code.
+ */
+#include "sketch.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_TICKS() __rdtsc()
+#else
+#define BENCH_TICKS() 0
+#endif
+
+SETTINGS_T config;
+TinyGPS gps;
+void blink_got_gps() {}
+
+#include "clock.ino"
+#include "gps.ino"
+#include "data.ino"
+
+#define BENCH_RECORDS 200000
+
+/**
+ * GPSDATA_T as it was, with float values
+ */
+typedef struct {
+    unsigned long fixAge;
+    float lat;              // latitude
+    float lon;              // longitude
+    float alt;              // altitude in meters (+/-)
+    float course;           // course/direction in degrees
+    float speed;            // speed in km/h
+    unsigned long hdop;
+    unsigned long time;
+    unsigned long date;
+    unsigned short nsats;
+} FLOAT_GPSDATA_T;
+
+/**
+ * The GPS record fields of formServerUpdateMessage() as they were, printing
+ * the float values with "%1.6f"
+ */
+static size_t form_float_record(
+    const FLOAT_GPSDATA_T* pGPSData,
+    unsigned long captureTime,
+    char* pMsg,
+    size_t msgSize
+) {
+    char* pos = pMsg;
+    char timeStr[22];
+    clockFormatTime(timeStr, DIM(timeStr), captureTime);
+    pos = calc_snprintf_return_pointer(pos, msgSize - (pos-pMsg),
+        snprintf(pos, msgSize - (pos-pMsg), "%s[", timeStr));
+    char* dataStart = pos;
+    const unsigned long ulongs[] = { pGPSData->date, pGPSData->time };
+    for (size_t idx = 0; idx < DIM(ulongs); ++idx) {
+        pos = calc_snprintf_return_pointer(pos, msgSize - (pos-pMsg),
+            snprintf(pos, msgSize - (pos-pMsg), "%s%lu",
+                     pos == dataStart ? "" : ",", ulongs[idx]));
+    }
+    const float floats[] = { pGPSData->lat, pGPSData->lon, pGPSData->speed,
+                             pGPSData->alt, pGPSData->course };
+    for (size_t idx = 0; idx < DIM(floats); ++idx) {
+        pos = calc_snprintf_return_pointer(pos, msgSize - (pos-pMsg),
+            snprintf(pos, msgSize - (pos-pMsg), "%s%1.6f",
+                     pos == dataStart ? "" : ",", floats[idx]));
+    }
+    pos = calc_snprintf_return_pointer(pos, msgSize - (pos-pMsg),
+        snprintf(pos, msgSize - (pos-pMsg), ",%lu,%lu]",
+                 pGPSData->hdop, (unsigned long)pGPSData->nsats));
+    return pos - pMsg;
+}
+
+/**
+ * Prints the cost per call of a benchmark
+ */
+static void report(
+    const char* pName,
+    uint64_t ns,
+    uint64_t ticks,
+    unsigned long count,
+    size_t totalLen
+) {
+    printf("%-28s %7.1f ns %8.1f ticks per call", pName,
+           (double)ns / count, (double)ticks / count);
+    if (totalLen != 0) {
+        printf(", %zu chars per record", totalLen / count);
+    }
+    printf("\n");
+}
+
+int main() {
+    config.server_send_flags =
+        (1UL << SERVER_SEND_GPSDATE_POS) | (1UL << SERVER_SEND_GPSTIME_POS) |
+        (1UL << SERVER_SEND_LATITUDE_POS) | (1UL << SERVER_SEND_LONGITUDE_POS) |
+        (1UL << SERVER_SEND_SPEED_POS) | (1UL << SERVER_SEND_ALTITUDE_POS) |
+        (1UL << SERVER_SEND_HEADING_POS) | (1UL << SERVER_SEND_HDOP_POS) |
+        (1UL << SERVER_SEND_NSAT_POS);
+    static SERVER_DATA_T records[256];
+    static FLOAT_GPSDATA_T floatRecords[DIM(records)];
+    for (size_t idx = 0; idx < DIM(records); ++idx) {
+        GPSDATA_T* pFix = &records[idx].gpsData;
+        memset(&records[idx], 0, sizeof(records[idx]));
+        pFix->lat = 515020570 + idx * 1234;
+        pFix->lon = -1927970 - idx * 4321;
+        pFix->alt = 5230 + idx * 10;
+        pFix->course = (idx * 1411) % 36000;
+        pFix->speed = 635 + idx * 3;
+        pFix->hdop = 90;
+        pFix->nsats = 9;
+        pFix->date = 170926;
+        pFix->time = 10150000 + idx * 100;
+        records[idx].captureTime = 559000000 + idx;
+        FLOAT_GPSDATA_T* pFloat = &floatRecords[idx];
+        pFloat->lat = pFix->lat / 1e7f;
+        pFloat->lon = pFix->lon / 1e7f;
+        pFloat->alt = pFix->alt / 100.0f;
+        pFloat->course = pFix->course / 100.0f;
+        pFloat->speed = pFix->speed * 0.036f;
+        pFloat->hdop = pFix->hdop;
+        pFloat->nsats = pFix->nsats;
+        pFloat->date = pFix->date;
+        pFloat->time = pFix->time;
+    }
+    char msg[256];
+    form_float_record(&floatRecords[0], records[0].captureTime, msg,
+                      sizeof(msg));
+    printf("float: %s\n", msg);
+    formServerUpdateMessage(&records[0], msg, sizeof(msg));
+    printf("fixed: %s\n\n", msg);
+
+    size_t totalLen = 0;
+    uint64_t ns = hostNanos();
+    uint64_t ticks = BENCH_TICKS();
+    for (unsigned long n = 0; n < BENCH_RECORDS; ++n) {
+        size_t idx = n % DIM(records);
+        totalLen += form_float_record(&floatRecords[idx],
+            records[idx].captureTime, msg, sizeof(msg));
+    }
+    report("float record (before)", hostNanos() - ns, BENCH_TICKS() - ticks,
+           BENCH_RECORDS, totalLen);
+
+    totalLen = 0;
+    ns = hostNanos();
+    ticks = BENCH_TICKS();
+    for (unsigned long n = 0; n < BENCH_RECORDS; ++n) {
+        formServerUpdateMessage(&records[n % DIM(records)], msg, sizeof(msg));
+        totalLen += strlen(msg);
+    }
+    report("fixed point record (after)", hostNanos() - ns,
+           BENCH_TICKS() - ticks, BENCH_RECORDS, totalLen);
+
+    volatile float floatSum = 0;
+    ns = hostNanos();
+    ticks = BENCH_TICKS();
+    for (unsigned long n = 0; n < BENCH_RECORDS; ++n) {
+        const FLOAT_GPSDATA_T* p1 = &floatRecords[n % DIM(records)];
+        const FLOAT_GPSDATA_T* p2 = &floatRecords[(n + 1) % DIM(records)];
+        floatSum += TinyGPS::distance_between(p1->lat, p1->lon,
+                                              p2->lat, p2->lon);
+    }
+    report("float distance (before)", hostNanos() - ns,
+           BENCH_TICKS() - ticks, BENCH_RECORDS, 0);
+
+    volatile unsigned long sum = 0;
+    ns = hostNanos();
+    ticks = BENCH_TICKS();
+    for (unsigned long n = 0; n < BENCH_RECORDS; ++n) {
+        const GPSDATA_T* p1 = &records[n % DIM(records)].gpsData;
+        const GPSDATA_T* p2 = &records[(n + 1) % DIM(records)].gpsData;
+        sum += gps_distance_between(p1->lat, p1->lon, p2->lat, p2->lon);
+    }
+    report("fixed point distance (after)", hostNanos() - ns,
+           BENCH_TICKS() - ticks, BENCH_RECORDS, 0);
+    return 0;
+}
@@ -0,0 +1,238 @@
+/**
+ * Replays NMEA streams through the GPS receive path (gps.ino): a model of
+ * the USART0 PDC writes the stream into gpsRxBuffer[] at 9600 baud whilst
+ * the gps task is run the way the scheduler runs it, with the main loop
+ * held up for a while every few seconds as it is by modem commands.
+ * Reports the bytes/s the decoder gets through on the host, and the NMEA
+ * sentences dropped.
+ *
+ * Usage: bench_nmea [file.nmea ...]
+ * With no files a generated 1 Hz GGA/RMC/GSA/GSV stream is replayed.
+ */
+#include <vector>
+#include "sketch.h"
+
+TinyGPS gps;
+void blink_got_gps() {}
+
+#include "scheduler.ino"
+#include "gps.ino"
+
+#define UART_BYTES_PER_SEC 960  // 9600 baud, 8N1
+
+/**
+ * Appends a sentence with its checksum
+ */
+static void add_sentence(
+    std::string* pStream,
+    const char* pBody
+) {
+    unsigned char sum = 0;
+    for (const char* p = pBody; *p != '\0'; ++p) {
+        sum ^= *p;
+    }
+    char tail[8];
+    snprintf(tail, sizeof(tail), "*%02X\r\n", sum);
+    *pStream += "$";
+    *pStream += pBody;
+    *pStream += tail;
+}
+
+/**
+ * Generates the output of a receiver with a fix, driving north east
+ * @param secs the number of seconds of output
+ * @param pSecondStart assigned the offset where each second's output starts
+ * @return the stream
+ */
+static std::string generate_stream(
+    unsigned secs,
+    std::vector<size_t>* pSecondStart
+) {
+    std::string stream;
+    char body[128];
+    for (unsigned sec = 0; sec < secs; ++sec) {
+        pSecondStart->push_back(stream.size());
+        unsigned hh = 10 + sec / 3600;
+        unsigned mm = (sec / 60) % 60;
+        unsigned ss = sec % 60;
+        double lat = 5130.1234 + sec * 0.0031;
+        double lon = 11.5678 + sec * 0.0042;
+        snprintf(body, sizeof(body),
+            "GPGGA,%02u%02u%02u.000,%.4f,N,%08.4f,W,1,09,0.9,%.1f,M,47.0,M,,",
+            hh, mm, ss, lat, lon, 52.3 + (sec % 7));
+        add_sentence(&stream, body);
+        snprintf(body, sizeof(body),
+            "GPRMC,%02u%02u%02u.000,A,%.4f,N,%08.4f,W,%.2f,%.2f,170926,,,A",
+            hh, mm, ss, lat, lon, 23.4 + (sec % 5), 45.0 + (sec % 3));
+        add_sentence(&stream, body);
+        add_sentence(&stream, "GPGSA,A,3,04,05,09,12,24,25,29,31,02,,,,1.6,0.9,1.3");
+        add_sentence(&stream, "GPGSV,3,1,11,04,45,067,42,05,23,304,38,09,11,033,35,12,71,260,45");
+        add_sentence(&stream, "GPGSV,3,2,11,24,58,130,44,25,17,179,36,29,37,232,41,31,05,319,30");
+        add_sentence(&stream, "GPGSV,3,3,11,02,09,044,31,17,02,210,,20,01,151,");
+    }
+    return stream;
+}
+
+/**
+ * Counts the GGA and RMC sentences, the ones TinyGPS decodes
+ */
+static unsigned count_fix_sentences(
+    const std::string& stream
+) {
+    unsigned count = 0;
+    for (size_t pos = 0; (pos = stream.find('$', pos)) != std::string::npos;
+         ++pos) {
+        if ((stream.compare(pos + 3, 3, "GGA") == 0) ||
+            (stream.compare(pos + 3, 3, "RMC") == 0)) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/**
+ * Models the PDC receiving one byte into the buffer set up by gpsRxStart()
+ * and gpsRxService()
+ * @return false if the PDC had no buffer for it, so it was lost
+ */
+static bool pdc_receive(
+    uint8_t c
+) {
+    if (USART0->US_RCR == 0) {
+        if (USART0->US_RNCR == 0) {
+            return false;
+        }
+        USART0->US_RPR = USART0->US_RNPR;
+        USART0->US_RCR = USART0->US_RNCR;
+        USART0->US_RNCR = 0;
+    }
+    *(uint8_t*)(uintptr_t)USART0->US_RPR = c;
+    USART0->US_RPR += 1;
+    USART0->US_RCR -= 1;
+    if ((USART0->US_RCR == 0) && (USART0->US_RNCR != 0)) {
+        USART0->US_RPR = USART0->US_RNPR;
+        USART0->US_RCR = USART0->US_RNCR;
+        USART0->US_RNCR = 0;
+    }
+    return true;
+}
+
+/**
+ * Replays a stream
+ * @param pName describes the stream
+ * @param stream the NMEA data
+ * @param secondStart where each second's output starts, the receiver sends
+ *        it at the line rate from the start of the second
+ * @param blockedMs how long the main loop is held up every blockPeriodMs
+ * @param blockPeriodMs ms between hold ups
+ */
+static void replay(
+    const char* pName,
+    const std::string& stream,
+    const std::vector<size_t>& secondStart,
+    unsigned long blockedMs,
+    unsigned long blockPeriodMs
+) {
+    gps = TinyGPS();
+    memset(USART0, 0, sizeof(*USART0));
+    gpsRxOverruns = 0;
+    gpsRxStart();
+    TASK_T task = TASK("gps", NULL, 0, 5);
+    GPSDATA_T fix;
+    size_t sent = 0;
+    size_t nextSecond = 0;
+    unsigned long lost = 0;
+    unsigned long fixes = 0;
+    uint64_t decodeNs = 0;
+    double lineBytes = 0;
+    for (unsigned long ms = 0; sent < stream.size(); ++ms) {
+        // The receiver starts each second's output on the second
+        if ((nextSecond < secondStart.size()) &&
+            (ms >= nextSecond * 1000)) {
+            lineBytes = MAX(lineBytes, 0.0);
+            ++nextSecond;
+        }
+        size_t limit = (nextSecond < secondStart.size())
+                       ? secondStart[nextSecond] : stream.size();
+        lineBytes += UART_BYTES_PER_SEC / 1000.0;
+        while ((lineBytes >= 1.0) && (sent < limit)) {
+            lost += !pdc_receive(stream[sent++]);
+            lineBytes -= 1.0;
+        }
+        if (sent >= limit) {
+            lineBytes = 0;
+        }
+        bool blocked = (blockedMs != 0) &&
+                       ((ms % blockPeriodMs) < blockedMs);
+        if (!blocked) {
+            uint64_t start = hostNanos();
+            schedulerStepStart = micros();
+            gpsRxService();
+            if (readGPSData(&fix, &task)) {
+                ++fixes;
+            }
+            decodeNs += hostNanos() - start;
+        }
+    }
+    schedulerStepStart = micros();
+    gpsRxService();
+    fixes += readGPSData(&fix, &task);
+    unsigned long chars;
+    unsigned short good;
+    unsigned short failed;
+    gps.stats(&chars, &good, &failed);
+    unsigned expected = count_fix_sentences(stream);
+    printf("%-10s blocked %4lu ms/%lu s: %9.0f bytes/s parsed, "
+           "%5u/%5u GGA+RMC decoded, %4u dropped (%u bad checksums, "
+           "%lu bytes lost, %lu overruns), %lu fixes\n",
+           pName, blockedMs, blockPeriodMs / 1000,
+           chars * 1e9 / (decodeNs ? decodeNs : 1), good, expected,
+           expected - good, failed, lost, gpsRxOverruns, fixes);
+}
+
+int main(
+    int argc,
+    char* argv[]
+) {
+    static const unsigned long BLOCKED_MS[] = { 0, 250, 500, 1000, 1500 };
+    std::vector<std::pair<std::string, std::string> > streams;
+    std::vector<std::vector<size_t> > starts;
+    for (int arg = 1; arg < argc; ++arg) {
+        FILE* pFile = fopen(argv[arg], "rb");
+        if (pFile == NULL) {
+            perror(argv[arg]);
+            return 1;
+        }
+        std::string stream;
+        char buf[4096];
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), pFile)) > 0) {
+            stream.append(buf, len);
+        }
+        fclose(pFile);
+        // Replay a recording as it was sent, a second's output per GGA
+        std::vector<size_t> secondStart;
+        for (size_t pos = 0; (pos = stream.find("GGA,", pos)) !=
+             std::string::npos; ++pos) {
+            secondStart.push_back(stream.rfind('$', pos));
+        }
+        streams.push_back(std::make_pair(std::string(argv[arg]), stream));
+        starts.push_back(secondStart);
+    }
+    if (streams.empty()) {
+        std::vector<size_t> secondStart;
+        streams.push_back(std::make_pair(std::string("generated"),
+                                         generate_stream(600, &secondStart)));
+        starts.push_back(secondStart);
+    }
+    for (size_t idx = 0; idx < streams.size(); ++idx) {
+        printf("%s: %zu bytes, %u GGA+RMC sentences, %zu secs\n",
+               streams[idx].first.c_str(), streams[idx].second.size(),
+               count_fix_sentences(streams[idx].second), starts[idx].size());
+        for (size_t b = 0; b < DIM(BLOCKED_MS); ++b) {
+            replay(streams[idx].first.c_str(), streams[idx].second,
+                   starts[idx], BLOCKED_MS[b], SECS(5));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,163 @@
+/**
+ * Times the server data store operations (storage.ino) on a
+ * RAMServerDataStore the size of the flash store, against how full the
+ * store is: appending a record, peeking at the oldest, reading and
+ * committing a batch as the send task does, and the scan at boot.
+ */
+#include "sketch.h"
+
+SETTINGS_T config;
+DueFlashStorage dueFlashStorage;
+
+#include "clock.ino"
+#include "data.ino"
+#include "storage.ino"
+
+#define BENCH_STORE_SIZE (64 * 1024)
+#define BENCH_OPS 4096
+#define BENCH_BATCH 32
+
+/**
+ * Makes the n'th fix of a drive
+ */
+static void make_record(
+    unsigned long n,
+    SERVER_DATA_T* pServerData
+) {
+    memset(pServerData, 0, sizeof(*pServerData));
+    GPSDATA_T* pFix = &pServerData->gpsData;
+    pFix->fixAge = 100;
+    pFix->lat = 515020570 + n * 731;
+    pFix->lon = -1927970 + n * 1093;
+    pFix->alt = 5230 + (n % 17) * 10;
+    pFix->course = (n * 37) % 36000;
+    pFix->speed = 1200 + (n % 50);
+    pFix->hdop = 90;
+    pFix->nsats = 9;
+    pFix->date = 260917;
+    pFix->time = (10150000 + n * 100) % 24000000;
+    pServerData->captureTime = 559736100 + n;
+    pServerData->ignState = true;
+    pServerData->engineRuntime = n;
+}
+
+/**
+ * Removes the oldest records
+ */
+static void drain(
+    RAMServerDataStore* pStore,
+    size_t count
+) {
+    STORE_CURSOR_T cursor;
+    SERVER_DATA_T serverData;
+    pStore->startCursor(&cursor);
+    while ((count-- > 0) && pStore->readCursor(&cursor, &serverData)) {
+    }
+    pStore->commitCursor(&cursor);
+}
+
+/**
+ * Finds how many records the store holds before it drops the oldest
+ */
+static size_t find_capacity() {
+    RAMServerDataStore store(BENCH_STORE_SIZE);
+    store.init();
+    SERVER_DATA_T serverData;
+    size_t count = 0;
+    for (unsigned long n = 0; ; ++n) {
+        make_record(n, &serverData);
+        store.writeServerData(&serverData);
+        if (store.getStoredServerDataCount() <= count) {
+            return count;
+        }
+        count = store.getStoredServerDataCount();
+    }
+}
+
+/**
+ * Times the operations with the store filled to a level
+ */
+static void bench_fill(
+    unsigned percent,
+    size_t capacity
+) {
+    RAMServerDataStore store(BENCH_STORE_SIZE);
+    store.init();
+    SERVER_DATA_T serverData;
+    unsigned long n = 0;
+    size_t fill = capacity * percent / 100;
+    // Start at the same place in a page each time
+    fill -= fill % BENCH_BATCH;
+    while (store.getStoredServerDataCount() < fill) {
+        make_record(n++, &serverData);
+        store.writeServerData(&serverData);
+    }
+    // Append, then drain (untimed) back to the fill level
+    uint64_t appendNs = 0;
+    for (unsigned ops = 0; ops < BENCH_OPS; ops += BENCH_BATCH) {
+        uint64_t start = hostNanos();
+        for (unsigned idx = 0; idx < BENCH_BATCH; ++idx) {
+            make_record(n++, &serverData);
+            store.writeServerData(&serverData);
+        }
+        appendNs += hostNanos() - start;
+        drain(&store, store.getStoredServerDataCount() - fill);
+    }
+    // Peek at the oldest record
+    STORE_CURSOR_T cursor;
+    uint64_t peekNs = hostNanos();
+    for (unsigned ops = 0; ops < BENCH_OPS; ++ops) {
+        store.startCursor(&cursor);
+        store.readCursor(&cursor, &serverData);
+    }
+    peekNs = hostNanos() - peekNs;
+    // Send a batch: read BENCH_BATCH records then commit them, then top
+    // the store back up (untimed)
+    uint64_t readNs = 0;
+    uint64_t commitNs = 0;
+    unsigned batches = 0;
+    for (unsigned ops = 0; (ops < BENCH_OPS) && (fill >= BENCH_BATCH);
+         ops += BENCH_BATCH) {
+        uint64_t start = hostNanos();
+        store.startCursor(&cursor);
+        for (unsigned idx = 0; idx < BENCH_BATCH; ++idx) {
+            store.readCursor(&cursor, &serverData);
+        }
+        uint64_t read = hostNanos();
+        store.commitCursor(&cursor);
+        commitNs += hostNanos() - read;
+        readNs += read - start;
+        batches += 1;
+        for (unsigned idx = 0; idx < BENCH_BATCH; ++idx) {
+            make_record(n++, &serverData);
+            store.writeServerData(&serverData);
+        }
+    }
+    // Flush and rebuild the index, as at boot
+    store.flush();
+    uint64_t scanNs = hostNanos();
+    store.init();
+    scanNs = hostNanos() - scanNs;
+    printf("%3u%% %5zu records: append %9.0f/s, peek %9.0f/s", percent,
+           store.getStoredServerDataCount(), BENCH_OPS * 1e9 / appendNs,
+           BENCH_OPS * 1e9 / peekNs);
+    if (batches > 0) {
+        printf(", read %9.0f/s, commit %2u %9.0f/s",
+               batches * BENCH_BATCH * 1e9 / readNs, BENCH_BATCH,
+               batches * 1e9 / commitNs);
+    } else {
+        printf(", read         -  , commit %2u         -  ", BENCH_BATCH);
+    }
+    printf(", boot scan %6.1f us\n", scanNs / 1e3);
+}
+
+int main() {
+    static const unsigned PERCENTS[] = { 0, 10, 25, 50, 75, 90, 99 };
+    size_t capacity = find_capacity();
+    printf("RAMServerDataStore(%u): %zu records, %u byte pages\n",
+           BENCH_STORE_SIZE, capacity, STORE_PAGE_SIZE);
+    for (size_t idx = 0; idx < DIM(PERCENTS); ++idx) {
+        bench_fill(PERCENTS[idx], capacity);
+    }
+    return 0;
+}
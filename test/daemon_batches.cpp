@@ -0,0 +1,124 @@
+/**
+ * Writes binary server batches from formServerBinaryBatch() (data.ino) for
+ * test_daemon.rb to send to the daemon: the same 20 records as a sequence
+ * numbered datagram batch (seq.bin) and as a plain tcp batch (plain.bin),
+ * and the latitude, longitude and ignition state the daemon should log for
+ * each record (expected.txt).
+ *
+ *   daemon_batches <directory>
+ */
+#include <vector>
+#include "sketch.h"
+
+SETTINGS_T config;
+
+#include "clock.ino"
+#include "data.ino"
+
+#define BATCH_SEQUENCE 42
+
+/**
+ * As in Opentracker_3_0_1.ino, for batches of records in RAM
+ */
+void serverBatchRewind(
+    SERVER_BATCH_T* pBatch
+) {
+    pBatch->readCount = 0;
+}
+
+bool serverBatchRead(
+    SERVER_BATCH_T* pBatch,
+    SERVER_DATA_T* pServerData
+) {
+    if (pBatch->readCount >= pBatch->count) {
+        return false;
+    }
+    *pServerData = pBatch->pServerData[pBatch->readCount++];
+    return true;
+}
+
+static std::vector<uint8_t> batchBytes;
+
+static bool write_batch(
+    const uint8_t* pData,
+    size_t len
+) {
+    batchBytes.insert(batchBytes.end(), pData, pData + len);
+    return true;
+}
+
+/**
+ * Writes a file in the output directory
+ */
+static void write_file(
+    const char* pDir,
+    const char* pName,
+    const void* pData,
+    size_t len
+) {
+    std::string path = std::string(pDir) + "/" + pName;
+    FILE* pFile = fopen(path.c_str(), "wb");
+    if ((pFile == NULL) || (fwrite(pData, 1, len, pFile) != len) ||
+        (fclose(pFile) != 0)) {
+        fprintf(stderr, "cannot write %s\n", path.c_str());
+        exit(1);
+    }
+}
+
+int main(
+    int argc,
+    char** argv
+) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <directory>\n", argv[0]);
+        return 1;
+    }
+    // Deltas between records stay well within 32 bits, as the host long is
+    // 64 bits (test_daemon.rb covers the tracker's 32-bit wrap around)
+    static SERVER_DATA_T records[20];
+    std::string expected;
+    for (size_t idx = 0; idx < DIM(records); ++idx) {
+        memset(&records[idx], 0, sizeof(records[idx]));
+        GPSDATA_T* pFix = &records[idx].gpsData;
+        pFix->fixAge = 5;
+        pFix->lat = 515020570 + idx * 1000;
+        // Whole 1e-6 degrees, as Ruby and C round halves differently
+        pFix->lon = -1927970 - idx * 80;
+        pFix->alt = 5230;
+        pFix->speed = 1200 + idx;
+        pFix->course = 9000;
+        pFix->hdop = 90;
+        pFix->nsats = 9;
+        pFix->date = 260917;
+        pFix->time = 10150000 + idx * 100;
+        records[idx].captureTime = 559736100 + idx;
+        records[idx].ignState = (idx & 1);
+        records[idx].engineRuntime = idx * 3;
+        char line[64];
+        snprintf(line, sizeof(line), "%.6f,%.6f,%d\n", pFix->lat / 1e7,
+                 pFix->lon / 1e7, records[idx].ignState);
+        expected += line;
+    }
+    strcpy(config.imei, "123456789012345");
+    strcpy(config.key, "abcdefghijkl");
+    // The daemon's log table needs the ignition state
+    config.server_send_flags = SERVER_SEND_DEFAULT |
+        (SERVER_SEND_IGN_MASK << SERVER_SEND_IGN_POS);
+    SERVER_BATCH_T batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.pServerData = records;
+    batch.count = DIM(records);
+
+    batchBytes.clear();
+    if (!formServerBinaryBatch(&batch, BATCH_SEQUENCE, write_batch)) {
+        return 1;
+    }
+    write_file(argv[1], "seq.bin", &batchBytes[0], batchBytes.size());
+    batchBytes.clear();
+    if (!formServerBinaryBatch(&batch, 0, write_batch)) {
+        return 1;
+    }
+    write_file(argv[1], "plain.bin", &batchBytes[0], batchBytes.size());
+    write_file(argv[1], "expected.txt", expected.data(), expected.size());
+    return 0;
+}
@@ -0,0 +1,120 @@
+/**
+ * Host stand-in for the parts of the Arduino Due core which the sketch
+ * modules under test use. The serial ports are fakes which tests feed with
+ * received data and whose sent data they can inspect.
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define F(x) (x)
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define DEC 10
+#define HEX 16
+#define ANALOG_VREF 3.3
+#define PI 3.1415926535897932384626433832795
+#define TWO_PI 6.283185307179586476925286766559
+#define radians(deg) ((deg)*(PI/180.0))
+#define degrees(rad) ((rad)*(180.0/PI))
+#define sq(x) ((x)*(x))
+
+// Opentracker variant pins, see variant.h
+#define PIN_C_PWR_GSM 25
+#define PIN_C_KILL_GSM 26
+#define PIN_STANDBY_GPS 27
+#define PIN_RESET_GPS 28
+#define PIN_STATUS_GSM 29
+#define PIN_RING_GSM 30
+#define PIN_WAKE_GSM 31
+#define PIN_POWER_LED 32
+#define PIN_C_REBOOT 33
+#define PIN_S_DETECT 34
+#define AIN_S_INLEVEL 35
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int analogRead(int pin);
+
+inline int stricmp(const char* pA, const char* pB) {
+    return strcasecmp(pA, pB);
+}
+
+/**
+ * A serial port. Bytes in rx are returned by read(), everything written is
+ * appended to tx (if capture is set) and onWrite, if set, is called after
+ * each write so a test can play the part of the device on the other end.
+ */
+class Stream {
+public:
+    std::string rx;                 //!< Data waiting to be read
+    size_t rxPos;                   //!< Position of the next byte in rx
+    std::string tx;                 //!< Data written
+    bool capture;                   //!< true to append writes to tx
+    bool echo;                      //!< true to copy writes to stdout
+    void (*onWrite)(Stream* pPort); //!< Called after each write, or NULL
+
+    Stream() : rxPos(0), capture(true), echo(false), onWrite(NULL) {}
+    void reset() { rx.clear(); rxPos = 0; tx.clear(); }
+    void begin(unsigned long /* baud */) {}
+    void flush() {}
+    int available() { return (int)(rx.size() - rxPos); }
+    int peek() { return (rxPos < rx.size()) ? (uint8_t)rx[rxPos] : -1; }
+    int read() { return (rxPos < rx.size()) ? (uint8_t)rx[rxPos++] : -1; }
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t* pData, size_t len);
+    size_t print(const char* pStr) { return write((const uint8_t*)pStr, strlen(pStr)); }
+    size_t print(const std::string& str) { return print(str.c_str()); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char value, int base = DEC) { return print((unsigned long)value, base); }
+    size_t print(int value, int base = DEC) { return print((long)value, base); }
+    size_t print(unsigned value, int base = DEC) { return print((unsigned long)value, base); }
+    size_t print(long value, int base = DEC);
+    size_t print(unsigned long value, int base = DEC);
+    size_t print(double value, int digits = 2);
+    template<class T> size_t println(T value) { return print(value) + print("\r\n"); }
+    size_t println() { return print("\r\n"); }
+};
+
+extern Stream Serial1, Serial2, SerialUSB;
+
+/**
+ * SAM3X USART registers, enough for the GPS PDC receive code. Builds which
+ * use them must be linked with -no-pie, as the sketch keeps buffer
+ * addresses in the 32-bit PDC pointer registers.
+ */
+typedef struct {
+    volatile uint32_t US_CR, US_MR, US_IER, US_IDR, US_IMR, US_CSR;
+    volatile uint32_t US_RHR, US_THR;
+    volatile uint32_t US_RPR, US_RCR, US_TPR, US_TCR;
+    volatile uint32_t US_RNPR, US_RNCR, US_TNPR, US_TNCR;
+    volatile uint32_t US_PTCR, US_PTSR;
+} Usart;
+extern Usart* USART0;
+#define US_IDR_RXRDY (1u << 0)
+#define US_PTCR_RXTEN (1u << 0)
+#define US_PTCR_RXTDIS (1u << 1)
+#define IFLASH1_PAGE_SIZE 256
+
+inline void __disable_irq() {}
+inline void __enable_irq() {}
+
+#endif
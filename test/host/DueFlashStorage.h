@@ -0,0 +1,28 @@
+/**
+ * Host stand-in for the DueFlashStorage library, backed by RAM which
+ * starts out erased. hostFlash is the whole of the second flash bank.
+ */
+#ifndef HOST_DUEFLASHSTORAGE_H
+#define HOST_DUEFLASHSTORAGE_H
+
+#include "Arduino.h"
+
+#define HOST_FLASH_SIZE (256 * 1024)
+
+extern byte hostFlash[HOST_FLASH_SIZE];
+
+class DueFlashStorage {
+public:
+    byte read(uint32_t address) { return hostFlash[address]; }
+    byte* readAddress(uint32_t address) { return hostFlash + address; }
+    boolean write(uint32_t address, byte value) {
+        hostFlash[address] = value;
+        return true;
+    }
+    boolean write(uint32_t address, byte* pData, uint32_t len) {
+        memcpy(hostFlash + address, pData, len);
+        return true;
+    }
+};
+
+#endif
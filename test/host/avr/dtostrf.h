@@ -0,0 +1 @@
+char* dtostrf(double value, signed char width, unsigned char prec, char* pStr);
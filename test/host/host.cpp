@@ -0,0 +1,136 @@
+/**
+ * Definitions for the host stand-ins declared in Arduino.h, host.h etc.
+ */
+#include "host.h"
+#include "DueFlashStorage.h"
+#include <chrono>
+
+Stream Serial1, Serial2, SerialUSB;
+static Usart usart0;
+Usart* USART0 = &usart0;
+byte hostFlash[HOST_FLASH_SIZE];
+unsigned long hostMillis = 0;
+unsigned long hostMillisStep = 0;
+unsigned hostFailures = 0;
+
+/**
+ * Sets up the parts of the host which need more than zeroing
+ */
+static struct HostInit {
+    HostInit() {
+        memset(hostFlash, 0xFF, sizeof(hostFlash));
+        // The debug output is only wanted when looking into a failure
+        SerialUSB.capture = false;
+        SerialUSB.echo = (getenv("HOST_DEBUG") != NULL);
+    }
+} hostInit;
+
+size_t Stream::write(
+    const uint8_t* pData,
+    size_t len
+) {
+    if (capture) {
+        tx.append((const char*)pData, len);
+    }
+    if (echo) {
+        fwrite(pData, 1, len, stdout);
+    }
+    if (onWrite != NULL) {
+        onWrite(this);
+    }
+    return len;
+}
+
+size_t Stream::print(
+    long value,
+    int base
+) {
+    if (value < 0) {
+        return print('-') + print((unsigned long)-value, base);
+    }
+    return print((unsigned long)value, base);
+}
+
+size_t Stream::print(
+    unsigned long value,
+    int base
+) {
+    char str[24];
+    snprintf(str, sizeof(str), (base == HEX) ? "%lX" : "%lu", value);
+    return print(str);
+}
+
+size_t Stream::print(
+    double value,
+    int digits
+) {
+    char str[40];
+    snprintf(str, sizeof(str), "%.*f", digits, value);
+    return print(str);
+}
+
+unsigned long millis() {
+    unsigned long timeNow = hostMillis;
+    hostMillis += hostMillisStep;
+    return timeNow;
+}
+
+uint64_t hostNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+unsigned long micros() {
+    return (unsigned long)(hostNanos() / 1000);
+}
+
+void delay(
+    unsigned long ms
+) {
+    hostMillis += ms;
+}
+
+void pinMode(int /* pin */, int /* mode */) {}
+void digitalWrite(int /* pin */, int /* value */) {}
+int digitalRead(int /* pin */) { return LOW; }
+int analogRead(int /* pin */) { return 0; }
+
+char* dtostrf(
+    double value,
+    signed char width,
+    unsigned char prec,
+    char* pStr
+) {
+    sprintf(pStr, "%*.*f", width, prec, value);
+    return pStr;
+}
+
+// timeDiff() and strncopy() as in Opentracker_3_0_1.ino, which the host
+// programs can not include
+
+unsigned long timeDiff(
+    unsigned long end_time,
+    unsigned long start_time
+) {
+    return end_time - start_time;
+}
+
+void strncopy(
+    char* pDst,
+    const char* pSrc,
+    size_t sz
+) {
+    strncpy(pDst, pSrc, sz);
+    pDst[sz-1] = '\0';
+}
+
+int hostResult(
+    const char* pName
+) {
+    if (hostFailures != 0) {
+        printf("%s: %u checks failed\n", pName, hostFailures);
+        return 1;
+    }
+    printf("%s: ok\n", pName);
+    return 0;
+}
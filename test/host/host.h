@@ -0,0 +1,45 @@
+/**
+ * Host test support: the controllable clock and the CHECK macros
+ */
+#ifndef HOST_H
+#define HOST_H
+
+#include <stdint.h>
+#include "Arduino.h"
+
+/**
+ * The value millis() returns next, and how much it moves on by each time
+ * it is called. Tests step time explicitly or let it run with each call.
+ */
+extern unsigned long hostMillis;
+extern unsigned long hostMillisStep;
+
+/**
+ * Host time in ns, for benchmarks
+ */
+uint64_t hostNanos();
+
+/**
+ * Counts a failed check. main() returns hostResult() so make fails.
+ */
+extern unsigned hostFailures;
+#define CHECK(cond) \
+    ((cond) ? (void)0 : (void)(++hostFailures, \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond)))
+#define CHECK_EQ(a, b) \
+    (((a) == (b)) ? (void)0 : (void)(++hostFailures, \
+        printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, \
+            __LINE__, #a, #b, (long long)(a), (long long)(b))))
+#define CHECK_STR(a, b) \
+    ((strcmp((a), (b)) == 0) ? (void)0 : (void)(++hostFailures, \
+        printf("%s:%d: CHECK_STR(%s, %s) failed: \"%s\" != \"%s\"\n", \
+            __FILE__, __LINE__, #a, #b, (a), (b))))
+
+/**
+ * Reports the test result
+ * @param pName the test name
+ * @return the exit code for main()
+ */
+int hostResult(const char* pName);
+
+#endif
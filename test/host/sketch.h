@@ -0,0 +1,32 @@
+/**
+ * Common setup for host builds of the sketch modules. Include this, then
+ * the .ino files under test. It includes what the main sketch file does,
+ * and prototypes for all the sketch functions as the Arduino build adds.
+ */
+#ifndef HOST_SKETCH_H
+#define HOST_SKETCH_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <TinyGPS.h>
+#include <avr/dtostrf.h>
+#include <DueFlashStorage.h>
+#include "tracker.h"
+#include "storage.h"
+#include "transport.h"
+#include "scheduler.h"
+#include "atcmd.h"
+#include "host.h"
+#include "sketch_protos.h"
+
+// As defined by Opentracker_3_0_1.ino
+#define debug_print(x)  debug_port.print(x)
+#define debug_println(x)  debug_port.println(x)
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define DIM(x) (sizeof(x)/sizeof(x[0]))
+#define gps_port Serial1
+#define debug_port SerialUSB
+#define gsm_port Serial2
+
+#endif
@@ -0,0 +1,228 @@
+#!/usr/bin/env ruby
+# Runs a host test program against an MQTT 3.1.1 broker on a free local
+# port, which is passed to the program as its argument. The broker is
+# mosquitto if it is installed, else the emulation here, which has what the
+# tracker and test_mqtt's server side use: persistent sessions, QoS 0 and 1
+# both ways, + and # topic filters and pings.
+#
+# Usage: mqtt_broker.rb <program>
+
+require 'socket'
+require 'tmpdir'
+require 'timeout'
+
+class MqttBroker
+    CONNECT = 0x10
+    CONNACK = 0x20
+    PUBLISH = 0x30
+    PUBACK = 0x40
+    SUBSCRIBE = 0x80
+    SUBACK = 0x90
+    PINGREQ = 0xC0
+    PINGRESP = 0xD0
+    DISCONNECT = 0xE0
+    PUBLISH_DUP = 0x08
+
+    # A client's session: its subscriptions (filter => QoS), the QoS 1
+    # messages sent to it and not yet acked (id => [topic, payload]), and
+    # the connection, nil whilst it is away
+    Session = Struct.new(:subs, :inflight, :last_id, :clean, :client)
+
+    def initialize(port)
+        @server = TCPServer.new("127.0.0.1", port)
+        @sessions = {}
+        # Held whilst using the sessions or writing to a client
+        @lock = Mutex.new
+    end
+
+    def start
+        Thread.start do
+            loop do
+                Thread.start(@server.accept) { |client| serve client }
+            end
+        end
+    end
+
+    private
+
+    def serve(client)
+        session = nil
+        while (packet = read_packet(client))
+            type, body = packet
+            case type & 0xF0
+            when CONNECT
+                session = connect(client, body)
+            when SUBSCRIBE
+                subscribe(session, body)
+            when PUBLISH
+                publish(client, type, body)
+            when PUBACK
+                @lock.synchronize { session.inflight.delete body.unpack1("n") }
+            when PINGREQ
+                @lock.synchronize { client.write packet(PINGRESP, "") }
+            when DISCONNECT
+                break
+            end
+        end
+    rescue IOError, SystemCallError
+    ensure
+        @lock.synchronize do
+            if session and session.client == client
+                session.client = nil
+                @sessions.delete_if { |id, s| s == session } if session.clean
+            end
+        end
+        client.close unless client.closed?
+    end
+
+    def connect(client, body)
+        flags = body.getbyte(7)
+        id = body[12, body[10, 2].unpack1("n")]
+        clean = (flags & 0x02 != 0)
+        @lock.synchronize do
+            session = @sessions[id]
+            present = (!clean and !session.nil?)
+            session.client.close if session and session.client
+            session = Session.new({}, {}, 0, clean) unless present
+            session.client = client
+            @sessions[id] = session
+            client.write packet(CONNACK, [present ? 1 : 0, 0].pack("C2"))
+            # What was sent before is sent again, what was queued is sent
+            session.inflight.each do |msg_id, (topic, payload, sent)|
+                send_publish(session, topic, payload, msg_id, sent)
+                session.inflight[msg_id][2] = true
+            end
+            session
+        end
+    end
+
+    def subscribe(session, body)
+        msg_id = body[0, 2]
+        pos = 2
+        granted = []
+        while pos < body.length
+            len = body[pos, 2].unpack1("n")
+            filter = body[pos + 2, len]
+            qos = [body.getbyte(pos + 2 + len), 1].min
+            pos += 2 + len + 1
+            granted << qos
+            @lock.synchronize { session.subs[filter] = qos }
+        end
+        @lock.synchronize do
+            session.client.write packet(SUBACK, msg_id + granted.pack("C*"))
+        end
+    end
+
+    def publish(client, type, body)
+        qos = (type >> 1) & 3
+        len = body[0, 2].unpack1("n")
+        topic = body[2, len]
+        pos = 2 + len
+        if qos > 0
+            msg_id = body[pos, 2]
+            pos += 2
+        end
+        payload = body[pos..-1]
+        @lock.synchronize do
+            client.write packet(PUBACK, msg_id) if qos > 0
+            @sessions.each_value do |session|
+                sub_qos = session.subs.select { |filter, q| match?(filter, topic) }.values.max
+                next if sub_qos.nil?
+                if [qos, sub_qos].min == 0
+                    session.client.write packet(PUBLISH, str(topic) + payload) if session.client
+                else
+                    session.last_id = session.last_id % 0xFFFF + 1
+                    session.inflight[session.last_id] = [topic, payload, !session.client.nil?]
+                    send_publish(session, topic, payload, session.last_id, false)
+                end
+            end
+        end
+    end
+
+    # Sends a QoS 1 PUBLISH if the client is connected
+    def send_publish(session, topic, payload, msg_id, dup)
+        return if session.client.nil?
+        type = PUBLISH | 0x02 | (dup ? PUBLISH_DUP : 0)
+        session.client.write packet(type, str(topic) + [msg_id].pack("n") + payload)
+    rescue IOError, SystemCallError
+    end
+
+    def match?(filter, topic)
+        filter = filter.split("/", -1)
+        topic = topic.split("/", -1)
+        filter.each_with_index do |level, idx|
+            return true if level == "#"
+            return false if idx >= topic.length
+            return false unless level == "+" or level == topic[idx]
+        end
+        filter.length == topic.length
+    end
+
+    def read_packet(client)
+        type = client.read(1) or return nil
+        len = 0
+        shift = 0
+        loop do
+            byte = client.read(1) or return nil
+            len |= (byte.ord & 0x7f) << shift
+            shift += 7
+            break if byte.ord < 0x80
+        end
+        body = client.read(len) or return nil
+        (body.length == len) ? [type.ord, body] : nil
+    end
+
+    def packet(type, body)
+        len = body.length
+        header = [type]
+        loop do
+            byte = len & 0x7f
+            len >>= 7
+            header << ((len > 0) ? (byte | 0x80) : byte)
+            break if len == 0
+        end
+        header.pack("C*") + body.b
+    end
+
+    def str(text)
+        [text.length].pack("n") + text.b
+    end
+end
+
+program = ARGV[0]
+server = TCPServer.new("127.0.0.1", 0)
+port = server.local_address.ip_port
+server.close
+
+mosquitto = nil
+Dir.mktmpdir do |dir|
+    if system("which mosquitto > /dev/null 2>&1")
+        conf = File.join(dir, "mosquitto.conf")
+        File.write(conf, "listener #{port} 127.0.0.1\nallow_anonymous true\n" +
+                         "persistence false\n")
+        mosquitto = spawn("mosquitto", "-c", conf,
+                          [:out, :err] => File.join(dir, "mosquitto.log"))
+        Timeout.timeout(5) do
+            begin
+                TCPSocket.new("127.0.0.1", port).close
+            rescue Errno::ECONNREFUSED
+                sleep 0.05
+                retry
+            end
+        end
+        broker = "mosquitto"
+    else
+        MqttBroker.new(port).start
+        broker = "the emulated broker"
+    end
+    puts "#{File.basename(program)}: against #{broker}"
+    begin
+        ok = system(program, port.to_s)
+    ensure
+        if mosquitto
+            Process.kill("TERM", mosquitto)
+            Process.wait(mosquitto)
+        end
+    end
+    exit(ok ? true : false)
+end
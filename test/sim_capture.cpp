@@ -0,0 +1,112 @@
+/**
+ * Simulation of capturing fixes between server updates (capture.ino):
+ * ten 30 s update periods of 1 Hz fixes along a winding route, with the
+ * network down for three of them. Fixes keep being captured whilst each
+ * batch is sent, as the gps task runs during the send. Reports the
+ * records kept by the simplifier, sent, and spilled to the store.
+ */
+#include "sketch.h"
+
+SETTINGS_T config;
+TinyGPS gps;
+void blink_got_gps() {}
+MOTION_STATE_T motionState = MOTION_MOVING;
+bool ignState = true;
+unsigned long engineRunningTime = 0;
+
+#define SIM_PERIODS 10
+#define SIM_PERIOD_SECS 30
+#define SIM_SEND_SECS 3               // time taken by each send
+#define SIM_BATCH_RECORDS 10          // records per server batch
+
+unsigned long simStored = 0;          // records spilled to the store
+unsigned long simSent = 0;            // records the server got
+unsigned long simSends = 0;           // batches sent
+bool simNetworkUp = true;
+
+/**
+ * Stands in for the store, counting what is spilled to it
+ */
+struct {
+    bool writeServerData(const SERVER_DATA_T* /* pServerData */) {
+        simStored += 1;
+        return true;
+    }
+} serverDataStore;
+
+size_t serverBatchMaxRecords() {
+    return SIM_BATCH_RECORDS;
+}
+
+unsigned long clockNow() {
+    return millis() / ONE_SEC;
+}
+
+#include "gps.ino"
+#include "track.ino"
+#include "capture.ino"
+
+unsigned simStep = 0;
+
+/**
+ * The next second's fix along the route, winding 200 m either side of
+ * due north at 10 m/s, captured as the gps task does
+ */
+static void sim_capture_next() {
+    delay(ONE_SEC);
+    simStep += 1;
+    double x = sin(simStep / 5.0) * 200;
+    double y = simStep * 10;
+    GPSDATA_T fix;
+    memset(&fix, 0, sizeof(fix));
+    fix.fixAge = 10;
+    fix.lat = (long)(510000000 + y / 0.0111195);
+    fix.lon = (long)(x / 0.0111195 / cos(51 * M_PI / 180));
+    fix.speed = 1000;
+    fix.hdop = 100;
+    captureFix(&fix);
+}
+
+/**
+ * Sends a batch, capturing the fixes which arrive meanwhile
+ */
+bool updateServerWithCurrentData(
+    SERVER_DATA_T* /* pServerData */,
+    size_t count
+) {
+    simSends += 1;
+    for (unsigned sec = 0; sec < SIM_SEND_SECS; ++sec) {
+        sim_capture_next();
+    }
+    if (simNetworkUp) {
+        simSent += count;
+    }
+    return simNetworkUp;
+}
+
+int main() {
+    config.capture_interval = 1;
+    config.track_tolerance = 15;
+    config.track_heading_tolerance = 30;
+    config.slow_server_interval = 600;
+    for (unsigned period = 0; period < SIM_PERIODS; ++period) {
+        simNetworkUp = (period < 4) || (period >= 7);
+        for (unsigned sec = 0; sec < SIM_PERIOD_SECS; ++sec) {
+            sim_capture_next();
+        }
+        size_t buffered = captureCount;
+        bool sentOK = captureFlush(simNetworkUp ? CONNECTED : NO_CELL);
+        printf("period %u: network %-4s buffered %2zu, %s, left %2zu, "
+               "sent %2lu, stored %2lu in %lu sends\n", period,
+               simNetworkUp ? "up" : "down", buffered,
+               sentOK ? "sent" : "not sent", captureCount, simSent,
+               simStored, simSends);
+    }
+    unsigned long sendFixes = simSends * SIM_SEND_SECS;
+    printf("%lu fixes (%lu during sends), %lu kept by the simplifier, "
+           "%lu sent in %lu sends, %lu spilled to the store, peak %zu/%u, "
+           "%lu overruns\n", simStep - sendFixes, sendFixes, trackKeptCount,
+           simSent, simSends, simStored, capturePeak, CAPTURE_BUFFER_SIZE,
+           captureOverrunCount);
+    return 0;
+}
@@ -0,0 +1,242 @@
+/**
+ * Simulation of the server update policy (policy.ino) and the track
+ * simplifier (track.ino) over generated drives: 20 minutes of 1 Hz fixes
+ * in town and on a motorway. The server task is run as it is on the
+ * tracker, sampling a fix when the policy triggers (or, without the
+ * policy, every 30 s), and the samples go through the simplifier if it is
+ * on. Reports the points sent and how far the drawn track strays from the
+ * true path.
+ */
+#include <vector>
+#include "sketch.h"
+
+SETTINGS_T config;
+TinyGPS gps;
+void blink_got_gps() {}
+MOTION_STATE_T motionState = MOTION_MOVING;
+GPSDATA_T lastGoodGPSData;
+
+/**
+ * Stands in for the store, which the simplifier only writes on flush
+ */
+struct {
+    bool writeServerData(const SERVER_DATA_T* /* pServerData */) {
+        return true;
+    }
+} serverDataStore;
+
+/**
+ * Fixes are not captured between updates here, see sim_capture
+ */
+bool captureIsFull() {
+    return false;
+}
+
+#include "gps.ino"
+#include "track.ino"
+#include "policy.ino"
+
+#define SIM_SECS 1200
+#define SIM_INTERVAL SECS(30)         // the fixed update period
+#define SIM_ORIGIN_LAT 510000000      // where the drives start
+
+/**
+ * A point on the ground, in meters east and north of the origin
+ */
+typedef struct {
+    double x;
+    double y;
+} SIM_POINT_T;
+
+/**
+ * Makes the fix for a point of a drive
+ */
+static GPSDATA_T sim_fix(
+    const SIM_POINT_T* pPoint,
+    double speed,
+    double heading
+) {
+    GPSDATA_T fix;
+    memset(&fix, 0, sizeof(fix));
+    fix.fixAge = 10;
+    // 1e-7 degrees is 0.0111195 m north, and cos(lat) of that east
+    fix.lat = (long)(SIM_ORIGIN_LAT + pPoint->y / 0.0111195);
+    fix.lon = (long)(pPoint->x / 0.0111195 / cos(51 * M_PI / 180));
+    fix.speed = speed * 100;
+    fix.course = (unsigned long)(fmod(heading + 360, 360) * 100);
+    fix.hdop = 100;
+    return fix;
+}
+
+/**
+ * Gets the ground position of a reported point
+ */
+static SIM_POINT_T sim_point(
+    const SERVER_DATA_T* pServerData
+) {
+    int64_t dx;
+    int64_t dy;
+    gps_offset_between(SIM_ORIGIN_LAT, 0, pServerData->gpsData.lat,
+                       pServerData->gpsData.lon, &dx, &dy);
+    SIM_POINT_T point = { dx / 10.0, dy / 10.0 };
+    return point;
+}
+
+/**
+ * Distance from a point to a line segment
+ */
+static double sim_segment_distance(
+    const SIM_POINT_T& p,
+    const SIM_POINT_T& a,
+    const SIM_POINT_T& b
+) {
+    double dx = b.x - a.x;
+    double dy = b.y - a.y;
+    double len2 = dx * dx + dy * dy;
+    double t = (len2 != 0) ? ((p.x - a.x) * dx + (p.y - a.y) * dy) / len2 : 0;
+    t = MAX(0.0, MIN(1.0, t));
+    double ex = a.x + t * dx - p.x;
+    double ey = a.y + t * dy - p.y;
+    return sqrt(ex * ex + ey * ey);
+}
+
+/**
+ * Runs a drive through the server task
+ */
+static void sim_run(
+    const char* pName,
+    const std::vector<GPSDATA_T>& fixes,
+    const std::vector<SIM_POINT_T>& path,
+    bool usePolicy,
+    bool useTrack
+) {
+    config.track_tolerance = useTrack ? 15 : 0;
+    trackHaveAnchor = false;
+    trackHaveHeld = false;
+    policyHaveLast = false;
+    memset(policyTriggerCounts, 0, sizeof(policyTriggerCounts));
+    std::vector<SIM_POINT_T> sent;
+    SERVER_DATA_T serverData;
+    SERVER_DATA_T emitted[2];
+    unsigned long lastSample = 0;
+    unsigned samples = 0;
+    for (size_t sec = 0; sec < fixes.size(); ++sec) {
+        lastGoodGPSData = fixes[sec];
+        unsigned long now = SECS(sec);
+        POLICY_TRIGGER_T trigger;
+        if (sec == 0) {
+            trigger = POLICY_TRIGGER_TIME;
+        } else if (usePolicy) {
+            trigger = policyCheck(now - lastSample, SIM_INTERVAL);
+        } else {
+            trigger = (now - lastSample >= SIM_INTERVAL) ? POLICY_TRIGGER_TIME
+                                                         : POLICY_TRIGGER_NONE;
+        }
+        if (trigger == POLICY_TRIGGER_NONE) {
+            continue;
+        }
+        samples += 1;
+        lastSample = now;
+        memset(&serverData, 0, sizeof(serverData));
+        serverData.gpsData = fixes[sec];
+        serverData.captureTime = sec;
+        policySampled(&serverData.gpsData, trigger);
+        size_t count = trackAddPoint(&serverData, emitted);
+        for (size_t idx = 0; idx < count; ++idx) {
+            sent.push_back(sim_point(&emitted[idx]));
+        }
+    }
+    memset(&serverData, 0, sizeof(serverData));
+    serverData.gpsData = fixes.back();
+    serverData.captureTime = fixes.size();
+    size_t count = trackEndSegment(&serverData, emitted);
+    for (size_t idx = 0; idx < count; ++idx) {
+        sent.push_back(sim_point(&emitted[idx]));
+    }
+    double maxError = 0;
+    double sumError = 0;
+    for (size_t idx = 0; idx < path.size(); ++idx) {
+        double error = 1e9;
+        for (size_t seg = 1; seg < sent.size(); ++seg) {
+            error = MIN(error, sim_segment_distance(path[idx], sent[seg - 1],
+                                                    sent[seg]));
+        }
+        maxError = MAX(maxError, error);
+        sumError += error;
+    }
+    printf("%-9s %-6s %-10s samples %4u, sent %4zu, error max %6.1f m "
+           "mean %5.1f m (time %lu distance %lu heading %lu speed %lu)\n",
+           pName, usePolicy ? "policy" : "30 s", useTrack ? "simplified" : "",
+           samples, sent.size(), maxError, sumError / path.size(),
+           policyTriggerCounts[POLICY_TRIGGER_TIME],
+           policyTriggerCounts[POLICY_TRIGGER_DISTANCE],
+           policyTriggerCounts[POLICY_TRIGGER_HEADING],
+           policyTriggerCounts[POLICY_TRIGGER_SPEED]);
+}
+
+/**
+ * Moves along a drive for a second
+ */
+static void sim_step(
+    std::vector<GPSDATA_T>* pFixes,
+    std::vector<SIM_POINT_T>* pPath,
+    SIM_POINT_T* pPoint,
+    double speed,
+    double heading
+) {
+    pPoint->x += speed * sin(heading * M_PI / 180);
+    pPoint->y += speed * cos(heading * M_PI / 180);
+    pFixes->push_back(sim_fix(pPoint, speed, heading));
+    pPath->push_back(*pPoint);
+}
+
+int main() {
+    config.slow_server_interval = 600;
+    config.track_heading_tolerance = 30;
+    config.policy_distance = 500;
+    config.policy_heading = 30;
+    config.policy_speed = 20;
+    config.capture_interval = 0;
+
+    // Town: 10 m/s, turning 90 degrees over 3 s every 200 m, alternately
+    // left and right
+    std::vector<GPSDATA_T> townFixes;
+    std::vector<SIM_POINT_T> townPath;
+    SIM_POINT_T point = { 0, 0 };
+    double heading = 90;
+    unsigned leg = 0;
+    for (unsigned sec = 0; sec < SIM_SECS; ++sec) {
+        unsigned step = sec % 20;
+        if (step >= 17) {
+            heading += (leg % 2) ? -30 : 30;
+        }
+        if (step == 19) {
+            leg += 1;
+        }
+        sim_step(&townFixes, &townPath, &point, 10, heading);
+    }
+    // Motorway: 30 m/s, slowing to 22 m/s every other 5 minutes, on a
+    // gentle curve of 1 degree every 30 s
+    std::vector<GPSDATA_T> motorwayFixes;
+    std::vector<SIM_POINT_T> motorwayPath;
+    point.x = 0;
+    point.y = 0;
+    heading = 0;
+    for (unsigned sec = 0; sec < SIM_SECS; ++sec) {
+        heading += 1.0 / 30;
+        double speed = ((sec / 300) % 2) ? 22 : 30;
+        sim_step(&motorwayFixes, &motorwayPath, &point, speed, heading);
+    }
+    for (int usePolicy = 0; usePolicy < 2; ++usePolicy) {
+        for (int useTrack = 0; useTrack < 2; ++useTrack) {
+            sim_run("town", townFixes, townPath, usePolicy, useTrack);
+        }
+    }
+    for (int usePolicy = 0; usePolicy < 2; ++usePolicy) {
+        for (int useTrack = 0; useTrack < 2; ++useTrack) {
+            sim_run("motorway", motorwayFixes, motorwayPath, usePolicy,
+                    useTrack);
+        }
+    }
+    return 0;
+}
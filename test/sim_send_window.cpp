@@ -0,0 +1,126 @@
+/**
+ * Model of draining the backlog over TCP, comparing the AT+QISACK polling
+ * gsm_validate_tcp() did after every AT+QISEND with the send window
+ * (TCP_SEND_WINDOW) which replaced it.
+ *
+ * The modem is modelled as a 115200 baud UART, a 20 ms turnaround for each
+ * AT command, and a TCP send buffer of TCP_SEND_WINDOW bytes drained to the
+ * network at the link rate. The server acknowledges a batch one round trip
+ * after its last byte has left the modem. A chunk sent when the modem's
+ * buffer has no room for it fails, but is still counted in the throughput,
+ * which flatters the polling where it overruns.
+ */
+#include "sketch.h"
+
+#define SIM_UART_BYTES_PER_MS 11.52   // 115200 baud, 8N1
+#define SIM_COMMAND_MS 20             // AT command turnaround
+#define SIM_BATCHES 50
+#define SIM_OLD_CHECKS 10             // AT+QISACK polls after each send
+#define SIM_OLD_LOW_WATER 3000        // polling stopped below this
+
+/**
+ * The modem and the time spent talking to it
+ */
+typedef struct {
+    double timeMs;                    // time taken so far
+    double queued;                    // bytes in the modem's send buffer
+    double rate;                      // link rate in bytes per ms
+    unsigned long failures;           // AT+QISENDs which overran
+} SIM_MODEM_T;
+
+/**
+ * Lets time pass whilst the modem drains its buffer to the network
+ */
+static void sim_wait(
+    SIM_MODEM_T* pModem,
+    double ms
+) {
+    pModem->queued = MAX(0.0, pModem->queued - pModem->rate * ms);
+    pModem->timeMs += ms;
+}
+
+/**
+ * Runs one scenario
+ * @param window true for the send window, false for the polling
+ * @return the throughput in bytes/s
+ */
+static double sim_run(
+    bool window,
+    double rate,
+    double rttMs,
+    size_t batchBytes,
+    unsigned long* pFailures
+) {
+    SIM_MODEM_T modem = { 0, 0, rate, 0 };
+    double unacked = 0;               // the window's count of bytes sent
+    for (unsigned batch = 0; batch < SIM_BATCHES; ++batch) {
+        for (size_t left = batchBytes; left > 0; ) {
+            size_t chunk = MIN((size_t)PACKET_SIZE, left);
+            left -= chunk;
+            if (window) {
+                double backoff = TCP_BACKOFF_MIN;
+                while (unacked + chunk > TCP_SEND_WINDOW) {
+                    // AT+QISACK
+                    sim_wait(&modem, SIM_COMMAND_MS);
+                    unacked = modem.queued;
+                    if (unacked + chunk > TCP_SEND_WINDOW) {
+                        sim_wait(&modem, backoff);
+                        backoff = MIN(backoff * 2, (double)TCP_BACKOFF_MAX);
+                    }
+                }
+            }
+            // AT+QISEND and the data
+            sim_wait(&modem, SIM_COMMAND_MS + chunk / SIM_UART_BYTES_PER_MS);
+            if (modem.queued + chunk > TCP_SEND_WINDOW) {
+                modem.failures += 1;
+                modem.queued = TCP_SEND_WINDOW;
+            } else {
+                modem.queued += chunk;
+            }
+            unacked += chunk;
+            if (!window) {
+                for (unsigned check = 0; check < SIM_OLD_CHECKS; ++check) {
+                    sim_wait(&modem, SIM_COMMAND_MS);
+                    if (modem.queued <= SIM_OLD_LOW_WATER) {
+                        break;
+                    }
+                }
+            }
+        }
+        // The server's ack arrives a round trip after the last byte left
+        sim_wait(&modem, modem.queued / rate + rttMs);
+        unacked = 0;
+    }
+    *pFailures = modem.failures;
+    return SIM_BATCHES * batchBytes * 1000.0 / modem.timeMs;
+}
+
+int main() {
+    static const struct {
+        const char* pName;
+        double kbps;
+        double rttMs;
+        size_t batchBytes;
+    } SCENARIOS[] = {
+        { "2.9 KB binary batches, 3 KB/s, 700 ms RTT", 3.0, 700, 2900 },
+        { "1.3 KB text batches, 3 KB/s, 700 ms RTT", 3.0, 700, 1300 },
+        { "2.9 KB batches, 20 KB/s, 300 ms RTT", 20.0, 300, 2900 },
+        { "8 KB batches, 20 KB/s, 300 ms RTT", 20.0, 300, 8000 },
+        { "20 KB batches, 1 KB/s, 1200 ms RTT", 1.0, 1200, 20000 }
+    };
+    printf("%u batches, bytes/s and failed sends, polling -> window\n",
+           SIM_BATCHES);
+    for (size_t idx = 0; idx < DIM(SCENARIOS); ++idx) {
+        unsigned long oldFailures;
+        unsigned long newFailures;
+        // 1 KB/s is 1 byte per ms
+        double oldRate = sim_run(false, SCENARIOS[idx].kbps,
+            SCENARIOS[idx].rttMs, SCENARIOS[idx].batchBytes, &oldFailures);
+        double newRate = sim_run(true, SCENARIOS[idx].kbps,
+            SCENARIOS[idx].rttMs, SCENARIOS[idx].batchBytes, &newFailures);
+        printf("%-44s %5.0f -> %5.0f, failed %4lu -> %4lu\n",
+               SCENARIOS[idx].pName, oldRate, newRate, oldFailures,
+               newFailures);
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#!/usr/bin/env ruby
+# Writes prototypes for the functions defined in the sketch's .ino files,
+# as the Arduino build generates them, so the .ino files can be included
+# into host builds in any order.
+#
+# Usage: sketch_protos.rb <sketch dir> <output file>
+
+sketch, output = ARGV
+main = File.join(sketch, File.basename(sketch) + ".ino")
+files = [main] + (Dir.glob(File.join(sketch, "*.ino")).sort - [main])
+
+protos = []
+files.each do |file|
+    src = File.read(file)
+    # Function definitions start in the first column, with the parameters
+    # either on the same line or one per line up to the ") {"
+    src.scan(/^([A-Za-z_][\w \*]*?[ \*])([A-Za-z_]\w*)\(((?:[^;{}()]|\([^;{}()]*\))*)\)\s*\{/m) do |type, name, params|
+        next if %w(if while for switch return else).include?(type.strip)
+        params = params.gsub(%r{//[^\n]*}, "").split.join(" ")
+        protos << "#{type.strip} #{name}(#{params});"
+    end
+end
+
+File.write(output, "// Generated by sketch_protos.rb, do not edit\n" +
+                   protos.join("\n") + "\n")
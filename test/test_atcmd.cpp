@@ -0,0 +1,281 @@
+/**
+ * Unit tests for the AT command engine in atcmd.ino: the result code table,
+ * and whole commands run against a scripted modem on the gsm port
+ */
+#include "sketch.h"
+
+char modem_reply[1024];
+bool modemLogging = false;
+
+/**
+ * The background tasks, which are all that run whilst atSendCommand()
+ * waits, just let time pass here
+ */
+void modemWaitIdle() {
+    delay(1);
+}
+
+#include "atcmd.ino"
+
+/**
+ * The scripted modem: when a command (or the command payload) has been
+ * written, replies with the next reply in the script
+ */
+static const char* modemScript[8];
+static size_t modemScriptLen = 0;
+static size_t modemScriptPos = 0;
+static std::string modemReceived;     // commands and payloads, '|' between
+
+static void modem_respond(
+    Stream* pPort
+) {
+    // A command ends with '\r', the payload is whatever follows a prompt
+    bool prompted = (modemScriptPos > 0) &&
+        (strcmp(modemScript[modemScriptPos - 1] +
+                strlen(modemScript[modemScriptPos - 1]) - 2, "> ") == 0);
+    size_t end = pPort->tx.find('\r');
+    if ((end == std::string::npos) && !prompted) {
+        return;
+    }
+    modemReceived += pPort->tx.substr(0, end) + "|";
+    pPort->tx.clear();
+    if (modemScriptPos < modemScriptLen) {
+        pPort->rx += modemScript[modemScriptPos++];
+    }
+}
+
+/**
+ * Sets up the modem script for the next command(s)
+ */
+static void modem_script(
+    const char* pReply1,
+    const char* pReply2 = NULL
+) {
+    modemScript[0] = pReply1;
+    modemScript[1] = pReply2;
+    modemScriptLen = (pReply2 != NULL) ? 2 : 1;
+    modemScriptPos = 0;
+    modemReceived.clear();
+}
+
+static std::string urcLines;
+
+static void urc_handler(
+    const char* pLine
+) {
+    urcLines += pLine;
+}
+
+static std::string callbackLines;
+
+/**
+ * Line callback which claims the line after each "+CMGL:" header, as
+ * sms_read_line() does for the message text
+ */
+static unsigned sms_lines(
+    const char* pLine
+) {
+    callbackLines += pLine;
+    return (strncmp(pLine, "+CMGL:", 6) == 0) ? 1 : 0;
+}
+
+static unsigned long doneIds[4];
+static size_t doneCount = 0;
+
+static void on_done(
+    unsigned long id,
+    unsigned /* result */
+) {
+    doneIds[doneCount++ % DIM(doneIds)] = id;
+}
+
+static void test_classify_line() {
+    static const struct {
+        const char* pLine;
+        unsigned kind;
+    } LINES[] = {
+        { "OK\r\n", AT_LINE_OK },
+        { "OK", AT_LINE_OK },
+        { "OKAY\r\n", AT_LINE_INTERMEDIATE },
+        { "ERROR\r\n", AT_LINE_ERROR },
+        { "+CME ERROR: 10\r\n", AT_LINE_ERROR },
+        { "+CMS ERROR: 321\r\n", AT_LINE_ERROR },
+        { "> ", AT_LINE_PROMPT },
+        { "SEND OK\r\n", AT_LINE_DONE },
+        { "SEND FAIL\r\n", AT_LINE_ERROR },
+        { "CONNECT OK\r\n", AT_LINE_DONE },
+        { "CONNECT FAIL\r\n", AT_LINE_ERROR },
+        { "CONNECT\r\n", AT_LINE_INTERMEDIATE },
+        { "NO CARRIER\r\n", AT_LINE_ERROR },
+        { "+QIRD: 1.2.3.4:80,TCP,5\r\n", AT_LINE_DATA },
+        { "+CPIN: READY\r\n", AT_LINE_INTERMEDIATE },
+        { "+CMGL: 1,\"REC UNREAD\"\r\n", AT_LINE_INTERMEDIATE },
+        { "\r\n", AT_LINE_INTERMEDIATE },
+        { "", AT_LINE_INTERMEDIATE }
+    };
+    for (size_t idx = 0; idx < DIM(LINES); ++idx) {
+        if (at_classify_line(LINES[idx].pLine) != LINES[idx].kind) {
+            printf("at_classify_line(\"%s\") != %u\n",
+                   LINES[idx].pLine, LINES[idx].kind);
+            CHECK(false);
+        }
+    }
+}
+
+static void test_replies() {
+    modem_script("AT+GSN\r\r\n861234567890123\r\n\r\nOK\r\n");
+    CHECK_EQ(atSendCommand("AT+GSN", true, 1000, NULL, 0, NULL),
+             AT_RESULT_OK);
+    CHECK_STR(modem_reply, "AT+GSN\r\r\n861234567890123\r\n\r\nOK\r\n");
+    CHECK_STR(modemReceived.c_str(), "AT+GSN|");
+
+    // "+CPIN:" is part of the reply, the OK ends it
+    modem_script("AT+CPIN?\r\r\n+CPIN: READY\r\n\r\nOK\r\n");
+    CHECK_EQ(atSendCommand("AT+CPIN?", true, 1000, NULL, 0, NULL),
+             AT_RESULT_OK);
+    CHECK(strstr(modem_reply, "+CPIN: READY\r\n\r\nOK\r\n") != NULL);
+
+    modem_script("AT+CPIN=1234\r\r\n+CME ERROR: 16\r\n");
+    CHECK_EQ(atSendCommand("AT+CPIN=1234", true, 1000, NULL, 0, NULL),
+             AT_RESULT_ERROR);
+
+    // OK does not end the reply when allowOK is false
+    modem_script("AT+QIOPEN\r\r\nOK\r\n\r\nCONNECT OK\r\n");
+    CHECK_EQ(atSendCommand("AT+QIOPEN", false, 1000, NULL, 0, NULL),
+             AT_RESULT_OK);
+    CHECK(strstr(modem_reply, "OK\r\n\r\nCONNECT OK\r\n") != NULL);
+    modem_script("AT+QIOPEN\r\r\nOK\r\n\r\nCONNECT FAIL\r\n");
+    CHECK_EQ(atSendCommand("AT+QIOPEN", false, 1000, NULL, 0, NULL),
+             AT_RESULT_ERROR);
+}
+
+static void test_prompt() {
+    modem_script("AT+QISEND=5\r\r\n> ", "hello\r\nSEND OK\r\n");
+    CHECK_EQ(atSendCommand("AT+QISEND=5", true, 1000, "hello", 5, NULL),
+             AT_RESULT_OK);
+    CHECK_STR(modemReceived.c_str(), "AT+QISEND=5|hello|");
+    CHECK(strstr(modem_reply, "> ") == NULL);
+    CHECK(strstr(modem_reply, "SEND OK") != NULL);
+    // Without a payload the prompt is the final result
+    modem_script("AT+CMGS=\"+44\"\r\r\n> ");
+    CHECK_EQ(atSendCommand("AT+CMGS=\"+44\"", true, 1000, NULL, 0, NULL),
+             AT_RESULT_OK);
+}
+
+static void test_raw_data() {
+    // The 12 bytes after the +QIRD: line are data, not result codes
+    modem_script("AT+QIRD=0,1,0,100\r\r\n+QIRD: 1.2.3.4:80,TCP,12\r\n"
+                 "OK\r\nERROR\r\n\r\nOK\r\n");
+    CHECK_EQ(atSendCommand("AT+QIRD=0,1,0,100", true, 1000, NULL, 0, NULL),
+             AT_RESULT_OK);
+    CHECK(strstr(modem_reply, "TCP,12\r\nOK\r\nERROR\r\n\r\nOK\r\n") != NULL);
+}
+
+static void test_urcs() {
+    urcLines.clear();
+    // A URC in the middle of a reply is handled and left out of it
+    modem_script("AT+QNSTATUS\r\r\n+CMTI: \"SM\",3\r\n+QNSTATUS: 0\r\n"
+                 "\r\nOK\r\n");
+    CHECK_EQ(atSendCommand("AT+QNSTATUS", true, 1000, NULL, 0, NULL),
+             AT_RESULT_OK);
+    CHECK_STR(urcLines.c_str(), "+CMTI: \"SM\",3\r\n");
+    CHECK_STR(modem_reply, "AT+QNSTATUS\r\r\n+QNSTATUS: 0\r\n\r\nOK\r\n");
+
+    // A stray OK (e.g. after a timed out command's reply) and a URC which
+    // arrive whilst the engine is idle are not taken for the next reply
+    urcLines.clear();
+    Serial2.rx += "\r\nOK\r\n+CMTI: \"SM\",4\r\n";
+    modem_script("AT+GSN\r\r\n861234567890123\r\n\r\nOK\r\n");
+    CHECK_EQ(atSendCommand("AT+GSN", true, 1000, NULL, 0, NULL),
+             AT_RESULT_OK);
+    CHECK_STR(urcLines.c_str(), "+CMTI: \"SM\",4\r\n");
+    CHECK(strstr(modem_reply, "861234567890123") != NULL);
+
+    // A part line gets AT_RESYNC_TIME to finish before the command is sent
+    urcLines.clear();
+    Serial2.rx += "+CMTI: \"SM\",";
+    modem_script("AT\r\r\nOK\r\n");
+    unsigned long id = atQueueCommand("AT", true, 1000, NULL, 0, NULL, NULL);
+    atService();
+    CHECK(modemReceived.empty());
+    Serial2.rx += "5\r\n";
+    atService();
+    CHECK_STR(urcLines.c_str(), "+CMTI: \"SM\",5\r\n");
+    CHECK_STR(modemReceived.c_str(), "AT|");
+    atService();
+    CHECK_EQ(atDoneId, id);
+}
+
+static void test_line_callback() {
+    // The message text is passed to the callback even where it looks like
+    // a result code or a URC
+    callbackLines.clear();
+    urcLines.clear();
+    modem_script("AT+CMGL=\"ALL\"\r\r\n"
+                 "+CMGL: 1,\"REC UNREAD\",\"+441\",,\"17/09/26,10:15:00+04\"\r\n"
+                 "OK\r\n"
+                 "+CMGL: 2,\"REC UNREAD\",\"+441\",,\"17/09/26,10:16:00+04\"\r\n"
+                 "+CMTI: \"SM\",3\r\n"
+                 "\r\nOK\r\n");
+    CHECK_EQ(atSendCommand("AT+CMGL=\"ALL\"", true, 1000, NULL, 0,
+                           sms_lines), AT_RESULT_OK);
+    CHECK(urcLines.empty());
+    CHECK(strstr(callbackLines.c_str(), "+CMGL: 1,") != NULL);
+    CHECK(strstr(callbackLines.c_str(), "\r\nOK\r\n+CMGL: 2,") != NULL);
+    CHECK(strstr(callbackLines.c_str(), "+CMTI: \"SM\",3\r\n") != NULL);
+    // Lines passed to the callback are not kept in modem_reply[]
+    CHECK(strstr(modem_reply, "+CMGL") == NULL);
+}
+
+static void test_queue_and_timeout() {
+    modem_script("AT+CSQ\r\r\n+CSQ: 18,0\r\n\r\nOK\r\n",
+                 "AT+CREG?\r\r\n+CREG: 0,1\r\n\r\nOK\r\n");
+    doneCount = 0;
+    unsigned long id1 = atQueueCommand("AT+CSQ", true, 1000, NULL, 0, NULL,
+                                       on_done);
+    unsigned long id2 = atQueueCommand("AT+CREG?", true, 1000, NULL, 0, NULL,
+                                       on_done);
+    CHECK(atIsPending(id1) && atIsPending(id2));
+    for (int n = 0; (n < 10) && (doneCount < 2); ++n) {
+        atService();
+    }
+    CHECK_EQ(doneCount, 2);
+    CHECK_EQ(doneIds[0], id1);
+    CHECK_EQ(doneIds[1], id2);
+    CHECK(!atIsPending(id1) && !atIsPending(id2));
+    CHECK_STR(modemReceived.c_str(), "AT+CSQ|AT+CREG?|");
+
+    for (size_t idx = 0; idx < AT_QUEUE_LEN; ++idx) {
+        CHECK(atQueueCommand("AT", true, 1000, NULL, 0, NULL, NULL) != 0);
+    }
+    CHECK_EQ(atQueueCommand("AT", true, 1000, NULL, 0, NULL, NULL), 0);
+    atReset();
+    CHECK_EQ(atQueueCount, 0);
+
+    // No reply
+    modem_script("AT+QLTS\r\r\n");
+    unsigned long timeouts = atTimeoutCount;
+    unsigned long start = millis();
+    CHECK_EQ(atSendCommand("AT+QLTS", true, 100, NULL, 0, NULL),
+             AT_RESULT_TIMEOUT);
+    CHECK(timeDiff(millis(), start) >= 100);
+    CHECK_EQ(atTimeoutCount, timeouts + 1);
+    // The late reply is dropped rather than taken for the next command's
+    Serial2.rx += "+QLTS: \"17/09/26,10:15:00+04,0\"\r\n\r\nOK\r\n";
+    modem_script("AT\r\r\nOK\r\n");
+    CHECK_EQ(atSendCommand("AT", true, 1000, NULL, 0, NULL), AT_RESULT_OK);
+    CHECK_STR(modem_reply, "AT\r\r\nOK\r\n");
+}
+
+int main() {
+    Serial2.onWrite = modem_respond;
+    atRegisterURC("+CMTI:", urc_handler);
+    test_classify_line();
+    test_replies();
+    test_prompt();
+    test_raw_data();
+    test_urcs();
+    test_line_callback();
+    test_queue_and_timeout();
+    return hostResult("test_atcmd");
+}
@@ -0,0 +1,76 @@
+/**
+ * Unit tests for the device clock in clock.ino: clockMakeTime() and
+ * clockBreakTime() against the C library's gmtime(), and the clock set from
+ * GPS date and time
+ */
+#include <time.h>
+#include "sketch.h"
+
+#include "clock.ino"
+
+#define UNIX_TIME_2000 946684800UL  // 2000/01/01 00:00:00 in Unix time
+#define UNIX_TIME_2100 4102444800UL
+#define SECS_PER_DAY 86400UL
+
+static void test_make_time() {
+    CHECK_EQ(clockMakeTime(0, 1, 1, 0, 0, 0), 0);
+    CHECK_EQ(clockMakeTime(2000, 1, 1, 0, 0, 1), 1);
+    CHECK_EQ(clockMakeTime(0, 3, 1, 0, 0, 0), 60 * SECS_PER_DAY);
+    CHECK_EQ(clockMakeTime(1, 1, 1, 0, 0, 0), 366 * SECS_PER_DAY);
+    CHECK_EQ(clockMakeTime(17, 9, 26, 10, 15, 0), 559736100);
+    CHECK_EQ(clockMakeTime(99, 12, 31, 23, 59, 59),
+             UNIX_TIME_2100 - 1 - UNIX_TIME_2000);
+}
+
+static void test_round_trip() {
+    unsigned long failures = 0;
+    // Every 7h 13s through 2000..2099, the years the clock handles
+    for (unsigned long t = 0; t < UNIX_TIME_2100 - UNIX_TIME_2000;
+         t += 7 * 3600 + 13) {
+        unsigned year, month, day, hour, mi, sec;
+        clockBreakTime(t, &year, &month, &day, &hour, &mi, &sec);
+        time_t unixTime = t + UNIX_TIME_2000;
+        struct tm expected;
+        gmtime_r(&unixTime, &expected);
+        if ((clockMakeTime(year, month, day, hour, mi, sec) != t) ||
+            ((int)year != expected.tm_year - 100) ||
+            ((int)month != expected.tm_mon + 1) ||
+            ((int)day != expected.tm_mday) ||
+            ((int)hour != expected.tm_hour) ||
+            ((int)mi != expected.tm_min) ||
+            ((int)sec != expected.tm_sec)) {
+            if (failures++ < 5) {
+                printf("%lu: %02u/%02u/%02u %02u:%02u:%02u\n",
+                       t, year, month, day, hour, mi, sec);
+            }
+        }
+    }
+    CHECK_EQ(failures, 0);
+}
+
+static void test_set_from_gps() {
+    char str[24];
+    hostMillis = 1000;
+    CHECK(clockNetworkSyncDue());
+    CHECK_STR(clockFormatTime(str, sizeof(str), clockNow()), BAD_TIME);
+    clockSetFromGPS(TinyGPS::GPS_INVALID_DATE, 10150000);
+    CHECK_EQ(clockNow(), CLOCK_INVALID_TIME);
+    clockSetFromGPS(260917, 10150000);
+    CHECK_EQ(clockSource, CLOCK_SOURCE_GPS);
+    CHECK(!clockNetworkSyncDue());
+    CHECK_EQ(clockNow(), 559736100);
+    hostMillis += 2500;
+    CHECK_EQ(clockNow(), 559736102);
+    CHECK_STR(clockFormatTime(str, sizeof(str), clockNow()),
+              "17/09/26,10:15:02+00");
+    clockTimeZone = -20;
+    CHECK_STR(clockFormatTime(str, sizeof(str), clockNow()),
+              "17/09/26,10:15:02-05");
+}
+
+int main() {
+    test_make_time();
+    test_round_trip();
+    test_set_from_gps();
+    return hostResult("test_clock");
+}
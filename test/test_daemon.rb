@@ -0,0 +1,198 @@
+#!/usr/bin/env ruby
+# Tests daemon/daemon.rb with batches written by formServerBinaryBatch()
+# (see daemon_batches.cpp). The daemon runs as it does in service, in a
+# scratch directory with its own daemon_config.rb, and with a stand-in for
+# the mysql library which appends each query to queries.log.
+#
+# - A sequence numbered datagram batch sent three times is acked three
+#   times and its records are logged once.
+# - A datagram which is not a sequence numbered batch is not acked.
+# - Plain and sequence numbered batches are both accepted over tcp, one
+#   after the other in the same session.
+# - A longitude crossing 180 degrees, where the tracker's 32-bit delta
+#   wraps, is logged as the two longitudes.
+#
+# Usage: test_daemon.rb <daemon_batches program>
+
+require 'socket'
+require 'tmpdir'
+require 'timeout'
+
+DAEMON = File.expand_path("../../daemon/daemon.rb", __FILE__)
+ACK_TIMEOUT = 2
+
+$failures = 0
+
+def check(cond, what)
+    unless cond
+        $failures += 1
+        puts "test_daemon.rb: #{what} failed"
+    end
+end
+
+# A free port to give the daemon
+def free_port(type)
+    socket = (type == UDPSocket) ? UDPSocket.new : TCPServer.new("127.0.0.1", 0)
+    socket.bind("127.0.0.1", 0) if type == UDPSocket
+    port = socket.local_address.ip_port
+    socket.close
+    port
+end
+
+# The binary batch coding, as in data.ino
+def varint(value)
+    bytes = []
+    loop do
+        byte = value & 0x7f
+        value >>= 7
+        bytes << ((value > 0) ? (byte | 0x80) : byte)
+        break if value == 0
+    end
+    bytes
+end
+
+def string(str)
+    varint(str.length) + str.bytes
+end
+
+# A zig-zag coded delta, computed as the tracker does in a 32-bit long
+def delta(value, prev)
+    d = (value - prev) & 0xFFFFFFFF
+    d -= 0x100000000 if d >= 0x80000000
+    varint(((d << 1) ^ (d >> 31)) & 0xFFFFFFFF)
+end
+
+# The INSERTs into the log table so far, as [latitude, longitude, ignition]
+def logged(dir)
+    path = File.join(dir, "queries.log")
+    return [] unless File.exist? path
+    File.readlines(path).grep(/^INSERT into `log`/).map do |query|
+        query[/values \((.*)\);/, 1].split(",")[1, 3].join(",")
+    end
+end
+
+# Waits for the daemon to have logged count records
+def wait_logged(dir, count)
+    Timeout.timeout(ACK_TIMEOUT) do
+        sleep 0.05 while logged(dir).length < count
+    end
+rescue Timeout::Error
+end
+
+# Reads an ack of len bytes from a tcp session
+def tcp_ack(session, len)
+    Timeout.timeout(ACK_TIMEOUT) { session.read(len) }
+rescue Timeout::Error
+    nil
+end
+
+# Waits for a datagram ack
+def udp_ack(socket)
+    return nil unless IO.select([socket], nil, nil, ACK_TIMEOUT)
+    socket.recv(100)
+end
+
+Dir.mktmpdir do |dir|
+    system(ARGV[0], dir) or abort "#{ARGV[0]} failed"
+    seq_batch = File.binread(File.join(dir, "seq.bin"))
+    plain_batch = File.binread(File.join(dir, "plain.bin"))
+    expected = File.readlines(File.join(dir, "expected.txt")).map(&:chomp)
+
+    Dir.mkdir(File.join(dir, "lib"))
+    File.write(File.join(dir, "lib", "process.rb"), "")
+    File.write(File.join(dir, "lib", "mysql.rb"), <<~EOS)
+        class Mysql
+            def initialize(*args); end
+            def query(sql)
+                File.open("queries.log", "a") { |log| log.puts sql }
+                nil
+            end
+            def close; end
+        end
+    EOS
+    port = free_port(TCPServer)
+    udp_port = free_port(UDPSocket)
+    File.write(File.join(dir, "daemon_config.rb"), <<~EOS)
+        $key = "abcdefghijkl"
+        $server = "127.0.0.1"
+        $port = #{port}
+        $udp_port = #{udp_port}
+        $udp_duplicate_window = 300
+        $user = #{Process.uid}
+        $group = #{Process.euid}
+        $include_key = true
+        $include_timestamp = false
+        $include_latitude = true
+        $include_longitude = true
+        $include_ignition_state = true
+        $timestamp_use = 'server'
+        $show_received = false
+        $debug = false
+        $detect_engineoff_movement = false
+        $detect_enginestart_athome = false
+        $detect_enginestart_overnight = false
+        $log_journeys = false
+    EOS
+
+    daemon = spawn("ruby", "-I", "lib", DAEMON, :chdir => dir,
+                   [:out, :err] => File.join(dir, "daemon.log"))
+    begin
+        Timeout.timeout(5) do
+            begin
+                TCPSocket.new("127.0.0.1", port).close
+            rescue Errno::ECONNREFUSED
+                sleep 0.05
+                retry
+            end
+        end
+
+        # Datagrams: a resent batch is acked each time but logged once
+        udp = UDPSocket.new
+        udp.connect("127.0.0.1", udp_port)
+        3.times do
+            udp.send(seq_batch, 0)
+            check(udp_ack(udp) == "eof 42", "datagram ack")
+        end
+        udp.send(plain_batch, 0)
+        check(udp_ack(udp).nil?, "no ack for a plain batch datagram")
+        wait_logged(dir, expected.length)
+        check(logged(dir) == expected, "datagram batch logged once")
+
+        # tcp: a plain batch then a sequence numbered one in one session
+        session = TCPSocket.new("127.0.0.1", port)
+        session.write(plain_batch)
+        check(tcp_ack(session, 3) == "eof", "plain batch ack")
+        session.write(seq_batch)
+        check(tcp_ack(session, 3) == "eof", "sequence numbered batch ack")
+        session.close
+        wait_logged(dir, expected.length * 3)
+        check(logged(dir) == expected * 3, "tcp batches logged")
+
+        # Two records either side of 180 degrees longitude
+        mask = (1 << 2) | (1 << 3) | (1 << 10)
+        payload = string("123456789012345") + string("abcdefghijkl") +
+                  varint(mask) + varint(2)
+        payload += varint(0x01) + delta(559736100, 0) +
+                   delta(515020570, 0) + delta(1799999000, 0)
+        payload += varint(0x01) + delta(559736101, 559736100) +
+                   delta(515020570, 515020570) + delta(-1799999000, 1799999000)
+        session = TCPSocket.new("127.0.0.1", port)
+        session.write(["OT", 1, payload.length].pack("a2Cv") +
+                      payload.pack("C*"))
+        check(tcp_ack(session, 3) == "eof", "wrapped batch ack")
+        session.close
+        wait_logged(dir, expected.length * 3 + 2)
+        check(logged(dir).last(2) == ["51.502057,179.999900,0",
+                                      "51.502057,-179.999900,0"],
+              "longitude across 180 degrees")
+    ensure
+        Process.kill("INT", daemon)
+        Process.wait(daemon)
+    end
+    if $failures > 0
+        puts File.read(File.join(dir, "daemon.log"))
+    end
+end
+
+puts "test_daemon.rb: " + (($failures == 0) ? "ok" : "#{$failures} failed")
+exit($failures == 0)
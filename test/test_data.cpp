@@ -0,0 +1,232 @@
+/**
+ * Unit tests for the binary server batch encoding in data.ino: the varint,
+ * delta and string coding, and a batch from formServerBinaryBatch() decoded
+ * the way the daemon decodes it
+ */
+#include <vector>
+#include "sketch.h"
+
+SETTINGS_T config;
+
+#include "clock.ino"
+#include "data.ino"
+
+/**
+ * As in Opentracker_3_0_1.ino, for batches of records in RAM
+ */
+void serverBatchRewind(
+    SERVER_BATCH_T* pBatch
+) {
+    pBatch->readCount = 0;
+}
+
+bool serverBatchRead(
+    SERVER_BATCH_T* pBatch,
+    SERVER_DATA_T* pServerData
+) {
+    if (pBatch->readCount >= pBatch->count) {
+        return false;
+    }
+    *pServerData = pBatch->pServerData[pBatch->readCount++];
+    return true;
+}
+
+static std::vector<uint8_t> batchBytes;
+static size_t batchWriteLimit = ~(size_t)0;
+
+static bool write_batch(
+    const uint8_t* pData,
+    size_t len
+) {
+    if (batchBytes.size() + len > batchWriteLimit) {
+        return false;
+    }
+    batchBytes.insert(batchBytes.end(), pData, pData + len);
+    return true;
+}
+
+static void test_varint() {
+    static const unsigned long VALUES[] = {
+        0, 1, 0x7F, 0x80, 0x3FFF, 0x4000, 123456789, 0xFFFFFFFFUL
+    };
+    static const size_t LENGTHS[] = { 1, 1, 1, 2, 2, 3, 4, 5 };
+    uint8_t buf[8];
+    for (size_t idx = 0; idx < DIM(VALUES); ++idx) {
+        uint8_t* pEnd = data_put_varint(buf, buf + sizeof(buf), VALUES[idx]);
+        CHECK(pEnd != NULL);
+        CHECK_EQ((size_t)(pEnd - buf), LENGTHS[idx]);
+        unsigned long value;
+        CHECK(data_get_varint(buf, pEnd, &value) == pEnd);
+        CHECK_EQ(value, VALUES[idx]);
+        // Too little room, or too little data
+        CHECK(data_put_varint(buf, buf + LENGTHS[idx] - 1, VALUES[idx]) == NULL);
+        CHECK(data_get_varint(buf, pEnd - 1, &value) == NULL);
+    }
+    CHECK(data_put_varint(NULL, buf + sizeof(buf), 1) == NULL);
+    unsigned long value;
+    CHECK(data_get_varint(NULL, buf + sizeof(buf), &value) == NULL);
+    // No more than 5 bytes
+    memset(buf, 0xFF, sizeof(buf));
+    CHECK(data_get_varint(buf, buf + sizeof(buf), &value) == NULL);
+}
+
+static void test_delta() {
+    // Deltas which fit in 32 bits, as unsigned long is 64 bits here
+    static const long VALUES[] = {
+        0, 1, -1, 515020570, -1927970, 515020570, 0x7FFFFFFFL, 0,
+        -0x7FFFFFFFL, 0, 63, 64, -64, -65
+    };
+    uint8_t buf[5 * DIM(VALUES)];
+    uint8_t* pPos = buf;
+    long prev = 0;
+    for (size_t idx = 0; idx < DIM(VALUES); ++idx) {
+        pPos = data_put_delta(pPos, buf + sizeof(buf), VALUES[idx], &prev);
+        CHECK_EQ(prev, VALUES[idx]);
+    }
+    CHECK(pPos != NULL);
+    // Small changes either way take one byte
+    prev = 100;
+    CHECK_EQ(data_put_delta(buf, buf + 1, 37, &prev) - buf, 1);
+    CHECK_EQ(buf[0], 125);   // -63 zig-zags to 125
+    prev = 0;
+    const uint8_t* pRead = buf;
+    pPos = buf;
+    for (size_t idx = 0; idx < DIM(VALUES); ++idx) {
+        pPos = data_put_delta(pPos, buf + sizeof(buf), VALUES[idx], &prev);
+    }
+    long value = 0;
+    for (size_t idx = 0; idx < DIM(VALUES); ++idx) {
+        pRead = data_get_delta(pRead, pPos, &value);
+        CHECK(pRead != NULL);
+        CHECK_EQ(value, VALUES[idx]);
+    }
+    CHECK(pRead == pPos);
+}
+
+static void test_string() {
+    uint8_t buf[20];
+    uint8_t* pEnd = data_put_string(buf, buf + sizeof(buf), "123456789012345");
+    CHECK_EQ(pEnd - buf, 16);
+    CHECK_EQ(buf[0], 15);
+    CHECK(memcmp(buf + 1, "123456789012345", 15) == 0);
+    CHECK(data_put_string(buf, buf + 15, "123456789012345") == NULL);
+    CHECK_EQ(data_put_string(buf, buf + 1, "") - buf, 1);
+}
+
+/**
+ * Reads a length prefixed string written by data_put_string()
+ */
+static const uint8_t* get_string(
+    const uint8_t* pPos,
+    const uint8_t* pEnd,
+    std::string* pStr
+) {
+    unsigned long len = 0;
+    pPos = data_get_varint(pPos, pEnd, &len);
+    if ((pPos == NULL) || (pPos + len > pEnd)) {
+        return NULL;
+    }
+    pStr->assign((const char*)pPos, len);
+    return pPos + len;
+}
+
+static void test_batch(
+    unsigned sequence
+) {
+    static SERVER_DATA_T records[20];
+    for (size_t idx = 0; idx < DIM(records); ++idx) {
+        memset(&records[idx], 0, sizeof(records[idx]));
+        GPSDATA_T* pFix = &records[idx].gpsData;
+        pFix->fixAge = (idx == 5) ? (unsigned long)TinyGPS::GPS_INVALID_AGE : 5;
+        pFix->lat = 515020570 + idx * 1000;
+        pFix->lon = -1927970 - idx * 77;
+        pFix->alt = 5230;
+        pFix->speed = 1200 + idx;
+        pFix->course = 9000;
+        pFix->hdop = 90;
+        pFix->nsats = 9;
+        pFix->date = 260917;
+        pFix->time = 10150000 + idx * 100;
+        records[idx].captureTime = 559736100 + idx;
+        records[idx].ignState = (idx & 1);
+        records[idx].engineRuntime = idx * 3;
+    }
+    strcpy(config.imei, "123456789012345");
+    strcpy(config.key, "abcdefghijkl");
+    config.server_send_flags = SERVER_SEND_DEFAULT;
+    SERVER_BATCH_T batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.pServerData = records;
+    batch.count = DIM(records);
+    batchBytes.clear();
+    CHECK(formServerBinaryBatch(&batch, sequence, write_batch));
+
+    const uint8_t* pPos = &batchBytes[0];
+    const uint8_t* pEnd = pPos + batchBytes.size();
+    CHECK_EQ(pPos[0], SERVER_BINARY_MAGIC1);
+    CHECK_EQ(pPos[1], SERVER_BINARY_MAGIC2);
+    CHECK_EQ(pPos[2], (sequence != 0) ? SERVER_BINARY_VERSION_SEQ
+                                      : SERVER_BINARY_VERSION);
+    CHECK_EQ(pPos[3] | (pPos[4] << 8),
+             batchBytes.size() - SERVER_BINARY_HEADER_LEN);
+    pPos += SERVER_BINARY_HEADER_LEN;
+    unsigned long value = 0;
+    if (sequence != 0) {
+        pPos = data_get_varint(pPos, pEnd, &value);
+        CHECK_EQ(value, sequence);
+    }
+    std::string imei;
+    std::string key;
+    pPos = get_string(pPos, pEnd, &imei);
+    pPos = get_string(pPos, pEnd, &key);
+    CHECK(imei == config.imei);
+    CHECK(key == config.key);
+    unsigned long fieldMask = 0;
+    unsigned long count = 0;
+    pPos = data_get_varint(pPos, pEnd, &fieldMask);
+    pPos = data_get_varint(pPos, pEnd, &count);
+    CHECK_EQ(fieldMask, (SERVER_SEND_DEFAULT) & SERVER_SEND_FIELDS_MASK);
+    CHECK_EQ(count, DIM(records));
+    long prev[SERVER_SEND_FIELD_COUNT + 1] = { 0 };
+    for (size_t idx = 0; (idx < count) && (pPos != NULL); ++idx) {
+        const SERVER_DATA_T* pRecord = &records[idx];
+        unsigned long flags = 0;
+        pPos = data_get_varint(pPos, pEnd, &flags);
+        bool gpsValid = (flags & SERVER_RECORD_GPS_VALID) != 0;
+        CHECK_EQ(gpsValid, pRecord->gpsData.fixAge != TinyGPS::GPS_INVALID_AGE);
+        CHECK_EQ((flags & SERVER_RECORD_IGN_ON) != 0, pRecord->ignState);
+        pPos = data_get_delta(pPos, pEnd, &prev[SERVER_SEND_FIELD_COUNT]);
+        CHECK_EQ(prev[SERVER_SEND_FIELD_COUNT], pRecord->captureTime);
+        for (unsigned field = 0; field < SERVER_SEND_FIELD_COUNT; ++field) {
+            if (((fieldMask >> field) & 1) && (field != SERVER_SEND_IGN_POS) &&
+                (gpsValid || (field >= SERVER_SEND_BATT_POS))) {
+                pPos = data_get_delta(pPos, pEnd, &prev[field]);
+            }
+        }
+        if (gpsValid) {
+            CHECK_EQ(prev[SERVER_SEND_GPSDATE_POS], 559699200 / (24 * 60 * 60));
+            CHECK_EQ(prev[SERVER_SEND_GPSTIME_POS],
+                     10 * 360000 + 15 * 6000 + idx * 100);
+            CHECK_EQ(prev[SERVER_SEND_LATITUDE_POS], pRecord->gpsData.lat);
+            CHECK_EQ(prev[SERVER_SEND_LONGITUDE_POS], pRecord->gpsData.lon);
+            CHECK_EQ(prev[SERVER_SEND_SPEED_POS], pRecord->gpsData.speed);
+        }
+        CHECK_EQ(prev[SERVER_SEND_BATT_POS], dataBatteryLevel);
+    }
+    CHECK(pPos == pEnd);
+
+    // A failed write stops the batch
+    batchWriteLimit = batchBytes.size() / 2;
+    batchBytes.clear();
+    CHECK(!formServerBinaryBatch(&batch, sequence, write_batch));
+    batchWriteLimit = ~(size_t)0;
+}
+
+int main() {
+    test_varint();
+    test_delta();
+    test_string();
+    test_batch(0);
+    test_batch(12345);
+    return hostResult("test_data");
+}
@@ -0,0 +1,172 @@
+/**
+ * Unit tests for the fixed point GPS helpers in gps.ino, and for the fix
+ * readGPSData() decodes from received NMEA data
+ */
+#include "sketch.h"
+
+TinyGPS gps;
+void blink_got_gps() {}
+
+#include "scheduler.ino"
+#include "gps.ino"
+
+/**
+ * Great circle distance in meters, for comparison
+ */
+static double haversine(
+    double lat1,
+    double lon1,
+    double lat2,
+    double lon2
+) {
+    const double R = 6371000.0;
+    const double RAD = M_PI / 180.0;
+    double dLat = (lat2 - lat1) * RAD;
+    double dLon = (lon2 - lon1) * RAD;
+    double h = sin(dLat / 2) * sin(dLat / 2) +
+        cos(lat1 * RAD) * cos(lat2 * RAD) * sin(dLon / 2) * sin(dLon / 2);
+    return 2 * R * asin(sqrt(h));
+}
+
+static void test_speed_conversions() {
+    CHECK_EQ(gps_knots100_to_cms(0), 0);
+    CHECK_EQ(gps_knots100_to_cms(1000), 514);      // 10 knots
+    for (unsigned long knots100 = 0; knots100 < 20000; knots100 += 7) {
+        // 1 knot = 51.4444 cm/s, to 0.01% and the rounding to 1 cm/s
+        double cms = knots100 * 0.514444;
+        CHECK(fabs(gps_knots100_to_cms(knots100) - cms) <= 0.5 + cms / 10000);
+    }
+    CHECK_EQ(gps_knots100_to_cms(TinyGPS::GPS_INVALID_SPEED),
+             TinyGPS::GPS_INVALID_SPEED);
+    CHECK_EQ(gps_cms_to_kmph100(0), 0);
+    CHECK_EQ(gps_cms_to_kmph100(100), 360);        // 1 m/s = 3.6 km/h
+    CHECK_EQ(gps_cms_to_kmph100(514), 1850);
+    CHECK_EQ(gps_cms_to_kmph100(TinyGPS::GPS_INVALID_SPEED),
+             TinyGPS::GPS_INVALID_SPEED);
+}
+
+static void test_form_fixed_str() {
+    char str[20];
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), 515000000, 7, 6),
+              "51.500000");
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), -41234567, 7, 6),
+              "-4.123457");
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), 5, 7, 6), "0.000001");
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), -5, 7, 6), "-0.000001");
+    // No "-0.000000" for values which round to 0
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), -4, 7, 6), "0.000000");
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), 1799999999, 7, 6),
+              "180.000000");
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), -1800000000, 7, 6),
+              "-180.000000");
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), 12345, 2, 2), "123.45");
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), 12345, 2, 1), "123.5");
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), -12345, 2, 0), "-123");
+    CHECK_STR(gps_form_fixed_str(str, sizeof(str), 7, 2, 2), "0.07");
+    // Truncated to fit, like snprintf()
+    CHECK_STR(gps_form_fixed_str(str, 5, 515000000, 7, 6), "51.5");
+}
+
+static void test_isqrt() {
+    CHECK_EQ(gps_isqrt(0), 0);
+    CHECK_EQ(gps_isqrt(1), 1);
+    CHECK_EQ(gps_isqrt(3), 1);
+    CHECK_EQ(gps_isqrt(4), 2);
+    CHECK_EQ(gps_isqrt(99), 9);
+    CHECK_EQ(gps_isqrt(1000000), 1000);
+    CHECK_EQ(gps_isqrt((uint64_t)1 << 62), (uint64_t)1 << 31);
+    CHECK_EQ(gps_isqrt(~(uint64_t)0), 0xFFFFFFFFu);
+    for (uint64_t value = 1; value < ((uint64_t)1 << 60); value = value * 3 + 7) {
+        uint64_t root = gps_isqrt(value);
+        CHECK((root * root <= value) && ((root + 1) * (root + 1) > value));
+    }
+}
+
+static void test_distance() {
+    static const double POINTS[][4] = {
+        { 51.5, -0.12, 51.501, -0.121 },
+        { 51.5, -0.12, 51.5, -0.1185 },
+        { 10.0, 10.0, 10.0009, 10.0 },
+        { -33.9, 18.4, -33.95, 18.45 },
+        { 0.0, 0.0, 0.1, 0.1 },
+        { 69.6, 18.9, 69.65, 19.0 },
+        { 60.0, 179.9999, 60.0, -179.9999 }
+    };
+    for (size_t idx = 0; idx < DIM(POINTS); ++idx) {
+        const double* p = POINTS[idx];
+        double expected = haversine(p[0], p[1], p[2], p[3]);
+        unsigned long distance = gps_distance_between(
+            lround(p[0] * 1e7), lround(p[1] * 1e7),
+            lround(p[2] * 1e7), lround(p[3] * 1e7));
+        // Good to 1% (or 1m) over the distances the tracker compares
+        if (fabs(distance - expected) > MAX(1.0, expected / 100)) {
+            printf("distance %zu: %lu m, expected %.1f m\n",
+                   idx, distance, expected);
+            CHECK(false);
+        }
+    }
+    int64_t dx;
+    int64_t dy;
+    gps_offset_between(515000000, -1000000, 515010000, -999000, &dx, &dy);
+    CHECK((dx > 0) && (dy > 0));
+    CHECK_EQ(dy, 1111);
+    gps_offset_between(0, 1799999000, 0, -1799999000, &dx, &dy);
+    CHECK_EQ(dx, 222);
+    CHECK_EQ(dy, 0);
+}
+
+/**
+ * Appends an NMEA sentence to the GPS receive buffer, as the PDC would
+ */
+static void receive_sentence(
+    const char* pBody
+) {
+    unsigned char sum = 0;
+    for (const char* p = pBody; *p != '\0'; ++p) {
+        sum ^= *p;
+    }
+    char sentence[128];
+    int len = snprintf(sentence, sizeof(sentence), "$%s*%02X\r\n", pBody, sum);
+    memcpy((uint8_t*)(uintptr_t)USART0->US_RPR, sentence, len);
+    USART0->US_RPR += len;
+    USART0->US_RCR -= len;
+}
+
+static void test_read_fix() {
+    TASK_T task = TASK("gps", NULL, 0, 5);
+    GPSDATA_T fix;
+    memset(&fix, 0, sizeof(fix));
+    hostMillis = 0;
+    gpsRxStart();
+    schedulerStepStart = micros();
+    CHECK(!readGPSData(&fix, &task));
+    receive_sentence("GPGGA,101500.000,5130.1234,N,00011.5678,W,1,09,0.9,"
+                     "52.3,M,47.0,M,,");
+    receive_sentence("GPRMC,101500.000,A,5130.1234,N,00011.5678,W,12.34,"
+                     "123.45,170926,,,A");
+    schedulerStepStart = micros();
+    CHECK(readGPSData(&fix, &task));
+    // 51deg 30.1234' N, 0deg 11.5678' W, TinyGPS resolves 1e-6 degrees
+    CHECK_EQ(fix.lat, 515020570);
+    CHECK_EQ(fix.lon, -1927970);
+    CHECK_EQ(fix.alt, 5230);               // cm
+    CHECK_EQ(fix.course, 12345);           // 100ths of a degree
+    CHECK_EQ(fix.speed, 635);              // 12.34 knots in cm/s
+    CHECK_EQ(fix.hdop, 90);
+    CHECK_EQ(fix.nsats, 9);
+    CHECK_EQ(fix.date, 170926);
+    CHECK_EQ(fix.time, 10150000);
+    // Nothing more received
+    schedulerStepStart = micros();
+    CHECK(!readGPSData(&fix, &task));
+    CHECK_EQ(gpsRxOverruns, 0);
+}
+
+int main() {
+    test_speed_conversions();
+    test_form_fixed_str();
+    test_isqrt();
+    test_distance();
+    test_read_fix();
+    return hostResult("test_gps");
+}
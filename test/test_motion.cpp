@@ -0,0 +1,209 @@
+/**
+ * Unit tests for the motion detection in motion.ino: fixes are fed to
+ * motionUpdate() and the motion state, pending park report and server
+ * update period checked after each
+ */
+#include "sketch.h"
+
+SETTINGS_T config;
+TinyGPS gps;
+void blink_got_gps() {}
+MOTION_STATE_T motionState = MOTION_MOVING;
+GPSDATA_T motionRest;
+bool motionParkPending = false;
+unsigned long serverUpdatePeriod;
+bool ignState = true;
+unsigned long engineRunningTime = 0;
+GSMSTATUS_T gsmNetworkStatus = CONNECTED;
+
+#include "gps.ino"
+#include "motion.ino"
+
+#define TEST_FAST_INTERVAL 10
+#define TEST_SLOW_INTERVAL 600
+#define TEST_HDOP 100           // HDOP 1.0, a radius of 30 m with itself
+
+/**
+ * Makes a fix a distance north of the start
+ * @param meters the distance north
+ * @param speed the speed in cm/s
+ * @param hdop the HDOP in 100ths
+ */
+static GPSDATA_T make_fix(
+    unsigned long meters,
+    unsigned long speed,
+    unsigned long hdop
+) {
+    GPSDATA_T fix;
+    memset(&fix, 0, sizeof(fix));
+    fix.fixAge = 10;
+    fix.lat = 515000000 + (long)(meters / 0.0111195);
+    fix.lon = -1000000;
+    fix.speed = speed;
+    fix.hdop = hdop;
+    return fix;
+}
+
+/**
+ * Feeds a fix to motionUpdate() a second after the last one
+ */
+static void feed(
+    unsigned long meters,
+    unsigned long speed,
+    unsigned long hdop
+) {
+    delay(1000);
+    GPSDATA_T fix = make_fix(meters, speed, hdop);
+    motionUpdate(&fix);
+}
+
+static void check_state(
+    MOTION_STATE_T state,
+    int line
+) {
+    if (motionState != state) {
+        printf("test_motion.cpp:%d: state %s, expected %s\n", line,
+               motionStateName(motionState), motionStateName(state));
+        ++hostFailures;
+    }
+    CHECK_EQ(motionParkPending, state == MOTION_PARKED);
+    CHECK_EQ(serverUpdatePeriod, (state == MOTION_MOVING)
+        ? TEST_FAST_INTERVAL : TEST_SLOW_INTERVAL);
+}
+#define CHECK_STATE(state) check_state(state, __LINE__)
+
+/**
+ * Starts each test moving, then stopped at 0 m with HDOP 1.0
+ */
+static void stop() {
+    config.fast_server_interval = TEST_FAST_INTERVAL;
+    config.slow_server_interval = TEST_SLOW_INTERVAL;
+    ignState = true;
+    motionSetState(MOTION_MOVING);
+    CHECK_STATE(MOTION_MOVING);
+    feed(0, MOTION_STOP_SPEED, TEST_HDOP);
+    CHECK_STATE(MOTION_MOVING);
+    feed(0, MOTION_STOP_SPEED - 1, TEST_HDOP);
+    CHECK_STATE(MOTION_STOPPING);
+}
+
+static void test_radius() {
+    // Wander within 20 m plus 5 m for each unit of the two HDOPs
+    stop();
+    for (int idx = 0; idx < 10; ++idx) {
+        feed(29, 0, TEST_HDOP);
+        CHECK_STATE(MOTION_STOPPING);
+    }
+    // A worse fix widens the radius, to 50 m for HDOP 5.0
+    for (int idx = 0; idx < 10; ++idx) {
+        feed(49, 0, 500);
+        CHECK_STATE(MOTION_STOPPING);
+    }
+    // and HDOP is taken as at most 20.0, 125 m
+    for (int idx = 0; idx < 10; ++idx) {
+        feed(124, 0, 9999);
+        CHECK_STATE(MOTION_STOPPING);
+    }
+    for (int idx = 1; idx < MOTION_START_FIXES; ++idx) {
+        feed(126, 0, 9999);
+        CHECK_STATE(MOTION_STOPPING);
+    }
+    feed(126, 0, 9999);
+    CHECK_STATE(MOTION_MOVING);
+
+    // A better fix of where we stopped narrows the radius
+    stop();
+    feed(0, 0, 50);
+    for (int idx = 0; idx < MOTION_START_FIXES; ++idx) {
+        CHECK_STATE(MOTION_STOPPING);
+        feed(26, 0, 50);
+    }
+    CHECK_STATE(MOTION_MOVING);
+}
+
+static void test_start_fixes() {
+    stop();
+    // Moving fixes must come MOTION_START_FIXES in a row
+    for (int idx = 1; idx < MOTION_START_FIXES; ++idx) {
+        feed(0, MOTION_START_SPEED, TEST_HDOP);
+        CHECK_STATE(MOTION_STOPPING);
+    }
+    feed(0, MOTION_START_SPEED - 1, TEST_HDOP);
+    CHECK_STATE(MOTION_STOPPING);
+    for (int idx = 1; idx < MOTION_START_FIXES; ++idx) {
+        feed(31, 0, TEST_HDOP);
+        CHECK_STATE(MOTION_STOPPING);
+    }
+    // by speed or by distance
+    feed(0, MOTION_START_SPEED, TEST_HDOP);
+    CHECK_STATE(MOTION_MOVING);
+}
+
+static void test_dwell() {
+    // Ignition on
+    stop();
+    unsigned long stopTime = millis();
+    while (millis() - stopTime + 1000 < MOTION_DWELL) {
+        feed(10, 0, TEST_HDOP);
+        CHECK_STATE(MOTION_STOPPING);
+    }
+    feed(10, 0, TEST_HDOP);
+    CHECK_STATE(MOTION_PARKED);
+    // The park is reported once, then only heartbeats
+    motionParkPending = false;
+    feed(10, 0, TEST_HDOP);
+    CHECK_EQ(motionState, MOTION_PARKED);
+    CHECK(!motionParkPending);
+
+    // Ignition off
+    stop();
+    ignState = false;
+    stopTime = millis();
+    while (millis() - stopTime + 1000 < MOTION_DWELL_IGN_OFF) {
+        feed(10, 0, TEST_HDOP);
+        CHECK_STATE(MOTION_STOPPING);
+    }
+    feed(10, 0, TEST_HDOP);
+    CHECK_STATE(MOTION_PARKED);
+
+    // Moving off from parked
+    for (int idx = 1; idx < MOTION_START_FIXES; ++idx) {
+        feed(0, MOTION_START_SPEED, TEST_HDOP);
+        CHECK_STATE(MOTION_PARKED);
+    }
+    feed(0, MOTION_START_SPEED, TEST_HDOP);
+    CHECK_STATE(MOTION_MOVING);
+}
+
+static void test_wake() {
+    stop();
+    ignState = false;
+    for (unsigned long secs = 0; secs < MOTION_DWELL_IGN_OFF / 1000; ++secs) {
+        feed(0, 0, TEST_HDOP);
+    }
+    CHECK_STATE(MOTION_PARKED);
+    // The engine starting wakes us, and the ignition on dwell time starts
+    ignState = true;
+    delay(MINS(10));
+    motionWake();
+    CHECK_STATE(MOTION_STOPPING);
+    unsigned long wakeTime = millis();
+    while (millis() - wakeTime + 1000 < MOTION_DWELL) {
+        feed(0, 0, TEST_HDOP);
+        CHECK_STATE(MOTION_STOPPING);
+    }
+    feed(0, 0, TEST_HDOP);
+    CHECK_STATE(MOTION_PARKED);
+    // Only from parked
+    motionSetState(MOTION_MOVING);
+    motionWake();
+    CHECK_STATE(MOTION_MOVING);
+}
+
+int main() {
+    test_radius();
+    test_start_fixes();
+    test_dwell();
+    test_wake();
+    return hostResult("test_motion");
+}
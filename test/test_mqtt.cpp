@@ -0,0 +1,622 @@
+/**
+ * Tests for the mqtt transport (mqtt.ino) against a broker on a local port,
+ * which mqtt_broker.rb starts. The tracker's TCP session is a socket to the
+ * broker in place of the modem's, with the TCP data passed on in the
+ * PACKET_SIZE chunks gsm.ino sends to the modem. The test plays the server
+ * side over a second connection, subscribed to the data topics and
+ * publishing commands.
+ *
+ *   test_mqtt <broker port>
+ */
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "sketch.h"
+
+SETTINGS_T config;
+char modem_data[PACKET_SIZE];
+size_t modem_data_len = 0;
+bool gsmSessionOpen = false;
+unsigned long gsmSessionSetupCount = 0;
+
+static int brokerPort = 0;
+static int trackerSocket = -1;
+static std::string trackerSent;       // what the tracker sent the broker
+static std::string trackerReceived;   // and what it read back
+static std::string trackerInjected;   // read before the socket, see below
+static std::vector<size_t> trackerFlushes; // bytes in each chunk sent
+static std::vector<std::string> smsCommands;
+
+#define TEST_IMEI "123456789012345"
+#define TEST_DATA_TOPIC MQTT_TOPIC_PREFIX TEST_IMEI MQTT_DATA_TOPIC
+#define TEST_COMMAND_TOPIC MQTT_TOPIC_PREFIX TEST_IMEI MQTT_COMMAND_TOPIC
+#define TEST_WAIT_MS 2000             // real time to wait for the broker
+
+/**
+ * Connects a socket to the broker
+ * @return the socket, -1 if it failed
+ */
+static int broker_connect() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(brokerPort);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/**
+ * Opens the tracker's TCP session, as gsmOpenSession() does
+ */
+static void open_session() {
+    trackerSocket = broker_connect();
+    gsmSessionOpen = (trackerSocket >= 0);
+    gsmSessionSetupCount += 1;
+}
+
+void gsmCloseSession() {
+    if (trackerSocket >= 0) {
+        close(trackerSocket);
+    }
+    trackerSocket = -1;
+    gsmSessionOpen = false;
+}
+
+/**
+ * Sends modem_data[] to the broker, as AT+QISEND does
+ */
+bool gsmFlushTcpData() {
+    bool rStat = true;
+    if (modem_data_len > 0) {
+        trackerFlushes.push_back(modem_data_len);
+        trackerSent.append(modem_data, modem_data_len);
+        rStat = gsmSessionOpen &&
+            (send(trackerSocket, modem_data, modem_data_len, MSG_NOSIGNAL) ==
+             (ssize_t)modem_data_len);
+        modem_data_len = 0;
+    }
+    return rStat;
+}
+
+/**
+ * As in gsm.ino, passing modem_data[] on each time it fills up
+ */
+bool gsmWriteTcpBytes(
+    const uint8_t* pData,
+    size_t len
+) {
+    bool rStat = true;
+    while (rStat && len--) {
+        if (modem_data_len >= sizeof(modem_data)) {
+            rStat = gsmFlushTcpData();
+        }
+        modem_data[modem_data_len++] = *pData++;
+    }
+    return rStat;
+}
+
+bool gsmWriteTcpData(
+    const char* pText
+) {
+    return gsmWriteTcpBytes((const uint8_t*)pText, strlen(pText));
+}
+
+/**
+ * Reads what the broker has sent, as AT+QIRD does. Data the test injects
+ * is read first.
+ */
+size_t parse_read_server_data(
+    char* pBuffer,
+    size_t bufferSize
+) {
+    if (!trackerInjected.empty()) {
+        size_t len = MIN(bufferSize, trackerInjected.size());
+        memcpy(pBuffer, trackerInjected.data(), len);
+        trackerInjected.erase(0, len);
+        return len;
+    }
+    if (!gsmSessionOpen) {
+        return 0;
+    }
+    ssize_t len = recv(trackerSocket, pBuffer, bufferSize, MSG_DONTWAIT);
+    if (len == 0) {
+        gsmCloseSession();
+    }
+    if (len <= 0) {
+        return 0;
+    }
+    trackerReceived.append(pBuffer, len);
+    return len;
+}
+
+/**
+ * Lets the time pass, but only a tenth of it in real time, so the broker
+ * can answer whilst the timeouts stay short
+ */
+void gsmDelay(
+    unsigned long ms
+) {
+    usleep(ms * 100);
+    delay(ms);
+}
+
+void sms_cmd(
+    char* pSMSMessage,
+    char* pPhone
+) {
+    CHECK_STR(pPhone, "");
+    smsCommands.push_back(pSMSMessage);
+}
+
+/**
+ * As in Opentracker_3_0_1.ino, for batches of records in RAM
+ */
+void serverBatchRewind(
+    SERVER_BATCH_T* pBatch
+) {
+    pBatch->readCount = 0;
+}
+
+bool serverBatchRead(
+    SERVER_BATCH_T* pBatch,
+    SERVER_DATA_T* pServerData
+) {
+    if (pBatch->readCount >= pBatch->count) {
+        return false;
+    }
+    *pServerData = pBatch->pServerData[pBatch->readCount++];
+    return true;
+}
+
+#include "clock.ino"
+#include "data.ino"
+#include "mqtt.ino"
+
+/**
+ * An MQTT control packet
+ */
+typedef struct {
+    uint8_t type;                     // the first header byte
+    std::string body;                 // what follows the fixed header
+} PACKET_T;
+
+static std::string u16(
+    unsigned value
+) {
+    return std::string(1, (char)(value >> 8)) + (char)(value & 0xFF);
+}
+
+static unsigned get_u16(
+    const std::string& data,
+    size_t pos
+) {
+    return ((uint8_t)data[pos] << 8) | (uint8_t)data[pos + 1];
+}
+
+static std::string make_packet(
+    uint8_t type,
+    const std::string& body
+) {
+    std::string packet(1, (char)type);
+    size_t len = body.size();
+    do {
+        uint8_t byte = len & 0x7F;
+        len >>= 7;
+        packet += (char)((len > 0) ? (byte | 0x80) : byte);
+    } while (len > 0);
+    return packet + body;
+}
+
+/**
+ * Takes the first whole packet off the front of some data
+ * @return true if there was a whole packet
+ */
+static bool take_packet(
+    std::string* pData,
+    PACKET_T* pPacket
+) {
+    size_t len = 0;
+    for (size_t idx = 1; (idx < pData->size()) && (idx <= 4); ++idx) {
+        len |= (size_t)((uint8_t)(*pData)[idx] & 0x7F) << (7 * (idx - 1));
+        if (((uint8_t)(*pData)[idx] & 0x80) == 0) {
+            if (idx + 1 + len > pData->size()) {
+                return false;
+            }
+            pPacket->type = (*pData)[0];
+            pPacket->body = pData->substr(idx + 1, len);
+            pData->erase(0, idx + 1 + len);
+            return true;
+        }
+    }
+    return false;
+}
+
+static std::vector<PACKET_T> split_packets(
+    std::string data
+) {
+    std::vector<PACKET_T> packets;
+    PACKET_T packet;
+    while (take_packet(&data, &packet)) {
+        packets.push_back(packet);
+    }
+    CHECK(data.empty());
+    return packets;
+}
+
+/**
+ * Splits a PUBLISH packet body
+ * @return the packet id, 0 for QoS 0
+ */
+static unsigned split_publish(
+    const PACKET_T& packet,
+    std::string* pTopic,
+    std::string* pPayload
+) {
+    size_t topicLen = get_u16(packet.body, 0);
+    *pTopic = packet.body.substr(2, topicLen);
+    size_t pos = 2 + topicLen;
+    unsigned id = 0;
+    if ((packet.type & MQTT_PUBLISH_QOS_MASK) != 0) {
+        id = get_u16(packet.body, pos);
+        pos += 2;
+    }
+    *pPayload = packet.body.substr(pos);
+    return id;
+}
+
+/**
+ * The server side's connection to the broker
+ */
+static int serverSocket = -1;
+static std::string serverRx;
+
+static void server_send(
+    uint8_t type,
+    const std::string& body
+) {
+    std::string packet = make_packet(type, body);
+    CHECK(send(serverSocket, packet.data(), packet.size(), MSG_NOSIGNAL) ==
+          (ssize_t)packet.size());
+}
+
+/**
+ * Reads the next packet the broker sends the server side
+ * @return true if one arrived in TEST_WAIT_MS
+ */
+static bool server_read(
+    PACKET_T* pPacket
+) {
+    for (int waited = 0; !take_packet(&serverRx, pPacket); waited += 10) {
+        struct pollfd pfd = { serverSocket, POLLIN, 0 };
+        char buf[4096];
+        ssize_t len;
+        if ((waited >= TEST_WAIT_MS) || (poll(&pfd, 1, 10) < 0) ||
+            (((pfd.revents & POLLIN) != 0) &&
+             ((len = recv(serverSocket, buf, sizeof(buf), 0)) <= 0))) {
+            return false;
+        }
+        if ((pfd.revents & POLLIN) != 0) {
+            serverRx.append(buf, len);
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads the next batch the tracker published, acking it
+ * @return the batch, empty if none arrived
+ */
+static std::string server_read_batch() {
+    PACKET_T packet;
+    std::string topic;
+    std::string payload;
+    if (!server_read(&packet) ||
+        ((packet.type & MQTT_TYPE_MASK) != MQTT_PUBLISH)) {
+        return "";
+    }
+    unsigned id = split_publish(packet, &topic, &payload);
+    CHECK_STR(topic.c_str(), TEST_DATA_TOPIC);
+    if (id != 0) {
+        server_send(MQTT_PUBACK, u16(id));
+    }
+    return payload;
+}
+
+/**
+ * Publishes a command to the tracker with QoS 1
+ */
+static void server_send_command(
+    const char* pCommand
+) {
+    static unsigned id = 0;
+    id += 1;
+    server_send(MQTT_PUBLISH | MQTT_PUBLISH_QOS1,
+                u16(strlen(TEST_COMMAND_TOPIC)) + TEST_COMMAND_TOPIC +
+                u16(id) + pCommand);
+    PACKET_T packet;
+    CHECK(server_read(&packet));
+    CHECK_EQ(packet.type, MQTT_PUBACK);
+    CHECK_EQ(get_u16(packet.body, 0), id);
+}
+
+/**
+ * Connects the server side with a clean session and subscribes it to all
+ * the trackers' data topics
+ */
+static void server_connect() {
+    serverSocket = broker_connect();
+    CHECK(serverSocket >= 0);
+    std::string id = "opentracker-server";
+    static const char CONNECT[] = { 0, 4, 'M', 'Q', 'T', 'T',
+                                    MQTT_PROTOCOL_LEVEL, 0x02, 0, 60 };
+    server_send(MQTT_CONNECT, std::string(CONNECT, sizeof(CONNECT)) +
+                u16(id.size()) + id);
+    PACKET_T packet;
+    CHECK(server_read(&packet));
+    CHECK_EQ(packet.type, MQTT_CONNACK);
+    CHECK_EQ(packet.body[1], 0);
+    std::string filter = MQTT_TOPIC_PREFIX "+" MQTT_DATA_TOPIC;
+    server_send(MQTT_SUBSCRIBE, u16(1) + u16(filter.size()) + filter + '\1');
+    CHECK(server_read(&packet));
+    CHECK_EQ(packet.type, MQTT_SUBACK);
+    CHECK_EQ(packet.body[2], 1);
+}
+
+static SERVER_DATA_T records[100];
+
+/**
+ * Makes a batch of the first count records
+ */
+static SERVER_BATCH_T make_batch(
+    size_t count
+) {
+    SERVER_BATCH_T batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.pServerData = records;
+    batch.count = count;
+    return batch;
+}
+
+static std::string batchBytes;
+
+static bool write_batch(
+    const uint8_t* pData,
+    size_t len
+) {
+    batchBytes.append((const char*)pData, len);
+    return true;
+}
+
+/**
+ * Gets the binary batch the broker should pass on for a batch
+ */
+static std::string expected_batch(
+    SERVER_BATCH_T* pBatch
+) {
+    batchBytes.clear();
+    CHECK(formServerBinaryBatch(pBatch, 0, write_batch));
+    return batchBytes;
+}
+
+/**
+ * The first connection: CONNECT with clean session off and the login, then
+ * SUBSCRIBE to the command topic as the broker has no session for us, then
+ * the PUBLISH
+ */
+static void test_first_connect() {
+    SERVER_BATCH_T batch = make_batch(5);
+    open_session();
+    trackerSent.clear();
+    CHECK(!mqttConnected());
+    CHECK(mqttSendBatch(&batch));
+    CHECK(mqttConnected());
+    CHECK(!mqttSessionPresent);
+    CHECK(mqttReceivePuback(SERVER_ACK_TIMEOUT));
+    std::vector<PACKET_T> packets = split_packets(trackerSent);
+    CHECK_EQ(packets.size(), 3);
+    if (packets.size() == 3) {
+        const std::string& connect = packets[0].body;
+        CHECK_EQ(packets[0].type, MQTT_CONNECT);
+        CHECK(connect.compare(0, 7, std::string("\0\4MQTT\4", 7)) == 0);
+        // User name and password, and not clean session (0x02)
+        CHECK_EQ((uint8_t)connect[7],
+                 MQTT_CONNECT_USERNAME | MQTT_CONNECT_PASSWORD);
+        CHECK_EQ(get_u16(connect, 8), MQTT_KEEPALIVE);
+        CHECK(connect.substr(10) == u16(15) + TEST_IMEI + u16(15) +
+              TEST_IMEI + u16(strlen(config.key)) + config.key);
+        CHECK_EQ(packets[1].type, MQTT_SUBSCRIBE);
+        CHECK(packets[1].body.substr(2) == u16(strlen(TEST_COMMAND_TOPIC)) +
+              TEST_COMMAND_TOPIC + '\1');
+        CHECK_EQ(packets[2].type, MQTT_PUBLISH | MQTT_PUBLISH_QOS1);
+    }
+    CHECK(server_read_batch() == expected_batch(&batch));
+    CHECK_EQ(mqttConnectCount, 1);
+}
+
+/**
+ * A new TCP session: the broker kept our session, so no SUBSCRIBE
+ */
+static void test_session_present() {
+    SERVER_BATCH_T batch = make_batch(5);
+    gsmCloseSession();
+    open_session();
+    trackerSent.clear();
+    CHECK(!mqttConnected());
+    CHECK(mqttSendBatch(&batch));
+    CHECK(mqttSessionPresent);
+    CHECK(mqttReceivePuback(SERVER_ACK_TIMEOUT));
+    std::vector<PACKET_T> packets = split_packets(trackerSent);
+    CHECK_EQ(packets.size(), 2);
+    if (packets.size() == 2) {
+        CHECK_EQ(packets[0].type, MQTT_CONNECT);
+        CHECK_EQ(packets[1].type, MQTT_PUBLISH | MQTT_PUBLISH_QOS1);
+    }
+    CHECK(server_read_batch() == expected_batch(&batch));
+    CHECK_EQ(mqttConnectCount, 2);
+}
+
+/**
+ * A batch longer than PACKET_SIZE goes to the modem in PACKET_SIZE chunks
+ * and reaches the server whole
+ */
+static void test_long_publish() {
+    SERVER_BATCH_T batch = make_batch(DIM(records));
+    std::string expected = expected_batch(&batch);
+    CHECK(expected.size() > PACKET_SIZE);
+    trackerSent.clear();
+    trackerFlushes.clear();
+    CHECK(mqttSendBatch(&batch));
+    CHECK(mqttReceivePuback(SERVER_ACK_TIMEOUT));
+    size_t packetLen = 1 + 2 + 2 + strlen(TEST_DATA_TOPIC) + 2 +
+                       expected.size();
+    CHECK_EQ(trackerFlushes.size(),
+             (packetLen + PACKET_SIZE - 1) / PACKET_SIZE);
+    for (size_t idx = 0; idx + 1 < trackerFlushes.size(); ++idx) {
+        CHECK_EQ(trackerFlushes[idx], PACKET_SIZE);
+    }
+    CHECK_EQ(trackerSent.size(), packetLen);
+    CHECK(server_read_batch() == expected);
+}
+
+/**
+ * Only the PUBACK with the id of the last PUBLISH acks the batch
+ */
+static void test_puback_id() {
+    SERVER_BATCH_T batch = make_batch(5);
+    unsigned id = mqttPacketId;
+    // A late ack of the batch before
+    trackerInjected = make_packet(MQTT_PUBACK, u16(id - 1));
+    CHECK(!mqttReceivePuback(SECS(1)));
+    trackerInjected = make_packet(MQTT_PUBACK, u16(id + 1)) +
+                      make_packet(MQTT_PUBACK, u16(id));
+    CHECK(mqttReceivePuback(SECS(1)));
+    CHECK(trackerInjected.empty());
+    // And the broker's ack of the next
+    CHECK(mqttSendBatch(&batch));
+    CHECK_EQ(mqttPacketId, id + 1);
+    CHECK(mqttReceivePuback(SERVER_ACK_TIMEOUT));
+    CHECK(server_read_batch() == expected_batch(&batch));
+}
+
+/**
+ * A QoS 1 command is run and acked with its packet id. It is not
+ * delivered again on the next connection, but one sent whilst we are away
+ * is.
+ */
+static void test_command() {
+    TASK_T task;
+    memset(&task, 0, sizeof(task));
+    smsCommands.clear();
+    trackerSent.clear();
+    trackerReceived.clear();
+    server_send_command("#1234,fint=45");
+    for (int waited = 0; (smsCommands.size() == 0) && (waited < 100);
+         ++waited) {
+        gsmDelay(100);
+        mqttCheck(&task);
+    }
+    CHECK_EQ(smsCommands.size(), 1);
+    if (smsCommands.size() == 1) {
+        CHECK_STR(smsCommands[0].c_str(), "#1234,fint=45");
+    }
+    std::vector<PACKET_T> received = split_packets(trackerReceived);
+    std::vector<PACKET_T> sent = split_packets(trackerSent);
+    CHECK_EQ(received.size(), 1);
+    CHECK_EQ(sent.size(), 1);
+    if ((received.size() == 1) && (sent.size() == 1)) {
+        std::string topic;
+        std::string payload;
+        unsigned id = split_publish(received[0], &topic, &payload);
+        CHECK_EQ(received[0].type & MQTT_PUBLISH_QOS_MASK,
+                 MQTT_PUBLISH_QOS1);
+        CHECK_STR(topic.c_str(), TEST_COMMAND_TOPIC);
+        CHECK_EQ(sent[0].type, MQTT_PUBACK);
+        CHECK(sent[0].body == u16(id));
+    }
+    CHECK_EQ(mqttCommandCount, 1);
+
+    // Away, then back with the session the broker kept
+    SERVER_BATCH_T batch = make_batch(5);
+    gsmCloseSession();
+    server_send_command("#1234,sint=600");
+    open_session();
+    CHECK(mqttSendBatch(&batch));
+    CHECK(mqttSessionPresent);
+    CHECK(mqttReceivePuback(SERVER_ACK_TIMEOUT));
+    for (int waited = 0; (smsCommands.size() < 2) && (waited < 10);
+         ++waited) {
+        gsmDelay(100);
+        mqttCheck(&task);
+    }
+    CHECK_EQ(smsCommands.size(), 2);
+    if (smsCommands.size() == 2) {
+        CHECK_STR(smsCommands[1].c_str(), "#1234,sint=600");
+    }
+    CHECK(server_read_batch() == expected_batch(&batch));
+}
+
+/**
+ * The mqtt task pings the broker once the session has been idle for half
+ * the keepalive
+ */
+static void test_ping() {
+    TASK_T task;
+    memset(&task, 0, sizeof(task));
+    trackerSent.clear();
+    mqttCheck(&task);
+    CHECK(trackerSent.empty());
+    delay(SECS(MQTT_KEEPALIVE / 2));
+    mqttCheck(&task);
+    CHECK(trackerSent == make_packet(MQTT_PINGREQ, ""));
+    CHECK_EQ(mqttPingCount, 1);
+    CHECK(mqttConnected());
+}
+
+int main(
+    int argc,
+    char** argv
+) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <broker port>\n", argv[0]);
+        return 1;
+    }
+    brokerPort = atoi(argv[1]);
+    for (size_t idx = 0; idx < DIM(records); ++idx) {
+        memset(&records[idx], 0, sizeof(records[idx]));
+        GPSDATA_T* pFix = &records[idx].gpsData;
+        pFix->fixAge = 5;
+        pFix->lat = 515020570 + idx * 1000;
+        pFix->lon = -1927970 - idx * 77;
+        pFix->alt = 5230;
+        pFix->speed = 1200 + idx;
+        pFix->course = 9000;
+        pFix->hdop = 90;
+        pFix->nsats = 9;
+        pFix->date = 260917;
+        pFix->time = 10150000 + idx * 100;
+        records[idx].captureTime = 559736100 + idx;
+        records[idx].ignState = (idx & 1);
+        records[idx].engineRuntime = idx * 3;
+    }
+    strcpy(config.imei, TEST_IMEI);
+    strcpy(config.key, "abcdefghijkl");
+    config.server_send_flags = SERVER_SEND_DEFAULT;
+    hostMillis = SECS(1000);
+    server_connect();
+    test_first_connect();
+    test_session_present();
+    test_long_publish();
+    test_puback_id();
+    test_command();
+    test_ping();
+    return hostResult("test_mqtt");
+}
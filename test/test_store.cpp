@@ -0,0 +1,453 @@
+/**
+ * Unit tests for the log-structured server data store in storage.ino, on
+ * a FlashServerDataStore over the host flash. A reboot is a new store
+ * object over the same flash. Covers the records dropped when the store
+ * wraps, recovery after a reboot, damaged records, page headers and
+ * checkpoints, a torn page and committing from a cursor.
+ */
+#include "sketch.h"
+
+SETTINGS_T config;
+DueFlashStorage dueFlashStorage;
+
+#include "clock.ino"
+#include "data.ino"
+#include "storage.ino"
+
+#define TEST_STORE_START 1024
+#define TEST_STORE_SIZE (64 * 1024)
+#define TEST_PAGES (TEST_STORE_SIZE / STORE_PAGE_SIZE - STORE_CHECKPOINT_PAGES)
+
+/**
+ * The store as the sketch has it, rebuilding its index from the flash
+ */
+class TestStore : public FlashServerDataStore {
+public:
+    TestStore() : FlashServerDataStore(dueFlashStorage, TEST_STORE_START,
+                                       TEST_STORE_SIZE) {
+        init();
+    }
+};
+
+/**
+ * Makes the n'th fix of a drive. Its captureTime gives n back.
+ */
+static void make_record(
+    unsigned long n,
+    SERVER_DATA_T* pServerData
+) {
+    memset(pServerData, 0, sizeof(*pServerData));
+    GPSDATA_T* pFix = &pServerData->gpsData;
+    pFix->fixAge = 100;
+    pFix->lat = 515020570 + n * 731;
+    pFix->lon = -1927970 + n * 1093;
+    pFix->alt = 5230 + (n % 17) * 10;
+    pFix->course = (n * 37) % 36000;
+    pFix->speed = 1200 + (n % 50);
+    pFix->hdop = 90;
+    pFix->nsats = 9;
+    pFix->date = 260917;
+    pFix->time = (10150000 + n * 100) % 24000000;
+    pServerData->captureTime = 559736100 + n;
+    pServerData->ignState = true;
+    pServerData->engineRuntime = n;
+}
+
+/**
+ * Writes records first..first+count-1
+ */
+static void fill(
+    ServerDataStore* pStore,
+    unsigned long first,
+    unsigned long count
+) {
+    SERVER_DATA_T serverData;
+    for (unsigned long n = first; n < first + count; ++n) {
+        make_record(n, &serverData);
+        CHECK(pStore->writeServerData(&serverData));
+    }
+}
+
+/**
+ * Reads the records from the oldest, checking each decodes to the record
+ * written and that they come in order
+ * @param pStore the store
+ * @param pFirst assigned the number of the oldest record
+ * @param pLast assigned the number of the newest record
+ * @return the number of records read
+ */
+static size_t read_all(
+    ServerDataStore* pStore,
+    unsigned long* pFirst,
+    unsigned long* pLast
+) {
+    STORE_CURSOR_T cursor;
+    SERVER_DATA_T serverData;
+    SERVER_DATA_T expected;
+    size_t count = 0;
+    pStore->startCursor(&cursor);
+    while (pStore->readCursor(&cursor, &serverData)) {
+        unsigned long n = serverData.captureTime - 559736100;
+        make_record(n, &expected);
+        CHECK_EQ(serverData.gpsData.lat, expected.gpsData.lat);
+        CHECK_EQ(serverData.gpsData.lon, expected.gpsData.lon);
+        CHECK_EQ(serverData.engineRuntime, expected.engineRuntime);
+        if (count == 0) {
+            *pFirst = n;
+        } else {
+            CHECK(n > *pLast);
+        }
+        *pLast = n;
+        count += 1;
+    }
+    return count;
+}
+
+/**
+ * Reads and commits up to count records from the oldest
+ */
+static void drain(
+    ServerDataStore* pStore,
+    size_t count
+) {
+    STORE_CURSOR_T cursor;
+    SERVER_DATA_T serverData;
+    pStore->startCursor(&cursor);
+    while ((count-- > 0) && pStore->readCursor(&cursor, &serverData)) {
+    }
+    CHECK(pStore->commitCursor(&cursor));
+}
+
+/**
+ * Gets a figure from ServerDataStore::report()
+ * @param pStore the store
+ * @param pName the name the figure follows, e.g. "dropped"
+ */
+static unsigned long report_value(
+    ServerDataStore* pStore,
+    const char* pName
+) {
+    SerialUSB.reset();
+    SerialUSB.capture = true;
+    pStore->report();
+    SerialUSB.capture = false;
+    std::string name = std::string(" ") + pName + " ";
+    size_t pos = SerialUSB.tx.find(name);
+    CHECK(pos != std::string::npos);
+    return strtoul(SerialUSB.tx.c_str() + pos + name.size(), NULL, 10);
+}
+
+/**
+ * Gets a page of the store in the host flash
+ */
+static STORED_PAGE_T* flash_page(
+    size_t pageIdx
+) {
+    return (STORED_PAGE_T*)(hostFlash + TEST_STORE_START +
+                            pageIdx * STORE_PAGE_SIZE);
+}
+
+static void erase_flash() {
+    memset(hostFlash, 0xFF, sizeof(hostFlash));
+}
+
+/**
+ * Fills the store until it wraps, and then by half as much again
+ * @return the number of records written
+ */
+static unsigned long fill_wrapped(
+    ServerDataStore* pStore
+) {
+    unsigned long n = 0;
+    while (flash_page(TEST_PAGES - 1)->header.marker == 0xFFFFFFFF) {
+        fill(pStore, n++, 1);
+    }
+    fill(pStore, n, n / 2);
+    return n + n / 2;
+}
+
+static void test_wrap() {
+    erase_flash();
+    TestStore store;
+    unsigned long n = 0;
+    size_t count = 0;
+    for (;;) {
+        fill(&store, n++, 1);
+        if (store.getStoredServerDataCount() <= count) {
+            break;
+        }
+        count = store.getStoredServerDataCount();
+    }
+    // Starting on page 0 again dropped the records in page 0
+    size_t pageRecords = flash_page(0)->header.count;
+    CHECK(pageRecords > 1);
+    CHECK_EQ(store.getStoredServerDataCount(), count + 1 - pageRecords);
+    CHECK_EQ(report_value(&store, "dropped"), pageRecords);
+    unsigned long first;
+    unsigned long last;
+    CHECK_EQ(read_all(&store, &first, &last), count + 1 - pageRecords);
+    CHECK_EQ(first, pageRecords);
+    CHECK_EQ(last, n - 1);
+    // Every record written is either held or was dropped
+    fill(&store, n, 5000);
+    n += 5000;
+    count = read_all(&store, &first, &last);
+    CHECK_EQ(count, store.getStoredServerDataCount());
+    CHECK_EQ(last, n - 1);
+    CHECK_EQ(report_value(&store, "dropped"), first);
+    CHECK_EQ(report_value(&store, "damaged"), 0);
+}
+
+static void test_reboot() {
+    erase_flash();
+    unsigned long first;
+    unsigned long last;
+    {
+        TestStore store;
+        CHECK_EQ(store.getStoredServerDataCount(), 0);
+        fill(&store, 0, 100);
+        CHECK(store.flush());
+    }
+    {
+        TestStore store;
+        CHECK_EQ(store.getStoredServerDataCount(), 100);
+        CHECK_EQ(read_all(&store, &first, &last), 100);
+        CHECK_EQ(first, 0);
+        CHECK_EQ(last, 99);
+        // Sent records come back if the oldest was not saved
+        drain(&store, 40);
+        CHECK_EQ(store.getStoredServerDataCount(), 60);
+    }
+    {
+        TestStore store;
+        CHECK_EQ(store.getStoredServerDataCount(), 100);
+        drain(&store, 40);
+        CHECK(store.flush());
+        // Records only held in RAM are lost
+        fill(&store, 100, 5);
+    }
+    {
+        TestStore store;
+        CHECK_EQ(store.getStoredServerDataCount(), 60);
+        // and the record numbers carry on from those saved
+        fill(&store, 100, 10);
+        CHECK(store.flush());
+    }
+    TestStore store;
+    CHECK_EQ(read_all(&store, &first, &last), 70);
+    CHECK_EQ(first, 40);
+    CHECK_EQ(last, 109);
+    CHECK_EQ(report_value(&store, "damaged"), 0);
+}
+
+static void test_commit_cursor() {
+    erase_flash();
+    TestStore store;
+    fill(&store, 0, 300);
+    STORE_CURSOR_T stale;
+    store.startCursor(&stale);
+    STORE_CURSOR_T behind = stale;
+    STORE_CURSOR_T cursor;
+    SERVER_DATA_T serverData;
+    store.startCursor(&cursor);
+    for (int idx = 0; idx < 10; ++idx) {
+        CHECK(store.readCursor(&cursor, &serverData));
+    }
+    CHECK(store.commitCursor(&cursor));
+    CHECK_EQ(store.getStoredServerDataCount(), 290);
+    // A cursor started before the commit reads on from the oldest record
+    CHECK(store.readCursor(&stale, &serverData));
+    CHECK_EQ(serverData.captureTime, 559736100 + 10);
+    // Committing a cursor behind the oldest record changes nothing
+    CHECK(store.commitCursor(&behind));
+    CHECK_EQ(store.getStoredServerDataCount(), 290);
+    // Draining records held on flash saves the oldest with a checkpoint
+    unsigned long checkpoints = report_value(&store, "checkpoints");
+    drain(&store, 290);
+    CHECK_EQ(store.getStoredServerDataCount(), 0);
+    CHECK(!store.startCursor(&cursor));
+    CHECK(!store.commitCursor(&cursor));
+    CHECK_EQ(report_value(&store, "checkpoints"), checkpoints + 1);
+    TestStore rebooted;
+    CHECK_EQ(rebooted.getStoredServerDataCount(), 0);
+    // but records only ever held in RAM need none. One is only needed if
+    // a page filled whilst holding unsent records.
+    checkpoints = report_value(&rebooted, "checkpoints");
+    unsigned long expected = checkpoints;
+    for (unsigned long n = 300; n < 600; n += 3) {
+        fill(&rebooted, n, 1);
+        unsigned long pageWrites = report_value(&rebooted, "writes");
+        fill(&rebooted, n + 1, 2);
+        drain(&rebooted, 3);
+        if (report_value(&rebooted, "writes") > pageWrites) {
+            expected += 1;
+        }
+        CHECK_EQ(report_value(&rebooted, "checkpoints"), expected);
+    }
+    CHECK(expected - checkpoints < 100 / 4);
+    CHECK_EQ(rebooted.getStoredServerDataCount(), 0);
+    TestStore rebootedAgain;
+    CHECK_EQ(rebootedAgain.getStoredServerDataCount(), 0);
+}
+
+static void test_damaged_record() {
+    erase_flash();
+    unsigned long written;
+    {
+        TestStore store;
+        written = fill_wrapped(&store);
+        CHECK(store.flush());
+    }
+    STORED_PAGE_T* pPage = flash_page(100);
+    size_t pageRecords = pPage->header.count;
+    // Damage the third record's values, losing it and those after it in
+    // the page, as they are delta coded from it
+    size_t offset = pPage->data[0] + pPage->data[pPage->data[0]];
+    pPage->data[offset + STORE_RECORD_HEADER_SIZE + 1] ^= 0x10;
+    TestStore store;
+    unsigned long first;
+    unsigned long last;
+    size_t count = read_all(&store, &first, &last);
+    CHECK_EQ(store.getStoredServerDataCount(), count);
+    CHECK_EQ(report_value(&store, "damaged"), pageRecords - 2);
+    CHECK_EQ(count, last + 1 - first - (pageRecords - 2));
+    CHECK_EQ(last, written - 1);
+    // The records after the damaged page are read
+    drain(&store, count - 1);
+    CHECK_EQ(store.getStoredServerDataCount(), 1);
+    CHECK_EQ(read_all(&store, &first, &last), 1);
+    CHECK_EQ(first, written - 1);
+    CHECK_EQ(report_value(&store, "damaged"), pageRecords - 2);
+}
+
+static void test_damaged_page_header() {
+    erase_flash();
+    unsigned long written;
+    {
+        TestStore store;
+        written = fill_wrapped(&store);
+        CHECK(store.flush());
+    }
+    STORED_PAGE_T* pPage = flash_page(100);
+    size_t pageRecords = pPage->header.count;
+    pPage->header.crc32 ^= 1;
+    TestStore store;
+    unsigned long first;
+    unsigned long last;
+    size_t count = read_all(&store, &first, &last);
+    CHECK_EQ(store.getStoredServerDataCount(), count);
+    CHECK_EQ(report_value(&store, "damaged"), pageRecords);
+    CHECK_EQ(count, last + 1 - first - pageRecords);
+    CHECK_EQ(last, written - 1);
+}
+
+static void test_torn_page() {
+    erase_flash();
+    {
+        TestStore store;
+        fill(&store, 0, 100);
+        CHECK(store.flush());
+    }
+    // The newest page was only partly written
+    size_t pageIdx = 0;
+    while (flash_page(pageIdx + 1)->header.marker != 0xFFFFFFFF) {
+        ++pageIdx;
+    }
+    STORED_PAGE_T* pPage = flash_page(pageIdx);
+    size_t pageRecords = pPage->header.count;
+    memset(pPage->data + pPage->header.used / 2, 0xFF,
+           pPage->header.used - pPage->header.used / 2);
+    size_t lost;
+    {
+        TestStore store;
+        unsigned long first;
+        unsigned long last;
+        size_t count = read_all(&store, &first, &last);
+        CHECK_EQ(store.getStoredServerDataCount(), count);
+        lost = report_value(&store, "damaged");
+        CHECK(lost > 0);
+        CHECK(lost < pageRecords);
+        CHECK_EQ(count, 100 - lost);
+        CHECK_EQ(first, 0);
+        // New records go in a fresh page, as the torn one can not be
+        // added to
+        fill(&store, 100, 10);
+        CHECK(store.flush());
+        CHECK_EQ(store.getStoredServerDataCount(), 110 - lost);
+    }
+    TestStore store;
+    unsigned long first;
+    unsigned long last;
+    CHECK_EQ(read_all(&store, &first, &last), 110 - lost);
+    CHECK_EQ(store.getStoredServerDataCount(), 110 - lost);
+    CHECK_EQ(last, 109);
+}
+
+/**
+ * Damages the newest undamaged checkpoint
+ */
+static void damage_checkpoint() {
+    STORED_CHECKPOINT_T* pNewest = NULL;
+    for (size_t idx = 0; idx < STORE_CHECKPOINT_PAGES; ++idx) {
+        STORED_CHECKPOINT_T* pCheckpoint =
+            (STORED_CHECKPOINT_T*)flash_page(TEST_PAGES + idx);
+        if ((pCheckpoint->marker != 0xFFFFFFFF) &&
+            (pCheckpoint->marker != 0) &&
+            ((pNewest == NULL) ||
+             (pCheckpoint->checkpointSeq > pNewest->checkpointSeq))) {
+            pNewest = pCheckpoint;
+        }
+    }
+    CHECK(pNewest != NULL);
+    if (pNewest != NULL) {
+        pNewest->marker = 0;
+    }
+}
+
+static void test_bad_checkpoint() {
+    erase_flash();
+    {
+        TestStore store;
+        fill(&store, 0, 50);
+        CHECK(store.flush());
+        // Two checkpoints, as no page is written after the records sent
+        drain(&store, 20);
+        CHECK(store.flush());
+        drain(&store, 10);
+        CHECK(store.flush());
+        CHECK_EQ(report_value(&store, "checkpoints"), 2);
+    }
+    unsigned long first;
+    unsigned long last;
+    {
+        TestStore store;
+        CHECK_EQ(read_all(&store, &first, &last), 20);
+        CHECK_EQ(first, 30);
+    }
+    // Falls back to the checkpoint before
+    damage_checkpoint();
+    {
+        TestStore store;
+        CHECK_EQ(store.getStoredServerDataCount(), 30);
+        CHECK_EQ(read_all(&store, &first, &last), 30);
+        CHECK_EQ(first, 20);
+        CHECK_EQ(last, 49);
+    }
+    // and then to the oldest record saved with the newest page
+    damage_checkpoint();
+    TestStore store;
+    CHECK_EQ(store.getStoredServerDataCount(), 50);
+    CHECK_EQ(read_all(&store, &first, &last), 50);
+    CHECK_EQ(first, 0);
+}
+
+int main() {
+    test_wrap();
+    test_reboot();
+    test_commit_cursor();
+    test_damaged_record();
+    test_damaged_page_header();
+    test_torn_page();
+    test_bad_checkpoint();
+    return hostResult("test_store");
+}
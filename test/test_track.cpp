@@ -0,0 +1,243 @@
+/**
+ * Unit tests for the track simplifier in track.ino: samples are fed to
+ * trackAddPoint() and the points it emits, and trackFlush() stores,
+ * checked against the track they should redraw
+ */
+#include "sketch.h"
+
+SETTINGS_T config;
+TinyGPS gps;
+void blink_got_gps() {}
+
+/**
+ * Stands in for the store, keeping the last record trackFlush() writes
+ */
+struct {
+    size_t count;
+    SERVER_DATA_T last;
+    bool writeServerData(const SERVER_DATA_T* pServerData) {
+        count += 1;
+        last = *pServerData;
+        return true;
+    }
+} serverDataStore;
+
+#include "gps.ino"
+#include "track.ino"
+
+#define TEST_TOLERANCE 15
+#define TEST_HEADING_TOLERANCE 30
+#define TEST_SLOW_INTERVAL 600
+#define TEST_SPEED 1000         // cm/s, enough to trust the course
+
+SERVER_DATA_T emitted[TRACK_MAX_EMIT];
+
+/**
+ * Makes a sample an offset from a point on the equator, where east and
+ * north are to the same scale
+ * @param secs the capture time
+ * @param east the distance east in m
+ * @param north the distance north in m
+ * @param course the course in 100ths of a degree
+ */
+static SERVER_DATA_T make_point(
+    unsigned long secs,
+    long east,
+    long north,
+    unsigned long course
+) {
+    SERVER_DATA_T point;
+    memset(&point, 0, sizeof(point));
+    point.gpsData.fixAge = 10;
+    point.gpsData.lat = (long)(north / 0.0111195);
+    point.gpsData.lon = 100000000 + (long)(east / 0.0111195);
+    point.gpsData.course = course;
+    point.gpsData.speed = TEST_SPEED;
+    point.ignState = true;
+    point.captureTime = secs;
+    return point;
+}
+
+/**
+ * Feeds a sample to trackAddPoint()
+ * @return the number of points emitted into emitted[]
+ */
+static size_t add(
+    const SERVER_DATA_T* pPoint
+) {
+    return trackAddPoint(pPoint, emitted);
+}
+
+static bool same_point(
+    const SERVER_DATA_T* pA,
+    const SERVER_DATA_T* pB
+) {
+    return (pA->captureTime == pB->captureTime) &&
+           (pA->gpsData.lat == pB->gpsData.lat) &&
+           (pA->gpsData.lon == pB->gpsData.lon);
+}
+
+/**
+ * Starts each test with a new segment anchored at the origin at time 0,
+ * forgetting any point held over from the test before
+ */
+static void start() {
+    config.track_tolerance = TEST_TOLERANCE;
+    config.track_heading_tolerance = TEST_HEADING_TOLERANCE;
+    config.slow_server_interval = TEST_SLOW_INTERVAL;
+    memset(&serverDataStore, 0, sizeof(serverDataStore));
+    trackHaveHeld = false;
+    SERVER_DATA_T origin = make_point(0, 0, 0, 0);
+    size_t count = trackEndSegment(&origin, emitted);
+    CHECK_EQ(count, 1);
+    CHECK(same_point(&emitted[0], &origin));
+    CHECK(!trackHaveHeld);
+}
+
+static void test_straight() {
+    start();
+    unsigned long dropped = trackDroppedCount;
+    // 300 m due north, wandering 3 m either side
+    SERVER_DATA_T point;
+    for (unsigned long secs = 1; secs <= 30; ++secs) {
+        point = make_point(secs, (secs & 1) ? 3 : -3, secs * 10, 0);
+        CHECK_EQ(add(&point), 0);
+    }
+    CHECK_EQ(trackDroppedCount - dropped, 29);
+    // The run ends at the held last sample
+    trackFlush();
+    CHECK_EQ(serverDataStore.count, 1);
+    CHECK(same_point(&serverDataStore.last, &point));
+    CHECK(!trackHaveHeld);
+    CHECK(same_point(&trackAnchor, &point));
+    trackFlush();
+    CHECK_EQ(serverDataStore.count, 1);
+}
+
+static void test_bend() {
+    start();
+    SERVER_DATA_T corner;
+    for (unsigned long secs = 1; secs <= 10; ++secs) {
+        corner = make_point(secs, 0, secs * 10, 0);
+        CHECK_EQ(add(&corner), 0);
+    }
+    // A bend still within the tolerance of a straight line is dropped
+    SERVER_DATA_T point = make_point(11, 10, 100, 0);
+    CHECK_EQ(add(&point), 0);
+    // Turning east, beyond the tolerance of a line through both, ends the
+    // run at the sample before
+    SERVER_DATA_T held = point;
+    point = make_point(12, 40, 100, 0);
+    CHECK_EQ(add(&point), 1);
+    CHECK(same_point(&emitted[0], &held));
+    CHECK(same_point(&trackAnchor, &held));
+    CHECK(same_point(&trackHeld, &point));
+
+    // Doubling back, past the furthest sample less the tolerance, is a
+    // break even along the same bearing
+    start();
+    for (unsigned long secs = 1; secs <= 10; ++secs) {
+        corner = make_point(secs, 0, secs * 10, 0);
+        CHECK_EQ(add(&corner), 0);
+    }
+    point = make_point(11, 0, 84, 0);
+    CHECK_EQ(add(&point), 1);
+    CHECK(same_point(&emitted[0], &corner));
+}
+
+static void test_heading() {
+    start();
+    // The geometry alone never breaks the segment
+    config.track_tolerance = 1000;
+    SERVER_DATA_T point;
+    for (unsigned long secs = 1; secs <= 5; ++secs) {
+        point = make_point(secs, 0, secs * 10, (secs & 1) ? 35000 : 1000);
+        CHECK_EQ(add(&point), 0);
+    }
+    point = make_point(6, 0, 60, TEST_HEADING_TOLERANCE * 100);
+    CHECK_EQ(add(&point), 0);
+    // Not trusted when slow
+    point = make_point(7, 0, 70, 9000);
+    point.gpsData.speed = TRACK_MIN_HEADING_SPEED - 1;
+    CHECK_EQ(add(&point), 0);
+    SERVER_DATA_T held = point;
+    point = make_point(8, 0, 80, TEST_HEADING_TOLERANCE * 100 + 1);
+    CHECK_EQ(add(&point), 1);
+    CHECK(same_point(&emitted[0], &held));
+    // Turning the other way
+    start();
+    config.track_tolerance = 1000;
+    point = make_point(1, 0, 10, 36000 - TEST_HEADING_TOLERANCE * 100);
+    CHECK_EQ(add(&point), 0);
+    held = point;
+    point = make_point(2, 0, 20, 36000 - TEST_HEADING_TOLERANCE * 100 - 1);
+    CHECK_EQ(add(&point), 1);
+    CHECK(same_point(&emitted[0], &held));
+    // and off
+    start();
+    config.track_tolerance = 1000;
+    config.track_heading_tolerance = 0;
+    point = make_point(1, 0, 10, 0);
+    CHECK_EQ(add(&point), 0);
+    point = make_point(2, 0, 20, 18000);
+    CHECK_EQ(add(&point), 0);
+}
+
+static void test_slow_interval() {
+    start();
+    // A sample every minute along a straight road
+    SERVER_DATA_T held;
+    SERVER_DATA_T point;
+    for (unsigned long secs = 60; secs < TEST_SLOW_INTERVAL; secs += 60) {
+        point = make_point(secs, 0, secs * 10, 0);
+        CHECK_EQ(add(&point), 0);
+        held = point;
+    }
+    // The anchor is at most slow_server_interval old
+    point = make_point(TEST_SLOW_INTERVAL, 0, TEST_SLOW_INTERVAL * 10, 0);
+    CHECK_EQ(add(&point), 1);
+    CHECK(same_point(&emitted[0], &held));
+    CHECK_EQ(trackAnchor.captureTime, TEST_SLOW_INTERVAL - 60);
+}
+
+static void test_ignition() {
+    start();
+    SERVER_DATA_T held;
+    SERVER_DATA_T point;
+    for (unsigned long secs = 1; secs <= 10; ++secs) {
+        point = make_point(secs, 0, secs * 10, 0);
+        CHECK_EQ(add(&point), 0);
+        held = point;
+    }
+    // The ignition going off ends the segment at the held point and the
+    // sample, both reported now
+    point = make_point(11, 0, 110, 0);
+    point.ignState = false;
+    CHECK_EQ(add(&point), 2);
+    CHECK(same_point(&emitted[0], &held));
+    CHECK(same_point(&emitted[1], &point));
+    CHECK(!trackHaveHeld);
+    CHECK(same_point(&trackAnchor, &point));
+    // and it coming back on ends the next without a held point
+    point = make_point(12, 0, 120, 0);
+    CHECK_EQ(add(&point), 1);
+    CHECK(same_point(&emitted[0], &point));
+    // As do fixes without a position
+    point = make_point(13, 0, 130, 0);
+    CHECK_EQ(add(&point), 0);
+    held = point;
+    point = make_point(14, 0, 140, 0);
+    point.gpsData.fixAge = TinyGPS::GPS_INVALID_AGE;
+    CHECK_EQ(add(&point), 2);
+    CHECK(same_point(&emitted[0], &held));
+    CHECK(same_point(&emitted[1], &point));
+}
+
+int main() {
+    test_straight();
+    test_bend();
+    test_heading();
+    test_slow_interval();
+    test_ignition();
+    return hostResult("test_track");
+}